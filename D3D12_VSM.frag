@@ -23,6 +23,8 @@
 */
 #define PI 3.14159265359
 
+#include "shadowCommon.h"
+
 cbuffer cbCamera : register(b0, UPDATE_FREQ_PER_FRAME)
 {
 	float4x4 projView;
@@ -40,19 +42,14 @@ cbuffer cbLight : register(b1, UPDATE_FREQ_PER_FRAME)
 	float4 lightValue;
 }
 
-cbuffer cbObject : register(b2, UPDATE_FREQ_PER_DRAW)
-{
-	float4x4 world;
-
-	float4 diffuse;
-	float3 specular;
-	float shininess;
-};
-
 cbuffer cbShadowRootConstants : register (b3)
 {
-    uint2 shadowMapSize;
-}; 
+    uint2 shadowMaskSize;
+    // Origin of the view the mask covers
+    uint2 viewportOffset;
+    // Full resolution pixels per mask texel
+    uint shadowMaskScale;
+};
 
 struct PsIn
 {
@@ -63,6 +60,9 @@ struct PsIn
     float4 Normal : NORMAL;
     float4 EyeVec : EYE_VECTOR;
     float4 LightVec : LIGHT_VECTOR;
+    // Material of the object, see objectMaterials in basic.vert
+    nointerpolation float4 Diffuse : DIFFUSE;
+    nointerpolation float4 Specular : SPECULAR;
 };
 
 struct PsOut
@@ -70,39 +70,94 @@ struct PsOut
     float4 color : COLOR;
 };
 
-Texture2D shadowMap : register(t4, UPDATE_FREQ_PER_FRAME);
+// Directional shadow evaluated by shadowMask.comp
+Texture2D<float2> shadowMask : register(t4, UPDATE_FREQ_PER_FRAME);
 SamplerState miplessSampler : register(s5);
 
-#define MIN_VARIANCE 0.00001
+Texture2D shadowAtlas : register(t7, UPDATE_FREQ_PER_FRAME);
 
-// Calculate the upper bound of the propabalistic upper bound 
-// of the current depth being in an occluded state, given the 
-// distribution of depth we have at the texel.
-float ChebyshevUpperBound(float2 samplePoint, float pixelDepth)
+cbuffer cbAtlasLights : register(b6, UPDATE_FREQ_PER_FRAME)
 {
-    float2 moments = shadowMap.Sample(miplessSampler, samplePoint).rg;
+    AtlasLight atlasLights[MAX_ATLAS_LIGHTS];
+    uint4 atlasLightCount;
+};
 
-    // If light (sampled) depth exceeds our pixel depth, it is lit
-    if (pixelDepth <= moments.x)
-        return 1.0;
+Texture2DArray pointShadowMaps : register(t9, UPDATE_FREQ_PER_FRAME);
 
-    // Check how likely pixel is to be lit using chebyshev's upper bound
-    
-    float variance = moments.y - (moments.x * moments.x);
+cbuffer cbPointLights : register(b8, UPDATE_FREQ_PER_FRAME)
+{
+    PointLight pointLights[MAX_POINT_LIGHTS];
+    // Light count, face size
+    uint4 pointLightCount;
+};
 
-    // Make sure variance is never 0 to avoid issues
-    variance = max(variance, MIN_VARIANCE);
+// Diffuse contribution of the shadowed spot lights in the atlas.
+// The atlas is pre-filtered, so a single bilinear tap per light is enough.
+float3 ComputeAtlasLights(float3 worldPos, float3 N, float3 Kd)
+{
+    float3 result = float3(0.0, 0.0, 0.0);
 
-    float difference = pixelDepth - moments.x;
-    float pMax = variance / (difference * difference + variance);
-    
-    // Resulting shadow coefficient for lighting
-    return pMax;
+    for (uint i = 0; i < atlasLightCount.x; ++i)
+    {
+        AtlasLight light = atlasLights[i];
+
+        float3 L;
+        float attenuation = GetAtlasLightAttenuation(light, worldPos, L) * saturate(dot(N, L));
+        if (attenuation <= 0.0)
+            continue;
+
+        float shadow = 1.0;
+        float2 atlasUV;
+        float depth;
+        if (GetAtlasShadowCoord(light, worldPos, atlasUV, depth))
+        {
+            float2 moments = DecodeVSMMoments(shadowAtlas.SampleLevel(miplessSampler, atlasUV, 0).rg);
+            shadow = ChebyshevUpperBoundMoments(moments, depth - ATLAS_DEPTH_BIAS);
+        }
+
+        result += Kd / PI * light.colorCosInner.rgb * attenuation * shadow;
+    }
+
+    return result;
+}
+
+// Diffuse contribution of the shadowed point lights
+float3 ComputePointLights(float3 worldPos, float3 N, float3 Kd)
+{
+    float3 result = float3(0.0, 0.0, 0.0);
+    float faceSize = float(pointLightCount.y);
+
+    for (uint i = 0; i < pointLightCount.x; ++i)
+    {
+        PointLight light = pointLights[i];
+
+        float3 L;
+        float attenuation = GetPointLightAttenuation(light, worldPos, L) * saturate(dot(N, L));
+        if (attenuation <= 0.0)
+            continue;
+
+        // Cached faces are looked up from where they were rendered
+        float3 dir = worldPos - light.shadowPosition.xyz;
+        uint face;
+        // Inset by half a texel, faces are clamped at their edges
+        float2 uv = GetCubeFaceUV(dir, face) * (faceSize - 1.0) / faceSize + 0.5 / faceSize;
+        float depth = GetCubeFaceDepth(light, dir);
+
+        float2 moments = DecodeVSMMoments(pointShadowMaps.SampleLevel(miplessSampler, float3(uv, i * 6 + face), 0).rg);
+        float shadow = ChebyshevUpperBoundMoments(moments, depth - ATLAS_DEPTH_BIAS);
+
+        result += Kd / PI * light.colorNear.rgb * attenuation * shadow;
+    }
+
+    return result;
 }
 
 PsOut main (PsIn input) : SV_TARGET
 {
     PsOut Out;
+    float4 diffuse = input.Diffuse;
+    float3 specular = input.Specular.rgb;
+    float shininess = input.Specular.a;
 
     // No 4th diffuse component, no lighting calc
     if (step(diffuse.a, 0.01)) 
@@ -111,83 +166,53 @@ PsOut main (PsIn input) : SV_TARGET
         return Out;
     }
 
+    // Directions stay in float: L + V cancels when they oppose,
+    // and pow(NH, a) scales the error of NH by a
     float3 N = normalize(input.Normal.xyz);
     float3 L = normalize(input.LightVec.xyz);
     float3 V = normalize(input.EyeVec.xyz);
     float3 H = normalize(L.xyz + V.xyz);
 
-	float3 Kd = (float3)diffuse;   
-    float3 Ks = specular;
-    float a = shininess;
+	real3 Kd = (real3)diffuse.rgb;   
+    real3 Ks = (real3)specular;
+    real a = (real)shininess;
 
-    float3 Ia = lightAmbient.rgb;
-    float3 Ii = lightValue.rgb;
+    real3 Ia = (real3)lightAmbient.rgb;
+    real3 Ii = (real3)lightValue.rgb;
 
     // Ambient light calculated as normal
-    float3 amb = Ia * Kd;
+    real3 amb = Ia * Kd;
 
     // Clamped L dot H
-    float LH = max(0.0, dot(L, H));
+    real LH = max(SHADING_MIN_LH, (real)dot(L, H));
 
     // Schlick approximation of fresnel
-    float3 F = Ks + (float3(1.0, 1.0, 1.0) - Ks)* pow(1 - LH, 5);
+    real3 F = Ks + (real3(1.0, 1.0, 1.0) - Ks)* pow(1 - LH, 5);
 
     // Masking term G and part of the BRDF denominator 
     // simplified and approximated
-    float G = 1 / pow(LH, 2);
+    real G = 1 / (LH * LH);
 
     // Clamped N dot H
     float NH = max(0.0f, dot(N, H));
 
     // Micro-facet normal distribution term D 
-    float D = ((a + 2) * pow(NH, a)) / (2.0 * PI); 
+    real D = ((a + 2) * (real)pow(NH, shininess)) / (2.0 * PI); 
 
-    float3 BRDF = Kd / PI + (F * G * D) / 4;    
+    real3 BRDF = Kd / PI + (F * G * D) / 4;    
 
     // Both specular and diffuse components in BRDF
     // Second half of the BRDF calculation
-    float3 diffspec = Ii * max(0.0, dot(N, L)) * BRDF;
-
-    float4 ShadowCoord = input.ShadowCoord;
-
-    // Get the shadow coordinates position in the
-	// shadow frustum
-	float3 shadowIndex = ShadowCoord.xyz;
-
-	// // If we are inside the shadow frustum
-	if (shadowIndex.z > 0.0 && shadowIndex.z < 1.0 &&
-		shadowIndex.x >= 0.0 && shadowIndex.x <= 1.0 && 
-		shadowIndex.y >= 0.0 && shadowIndex.y <= 1.0)
-	{
-		float pixelDepth = shadowIndex.z;
-
-        // Angular bias to offset for uneven surfaces 
-		float cosTheta=clamp(dot(N,L), -1.0, 1.0);
-		float bias = .005 * tan(acos(cosTheta)) ;
-		bias = clamp(bias, 0.0, .1);
-
-		float x, y; float sum = 0.0;
-		int iterCount = 0;
-		
-		for (x = -1.5; x <= 1.5; x += 1.0)   
-		{
-			for (y = -1.5; y <= 1.5; y += 1.0)   
-			{
-                // Sample around in area, offset by one texel
-				float shadowPortion = ChebyshevUpperBound(shadowIndex.xy + 
-                    float2(x, y) * float2(1.0 / shadowMapSize.x, 1.0 / shadowMapSize.y), pixelDepth);
-
-                sum += shadowPortion;
-				++iterCount;
-			}
-		}
-
-		float shadowCoef = sum / (float(iterCount));
-
-		Out.color = float4(amb + diffspec * saturate(shadowCoef), 1.0);
-        return Out;
-	}
+    real3 diffspec = Ii * max(0.0, (real)dot(N, L)) * BRDF;
+
+    // Spot lights from the shadow atlas and point lights, their shadows are evaluated in float
+    float3 localLighting = ComputeAtlasLights(input.WorldPos.xyz, N, Kd) +
+        ComputePointLights(input.WorldPos.xyz, N, Kd);
+
+    // Directional shadow, upsampled from the reduced resolution mask
+    float shadowCoef = UpsampleShadowMask(shadowMask, input.position.xy - float2(viewportOffset),
+        length(input.WorldPos.xyz - camPos.xyz), shadowMaskSize, shadowMaskScale);
 
-	Out.color = float4(diffspec + amb, 1.0);
+    Out.color = float4(float3(amb) + localLighting + float3(diffspec) * shadowCoef, 1.0);
     return Out;
 }
\ No newline at end of file
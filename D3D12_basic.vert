@@ -21,10 +21,13 @@
  * specific language governing permissions and limitations
  * under the License.
 */
+#include "shadowCommon.h"
+
 struct VsIn
 {
 	float4 position : POSITION;
 	float4 normal : NORMAL;
+	uint InstanceID : SV_InstanceID;
 };
 
 cbuffer cbCamera : register(b0, UPDATE_FREQ_PER_FRAME)
@@ -44,15 +47,19 @@ cbuffer cbLight : register(b1, UPDATE_FREQ_PER_FRAME)
 	float4 lightValue;
 };
 
+// Range of objects drawn, one instance per object. Culled draws read
+// their objects from the visible list at visibleOffset instead, ~0u otherwise.
 cbuffer cbObject : register(b2, UPDATE_FREQ_PER_DRAW)
 {
-	float4x4 world;
-
-	float4 diffuse;
-	float3 specular;
-	float shininess;
+	uint firstObject;
+	uint objectCount;
+	uint visibleOffset;
 };
 
+StructuredBuffer<float4> objectTransforms : register(t10, UPDATE_FREQ_PER_FRAME);
+StructuredBuffer<ObjectMaterial> objectMaterials : register(t11, UPDATE_FREQ_PER_FRAME);
+StructuredBuffer<uint> visibleObjects : register(t12, UPDATE_FREQ_PER_FRAME);
+
 struct PsIn
 {
 	float4 position : SV_POSITION;
@@ -62,6 +69,8 @@ struct PsIn
 	float4 Normal : NORMAL;
 	float4 EyeVec : EYE_VECTOR;
 	float4 LightVec : LIGHT_VECTOR;
+	nointerpolation float4 Diffuse : DIFFUSE;
+	nointerpolation float4 Specular : SPECULAR;
 };
 
 
@@ -70,11 +79,15 @@ struct PsIn
 PsIn main (VsIn In)
 {
 	PsIn Out;
-	float4x4 tempMat = mul(projView, world);
-	Out.position = mul(tempMat, float4(In.position.xyz, 1.0f));
+	uint object = (visibleOffset != ~0u) ? visibleObjects[visibleOffset + In.InstanceID] : firstObject + In.InstanceID;
+	float4 positionScale = objectTransforms[object];
+	ObjectMaterial material = objectMaterials[object];
+
+	// Uniform scale, the normal needs no inverse transpose
+	Out.WorldPos = float4(GetObjectWorldPosition(positionScale, In.position.xyz), 1.0f);
+	Out.position = mul(projView, Out.WorldPos);
 	
-	Out.Normal = mul(world, float4(In.normal.xyz, 0.0f));
-	Out.WorldPos = mul(world, float4(In.position.xyz, 1.0f));
+	Out.Normal = float4(In.normal.xyz, 0.0f);
 	Out.EyeVec = camPos - Out.WorldPos;
 	Out.LightVec = lightPos - Out.WorldPos;
 	
@@ -87,8 +100,10 @@ PsIn main (VsIn In)
 
 	float4x4 shadowMatrix = mul(shift, lightProjView);
 	// Shadow matrix * world space position per vert
-	float4 objWorld = mul(world, float4(In.position.xyz, 1.0f));
-	Out.ShadowCoord = mul(shadowMatrix, objWorld);
+	Out.ShadowCoord = mul(shadowMatrix, Out.WorldPos);
+
+	Out.Diffuse = material.diffuse;
+	Out.Specular = material.specular;
 
 	return Out;
 }
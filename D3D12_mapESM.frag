@@ -0,0 +1,51 @@
+/*
+* Copyright (c) 2018-2020 The Forge Interactive Inc.
+*
+* This file is part of The-Forge
+* (see https://github.com/ConfettiFX/The-Forge).
+*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#include "shadowCommon.h"
+
+struct PsIn
+{
+    float4 Position : SV_Position;
+
+    // The directional depth z / w is linear in screen space, not in the
+    // world, once the light projection is warped
+#if defined(SCREEN_DEPTH)
+    noperspective
+#endif
+    float Depth : TARGET;
+};
+
+struct PsOut
+{
+    float Depth : SV_TARGET0;
+};
+
+PsOut main(PsIn input)
+{
+	PsOut output;
+
+	// ESM stores the occluder depth alone, filtering happens in log space
+	output.Depth = input.Depth;
+
+    return output;
+}
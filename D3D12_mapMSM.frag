@@ -24,11 +24,17 @@
 #ifdef PREDEFINED_MACRO
 #include "stdmacro_defs.inc"
 #endif
+#include "shadowCommon.h"
 
 struct PsIn
 {
     float4 Position : SV_Position;
 
+    // The directional depth z / w is linear in screen space, not in the
+    // world, once the light projection is warped
+#if defined(SCREEN_DEPTH)
+    noperspective
+#endif
     float Depth : TARGET;
 };
 
@@ -40,25 +46,7 @@ struct PsOut
 PsOut main(PsIn input)
 {
 	PsOut output;
-	float depth = input.Depth;
-
-    float depthSq = depth * depth;
-
-	// Store moments as depth, depth^2, depth^3, depth^4
-    output.Moments = float4(depth, depthSq, 
-		depthSq * depth, depthSq * depthSq);
-
-	// Perform this magic number matrix multiplication in order to optimize
-	// the storage of these values. This improves numerical stability by 
-	// maximizing the entropy of the convex hull spanned by the vectors created
-	// by the above equation.
-    output.Moments = mul( output.Moments, float4x4(
-                     -2.07224649f,   13.7948857237f,  0.105877704f,   9.7924062118f,
-                     32.23703778f,  -59.4683975703f, -1.9077466311f,-33.7652110555f,
-                    -68.571074599f,  82.0359750338f,  9.3496555107f, 47.9456096605f,
-                     39.3703274134f,-35.364903257f,  -6.6543490743f,-23.9728048165f));
-
-    output.Moments[0] += 0.035955884801f;
+    output.Moments = EncodeMSMMoments(input.Depth);
 
     return output;
 }
\ No newline at end of file
@@ -21,10 +21,17 @@
 * specific language governing permissions and limitations
 * under the License.
 */
+#include "shadowCommon.h"
+
 struct PsIn
 {
     float4 Position : SV_Position;
 
+    // The directional depth z / w is linear in screen space, not in the
+    // world, once the light projection is warped
+#if defined(SCREEN_DEPTH)
+    noperspective
+#endif
     float Depth : TARGET;
 };
 
@@ -36,14 +43,11 @@ struct PsOut
 PsOut main(PsIn input)
 {
 	PsOut output;
-    output.Moments.x = input.Depth;
-
-	output.Moments.y = input.Depth * input.Depth;
 
 	// Compute partial derivative for bias to avoid self-shadows
 	float dx = ddx(input.Depth);
 	float dy = ddy(input.Depth);
-	output.Moments.y += 0.25 * (dx*dx + dy*dy);
+	output.Moments = EncodeVSMMoments(input.Depth, 0.25 * (dx*dx + dy*dy));
 
     return output;
 }
\ No newline at end of file
@@ -0,0 +1,397 @@
+/*
+* Copyright (c) 2018-2020 The Forge Interactive Inc.
+*
+* This file is part of The-Forge
+* (see https://github.com/ConfettiFX/The-Forge).
+*
+* Licensed to the Apache Software Foundation (ASF) under one
+* or more contributor license agreements.  See the NOTICE file
+* distributed with this work for additional information
+* regarding copyright ownership.  The ASF licenses this file
+* to you under the Apache License, Version 2.0 (the
+* "License"); you may not use this file except in compliance
+* with the License.  You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+// Moment evaluation shared by the resolve shaders
+
+#define MIN_VARIANCE 0.00001
+#define MOMENT_BIAS 0.000003
+
+#define MAX_ATLAS_LIGHTS 32
+#define ATLAS_DEPTH_BIAS 0.002
+
+#define MAX_POINT_LIGHTS 4
+
+// Compacted sphere lists written by cullObjects.comp, one per view
+#define CULL_VIEW_CAMERA 0
+#define CULL_VIEW_LIGHT 1
+#define CULL_VIEW_OCCLUSION 2
+// Depth prepass pixels per Hi-Z texel side, each texel holds the farthest depth of its tile
+#define HIZ_TILE_SIZE 8
+// Spheres covering more Hi-Z texels per side than this are never occlusion culled
+#define HIZ_MAX_TEST_TILES 4
+
+// Shading math that keeps its accuracy in 16-bit floats. The HALF_PRECISION
+// variants compute it in min16float, shadow coordinates, moments and the
+// moment solves always stay in float.
+#if defined(HALF_PRECISION)
+typedef min16float  real;
+typedef min16float2 real2;
+typedef min16float3 real3;
+typedef min16float4 real4;
+// 1 / LH^2 of the specular term stays far from the largest half float
+#define SHADING_MIN_LH (1.0 / 64.0)
+#else
+typedef float  real;
+typedef float2 real2;
+typedef float3 real3;
+typedef float4 real4;
+#define SHADING_MIN_LH 0.0
+#endif
+
+// Distance stored for background texels of the shadow mask, largest half float
+#define SHADOW_MASK_FAR 65504.0
+// Relative view distance difference at which a mask texel stops contributing
+#define SHADOW_MASK_DEPTH_SHARPNESS 50.0
+
+// Shadowed spot light stored in a tile of the shadow atlas
+struct AtlasLight
+{
+    float4x4 viewProj;
+    // xyz position, w 1 / range
+    float4 positionInvRange;
+    // xyz direction, w cosine of the outer cone angle
+    float4 directionCosOuter;
+    // rgb color, a cosine of the inner cone angle
+    float4 colorCosInner;
+    // xy uv offset, zw uv scale of the light's tile
+    float4 tileRect;
+};
+
+// Shadowed point light, its six faces are layers [6 * i, 6 * i + 5] of the point shadow array
+struct PointLight
+{
+    // xyz position, w 1 / range
+    float4 positionInvRange;
+    // rgb color, a near plane
+    float4 colorNear;
+    // Position the cached faces were rendered from, trails position
+    // while the light's shadow update is deferred
+    float4 shadowPosition;
+};
+
+// Material of a scene object. Objects are only translated and uniformly
+// scaled, their transforms live in a separate buffer.
+struct ObjectMaterial
+{
+    // a 0 for unlit objects
+    float4 diffuse;
+    // rgb specular, a shininess
+    float4 specular;
+};
+
+// Transform as stored in objectTransforms, xyz translation and w scale
+float3 GetObjectWorldPosition(float4 positionScale, float3 position)
+{
+    return positionScale.xyz + position * positionScale.w;
+}
+
+// Bounce state of a sphere animated on the GPU
+struct SphereAnimation
+{
+    // x, lowest height, z, scale
+    float4 positionScale;
+    // |sin(angle)| is the bounce, kept in [0, pi)
+    float angle;
+    float frequency;
+    float2 padding;
+};
+
+// Cube faces in D3D order (+X, -X, +Y, -Y, +Z, -Z), right is cross(up, forward).
+// The point shadows keep the faces in a texture array and pick them here, so
+// filters can follow a direction across face edges.
+static const float3 CUBE_FACE_FORWARD[6] =
+{
+    float3( 1.0, 0.0, 0.0), float3(-1.0, 0.0, 0.0),
+    float3( 0.0, 1.0, 0.0), float3( 0.0,-1.0, 0.0),
+    float3( 0.0, 0.0, 1.0), float3( 0.0, 0.0,-1.0)
+};
+
+static const float3 CUBE_FACE_UP[6] =
+{
+    float3( 0.0, 1.0, 0.0), float3( 0.0, 1.0, 0.0),
+    float3( 0.0, 0.0,-1.0), float3( 0.0, 0.0, 1.0),
+    float3( 0.0, 1.0, 0.0), float3( 0.0, 1.0, 0.0)
+};
+
+// Calculate the upper bound of the propabalistic upper bound 
+// of the current depth being in an occluded state, given the 
+// distribution of depth we have at the texel.
+float ChebyshevUpperBoundMoments(float2 moments, float pixelDepth)
+{
+    // If light (sampled) depth exceeds our pixel depth, it is lit
+    if (pixelDepth <= moments.x)
+        return 1.0;
+
+    // Check how likely pixel is to be lit using chebyshev's upper bound
+    
+    float variance = moments.y - (moments.x * moments.x);
+
+    // Make sure variance is never 0 to avoid issues
+    variance = max(variance, MIN_VARIANCE);
+
+    float difference = pixelDepth - moments.x;
+    float pMax = variance / (difference * difference + variance);
+    
+    // Resulting shadow coefficient for lighting
+    return pMax;
+}
+
+// Solve the system of linear equations necessary to derive
+// the cumulative minimal probability of occlusion at this depth 
+float ComputeMSMShadowIntensity(float4 moments,
+    float pixelDepth,float depthBias, float momentBias)
+{
+    float4 b=lerp(moments, float4(0.5f,0.5f,0.5f,0.5f), momentBias);
+    float3 z;
+    z[0] = pixelDepth - depthBias;
+    float L32D22 = mad(-b[0], b[1], b[2]);
+    float D22 = mad(-b[0], b[0], b[1]);
+    float SquaredDepthVariance = mad(-b[1], b[1], b[3]);
+    float D33D22 = dot(float2(SquaredDepthVariance,-L32D22),
+                     float2(D22,                  L32D22));
+    float InvD22 = 1.0f / D22;
+    float L32 = L32D22 * InvD22;
+    float3 c=float3(1.0f, z[0], z[0] * z[0]);
+    c[1] -= b.x;
+    c[2] -= b.y+L32*c[1];
+    c[1] *= InvD22;
+    c[2] *= D22 / D33D22;
+    c[1] -= L32 * c[2];
+    c[0] -= dot(c.yz, b.xy);
+    float p = c[1] / c[2];
+    float q = c[0] / c[2];
+    float r = sqrt((p*p*0.25f) -q);
+    z[1] =- p * 0.5f - r;
+    z[2] =- p * 0.5f + r;
+
+    float4 Switch=
+    	(z[2]<z[0])?float4(z[1],z[0],1.0f,1.0f):(
+    	(z[1]<z[0])?float4(z[0],z[1],0.0f,1.0f):
+    	float4(0.0f,0.0f,0.0f,0.0f));
+
+    float Quotient = (Switch[0]*z[2]-b[0]*(Switch[0]+z[2])+b[1])
+                  / ((z[2]-Switch[1])*(z[0]-z[1]));
+
+    return 1.0f -saturate(Switch[2] + Switch[3] * Quotient);
+}
+
+// Moments written to the VSM shadow maps, bias is added to the second
+// moment against self-shadowing
+float2 EncodeVSMMoments(float depth, float bias)
+{
+    float2 moments = float2(depth, depth * depth + bias);
+#if defined(MOMENT_CENTERED)
+    // 16-bit UNORM has no precision to spare near zero, keep the second moment
+    // about the middle of the depth range: 4 * E[(d - 0.5)^2] stays in [0, 1]
+    moments.y = 4.0 * (moments.y - depth) + 1.0;
+#endif
+    return moments;
+}
+
+// Moments written to the MSM shadow maps
+float4 EncodeMSMMoments(float depth)
+{
+    float depthSq = depth * depth;
+
+    // Store moments as depth, depth^2, depth^3, depth^4
+    float4 moments = float4(depth, depthSq, depthSq * depth, depthSq * depthSq);
+
+#if !defined(MOMENT_RAW)
+    // Perform this magic number matrix multiplication in order to optimize
+    // the storage of these values. This improves numerical stability by 
+    // maximizing the entropy of the convex hull spanned by the vectors created
+    // by the above equation.
+    moments = mul(moments, float4x4(
+                     -2.07224649f,   13.7948857237f,  0.105877704f,   9.7924062118f,
+                     32.23703778f,  -59.4683975703f, -1.9077466311f,-33.7652110555f,
+                    -68.571074599f,  82.0359750338f,  9.3496555107f, 47.9456096605f,
+                     39.3703274134f,-35.364903257f,  -6.6543490743f,-23.9728048165f));
+
+    moments[0] += 0.035955884801f;
+#endif
+    return moments;
+}
+
+// Reconstruct the expected moments from the numerically
+// optimized representation written by EncodeMSMMoments
+float4 DecodeOptimizedMoments(float4 momentsOptimized)
+{
+    momentsOptimized[0] -= 0.035955884801f;
+
+    return mul(momentsOptimized,
+        float4x4(0.2227744146f, 0.1549679261f, 0.1451988946f, 0.163127443f,
+                 0.0771972861f, 0.1394629426f, 0.2120202157f, 0.2591432266f,
+                 0.7926986636f, 0.7963415838f, 0.7258694464f, 0.6539092497f,
+                 0.0319417555f,-0.1722823173f,-0.2758014811f,-0.3376131734f));
+}
+
+// VSM moments as sampled from the shadow maps. 16-bit UNORM maps store the
+// second moment about the middle of the depth range, see EncodeVSMMoments.
+// The encoding is linear, so filtered moments decode the same way.
+float2 DecodeVSMMoments(float2 moments)
+{
+#if defined(MOMENT_CENTERED)
+    moments.y = 0.25 * moments.y + moments.x - 0.25;
+#endif
+    return moments;
+}
+
+// MSM moments as sampled from the shadow maps, 128-bit maps store them as is
+float4 DecodeMSMMoments(float4 moments)
+{
+#if defined(MOMENT_RAW)
+    return moments;
+#else
+    return DecodeOptimizedMoments(moments);
+#endif
+}
+
+// ESM maps store the occluder depth d and are filtered in log space: filters
+// sum w * exp(c * d) and a filtered texel holds log(sum) / c, so the resolve
+// takes one exp per lookup. Sums are taken relative to a reference depth,
+// for depth differences up to 1 exp(c) stays well inside float range.
+#define ESM_EXPONENT 80.0
+
+// Weighted exp(c * d) of a filter tap, relative to reference
+float ESMLogSpaceWeight(float depth, float reference, float weight)
+{
+    return weight * exp(ESM_EXPONENT * (depth - reference));
+}
+
+// Depth stored for a sum of ESMLogSpaceWeight taps
+float ESMLogSpaceDepth(float reference, float sum)
+{
+    return reference + log(sum) / ESM_EXPONENT;
+}
+
+// Receivers at or in front of the filtered occluders are lit, the shadow
+// falls off exponentially behind them
+float ExponentialShadow(float occluder, float pixelDepth)
+{
+    return saturate(exp(ESM_EXPONENT * (occluder - pixelDepth)));
+}
+
+// Projects a world position into an atlas light's tile.
+// Returns false outside of the light's frustum.
+bool GetAtlasShadowCoord(AtlasLight light, float3 worldPos, out float2 atlasUV, out float depth)
+{
+    float4 coord = mul(light.viewProj, float4(worldPos, 1.0));
+    float2 uv = coord.xy / coord.w * float2(0.5, -0.5) + 0.5;
+
+    // Perspective w is the view depth, stored linearly in the atlas
+    depth = coord.w * light.positionInvRange.w;
+    atlasUV = light.tileRect.xy + saturate(uv) * light.tileRect.zw;
+
+    return coord.w > 0.0 && all(uv >= 0.0) && all(uv <= 1.0) && depth < 1.0;
+}
+
+// Spot cone and range falloff of an atlas light
+float GetAtlasLightAttenuation(AtlasLight light, float3 worldPos, out float3 L)
+{
+    float3 toLight = light.positionInvRange.xyz - worldPos;
+    float distance = length(toLight);
+    L = toLight / distance;
+
+    float cosAngle = dot(-L, light.directionCosOuter.xyz);
+    float cone = saturate((cosAngle - light.directionCosOuter.w) /
+        max(light.colorCosInner.a - light.directionCosOuter.w, 0.0001));
+    float range = saturate(1.0 - distance * light.positionInvRange.w);
+
+    return cone * cone * range * range;
+}
+
+// Face a direction from the light points into, and its uv on that face
+float2 GetCubeFaceUV(float3 dir, out uint face)
+{
+    float3 a = abs(dir);
+    if (a.x >= a.y && a.x >= a.z)
+        face = (dir.x >= 0.0) ? 0 : 1;
+    else if (a.y >= a.z)
+        face = (dir.y >= 0.0) ? 2 : 3;
+    else
+        face = (dir.z >= 0.0) ? 4 : 5;
+
+    float3 forward = CUBE_FACE_FORWARD[face];
+    float3 up = CUBE_FACE_UP[face];
+    float3 right = cross(up, forward);
+
+    return float2(dot(dir, right), -dot(dir, up)) / dot(dir, forward) * 0.5 + 0.5;
+}
+
+// Point shadows store the view depth of the face, which is the
+// largest component of the direction
+float GetCubeFaceDepth(PointLight light, float3 dir)
+{
+    float3 a = abs(dir);
+    return max(a.x, max(a.y, a.z)) * light.positionInvRange.w;
+}
+
+// Range falloff of a point light
+float GetPointLightAttenuation(PointLight light, float3 worldPos, out float3 L)
+{
+    float3 toLight = light.positionInvRange.xyz - worldPos;
+    float distance = length(toLight);
+    L = toLight / distance;
+
+    float range = saturate(1.0 - distance * light.positionInvRange.w);
+    return range * range;
+}
+
+// Bilinear upsample of the reduced resolution shadow mask (shadow, view distance).
+// Texels from another surface are weighted out by their view distance, when none
+// is close enough the nearest one in distance is used.
+float UpsampleShadowMask(Texture2D<float2> mask, float2 pixel, float viewDistance, uint2 maskSize, uint maskScale)
+{
+    // Mask texel i covers full resolution pixels [i * scale, (i + 1) * scale)
+    float2 coord = pixel / float(maskScale) - 0.5;
+    int2 base = int2(floor(coord));
+    float2 f = coord - float2(base);
+
+    float bilinear[4] = { (1.0 - f.x) * (1.0 - f.y), f.x * (1.0 - f.y), (1.0 - f.x) * f.y, f.x * f.y };
+    int2 offsets[4] = { int2(0, 0), int2(1, 0), int2(0, 1), int2(1, 1) };
+
+    float sum = 0.0;
+    float totalWeight = 0.0;
+    float nearestShadow = 1.0;
+    float nearestDifference = SHADOW_MASK_FAR;
+
+    for (uint i = 0; i < 4; ++i)
+    {
+        int2 texel = clamp(base + offsets[i], int2(0, 0), int2(maskSize) - 1);
+        float2 value = mask.Load(int3(texel, 0));
+
+        float difference = abs(value.y - viewDistance) / viewDistance;
+        float weight = bilinear[i] * saturate(1.0 - difference * SHADOW_MASK_DEPTH_SHARPNESS);
+
+        sum += value.x * weight;
+        totalWeight += weight;
+
+        if (difference < nearestDifference)
+        {
+            nearestDifference = difference;
+            nearestShadow = value.x;
+        }
+    }
+
+    return (totalWeight > 0.0001) ? sum / totalWeight : nearestShadow;
+}
@@ -21,11 +21,38 @@
 * specific language governing permissions and limitations
 * under the License.
 */
+#include "shadowCommon.h"
+
 struct VsIn
 {
 	float4 position : POSITION;
+	uint InstanceID : SV_InstanceID;
+};
+
+#if defined(SHADOW_ATLAS)
+cbuffer cbAtlasLights : register(b3, UPDATE_FREQ_PER_FRAME)
+{
+    AtlasLight atlasLights[MAX_ATLAS_LIGHTS];
+    uint4 atlasLightCount;
+};
+
+cbuffer cbAtlasRootConstants : register(b4)
+{
+    uint atlasLightIndex;
+};
+#elif defined(SHADOW_CUBE)
+cbuffer cbPointLights : register(b3, UPDATE_FREQ_PER_FRAME)
+{
+    PointLight pointLights[MAX_POINT_LIGHTS];
+    uint4 pointLightCount;
 };
 
+// Lights are updated in runs of consecutive indices
+cbuffer cbPointShadowRootConstants : register(b4)
+{
+    uint firstPointLight;
+};
+#else
 cbuffer cbLight : register(b1, UPDATE_FREQ_PER_FRAME)
 {
 	float4x4 lightProjView;
@@ -35,27 +62,84 @@ cbuffer cbLight : register(b1, UPDATE_FREQ_PER_FRAME)
 	float4 lightValue;
 };
 
-cbuffer cbObject : register(b2, UPDATE_FREQ_PER_DRAW)
+#if defined(VIRTUAL_PAGE)
+// Clip space scale, x and y offset that fit one virtual page and its border to the viewport
+cbuffer cbVirtualPageRootConstants : register(b4)
 {
-	float4x4 world;
+    float4 pageTransform;
+};
+#endif
+#endif
 
-	float4 diffuse;
-	float3 specular;
-	float shininess;
+// Range of objects drawn. Layered passes draw objectCount instances per layer.
+// Culled draws of the directional map read their objects from the visible
+// list at visibleOffset instead, ~0u otherwise.
+cbuffer cbObject : register(b2, UPDATE_FREQ_PER_DRAW)
+{
+	uint firstObject;
+	uint objectCount;
+	uint visibleOffset;
 };
 
+StructuredBuffer<float4> objectTransforms : register(t10, UPDATE_FREQ_PER_FRAME);
+#if !defined(SHADOW_ATLAS) && !defined(SHADOW_CUBE)
+StructuredBuffer<uint> visibleObjects : register(t12, UPDATE_FREQ_PER_FRAME);
+#endif
+
 struct PsIn
 {
     float4 Position : SV_Position;
 
     float Depth : TARGET;
+#if defined(SHADOW_CUBE)
+    // Consumed by the rasterizer only, the moment shaders don't read it
+    uint Layer : SV_RenderTargetArrayIndex;
+#endif
 };
 
 PsIn main(VsIn input)
 {
     PsIn output;
-    float4 pos = mul(lightProjView, mul(world, float4(input.position.xyz, 1.0)));
+    uint object = firstObject + input.InstanceID % objectCount;
+#if !defined(SHADOW_ATLAS) && !defined(SHADOW_CUBE)
+    if (visibleOffset != ~0u)
+        object = visibleObjects[visibleOffset + input.InstanceID];
+#endif
+    float4 positionScale = objectTransforms[object];
+    float4 worldPos = float4(GetObjectWorldPosition(positionScale, input.position.xyz), 1.0);
+#if defined(SHADOW_ATLAS)
+    AtlasLight light = atlasLights[atlasLightIndex];
+    float4 pos = mul(light.viewProj, worldPos);
     output.Position = pos;
+    // Perspective w is the view depth, stored linearly for the spot lights
+    output.Depth = pos.w * light.positionInvRange.w;
+#elif defined(SHADOW_CUBE)
+    // Every object once per cube face of every point light, routed to its own layer
+    uint layer = input.InstanceID / objectCount;
+    uint face = layer % 6;
+    PointLight light = pointLights[firstPointLight + layer / 6];
+
+    float3 toVertex = worldPos.xyz - light.shadowPosition.xyz;
+    float3 forward = CUBE_FACE_FORWARD[face];
+    float3 up = CUBE_FACE_UP[face];
+    float3 right = cross(up, forward);
+
+    // 90 degree perspective projection of the face
+    float z = dot(toVertex, forward);
+    float nearPlane = light.colorNear.a;
+    float farPlane = 1.0 / light.positionInvRange.w;
+    output.Position = float4(dot(toVertex, right), dot(toVertex, up),
+        (z - nearPlane) * farPlane / (farPlane - nearPlane), z);
+    output.Depth = z * light.positionInvRange.w;
+    output.Layer = firstPointLight * 6 + layer;
+#else
+    float4 pos = mul(lightProjView, worldPos);
+    // The map shaders interpolate it without perspective, see SCREEN_DEPTH
     output.Depth = pos.z / pos.w;
+#if defined(VIRTUAL_PAGE)
+    pos.xy = pos.xy * pageTransform.x + pageTransform.yz * pos.w;
+#endif
+    output.Position = pos;
+#endif
     return output;
 }
\ No newline at end of file
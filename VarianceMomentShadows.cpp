@@ -32,9 +32,17 @@
 #include "../../../../Common_3/OS/Interfaces/IApp.h"
 #include "../../../../Common_3/OS/Interfaces/IProfiler.h"
 #include "../../../../Common_3/OS/Interfaces/IInput.h"
+#include "../../../../Common_3/OS/Interfaces/IThread.h"
+#include "../../../../Common_3/OS/Core/Atomics.h"
 
 //Math
 #include "../../../../Common_3/OS/Math/MathTypes.h"
+// The scene loops take four spheres at a time with SSE2 where it exists, and
+// one at a time elsewhere, e.g. on ARM64
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SCENE_SSE2
+#include <emmintrin.h>
+#endif
 
 //ui
 #include "../../../../Middleware_3/UI/AppUI.h"
@@ -97,28 +105,893 @@ struct LightView
 	}
 };
 
-struct UniformObjectData
+// Matches ObjectMaterial in shadowCommon.h. Transforms are a separate
+// buffer of translation and uniform scale, see objectTransforms.
+struct ObjectMaterial
 {
-	mat4 mWorld;
-
 	// Last component determines if lit or not, >0
 	vec4 mDiffuse;
 	// Last component is shininess
 	vec4 mSpecular;
 };
 
+// Matches SphereAnimation in shadowCommon.h
+struct SphereAnimation
+{
+	// x, lowest height, z, scale
+	vec4  mPositionScale;
+	float mAngle;
+	float mFrequency;
+	float mPadding[2];
+};
+
+// Root constants of sceneAnimation.comp
+struct SceneAnimationConstants
+{
+	float    mDeltaTime;
+	float    mBounceSpeed;
+	uint32_t mFirstSphere;
+	uint32_t mSphereCount;
+};
+
+// Range of the object buffers read by one draw, matches cbObject
+struct UniformObjectDrawData
+{
+	uint32_t mFirstObject;
+	uint32_t mObjectCount;
+	// Start of the visible list a culled draw reads, ~0u draws the range
+	uint32_t mVisibleOffset;
+};
+
+// Views the culling pass writes a sphere list and an indirect draw for,
+// matches CULL_VIEW_* in shadowCommon.h
+enum CullView
+{
+	CULL_VIEW_CAMERA = 0,    // Camera frustum, drawn by the depth prepass
+	CULL_VIEW_LIGHT,         // Directional light frustum, drawn by the shadow map
+	CULL_VIEW_OCCLUSION,     // Camera frustum and Hi-Z, drawn by the main pass
+	CULL_VIEW_COUNT,
+	CULL_VIEW_NONE = CULL_VIEW_COUNT,
+};
+
+// Draws issued by drawObjects, indices into the per draw descriptor sets
+enum SceneDraw
+{
+	SCENE_DRAW_PLANE = 0,
+	SCENE_DRAW_LIGHT_OBJECT,
+	SCENE_DRAW_SPHERES,
+	// Spheres of a cull view's visible list, one per view
+	SCENE_DRAW_CULLED_SPHERES,
+	SCENE_DRAW_COUNT = SCENE_DRAW_CULLED_SPHERES + CULL_VIEW_COUNT,
+};
+
 struct UniformShadowMapData
 {
 	uvec2 mSize = { 2048, 2048 };
 };
 
+// The rect is filtered by one dispatch, the cache's writes
+// are offset by the scroll of the toroidal shadow map
+struct ShadowBlurConstant
+{
+	uvec2 shadowMapSize;
+	uvec2 rectOffset;
+	uvec2 rectSize;
+	uvec2 dstOffset;
+	bool horizontalPass;
+};
+
+struct ShadowMomentsConstant
+{
+	uvec2 shadowMapSize;
+	uvec2 rectOffset;
+	uvec2 rectSize;
+	uvec2 dstOffset;
+	bool horizontalBlur;
+};
+
+struct UniformShadowMaskData
+{
+	mat4 mInvProjectView;
+	mat4 mPrevProjectView;
+	mat4 mLightViewProj;
+	vec4 mCamPos;
+	vec4 mPrevCamPos;
+	vec4 mLightPosition;
+	// Mask width, height, full resolution pixels per mask texel, kernel taps per frame
+	uint32_t mShadowMaskSize[4] = { 0, 0, 0, 0 };
+	// View width, height, shadow map width, height
+	uint32_t mSourceSize[4] = { 0, 0, 0, 0 };
+	// Frame index, history valid
+	uint32_t mTemporalParams[4] = { 0, 0, 0, 0 };
+	// x weight of the current frame
+	vec4 mTemporalBlend;
+	// Virtual pages per side (0 disables the virtual map), slot size, slot border, request stamp
+	uint32_t mVirtualPages[4] = { 0, 0, 0, 0 };
+	// Pool width, height, slots per row
+	uint32_t mVirtualPool[4] = { 0, 0, 0, 0 };
+	// Min/max pyramid levels, 0 disables the early-out
+	uint32_t mMinMaxParams[4] = { 0, 0, 0, 0 };
+	// Origin of the view in the depth buffer
+	uint32_t mViewportOffset[4] = { 0, 0, 0, 0 };
+	// x penumbra texels per unit of light depth (0 disables contact hardening), y blocker search width in texels
+	vec4 mContactHardening;
+	// xy cache texel of the frustum's first one in uv, z 1 when the toroidal map is scrolled
+	vec4 mShadowMapOrigin;
+};
+
+struct ShadowMaskConstant
+{
+	uint32_t shadowMaskSize[2];
+	uint32_t viewportOffset[2];
+	uint32_t shadowMaskScale;
+};
+
+/************************************************************************/
+// Shadow update scheduling
+/************************************************************************/
+// Every shadow view (the directional map, each point light, each atlas tile)
+// keeps its last contents in a persistent target. Views that changed are
+// updated at most every mInterval frames, most overdue first, until the
+// per-frame texel budget is spent. Stale views are sampled with the transform
+// they were rendered with, so they stay aligned with the scene.
+struct ShadowViewSchedule
+{
+	uint32_t mInterval;
+	uint32_t mLastUpdate;
+	// Texels rendered by one update
+	uint32_t mCost;
+	// Contents changed since the last update
+	bool     mPending;
+	// Nothing usable cached, updated regardless of the budget
+	bool     mInvalid;
+	// Updated this frame
+	bool     mScheduled;
+};
+
+/************************************************************************/
+// Shadow atlas
+/************************************************************************/
+// Moment maps of many spot lights packed into one persistent target. Each light
+// gets a tile sized by its screen coverage; only tiles whose contents changed
+// are re-rendered and blurred.
+const uint32_t gMaxAtlasLights = 32;
+
+// Matches AtlasLight in shadowCommon.h
+struct UniformAtlasLight
+{
+	mat4 mViewProj;
+	// w is 1 / range
+	vec4 mPositionInvRange;
+	// w is the cosine of the outer cone angle
+	vec4 mDirectionCosOuter;
+	// w is the cosine of the inner cone angle
+	vec4 mColorCosInner;
+	// Tile uv offset, uv scale
+	vec4 mTileRect;
+};
+
+struct UniformAtlasLightData
+{
+	UniformAtlasLight mLights[gMaxAtlasLights];
+	uint32_t mLightCount[4] = { 0, 0, 0, 0 };
+};
+
+struct ShadowAtlasBlurConstant
+{
+	uvec2 atlasSize;
+	uint32_t horizontalPass;
+};
+
+// Texel rectangle of a light, matches dirtyTiles in shadowAtlasBlur.comp
+struct ShadowAtlasTile
+{
+	uint32_t mX;
+	uint32_t mY;
+	uint32_t mSize;
+	uint32_t mPad;
+};
+
+struct ShadowAtlasLight
+{
+	vec3 mPosition;
+	vec3 mDirection;
+	vec3 mColor;
+	float mRange;
+	float mCosOuter;
+	float mCosInner;
+	mat4 mViewProj;
+
+	// Transform the cached tile was rendered with
+	mat4 mShadowViewProj;
+
+	// Tile size asked for by the light's screen coverage, and the tile it got
+	uint32_t mRequestedSize;
+	ShadowAtlasTile mTile;
+	ShadowViewSchedule mSchedule;
+};
+
+/************************************************************************/
+// Point light shadows
+/************************************************************************/
+// The six faces of every point light are layers of one texture array, written
+// by a single instanced draw per object. See CUBE_FACE_* in shadowCommon.h.
+const uint32_t gMaxPointLights = 4;
+
+// Matches PointLight in shadowCommon.h
+struct UniformPointLight
+{
+	// w is 1 / range
+	vec4 mPositionInvRange;
+	// w is the near plane
+	vec4 mColorNear;
+	vec4 mShadowPosition;
+};
+
+struct ShadowPointLight
+{
+	vec3 mPosition;
+	// Position the cached faces were rendered from
+	vec3 mShadowPosition;
+	ShadowViewSchedule mSchedule;
+};
+
+struct UniformPointLightData
+{
+	UniformPointLight mLights[gMaxPointLights];
+	// Light count, face size
+	uint32_t mLightCount[4] = { 0, 0, 0, 0 };
+};
+
+struct ShadowCubeBlurConstant
+{
+	uint32_t faceSize;
+	uint32_t horizontalPass;
+	uint32_t firstLayer;
+};
+
+// Skyline packer: the atlas is a list of horizontal segments,
+// every allocation raises the segments under it
+struct ShadowAtlasSkylineNode
+{
+	int32_t mX;
+	int32_t mY;
+	int32_t mWidth;
+};
+
+struct ShadowAtlasAllocator
+{
+	// Each allocation adds at most one segment
+	ShadowAtlasSkylineNode mNodes[gMaxAtlasLights + 1];
+	uint32_t mNodeCount;
+	int32_t  mSize;
+};
+
+/************************************************************************/
+// Virtual shadow map
+/************************************************************************/
+// The directional light's frustum is split into a grid of pages, and only the
+// pages the shadow mask pass found receivers in are rendered. Resident pages
+// live in slots of a persistent pool, a page table maps every virtual page to
+// its slot. Requests reach the CPU through a readback gImageCount frames later,
+// until then the receivers fall back to the directional shadow map.
+const uint32_t gVirtualShadowPages = 128;        // Per side of the light frustum
+const uint32_t gVirtualShadowSlotSize = 128;
+// Texels of the neighbouring pages around every slot, covers the blur and the mask kernel
+const uint32_t gVirtualShadowSlotBorder = 8;
+const uint32_t gVirtualShadowPoolSize = 2048;
+const uint32_t gVirtualShadowPoolSlots = gVirtualShadowPoolSize / gVirtualShadowSlotSize;    // Per row
+const uint32_t gVirtualShadowSlotCount = gVirtualShadowPoolSlots * gVirtualShadowPoolSlots;
+const uint32_t gVirtualShadowPageCount = gVirtualShadowPages * gVirtualShadowPages;
+const uint32_t gMaxVirtualShadowPageUpdates = 64;
+// Matches VIRTUAL_PAGE_NONE in shadowMask.comp
+const uint32_t VIRTUAL_PAGE_NONE = ~0u;
+
+struct VirtualShadowSlot
+{
+	// Virtual page held, VIRTUAL_PAGE_NONE when free
+	uint32_t mPage;
+	// Frames the page was last requested and rendered in
+	uint32_t mLastRequest;
+	uint32_t mLastUpdate;
+};
+
+/************************************************************************/
+// Shadow min/max pyramid
+/************************************************************************/
+// Depth intervals of the directional shadow map outside of which the moment
+// resolve is fully lit or fully shadowed. Level 0 holds one per 2x2 texels,
+// the shadow mask pass tests the level its kernel fits in before the solve.
+// Rebuilt whenever the shadow map cache is.
+const uint32_t gMaxShadowMinMaxLevels = 6;
+
+struct ShadowMinMaxConstant
+{
+	uvec2 srcSize;
+	uint32_t firstLevel;
+};
+
+/************************************************************************/
+// Contact hardening
+/************************************************************************/
+// The shadow map cache gets a mip chain of its moments. The shadow mask reads
+// the mean moments of a blocker search region with one coarse sample,
+// estimates the average blocker depth from them and widens its kernel with
+// the distance between blocker and receiver, at the same cost for any width.
+// Levels of the cache, the widest penumbra is 2^(levels - 1) texels.
+const uint32_t gMaxShadowMomentLevels = 8;
+
+struct ShadowMomentMipsConstant
+{
+	uvec2 srcSize;
+};
+
+/************************************************************************/
+// Toroidal shadow map
+/************************************************************************/
+// The directional frustum follows the camera in whole texels. The cache keeps
+// the texels both frustums share where they are, addressed modulo its size,
+// and only the bands the scroll exposed are rendered and filtered again.
+// Texel rectangle of the directional shadow map
+struct ShadowRect
+{
+	uint32_t mX;
+	uint32_t mY;
+	uint32_t mWidth;
+	uint32_t mHeight;
+};
+
+// Parts of the frustum the scheduled update re-renders, in its own texels.
+// Every pass up to the last one fills the render rects, the last one writes
+// the write rects into the cache. The render rects reach further than the
+// filters do, so every written texel only sees rendered ones.
+struct DirectionalShadowUpdate
+{
+	ShadowRect mRenderRects[2];
+	ShadowRect mWriteRects[2];
+	uint32_t   mRenderRectCount;
+	uint32_t   mWriteRectCount;
+	// Cache texel holding the first texel of the frustum
+	uvec2      mWrapOffset;
+};
+
+/************************************************************************/
+// Frame graph
+/************************************************************************/
+// Passes declare the render targets they read and write every frame. Compiling
+// the graph culls passes whose results are never consumed, derives one batched
+// barrier per pass from the declared states, and hands transient targets out of
+// a persistent pool so that targets with disjoint lifetimes share memory.
+// Pass and resource capacities follow the features, see gMaxFrameGraphPasses.
+const uint32_t gMaxFrameGraphPassAccesses = 8;
+const uint32_t FRAME_GRAPH_INVALID = ~0u;
+
+typedef uint32_t FrameGraphResource;
+
+struct FrameGraph;
+typedef void (*FrameGraphExecuteFn)(Cmd* pCmd, FrameGraph* pGraph, void* pUserData);
+
+struct FrameGraphAccess
+{
+	FrameGraphResource mResource;
+	ResourceState      mState;
+};
+
+struct FrameGraphPass
+{
+	const char*         pName;
+	FrameGraphExecuteFn pExecute;
+	void*               pUserData;
+
+	FrameGraphAccess    mReads[gMaxFrameGraphPassAccesses];
+	FrameGraphAccess    mWrites[gMaxFrameGraphPassAccesses];
+	uint32_t            mReadCount;
+	uint32_t            mWriteCount;
+
+	// Number of consumed writes, 0 once culled
+	uint32_t            mRefCount;
+
+	RenderTargetBarrier mBarriers[gMaxFrameGraphPassAccesses * 2];
+	uint32_t            mBarrierCount;
+};
+
+struct FrameGraphResourceNode
+{
+	const char*      pName;
+	RenderTargetDesc mDesc;
+	// Imported target, or the physical target assigned during compilation
+	RenderTarget*    pRenderTarget;
+	// Imported targets only
+	ResourceState    mState;
+	ResourceState    mFinalState;
+	bool             mImported;
+	// Keeps its contents across frames, see fgCreatePersistent
+	bool             mPersistent;
+
+	uint32_t         mFirstPass;
+	uint32_t         mLastPass;
+	// Number of passes reading this resource
+	uint32_t         mRefCount;
+	uint32_t         mPhysical;
+};
+
+struct FrameGraphPhysicalTarget
+{
+	RenderTargetDesc mDesc;
+	RenderTarget*    pRenderTarget;
+	ResourceState    mState;
+
+	// Aliasing: the target is free for any resource first used after mBusyUntilPass
+	uint32_t         mAssignedFrame;
+	uint32_t         mBusyUntilPass;
+	uint64_t         mSize;
+	bool             mPersistent;
+};
+
+// Per pass data referenced by the frame graph execute callbacks
+struct ShadowPassData
+{
+	FrameGraphResource mMap;
+	FrameGraphResource mDepth;
+};
+
+// Multisampled directional shadow depth at half resolution. The moments
+// pass resolves it, the mean moments of a texel's samples filter coverage
+// below the texel size.
+enum ShadowMsaa
+{
+	SHADOW_MSAA_OFF = 0,
+	SHADOW_MSAA_4X,
+	SHADOW_MSAA_8X,
+	SHADOW_MSAA_COUNT,
+};
+
+// Depth-only shadow pass: moments are built from the depth in compute
+struct ShadowMomentsPassData
+{
+	FrameGraphResource mDepth;
+	FrameGraphResource mDst;
+	// Applies the horizontal pass of the first blur
+	bool               mHorizontalBlur;
+	// Writes the directional cache, see DirectionalShadowUpdate
+	bool               mWritesCache;
+};
+
+struct BlurPassData
+{
+	FrameGraphResource mSrc;
+	FrameGraphResource mDst;
+	uint32_t           mBlurIndex;
+	bool               mHorizontal;
+	// Writes the directional cache, see DirectionalShadowUpdate
+	bool               mWritesCache;
+	// Pass name, telemetry keeps the iterations apart
+	char               mName[32];
+};
+
+struct ShadowAtlasPassData
+{
+	FrameGraphResource mRaw;
+	FrameGraphResource mDepth;
+	// Lights whose tiles are re-rendered this frame
+	uint32_t           mDirtyLights[gMaxAtlasLights];
+	uint32_t           mDirtyCount;
+	uint32_t           mMaxDirtySize;
+};
+
+// Pages rendered this frame, blurred with the atlas blur shader afterwards
+struct VirtualShadowPassData
+{
+	FrameGraphResource mRaw;
+	FrameGraphResource mDepth;
+	uint32_t           mPages[gMaxVirtualShadowPageUpdates];
+	uint32_t           mPageCount;
+};
+
+struct PointShadowPassData
+{
+	FrameGraphResource mMap;
+	FrameGraphResource mDepth;
+	// Runs of consecutive scheduled lights, drawn and blurred together
+	uint32_t           mRunFirst[gMaxPointLights];
+	uint32_t           mRunLength[gMaxPointLights];
+	uint32_t           mRunCount;
+};
+
+// Shared by the depth prepass and the shadow mask passes that read its depth
+struct ShadowMaskPassData
+{
+	// ShadowViewId of the view the passes render
+	uint32_t           mView;
+	FrameGraphResource mDepth;
+	FrameGraphResource mShadowMap;
+	// FRAME_GRAPH_INVALID without the virtual shadow map
+	FrameGraphResource mVirtualPool;
+	// FRAME_GRAPH_INVALID without the min/max early-out
+	FrameGraphResource mMinMax;
+	FrameGraphResource mMask;
+	// Temporal filter, FRAME_GRAPH_INVALID without history
+	FrameGraphResource mHistory;
+	FrameGraphResource mResolved;
+};
+
+struct ShadowMinMaxPassData
+{
+	FrameGraphResource mShadowMap;
+	FrameGraphResource mPyramid;
+	uint32_t           mLevelCount;
+};
+
+// Filters the mips of the shadow map cache in place
+struct ShadowMomentMipsPassData
+{
+	FrameGraphResource mShadowMap;
+	uint32_t           mLevelCount;
+};
+
+struct HiZPassData
+{
+	FrameGraphResource mDepth;
+	FrameGraphResource mHiZ;
+};
+
+struct MainPassData
+{
+	uint32_t           mView;
+	FrameGraphResource mShadowMask;
+	FrameGraphResource mShadowAtlas;
+	FrameGraphResource mPointShadows;
+	FrameGraphResource mColor;
+	FrameGraphResource mDepth;
+};
+
+/************************************************************************/
+// Shadow renderer
+/************************************************************************/
+// The shadow build is shared by every camera view of a frame. The light is
+// set and the casters submitted once, the build adds the directional, atlas,
+// point light and virtual page passes to the graph once, and each view binds
+// the result against its own depth, which only adds its shadow mask pass.
+enum ShadowViewId
+{
+	SHADOW_VIEW_MAIN = 0,
+	// Top-down overview in a corner of the screen
+	SHADOW_VIEW_MINIMAP,
+	SHADOW_VIEW_COUNT,
+};
+
+struct ShadowView
+{
+	bool                  mActive;
+	UniformCamData        mCamera;
+	UniformShadowMaskData mShadowMask;
+	// x, y, width, height in the swapchain and the depth buffer
+	uint32_t              mViewport[4];
+	// Spheres of the depth prepass and the main pass, CULL_VIEW_NONE draws all
+	CullView              mPrepassCull;
+	CullView              mMainCull;
+	// Only the main view keeps a mask history
+	bool                  mTemporal;
+	ShadowMaskPassData    mMaskPassData;
+	MainPassData          mMainPassData;
+};
+
+struct ShadowRenderer
+{
+	vec3               mLightPosition;
+	mat4               mLightViewProj;
+	// Outputs of the build, valid for the graph's current frame.
+	// FRAME_GRAPH_INVALID where a feature is disabled.
+	FrameGraphResource mShadowMap;
+	FrameGraphResource mShadowAtlas;
+	FrameGraphResource mPointShadows;
+	FrameGraphResource mVirtualPool;
+	FrameGraphResource mMinMax;
+};
+
+// Graph capacity with every feature on. The directional map renders, builds
+// its moments and blurs gMaxBlurs times in two passes, the atlas, virtual
+// pages and point lights render and blur once. Every view adds a depth
+// prepass, a mask, a temporal resolve and a main pass. Hi-Z, min/max, moment
+// mips and the UI come once.
+const uint32_t gMaxBlurs = 8;
+const uint32_t gMaxFrameGraphPasses = (2 + 2 * gMaxBlurs) + 3 * 3 + 4 * SHADOW_VIEW_COUNT + 4;
+// Targets of the same features, plus the imported swapchain and depth buffer
+const uint32_t gMaxFrameGraphResources = (3 + 2 * gMaxBlurs) + 4 * 3 + 3 * SHADOW_VIEW_COUNT + 4;
+// One frame never assigns more targets than it has resources, so a full pool
+// always holds a target unused this frame that can be evicted
+const uint32_t gMaxFrameGraphPhysicalTargets = gMaxFrameGraphResources;
+
+struct FrameGraph
+{
+	FrameGraphPass           mPasses[gMaxFrameGraphPasses];
+	FrameGraphResourceNode   mResources[gMaxFrameGraphResources];
+	FrameGraphPhysicalTarget mPhysical[gMaxFrameGraphPhysicalTargets];
+	RenderTargetBarrier      mFinalBarriers[gMaxFrameGraphResources];
+
+	uint32_t mPassCount;
+	uint32_t mResourceCount;
+	uint32_t mPhysicalCount;
+	uint32_t mFinalBarrierCount;
+	uint32_t mFrame;
+
+	// Targets unused for this many frames are released
+	uint32_t mIdleFrames;
+	uint64_t mBudget;
+	bool     mOverBudget;
+};
+
+/************************************************************************/
+// Telemetry
+/************************************************************************/
+// Hierarchical CPU and GPU timing scopes plus pipeline statistics of the
+// shadow and main passes. Frames are averaged over an interval and appended
+// to a CSV or JSON lines file in the log directory.
+const uint32_t gMaxTelemetryScopes = 64;
+const uint32_t gMaxTelemetryScopeDepth = 8;
+const uint32_t gMaxTelemetryStatQueries = 8;
+const uint32_t gMaxTelemetryRecords = 128;
+
+enum TelemetryFormat
+{
+	TELEMETRY_FORMAT_CSV = 0,
+	TELEMETRY_FORMAT_JSON,
+};
+
+// Layout of D3D12_QUERY_DATA_PIPELINE_STATISTICS
+struct PipelineStatistics
+{
+	uint64_t mIAVertices;
+	uint64_t mIAPrimitives;
+	uint64_t mVSInvocations;
+	uint64_t mGSInvocations;
+	uint64_t mGSPrimitives;
+	uint64_t mCInvocations;
+	uint64_t mCPrimitives;
+	uint64_t mPSInvocations;
+	uint64_t mHSInvocations;
+	uint64_t mDSInvocations;
+	uint64_t mCSInvocations;
+};
+
+struct TelemetryScope
+{
+	const char* pName;
+	// Index of the enclosing scope, ~0u at the root
+	uint32_t    mParent;
+	uint32_t    mDepth;
+	// Microseconds for CPU scopes, timestamp query indices for GPU scopes
+	int64_t     mBegin;
+	int64_t     mEnd;
+};
+
+// Scopes of one frame. GPU frames are read back once their fence signalled.
+struct TelemetryFrame
+{
+	TelemetryScope mScopes[gMaxTelemetryScopes];
+	uint32_t       mScopeCount;
+	uint32_t       mStack[gMaxTelemetryScopeDepth];
+	uint32_t       mStackDepth;
+	// Open scopes that did not fit, they and everything inside them are dropped
+	uint32_t       mDropped;
+
+	const char*    pStatNames[gMaxTelemetryStatQueries];
+	uint32_t       mStatCount;
+	bool           mStatOpen;
+
+	// Queries were issued and resolved for this frame
+	bool           mRecorded;
+};
+
+// One scope path accumulated over the export interval
+struct TelemetryRecord
+{
+	const char* pName;
+	const char* pParent;
+	uint32_t    mDepth;
+	bool        mGpu;
+	double      mTotalMs;
+	double      mMaxMs;
+	uint32_t    mSamples;
+};
+
+struct TelemetryStatRecord
+{
+	const char*        pName;
+	PipelineStatistics mTotal;
+	uint32_t           mSamples;
+};
+
+/************************************************************************/
+// Benchmark
+/************************************************************************/
+// Replays a scripted camera and light path with a seeded scene and a fixed
+// timestep for every combination of technique, blur count and shadow map
+// resolution, then reports frame time percentiles per combination.
+struct BenchmarkKeyframe
+{
+	float mTime;
+	vec3  mCameraPosition;
+	vec3  mCameraTarget;
+	// Radius, theta, phi like gLightSphereCoords
+	vec3  mLightSphereCoords;
+};
+
+struct BenchmarkConfig
+{
+	int32_t  mTechnique;
+	uint32_t mBlurCount;
+	uint32_t mShadowMapSize;
+};
+
+// Settings the sweep overrides, restored once it finished
+struct BenchmarkSettings
+{
+	int32_t  mTechnique;
+	uint32_t mBlurCount;
+	uvec2    mShadowMapSize;
+	vec3     mLightSphereCoords;
+	bool     mVSync;
+};
+
+/************************************************************************/
+// Job system
+/************************************************************************/
+// Per-frame CPU work split into jobs. Every worker owns a deque: it pushes and
+// pops its own jobs at the bottom while idle workers steal the oldest job from
+// the top of another deque. The main thread is worker 0 and helps while it
+// waits. Jobs live for one frame and are all waited on before the next.
+const uint32_t gMaxJobWorkers = 16;
+const uint32_t gMaxJobs = 256;                 // Per frame, power of two
+const uint32_t gMaxJobRanges = 64;             // Per parallel for
+const uint32_t gMaxJobContinuations = 4;
+
+typedef uint32_t JobHandle;
+const JobHandle JOB_INVALID = ~0u;
+
+typedef void (*JobFunc)(void* pData, uint32_t begin, uint32_t end);
+
+struct Job
+{
+	JobFunc   pFunc;
+	void*     pData;
+	uint32_t  mBegin;
+	uint32_t  mEnd;
+	JobHandle mParent;
+	// Ranges of a parallel for, pushed once the job itself runs
+	JobHandle mFirstChild;
+	uint32_t  mChildCount;
+	// The job and its unfinished ranges
+	tfrg_atomic32_t mUnfinished;
+	// Unfinished dependencies, plus one until the job is submitted
+	tfrg_atomic32_t mBlockers;
+	// Jobs waiting on this one, guarded by gJobDependencyMutex
+	JobHandle mContinuations[gMaxJobContinuations];
+	uint32_t  mContinuationCount;
+	bool      mComplete;
+};
+
+struct JobDeque
+{
+	Mutex     mMutex;
+	JobHandle mJobs[gMaxJobs];
+	uint32_t  mTop;       // Stolen from
+	uint32_t  mBottom;    // Pushed to and popped from by the owner
+};
+
+
+/************************************************************************/
+// GPU culling
+/************************************************************************/
+// A compute pass tests the spheres against the camera and directional light
+// frusta once their transforms are final, a second one tests the camera's
+// against a Hi-Z of the depth prepass. Visible spheres are appended to a list
+// per view and counted in the instance count of the view's indirect draw, so
+// the CPU records the same commands for any number of spheres.
+const uint32_t gHiZTileSize = 8;    // Matches HIZ_TILE_SIZE in shadowCommon.h
+
+// Matches cbCull in cullObjects.comp
+struct UniformCullData
+{
+	mat4 mCameraProjView;
+	vec4 mCameraPlanes[6];
+	vec4 mLightPlanes[6];
+	// First sphere object, sphere count, list stride
+	uint32_t mSphereRange[4] = { 0, 0, 0, 0 };
+	// Depth prepass width, height, Hi-Z width, height
+	uint32_t mDepthSize[4] = { 0, 0, 0, 0 };
+	// Sphere mesh radius, projection x and y scale
+	vec4 mProjParams;
+	// Depth of view distance w is x + y / w, z near plane
+	vec4 mDepthParams;
+};
+
+/************************************************************************/
+// Moment storage formats
+/************************************************************************/
+// Filtering technique of the directional light. Spot and point lights have
+// no ESM path and keep VSM when the directional light uses ESM.
+enum ShadowTechnique
+{
+	SHADOW_TECHNIQUE_VSM = 0,
+	SHADOW_TECHNIQUE_MSM,
+	// Single channel occluder depth filtered in log space, see ESM_EXPONENT
+	SHADOW_TECHNIQUE_ESM,
+	SHADOW_TECHNIQUE_COUNT,
+};
+
+// Every format has its own pipelines, switching formats only changes the
+// persistent shadow targets, which the frame graph then re-renders.
+enum VSMFormat
+{
+	VSM_FORMAT_RG32F = 0,
+	VSM_FORMAT_RG16F,
+	// Second moment about the middle of the depth range, see EncodeVSMMoments
+	VSM_FORMAT_RG16_UNORM,
+	VSM_FORMAT_COUNT,
+};
+
+enum MSMFormat
+{
+	// Optimized moment basis of EncodeMSMMoments
+	MSM_FORMAT_RGBA16_UNORM = 0,
+	// Plain power moments
+	MSM_FORMAT_RGBA32F,
+	MSM_FORMAT_COUNT,
+};
+
+// ESM stores depth as is, both formats share their shaders
+enum ESMFormat
+{
+	ESM_FORMAT_R32F = 0,
+	ESM_FORMAT_R16_UNORM,
+	ESM_FORMAT_COUNT,
+};
+
+// Shader variants per technique: the default encoding, then the one of
+// VSM_FORMAT_RG16_UNORM or MSM_FORMAT_RGBA32F
+const uint32_t gMomentEncodingCount = 2;
+
+// The HALF_PRECISION variants of the main pass, the shadow mask and the
+// directional blur compute their shading math in min16float. The moment
+// solves stay in float in both.
+enum ShaderPrecision
+{
+	SHADER_PRECISION_FULL = 0,
+	SHADER_PRECISION_HALF,
+	SHADER_PRECISION_COUNT,
+};
+
+// The precision test compares the moments a format stores, filtered and
+// decoded in float, with float64 moments of the same depth samples
+struct MomentPrecisionScene
+{
+	const char* pName;
+	// Depth samples in one filter footprint
+	uint32_t    mSampleCount;
+	// Samples lie on this many flat occluders, 0 spreads them over the range
+	uint32_t    mLayerCount;
+	float       mMinDepth;
+	float       mMaxDepth;
+	// Distance of the occluded receiver behind the farthest sample
+	float       mReceiverOffset;
+};
+
+struct MomentPrecisionResult
+{
+	double   mErrorSum;
+	double   mErrorMax;
+	// Visibility of receivers every sample occludes
+	double   mLeakSum;
+	double   mLeakMax;
+	double   mReferenceLeakSum;
+	uint32_t mCount;
+};
 
 // ----------------------
 
 // VARIABLES
 const uint32_t gImageCount = 3;
-const uint32_t gMaxBlurs = 8;
-const uint32_t gMaxObjectCount = 512;
 const int      gSphereResolution = 30;    // Increase for higher resolution spheres
 const float    gSphereDiameter = 0.5f;
 
@@ -135,47 +1008,243 @@ const vec3 gPolishedSpec(0.02f, 0.02f, 0.02f);
 const vec3 gMiniSpec(0.01f, 0.01f, 0.01f);
 const vec3	   gPlaneSize = { 75.0f, 1.0f, 75.0f };
 
+const TinyImageFormat gShadowMapFormatsVSM[VSM_FORMAT_COUNT] = {
+	TinyImageFormat_R32G32_SFLOAT,
+	TinyImageFormat_R16G16_SFLOAT,
+	TinyImageFormat_R16G16_UNORM,
+};
+const TinyImageFormat gShadowMapFormatsMSM[MSM_FORMAT_COUNT] = {
+	TinyImageFormat_R16G16B16A16_UNORM,
+	TinyImageFormat_R32G32B32A32_SFLOAT,
+};
+const TinyImageFormat gShadowMapFormatsESM[ESM_FORMAT_COUNT] = {
+	TinyImageFormat_R32_SFLOAT,
+	TinyImageFormat_R16_UNORM,
+};
+const TinyImageFormat gShadowDepthFormat = TinyImageFormat_D32_SFLOAT;
+// Shadow, view distance
+const TinyImageFormat gShadowMaskFormat = TinyImageFormat_R16G16_SFLOAT;
+
+// Moments of the far plane, what empty atlas texels must hold
+const ClearValue gShadowAtlasFarMomentsVSM = { { 1.0f, 1.0f, 0.0f, 0.0f } };
+const ClearValue gShadowAtlasFarMomentsMSM[MSM_FORMAT_COUNT] = {
+	{ { 1.0f, 0.99756f, 0.89344f, 0.0f } },
+	{ { 1.0f, 1.0f, 1.0f, 1.0f } },
+};
+
 bool gToggleVSync = false;
-int32_t gToggleMSM = false;
+int32_t gShadowTechnique = SHADOW_TECHNIQUE_VSM;
+int32_t gFormatVSM = VSM_FORMAT_RG32F;
+int32_t gFormatMSM = MSM_FORMAT_RGBA16_UNORM;
+int32_t gFormatESM = ESM_FORMAT_R16_UNORM;
+// Selects the SHADER_PRECISION_HALF pipelines, see getShadingPrecision
+bool gHalfPrecision = false;
 
 uint32_t gFrameIndex = 0;
 uint32_t gBlurCount = 1;
+// Render the directional shadow map depth-only, see ShadowMomentsPassData
+bool gDepthOnlyShadows = false;
+// Implies depth-only, see ShadowMsaa
+int32_t gShadowMsaa = SHADOW_MSAA_OFF;
+const SampleCount gShadowMsaaSampleCounts[SHADOW_MSAA_COUNT] = { SAMPLE_COUNT_1, SAMPLE_COUNT_4, SAMPLE_COUNT_8 };
+
+// Memory
+bool gShowMemoryReport = true;
+float gMemoryBudgetMB = 192.0f;
+uint32_t gTransientIdleFrames = 120;
+
+// Scene, objects are the plane, the light object and then the spheres
+const uint32_t gSceneSeed = 0x9b0c5eed;
+const uint32_t gMaxSceneSpheres = 128 * 1024;
+const uint32_t gSceneFirstSphere = 2;
+const uint32_t gMaxSceneObjects = gSceneFirstSphere + gMaxSceneSpheres;
+// Hand placed rows, the generator spreads any further spheres over the plane
+const uint32_t gSceneClassicSpheres = 27;
+uint32_t gSceneSphereCount = gSceneClassicSpheres;
+// Sphere count the object buffers currently hold
+uint32_t gSceneGeneratedSphereCount = 0;
+// Transforms written by the CPU, copied into pBufferSceneTransforms which the passes read
+Buffer* pBufferObjectTransforms[gImageCount] = { NULL };
+Buffer* pBufferObjectMaterials[gImageCount] = { NULL };
+Buffer* pBufferSceneTransforms = NULL;
+Buffer* pBufferUniformObjectDraw[SCENE_DRAW_COUNT] = { NULL };
+
+// Sphere animation state as structure of arrays,
+// height = plane + 1 + |sin(phase + time * frequency)| * 4
+alignas(16) float gSceneSphereX[gMaxSceneSpheres] = {};
+alignas(16) float gSceneSphereY[gMaxSceneSpheres] = {};
+alignas(16) float gSceneSphereZ[gMaxSceneSpheres] = {};
+alignas(16) float gSceneSphereScale[gMaxSceneSpheres] = {};
+alignas(16) float gSceneSpherePhase[gMaxSceneSpheres] = {};
+alignas(16) float gSceneSphereFrequency[gMaxSceneSpheres] = {};
+// Shared by all spheres, advanced by the bounce speed
+float gSceneAnimationTime = 0.0f;
+// Spheres per job range, a multiple of the SIMD width
+const uint32_t gSceneJobGrain = 2048;
+// Computes gSceneSphereY of this frame
+JobHandle gSceneAnimationJob = JOB_INVALID;
+// Bounce the spheres in a compute pass, their state stays on the GPU
+bool gSceneGpuAnimation = true;
+// gSceneGpuAnimation as latched by Update. While it stays set the GPU state
+// advanced every frame since its upload and matches gSceneAnimationTime.
+bool gSceneGpuAnimationActive = false;
+SceneAnimationConstants gSceneAnimationConstants = {};
+Buffer* pBufferSphereAnimation = NULL;
+
+// GPU culling
+bool gGpuCulling = true;
+UniformCullData gDataCull = {};
+Buffer* pBufferUniformCull[gImageCount] = { NULL };
+// Sphere objects visible in each cull view, gMaxSceneSpheres apart
+Buffer* pBufferVisibleObjects = NULL;
+// IndirectDrawArguments of every cull view, reset from pBufferCullArgumentsReset each frame
+Buffer* pBufferCullArguments = NULL;
+Buffer* pBufferCullArgumentsReset = NULL;
+CommandSignature* pCommandSignatureCull = NULL;
 
-const uint32_t gNumSpheres = 29;
 int gNumberOfSpherePoints = 0;
 Buffer* pBufferVertexSphere = { NULL };
-Buffer* pBufferUniformSphere[gNumSpheres] = { NULL };
-UniformObjectData gDataSphere[gNumSpheres] = {};
-float gSphereTimers[gNumSpheres] = { 0.0f };
-float gSphereBounceModifiers[gNumSpheres] = { 0.0f };
 float gBounceSpeed = 1.0f;
 
 const vec3 gPlanePosition = { 0.0f, -3.0f, 0.0f };
 int gNumberOfPlanePoints = 0;
 Buffer* pBufferVertexPlane = NULL;
-Buffer* pBufferUniformPlane = NULL;
-UniformObjectData gDataPlane = {};
+ObjectMaterial gDataPlane = {};
 
 // Lights
 LightView gViewLight;
 UniformLightData gDataLight = {};
-UniformObjectData gDataLightObject = {};
+ObjectMaterial gDataLightObject = {};
 // Radius, theta, phi
 vec3 gLightSphereCoords = { 100.0f, 60.0f, 0.0f };
 int gNumberOfLightObjectPoints = 0;
 float gLightOrbitSpeed = 1.0f;
 float gLightOrbitDistance = 15.0f;
-Buffer* pBufferUniformLightObject = NULL;
 Buffer* pBufferVertexLightObject = NULL;
 Buffer* pBufferUniformLight[gImageCount] = { NULL };
 
 // Shadow
 UniformShadowMapData gShadowMapData;
 
+// Full resolution pixels per shadow mask texel, 2 is half resolution
+uint32_t gShadowMaskScale = 2;
+Buffer* pBufferUniformShadowMask[SHADOW_VIEW_COUNT][gImageCount] = { { NULL } };
+
+// Temporal shadow filter, the mask pass spreads its 4x4 kernel over several frames
+bool gShadowMaskTemporal = true;
+uint32_t gShadowMaskTaps = 2;
+float gShadowMaskTemporalBlend = 0.1f;
+// Frames the temporal filter ran, picks the history target and the kernel taps
+uint32_t gShadowMaskFrame = 0;
+// Graph frame the history was last written in
+uint32_t gShadowMaskHistoryFrame = 0;
+bool gShadowMaskHistoryValid = false;
+mat4 gPrevProjectView = mat4::identity();
+vec4 gPrevCamPos = vec4(0.0f);
+
+// Skips the moment solve of receivers the min/max pyramid decides
+bool gShadowMinMax = true;
+
+// Penumbra width follows the blocker distance, see gMaxShadowMomentLevels
+bool gContactHardening = false;
+// Angular diameter of the directional light, the sun is about half a degree
+float gLightAngularSizeDeg = 2.0f;
+// Widest penumbra and width of the blocker search region, in shadow map texels
+uint32_t gMaxPenumbraTexels = 32;
+// Half width of the directional light's orthographic frustum
+const float gDirectionalShadowExtent = 15.0f;
+
+// Light space perspective shadow map, see getWarpedLightViewProj
+bool gShadowWarp = false;
+// The last directional transform was warped
+bool gDirectionalWarped = false;
+
+// Directional frustum follows the camera, see DirectionalShadowUpdate
+bool gToroidalShadowMap = false;
+// Texel of the frustum's first one on the light's texel grid, current and cached
+int32_t gDirectionalOrigin[2] = { 0, 0 };
+int32_t gShadowMapOrigin[2] = { 0, 0 };
+// Casters or the light changed, the next update re-renders the whole frustum
+bool gDirectionalFullUpdate = true;
+// Light view and light view space xy bounds of the texels a scroll keeps,
+// bouncing spheres outside of them leave the cache valid
+mat4 gDirectionalKeptView;
+vec4 gDirectionalKeptRegion = { 0.0f, 0.0f, 0.0f, 0.0f };
+DirectionalShadowUpdate gDirectionalUpdate = {};
+
+// Shadow update scheduling
+const float gShadowNearLightDistance = 15.0f;
+ShadowViewSchedule gDirectionalSchedule = {};
+// Current light transform, gDataLight holds the one the cached map was rendered with
+mat4 gDirectionalViewProj;
+float gShadowUpdateBudgetMTexels = 8.0f;
+uint32_t gDirectionalUpdateInterval = 1;
+uint32_t gNearLightUpdateInterval = 1;
+uint32_t gFarLightUpdateInterval = 4;
+uint32_t gShadowScheduleFrame = 0;
+uint64_t gShadowUpdateCost = 0;
+uint32_t gShadowUpdatesDeferred = 0;
+
+// Shadow atlas
+const uint32_t gShadowAtlasSize = 2048;
+const uint32_t gShadowAtlasMinTileSize = 64;
+const uint32_t gShadowAtlasMaxTileSize = 512;
+ShadowAtlasLight gShadowAtlasLights[gMaxAtlasLights] = {};
+ShadowAtlasTile gShadowAtlasDirtyTiles[gMaxAtlasLights] = {};
+UniformAtlasLightData gDataShadowAtlasLights = {};
+uint32_t gShadowAtlasLightCount = 8;
+uint32_t gShadowAtlasPackedCount = 0;
+float gShadowAtlasOrbit = 0.0f;
+float gShadowAtlasOrbitSpeed = 0.0f;
+Buffer* pBufferUniformShadowAtlas[gImageCount] = { NULL };
+Buffer* pBufferShadowAtlasTiles[gImageCount] = { NULL };
+
+// Point light shadows
+const uint32_t gPointShadowSize = 256;
+UniformPointLightData gDataPointLights = {};
+ShadowPointLight gPointLights[gMaxPointLights] = {};
+uint32_t gPointLightCount = 2;
+// Set by the caster test jobs, spot lights first, then point lights, then
+// the region kept by the directional map
+const uint32_t gDirectionalCastersMoved = gMaxAtlasLights + gMaxPointLights;
+tfrg_atomic32_t gShadowCastersMoved[gMaxAtlasLights + gMaxPointLights + 1] = {};
+float gPointLightOrbit = 0.0f;
+float gPointLightOrbitSpeed = 0.3f;
+Buffer* pBufferUniformPointLights[gImageCount] = { NULL };
+
+// Virtual shadow map
+bool gVirtualShadowMap = false;
+// Pages rendered per frame, missing pages first
+uint32_t gVirtualShadowPageBudget = 16;
+VirtualShadowSlot gVirtualShadowSlots[gVirtualShadowSlotCount] = {};
+uint32_t gVirtualShadowFreeSlots[gVirtualShadowSlotCount] = {};
+uint32_t gVirtualShadowFreeSlotCount = 0;
+// Slot of every virtual page, uploaded every frame
+uint32_t gVirtualShadowPageTable[gVirtualShadowPageCount] = {};
+ShadowAtlasTile gVirtualShadowDirtyTiles[gMaxVirtualShadowPageUpdates] = {};
+// Advances every frame the virtual map is enabled, the mask pass writes it as
+// its request stamp. 0 marks frame indices whose requests were not copied.
+uint32_t gVirtualShadowFrame = 0;
+uint32_t gVirtualShadowRequestStamps[gImageCount] = {};
+uint32_t gVirtualShadowResidentCount = 0;
+// Light transform the resident pages were rendered with
+mat4 gVirtualShadowViewProj = mat4::identity();
+Buffer* pBufferVirtualPageTable[gImageCount] = { NULL };
+Buffer* pBufferVirtualPageTiles[gImageCount] = { NULL };
+Buffer* pBufferVirtualPageRequests = NULL;
+Buffer* pBufferVirtualPageReadback[gImageCount] = { NULL };
+
 // Camera
-UniformCamData gDataCamera = {};
 ICameraController* pCameraController = NULL;
-Buffer* pBufferUniformCamera[gImageCount] = { NULL };
+Buffer* pBufferUniformCamera[SHADOW_VIEW_COUNT][gImageCount] = { { NULL } };
+
+// Shadow renderer and the views it is bound for
+ShadowRenderer gShadowRenderer = {};
+ShadowView gShadowViews[SHADOW_VIEW_COUNT] = {};
+bool gMinimap = false;
+uint32_t gMinimapSize = 256;
+// Half the width of the ground the minimap covers around the camera
+const float gMinimapExtent = 20.0f;
 
 // Rendering info
 Renderer* pRenderer = NULL;
@@ -187,1361 +1256,6818 @@ SwapChain* pSwapChain = NULL;
 
 RenderTarget* pRenderTargetDepthBuffer = NULL;
 
-RenderTarget* pRenderTargetMapVSM = NULL;
-RenderTarget* pRenderTargetMapMSM = NULL;
-RenderTarget* pRenderTargetShadowDepth = NULL;
-
-Texture* pTexBlurHorVSM = NULL;
-Texture* pTexBlurVertVSM = NULL;
-Texture* pTexBlurHorMSM = NULL;
-Texture* pTexBlurVertMSM = NULL;
+// Frame graph, owns the shadow map, shadow depth and blur targets
+FrameGraph gFrameGraph = {};
+ShadowPassData gShadowPassData = {};
+ShadowMomentsPassData gShadowMomentsPassData = {};
+BlurPassData gBlurPassData[gMaxBlurs][2] = {};
+ShadowAtlasPassData gShadowAtlasPassData = {};
+BlurPassData gShadowAtlasBlurPassData[2] = {};
+PointShadowPassData gPointShadowPassData = {};
+BlurPassData gPointShadowBlurPassData[2] = {};
+VirtualShadowPassData gVirtualShadowPassData = {};
+BlurPassData gVirtualShadowBlurPassData[2] = {};
+ShadowMinMaxPassData gShadowMinMaxPassData = {};
+ShadowMomentMipsPassData gShadowMomentMipsPassData = {};
+HiZPassData gHiZPassData = {};
+MainPassData gUIPassData = {};
 
 Fence*        pFencesRenderComplete[gImageCount] = { NULL };
 Semaphore*    pSemaphoreImageAcquired = NULL;
 Semaphore*    pSemaphoresRenderComplete[gImageCount] = { NULL };
 
-Shader* pShaderVSM = NULL;
-Shader* pShaderMSM = NULL;
-Shader* pShaderMapVSM = NULL;
-Shader* pShaderMapMSM = NULL;
-Shader* pShaderShadowBlur = NULL;
+Shader* pShaderVSM[SHADER_PRECISION_COUNT][gMomentEncodingCount] = { { NULL } };
+Shader* pShaderMSM[SHADER_PRECISION_COUNT][gMomentEncodingCount] = { { NULL } };
+Shader* pShaderMapVSM[gMomentEncodingCount] = { NULL };
+Shader* pShaderMapMSM[gMomentEncodingCount] = { NULL };
+Shader* pShaderMapESM = NULL;
+Shader* pShaderShadowBlur[SHADER_PRECISION_COUNT] = { NULL };
+Shader* pShaderShadowBlurESM = NULL;
+Shader* pShaderShadowDepth = NULL;
+Shader* pShaderShadowMomentsVSM[SHADOW_MSAA_COUNT][gMomentEncodingCount] = { { NULL } };
+Shader* pShaderShadowMomentsMSM[SHADOW_MSAA_COUNT][gMomentEncodingCount] = { { NULL } };
+Shader* pShaderShadowMomentsESM[SHADOW_MSAA_COUNT] = { NULL };
+Shader* pShaderShadowAtlasVSM[gMomentEncodingCount] = { NULL };
+Shader* pShaderShadowAtlasMSM[gMomentEncodingCount] = { NULL };
+Shader* pShaderShadowAtlasBlur = NULL;
+Shader* pShaderPointShadowVSM[gMomentEncodingCount] = { NULL };
+Shader* pShaderPointShadowMSM[gMomentEncodingCount] = { NULL };
+Shader* pShaderPointShadowBlur = NULL;
+Shader* pShaderVirtualPageVSM[gMomentEncodingCount] = { NULL };
+Shader* pShaderVirtualPageMSM[gMomentEncodingCount] = { NULL };
+Shader* pShaderDepthPrepass = NULL;
+Shader* pShaderShadowMaskVSM[SHADER_PRECISION_COUNT][gMomentEncodingCount] = { { NULL } };
+Shader* pShaderShadowMaskMSM[SHADER_PRECISION_COUNT][gMomentEncodingCount] = { { NULL } };
+Shader* pShaderShadowMaskESM[SHADER_PRECISION_COUNT] = { NULL };
+Shader* pShaderShadowMaskTemporal = NULL;
+Shader* pShaderShadowMinMaxVSM[gMomentEncodingCount] = { NULL };
+Shader* pShaderShadowMinMaxMSM[gMomentEncodingCount] = { NULL };
+Shader* pShaderShadowMinMaxESM = NULL;
+Shader* pShaderShadowMomentMips = NULL;
+Shader* pShaderSceneAnimation = NULL;
+Shader* pShaderHiZ = NULL;
+Shader* pShaderCullFrustum = NULL;
+Shader* pShaderCullOcclusion = NULL;
 
 RootSignature* pRootSignatureVSM = NULL;
 RootSignature* pRootSignatureMSM = NULL;
 RootSignature* pRootSignatureMapVSM = NULL;
 RootSignature* pRootSignatureMapMSM = NULL;
 RootSignature* pRootSignatureShadowBlur = NULL;
-
-Pipeline* pPipelineVSM = NULL;
-Pipeline* pPipelineMSM = NULL;
-Pipeline* pPipelineMapVSM = NULL;
-Pipeline* pPipelineMapMSM = NULL;
-Pipeline* pPipelineShadowBlur[gMaxBlurs][2] = { NULL };
+RootSignature* pRootSignatureShadowMoments[SHADOW_MSAA_COUNT] = { NULL };
+RootSignature* pRootSignatureShadowAtlas = NULL;
+RootSignature* pRootSignatureShadowAtlasBlur = NULL;
+RootSignature* pRootSignaturePointShadow = NULL;
+RootSignature* pRootSignaturePointShadowBlur = NULL;
+RootSignature* pRootSignatureVirtualPage = NULL;
+RootSignature* pRootSignatureDepthPrepass = NULL;
+RootSignature* pRootSignatureShadowMask = NULL;
+RootSignature* pRootSignatureShadowMaskTemporal = NULL;
+RootSignature* pRootSignatureShadowMinMax = NULL;
+RootSignature* pRootSignatureShadowMomentMips = NULL;
+RootSignature* pRootSignatureSceneAnimation = NULL;
+RootSignature* pRootSignatureHiZ = NULL;
+RootSignature* pRootSignatureCull = NULL;
+
+Pipeline* pPipelineVSM[SHADER_PRECISION_COUNT][VSM_FORMAT_COUNT] = { { NULL } };
+Pipeline* pPipelineMSM[SHADER_PRECISION_COUNT][MSM_FORMAT_COUNT] = { { NULL } };
+Pipeline* pPipelineMapVSM[VSM_FORMAT_COUNT] = { NULL };
+Pipeline* pPipelineMapMSM[MSM_FORMAT_COUNT] = { NULL };
+Pipeline* pPipelineMapESM[ESM_FORMAT_COUNT] = { NULL };
+Pipeline* pPipelineShadowBlur[SHADER_PRECISION_COUNT][gMaxBlurs][2] = { { { NULL } } };
+Pipeline* pPipelineShadowBlurESM[gMaxBlurs][2] = { { NULL } };
+Pipeline* pPipelineShadowDepth[SHADOW_MSAA_COUNT] = { NULL };
+Pipeline* pPipelineShadowMomentsVSM[SHADOW_MSAA_COUNT][VSM_FORMAT_COUNT] = { { NULL } };
+Pipeline* pPipelineShadowMomentsMSM[SHADOW_MSAA_COUNT][MSM_FORMAT_COUNT] = { { NULL } };
+Pipeline* pPipelineShadowMomentsESM[SHADOW_MSAA_COUNT] = { NULL };
+Pipeline* pPipelineShadowAtlasVSM[VSM_FORMAT_COUNT] = { NULL };
+Pipeline* pPipelineShadowAtlasMSM[MSM_FORMAT_COUNT] = { NULL };
+Pipeline* pPipelineShadowAtlasBlur = NULL;
+Pipeline* pPipelinePointShadowVSM[VSM_FORMAT_COUNT] = { NULL };
+Pipeline* pPipelinePointShadowMSM[MSM_FORMAT_COUNT] = { NULL };
+Pipeline* pPipelinePointShadowBlur = NULL;
+Pipeline* pPipelineVirtualPageVSM[VSM_FORMAT_COUNT] = { NULL };
+Pipeline* pPipelineVirtualPageMSM[MSM_FORMAT_COUNT] = { NULL };
+Pipeline* pPipelineDepthPrepass = NULL;
+Pipeline* pPipelineShadowMaskVSM[SHADER_PRECISION_COUNT][VSM_FORMAT_COUNT] = { { NULL } };
+Pipeline* pPipelineShadowMaskMSM[SHADER_PRECISION_COUNT][MSM_FORMAT_COUNT] = { { NULL } };
+Pipeline* pPipelineShadowMaskESM[SHADER_PRECISION_COUNT] = { NULL };
+Pipeline* pPipelineShadowMaskTemporal = NULL;
+Pipeline* pPipelineShadowMinMaxVSM[VSM_FORMAT_COUNT] = { NULL };
+Pipeline* pPipelineShadowMinMaxMSM[MSM_FORMAT_COUNT] = { NULL };
+Pipeline* pPipelineShadowMinMaxESM = NULL;
+Pipeline* pPipelineShadowMomentMips = NULL;
+Pipeline* pPipelineSceneAnimation = NULL;
+Pipeline* pPipelineHiZ = NULL;
+Pipeline* pPipelineCullFrustum = NULL;
+Pipeline* pPipelineCullOcclusion = NULL;
 
 DescriptorSet* pDescriptorSetVSM[3] = { NULL };
 DescriptorSet* pDescriptorSetMSM[3] = { NULL };
 DescriptorSet* pDescriptorSetMapVSM[3] = { NULL };
 DescriptorSet* pDescriptorSetMapMSM[3] = { NULL };
 DescriptorSet* pDescriptorSetShadowBlur[3] = { NULL };
+DescriptorSet* pDescriptorSetShadowMoments[SHADOW_MSAA_COUNT] = { NULL };
+DescriptorSet* pDescriptorSetShadowAtlas[2] = { NULL };
+DescriptorSet* pDescriptorSetShadowAtlasBlur = NULL;
+DescriptorSet* pDescriptorSetPointShadow[2] = { NULL };
+DescriptorSet* pDescriptorSetPointShadowBlur = NULL;
+DescriptorSet* pDescriptorSetVirtualPage[2] = { NULL };
+DescriptorSet* pDescriptorSetVirtualShadowBlur = NULL;
+DescriptorSet* pDescriptorSetDepthPrepass[2] = { NULL };
+DescriptorSet* pDescriptorSetShadowMask = NULL;
+DescriptorSet* pDescriptorSetShadowMaskTemporal = NULL;
+DescriptorSet* pDescriptorSetShadowMinMax = NULL;
+DescriptorSet* pDescriptorSetShadowMomentMips = NULL;
+DescriptorSet* pDescriptorSetSceneAnimation = NULL;
+DescriptorSet* pDescriptorSetHiZ = NULL;
+// Per frame buffers, then the Hi-Z of the occlusion test
+DescriptorSet* pDescriptorSetCull[2] = { NULL };
 
 Sampler* pSamplerBilinear = NULL;
 Sampler* pSamplerMipless = NULL;
+// Lookups of the toroidal shadow map reach across its edges
+Sampler* pSamplerWrapMipless = NULL;
 
 // Profiling
 ProfileToken gGpuProfileToken = PROFILE_INVALID_TOKEN;
 
+// Telemetry
+bool     gTelemetryEnabled = false;
+float    gTelemetryIntervalSec = 5.0f;
+int32_t  gTelemetryFormat = TELEMETRY_FORMAT_CSV;
+// Whether the current file was started, later intervals are appended
+bool     gTelemetryFileStarted[2] = { false, false };
+int64_t  gTelemetryStartTime = 0;
+int64_t  gTelemetryIntervalStart = 0;
+uint32_t gTelemetryFrames = 0;
+double   gTelemetryTimestampFrequency = 1.0;
+
+TelemetryFrame gTelemetryCpuFrame = {};
+// GPU scopes of the frame recorded with gFrameIndex
+TelemetryFrame gTelemetryGpuFrames[gImageCount] = {};
+
+TelemetryRecord     gTelemetryRecords[gMaxTelemetryRecords] = {};
+uint32_t            gTelemetryRecordCount = 0;
+TelemetryStatRecord gTelemetryStatRecords[gMaxTelemetryStatQueries] = {};
+uint32_t            gTelemetryStatRecordCount = 0;
+
+QueryPool* pTelemetryTimestampPool[gImageCount] = { NULL };
+QueryPool* pTelemetryStatPool[gImageCount] = { NULL };
+Buffer*    pTelemetryTimestampReadback[gImageCount] = { NULL };
+Buffer*    pTelemetryStatReadback[gImageCount] = { NULL };
+
+// Benchmark
+const float    gBenchmarkTimestep = 1.0f / 60.0f;
+const uint32_t gBenchmarkWarmupFrames = 60;
+const uint32_t gMaxBenchmarkFrames = 4096;
+const uint32_t gBenchmarkBlurCounts[] = { 0, 1, 4 };
+const uint32_t gBenchmarkShadowMapSizes[] = { 1024, 2048, 4096 };
+const uint32_t gBenchmarkConfigCount = SHADOW_TECHNIQUE_COUNT * (sizeof(gBenchmarkBlurCounts) / sizeof(gBenchmarkBlurCounts[0])) *
+	(sizeof(gBenchmarkShadowMapSizes) / sizeof(gBenchmarkShadowMapSizes[0]));
+// Looped, the last keyframe matches the first one
+const BenchmarkKeyframe gBenchmarkPath[] = {
+	{ 0.0f,  { 0.0f, 5.0f, -10.0f },  { 0.0f, 0.0f, 0.0f },   { 100.0f, 60.0f, 0.0f } },
+	{ 3.0f,  { -12.0f, 8.0f, -6.0f }, { 0.0f, -1.0f, 0.0f },  { 120.0f, 35.0f, 60.0f } },
+	{ 6.0f,  { -6.0f, 2.0f, 8.0f },   { 0.0f, -2.0f, 0.0f },  { 150.0f, 25.0f, 150.0f } },
+	{ 9.0f,  { 10.0f, 12.0f, 10.0f }, { 0.0f, -3.0f, 0.0f },  { 80.0f, 90.0f, -120.0f } },
+	{ 12.0f, { 0.0f, 5.0f, -10.0f },  { 0.0f, 0.0f, 0.0f },   { 100.0f, 60.0f, 0.0f } },
+};
+
+const char* gShadowTechniqueNames[SHADOW_TECHNIQUE_COUNT] = { "VSM", "MSM", "ESM" };
+uint32_t gBenchmarkFrames = 600;
+bool     gBenchmarkRequested = false;
+bool     gBenchmarkActive = false;
+// Set by -benchmark on the command line, quits once the sweep finished
+bool     gBenchmarkExitWhenDone = false;
+uint32_t gBenchmarkConfig = 0;
+// Frames of the current configuration, including the warmup
+uint32_t gBenchmarkFrame = 0;
+float    gBenchmarkTime = 0.0f;
+int64_t  gBenchmarkLastFrameTime = 0;
+// Microseconds between the ends of consecutive frames
+uint32_t gBenchmarkFrameTimes[gMaxBenchmarkFrames] = {};
+uint32_t gBenchmarkSampleCount = 0;
+BenchmarkSettings gBenchmarkSavedSettings = {};
+
+// Moment precision
+const char* gFormatNamesVSM[VSM_FORMAT_COUNT] = { "VSM RG32F (64-bit)", "VSM RG16F (32-bit)", "VSM RG16 UNORM (32-bit)" };
+const char* gFormatNamesMSM[MSM_FORMAT_COUNT] = { "MSM RGBA16 UNORM (64-bit)", "MSM RGBA32F (128-bit)" };
+const char* gFormatNamesESM[ESM_FORMAT_COUNT] = { "ESM R32F (32-bit)", "ESM R16 UNORM (16-bit)" };
+const MomentPrecisionScene gMomentPrecisionScenes[] = {
+	// Receiver right behind a flat occluder
+	{ "Contact", 16, 1, 0.50f, 0.51f, 0.005f },
+	// Two occluders far apart in front of the receiver, light bleeding
+	{ "Layered", 16, 2, 0.20f, 0.60f, 0.30f },
+	// Close to the far plane, where half floats are coarsest
+	{ "Far", 16, 1, 0.95f, 0.99f, 0.005f },
+	{ "Near", 16, 1, 0.01f, 0.05f, 0.01f },
+	// Wide blur over unrelated depths
+	{ "Wide filter", 64, 0, 0.10f, 0.90f, 0.05f },
+};
+const uint32_t gMomentPrecisionMaxSamples = 64;
+const uint32_t gMomentPrecisionCases = 4096;    // Per scene
+const uint32_t gMomentPrecisionSeed = 0x3039cafe;
+// Depth spread of the samples on one occluder
+const float    gMomentPrecisionLayerJitter = 0.001f;
+// Match MIN_VARIANCE and MOMENT_BIAS in shadowCommon.h
+const double   gMomentMinVariance = 0.00001;
+const double   gMomentBias = 0.000003;
+bool           gMomentPrecisionRequested = false;
+
+// Half precision
+const uint32_t gHalfPrecisionCases = 65536;
+const uint32_t gHalfPrecisionSeed = 0x16f10a7;
+// One step of the 8-bit swapchain
+const float    gHalfShadingTolerance = 1.0f / 255.0f;
+// Relative, the bias only has to stay clear of acne
+const float    gHalfBiasTolerance = 0.01f;
+// RG16F steps, the half sum rounds every tap where the float one rounds once
+const float    gHalfBlurTolerance = 2.0f;
+// Match gaussFilter in shadowBlur.comp
+const float    gHalfBlurWeights[5] = { 0.06136f, 0.24477f, 0.38774f, 0.24477f, 0.06136f };
+// Match SHADING_MIN_LH in shadowCommon.h
+const float    gHalfShadingMinLH = 1.0f / 64.0f;
+bool           gHalfPrecisionRequested = false;
+
+// Job system
+Job gJobs[gMaxJobs] = {};
+tfrg_atomic32_t gJobCount = 0;
+JobDeque gJobDeques[gMaxJobWorkers] = {};
+ThreadDesc gJobWorkerDescs[gMaxJobWorkers] = {};
+ThreadHandle gJobWorkerThreads[gMaxJobWorkers] = {};
+// Threads besides the main thread, and how many of them take jobs
+uint32_t gJobWorkerCount = 0;
+uint32_t gJobActiveWorkers = 0;
+tfrg_atomic32_t gJobQueued = 0;
+Mutex gJobSleepMutex;
+ConditionVariable gJobWake;
+Mutex gJobDependencyMutex;
+bool gJobQuit = false;
+
 // UI
 UIApp gAppUI = {};
 GuiComponent* pGui = NULL;
 TextDrawDesc gFrameTimeDraw = TextDrawDesc(0, 0xff00ffff, 18);
+TextDrawDesc gMemoryReportDraw = TextDrawDesc(0, 0xffffffff, 16);
+TextDrawDesc gMemoryReportOverBudgetDraw = TextDrawDesc(0, 0xff0000ff, 16);
 VirtualJoystickUI gVirtualJoystick = {};
 
 // ------------------------------------
 
-class MomentShadows : public IApp
+// TELEMETRY
+uint32_t telemetryPushScope(TelemetryFrame* pFrame, const char* pName, int64_t begin)
 {
-public:
-	MomentShadows()
+	if (pFrame->mDropped || pFrame->mScopeCount == gMaxTelemetryScopes || pFrame->mStackDepth == gMaxTelemetryScopeDepth)
 	{
-		gToggleVSync = mSettings.mDefaultVSyncEnabled;
+		++pFrame->mDropped;
+		return ~0u;
 	}
 
-	bool Init()
+	uint32_t index = pFrame->mScopeCount++;
+	TelemetryScope& scope = pFrame->mScopes[index];
+	scope.pName = pName;
+	scope.mParent = pFrame->mStackDepth ? pFrame->mStack[pFrame->mStackDepth - 1] : ~0u;
+	scope.mDepth = pFrame->mStackDepth;
+	scope.mBegin = begin;
+	scope.mEnd = begin;
+	pFrame->mStack[pFrame->mStackDepth++] = index;
+	return index;
+}
+
+uint32_t telemetryPopScope(TelemetryFrame* pFrame)
+{
+	if (pFrame->mDropped)
 	{
-		// FILE PATHS
-		fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_SHADER_SOURCES, "Shaders");
-		fsSetPathForResourceDir(pSystemFileIO, RM_DEBUG, RD_SHADER_BINARIES, "CompiledShaders");
-		fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_GPU_CONFIG, "GPUCfg");
-		fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_TEXTURES, "Textures");
-		fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_FONTS, "Fonts");
+		--pFrame->mDropped;
+		return ~0u;
+	}
 
-		// window and renderer setup
-		RendererDesc settings = { 0 };
-		initRenderer(GetName(), &settings, &pRenderer);
-		//check for init success
-		if (!pRenderer)
-			return false;
+	ASSERT(pFrame->mStackDepth);
+	return pFrame->mStack[--pFrame->mStackDepth];
+}
 
-		// Set up the graphics queue
-		QueueDesc queueDesc = {};
-		queueDesc.mType = QUEUE_TYPE_GRAPHICS;
-		queueDesc.mFlag = QUEUE_FLAG_INIT_MICROPROFILE;
-		addQueue(pRenderer, &queueDesc, &pGraphicsQueue);
-
-		for (uint32_t i = 0; i < gImageCount; ++i)
-		{
-			CmdPoolDesc cmdPoolDesc = {};
-			cmdPoolDesc.pQueue = pGraphicsQueue;
-			addCmdPool(pRenderer, &cmdPoolDesc, &pCmdPools[i]);
-			CmdDesc cmdDesc = {};
-			cmdDesc.pPool = pCmdPools[i];
-			addCmd(pRenderer, &cmdDesc, &pCmds[i]);
-
-			addFence(pRenderer, &pFencesRenderComplete[i]);
-			addSemaphore(pRenderer, &pSemaphoresRenderComplete[i]);
-		}
-		addSemaphore(pRenderer, &pSemaphoreImageAcquired);
-
-		initResourceLoaderInterface(pRenderer);
-
-		// Initialize virtual joystick
-		if (!gVirtualJoystick.Init(pRenderer, "circlepad"))
-		{
-			LOGF(LogLevel::eERROR, "Could not initialize Virtual Joystick.");
-			return false;
-		}
-
-		ShaderLoadDesc shaderVSM = {};
-		shaderVSM.mStages[0] = { "basic.vert", NULL, 0 };
-		shaderVSM.mStages[1] = { "VSM.frag", NULL, 0 };
-		addShader(pRenderer, &shaderVSM, &pShaderVSM);
-
-		ShaderLoadDesc shaderMSM = {};
-		shaderMSM.mStages[0] = { "basic.vert", NULL, 0 };
-		shaderMSM.mStages[1] = { "MSM.frag", NULL, 0 };
-		addShader(pRenderer, &shaderMSM, &pShaderMSM);
+void telemetryResetFrame(TelemetryFrame* pFrame)
+{
+	pFrame->mScopeCount = 0;
+	pFrame->mStackDepth = 0;
+	pFrame->mDropped = 0;
+	pFrame->mStatCount = 0;
+	pFrame->mStatOpen = false;
+	// Latched for the whole frame so that scopes stay balanced when the UI toggles telemetry
+	pFrame->mRecorded = gTelemetryEnabled;
+}
+
+void telemetryBeginCpuScope(const char* pName)
+{
+	if (gTelemetryCpuFrame.mRecorded)
+		telemetryPushScope(&gTelemetryCpuFrame, pName, getUSec());
+}
 
+void telemetryEndCpuScope()
+{
+	if (!gTelemetryCpuFrame.mRecorded)
+		return;
 
-		ShaderLoadDesc shaderMapVSM = {};
-		shaderMapVSM.mStages[0] = { "shadowPass.vert", NULL, 0 };
-		shaderMapVSM.mStages[1] = { "mapVSM.frag", NULL, 0 };
-		addShader(pRenderer, &shaderMapVSM, &pShaderMapVSM);
+	uint32_t index = telemetryPopScope(&gTelemetryCpuFrame);
+	if (index != ~0u)
+		gTelemetryCpuFrame.mScopes[index].mEnd = getUSec();
+}
 
-		ShaderLoadDesc shaderMapMSM = {};
-		shaderMapMSM.mStages[0] = { "shadowPass.vert", NULL, 0 };
-		shaderMapMSM.mStages[1] = { "mapMSM.frag", NULL, 0 };
-		addShader(pRenderer, &shaderMapMSM, &pShaderMapMSM);
+// Also a scope of the GPU profiler, so the on-screen profile keeps the same hierarchy
+void telemetryBeginGpuScope(Cmd* pCmd, const char* pName)
+{
+	cmdBeginGpuTimestampQuery(pCmd, gGpuProfileToken, pName);
 
+	TelemetryFrame& frame = gTelemetryGpuFrames[gFrameIndex];
+	if (!frame.mRecorded)
+		return;
 
-		ShaderLoadDesc shaderShadowBlur = {};
-		shaderShadowBlur.mStages[0] = { "shadowBlur.comp", NULL, 0 };
-		addShader(pRenderer, &shaderShadowBlur, &pShaderShadowBlur);
+	uint32_t index = telemetryPushScope(&frame, pName, 0);
+	if (index == ~0u)
+		return;
 
+	// Two timestamps per scope
+	frame.mScopes[index].mBegin = index * 2;
+	frame.mScopes[index].mEnd = index * 2 + 1;
+	QueryDesc queryDesc = { index * 2 };
+	cmdBeginQuery(pCmd, pTelemetryTimestampPool[gFrameIndex], &queryDesc);
+}
 
-		SamplerDesc clampMiplessSamplerDesc = {};
-		clampMiplessSamplerDesc.mAddressU = ADDRESS_MODE_CLAMP_TO_EDGE;
-		clampMiplessSamplerDesc.mAddressV = ADDRESS_MODE_CLAMP_TO_EDGE;
-		clampMiplessSamplerDesc.mAddressW = ADDRESS_MODE_CLAMP_TO_EDGE;
-		clampMiplessSamplerDesc.mMinFilter = FILTER_LINEAR;
-		clampMiplessSamplerDesc.mMagFilter = FILTER_LINEAR;
-		clampMiplessSamplerDesc.mMipMapMode = MIPMAP_MODE_LINEAR;
-		clampMiplessSamplerDesc.mMipLodBias = 0.0f;
-		clampMiplessSamplerDesc.mMaxAnisotropy = 0.0f;
-		addSampler(pRenderer, &clampMiplessSamplerDesc, &pSamplerMipless);
+void telemetryEndGpuScope(Cmd* pCmd)
+{
+	cmdEndGpuTimestampQuery(pCmd, gGpuProfileToken);
 
-		SamplerDesc samplerDesc = { FILTER_LINEAR,       FILTER_LINEAR,       MIPMAP_MODE_LINEAR,
-									ADDRESS_MODE_REPEAT, ADDRESS_MODE_REPEAT, ADDRESS_MODE_REPEAT };
-		addSampler(pRenderer, &samplerDesc, &pSamplerBilinear);
+	TelemetryFrame& frame = gTelemetryGpuFrames[gFrameIndex];
+	if (!frame.mRecorded)
+		return;
 
+	uint32_t index = telemetryPopScope(&frame);
+	if (index == ~0u)
+		return;
 
-		/************************************************************************/
-		// Root sigs
-		/************************************************************************/
-		const char*       pStaticSamplerNames[] = { "miplessSampler" };
-		Sampler* pStaticSamplers[] = { pSamplerMipless };
+	QueryDesc queryDesc = { (uint32_t)frame.mScopes[index].mEnd };
+	cmdEndQuery(pCmd, pTelemetryTimestampPool[gFrameIndex], &queryDesc);
+}
 
-		// Main render passes
-		RootSignatureDesc rootDesc = { &pShaderVSM, 1 };
-		rootDesc.mStaticSamplerCount = 1;
-		rootDesc.ppStaticSamplerNames = pStaticSamplerNames;
-		rootDesc.ppStaticSamplers = pStaticSamplers;
-		addRootSignature(pRenderer, &rootDesc, &pRootSignatureVSM);
+// Statistics queries do not nest, a query begun while another one is open is ignored
+void telemetryBeginPipelineStatistics(Cmd* pCmd, const char* pName)
+{
+	TelemetryFrame& frame = gTelemetryGpuFrames[gFrameIndex];
+	if (!frame.mRecorded || frame.mStatOpen || frame.mStatCount == gMaxTelemetryStatQueries)
+		return;
 
-		rootDesc.ppShaders = &pShaderMSM;
-		addRootSignature(pRenderer, &rootDesc, &pRootSignatureMSM);
+	frame.pStatNames[frame.mStatCount] = pName;
+	frame.mStatOpen = true;
+	QueryDesc queryDesc = { frame.mStatCount };
+	cmdBeginQuery(pCmd, pTelemetryStatPool[gFrameIndex], &queryDesc);
+}
 
+void telemetryEndPipelineStatistics(Cmd* pCmd)
+{
+	TelemetryFrame& frame = gTelemetryGpuFrames[gFrameIndex];
+	if (!frame.mStatOpen)
+		return;
 
-		// Shadow blur
-		rootDesc = { &pShaderShadowBlur, 1 };
-		addRootSignature(pRenderer, &rootDesc, &pRootSignatureShadowBlur);
+	QueryDesc queryDesc = { frame.mStatCount++ };
+	frame.mStatOpen = false;
+	cmdEndQuery(pCmd, pTelemetryStatPool[gFrameIndex], &queryDesc);
+}
 
-		// Shadow mapping
-		rootDesc = { &pShaderMapVSM, 1 };
-		addRootSignature(pRenderer, &rootDesc, &pRootSignatureMapVSM);
+void telemetryBeginCpuFrame()
+{
+	telemetryResetFrame(&gTelemetryCpuFrame);
+}
 
-		rootDesc = { &pShaderMapMSM, 1 };
-		addRootSignature(pRenderer, &rootDesc, &pRootSignatureMapMSM);
+void telemetryBeginGpuFrame(Cmd* pCmd)
+{
+	TelemetryFrame& frame = gTelemetryGpuFrames[gFrameIndex];
+	telemetryResetFrame(&frame);
+	if (!frame.mRecorded)
+		return;
 
+	cmdResetQueryPool(pCmd, pTelemetryTimestampPool[gFrameIndex], 0, gMaxTelemetryScopes * 2);
+	cmdResetQueryPool(pCmd, pTelemetryStatPool[gFrameIndex], 0, gMaxTelemetryStatQueries);
+}
 
-		/************************************************************************/
-		// Descriptor Sets
-		/************************************************************************/
+// Copies the results into the readback buffers, collected when the frame index comes around again
+void telemetryEndGpuFrame(Cmd* pCmd)
+{
+	TelemetryFrame& frame = gTelemetryGpuFrames[gFrameIndex];
+	if (!frame.mRecorded)
+		return;
 
-		// Rendering sets
-		DescriptorSetDesc desc = { pRootSignatureVSM, DESCRIPTOR_UPDATE_FREQ_NONE, 1 };
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetVSM[0]);
-		desc = { pRootSignatureVSM, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetVSM[1]);
-		desc = { pRootSignatureVSM, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, gMaxObjectCount };
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetVSM[2]);
+	if (frame.mScopeCount)
+		cmdResolveQuery(pCmd, pTelemetryTimestampPool[gFrameIndex], pTelemetryTimestampReadback[gFrameIndex], 0, frame.mScopeCount * 2);
+	if (frame.mStatCount)
+		cmdResolveQuery(pCmd, pTelemetryStatPool[gFrameIndex], pTelemetryStatReadback[gFrameIndex], 0, frame.mStatCount);
+}
 
-		// Rendering sets
-		desc = { pRootSignatureMSM, DESCRIPTOR_UPDATE_FREQ_NONE, 1 };
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMSM[0]);
-		desc = { pRootSignatureMSM, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMSM[1]);
-		desc = { pRootSignatureMSM, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, gMaxObjectCount };
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMSM[2]);
+const char* telemetryParentName(const TelemetryFrame& frame, const TelemetryScope& scope)
+{
+	return scope.mParent == ~0u ? "" : frame.mScopes[scope.mParent].pName;
+}
 
+// Scopes are keyed by their name and their parent's name, the pointers may differ between frames
+void telemetryAccumulate(const char* pName, const char* pParent, uint32_t depth, bool gpu, double ms)
+{
+	TelemetryRecord* pRecord = NULL;
+	for (uint32_t i = 0; i < gTelemetryRecordCount && !pRecord; ++i)
+	{
+		TelemetryRecord& record = gTelemetryRecords[i];
+		if (record.mGpu == gpu && record.mDepth == depth && !strcmp(record.pName, pName) && !strcmp(record.pParent, pParent))
+			pRecord = &record;
+	}
 
-		// Shadow pass set
-		desc = { pRootSignatureMapVSM, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMapVSM[0]);
-		desc = { pRootSignatureMapVSM, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, gMaxObjectCount };
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMapVSM[1]);
+	if (!pRecord)
+	{
+		if (gTelemetryRecordCount == gMaxTelemetryRecords)
+			return;
+
+		pRecord = &gTelemetryRecords[gTelemetryRecordCount++];
+		*pRecord = {};
+		pRecord->pName = pName;
+		pRecord->pParent = pParent;
+		pRecord->mDepth = depth;
+		pRecord->mGpu = gpu;
+	}
 
-		desc = { pRootSignatureMapMSM, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMapMSM[0]);
-		desc = { pRootSignatureMapMSM, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, gMaxObjectCount };
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMapMSM[1]);
+	pRecord->mTotalMs += ms;
+	pRecord->mMaxMs = max(pRecord->mMaxMs, ms);
+	++pRecord->mSamples;
+}
 
+void telemetryAccumulateStatistics(const char* pName, const PipelineStatistics& stats)
+{
+	TelemetryStatRecord* pRecord = NULL;
+	for (uint32_t i = 0; i < gTelemetryStatRecordCount && !pRecord; ++i)
+	{
+		if (!strcmp(gTelemetryStatRecords[i].pName, pName))
+			pRecord = &gTelemetryStatRecords[i];
+	}
 
+	if (!pRecord)
+	{
+		if (gTelemetryStatRecordCount == gMaxTelemetryStatQueries)
+			return;
 
-		// Shadow blur set
-		desc = { pRootSignatureShadowBlur, DESCRIPTOR_UPDATE_FREQ_NONE, gMaxBlurs * 2 * gImageCount };
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowBlur[0]);
-		desc = { pRootSignatureShadowBlur, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, gMaxBlurs * 2 * gImageCount};
-		addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowBlur[1]);
+		pRecord = &gTelemetryStatRecords[gTelemetryStatRecordCount++];
+		*pRecord = {};
+		pRecord->pName = pName;
+	}
 
+	// Every counter is a uint64_t
+	uint64_t* pTotal = &pRecord->mTotal.mIAVertices;
+	const uint64_t* pCounters = &stats.mIAVertices;
+	for (uint32_t i = 0; i < sizeof(PipelineStatistics) / sizeof(uint64_t); ++i)
+		pTotal[i] += pCounters[i];
+	++pRecord->mSamples;
+}
 
-		// Generate sphere vertex buffer
-		float* pSpherePoints;
-		generateSpherePoints(&pSpherePoints, &gNumberOfSpherePoints, gSphereResolution, gSphereDiameter);
+void telemetryEndCpuFrame()
+{
+	const TelemetryFrame& frame = gTelemetryCpuFrame;
+	if (!frame.mRecorded)
+		return;
 
-		// Generate plane vertex buffer
-		float* pPlanePoints;
-		generateCuboidPoints(&pPlanePoints, &gNumberOfPlanePoints,
-			gPlaneSize.getX(),
-			gPlaneSize.getY(),
-			gPlaneSize.getZ(),
-			vec3(0.0f));
+	for (uint32_t i = 0; i < frame.mScopeCount; ++i)
+	{
+		const TelemetryScope& scope = frame.mScopes[i];
+		telemetryAccumulate(scope.pName, telemetryParentName(frame, scope), scope.mDepth, false, (scope.mEnd - scope.mBegin) / 1000.0);
+	}
+	++gTelemetryFrames;
+}
 
-		float* pLightObjPoints;
-		generateCuboidPoints(&pLightObjPoints, &gNumberOfLightObjectPoints, 3.0f, 3.0f, 3.0f, vec3(0.0f));
+// Must only be called once the fence of gFrameIndex signalled
+void telemetryCollectGpuFrame()
+{
+	TelemetryFrame& frame = gTelemetryGpuFrames[gFrameIndex];
+	if (!frame.mRecorded)
+		return;
+	frame.mRecorded = false;
 
-		// vertex data
-		// Common among all
-		BufferLoadDesc vbDesc = {};
-		vbDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_VERTEX_BUFFER;
-		vbDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_ONLY;
+	const uint64_t* pTimestamps = (const uint64_t*)pTelemetryTimestampReadback[gFrameIndex]->pCpuMappedAddress;
+	for (uint32_t i = 0; i < frame.mScopeCount; ++i)
+	{
+		const TelemetryScope& scope = frame.mScopes[i];
+		uint64_t begin = pTimestamps[scope.mBegin];
+		uint64_t end = pTimestamps[scope.mEnd];
+		double ms = (end > begin) ? (end - begin) * 1000.0 / gTelemetryTimestampFrequency : 0.0;
+		telemetryAccumulate(scope.pName, telemetryParentName(frame, scope), scope.mDepth, true, ms);
+	}
 
-		// Sphere
-		uint64_t       sphereDataSize = gNumberOfSpherePoints * sizeof(float);
-		vbDesc.mDesc.mSize = sphereDataSize;
-		vbDesc.pData = pSpherePoints;
-		vbDesc.ppBuffer = &pBufferVertexSphere;
-		addResource(&vbDesc, NULL);
+	const PipelineStatistics* pStats = (const PipelineStatistics*)pTelemetryStatReadback[gFrameIndex]->pCpuMappedAddress;
+	for (uint32_t i = 0; i < frame.mStatCount; ++i)
+		telemetryAccumulateStatistics(frame.pStatNames[i], pStats[i]);
+}
 
-		// Plane 
-		uint64_t       planeDataSize = gNumberOfPlanePoints * sizeof(float);
-		vbDesc.mDesc.mSize = planeDataSize;
-		vbDesc.pData = pPlanePoints;
-		vbDesc.ppBuffer = &pBufferVertexPlane;
-		addResource(&vbDesc, NULL);
+void telemetryResetRecords(int64_t now)
+{
+	gTelemetryRecordCount = 0;
+	gTelemetryStatRecordCount = 0;
+	gTelemetryFrames = 0;
+	gTelemetryIntervalStart = now;
+}
 
-		// Light object
-		uint64_t       lightObjectDataSize = gNumberOfLightObjectPoints * sizeof(float);
-		vbDesc.mDesc.mSize = lightObjectDataSize;
-		vbDesc.pData = pLightObjPoints;
-		vbDesc.ppBuffer = &pBufferVertexLightObject;;
-		addResource(&vbDesc, NULL);
+void telemetryWrite(int64_t now)
+{
+	const bool json = (gTelemetryFormat == TELEMETRY_FORMAT_JSON);
+	const char* pFileName = json ? "VarianceMomentShadows_telemetry.json" : "VarianceMomentShadows_telemetry.csv";
+	bool& fileStarted = gTelemetryFileStarted[json ? 1 : 0];
 
+	// Every run starts a new file
+	FileStream stream = {};
+	if (!fsOpenStreamFromPath(RD_LOG, pFileName, fileStarted ? FM_APPEND : FM_WRITE, &stream))
+	{
+		LOGF(LogLevel::eWARNING, "Telemetry: could not open %s, export disabled", pFileName);
+		gTelemetryEnabled = false;
+		return;
+	}
 
-		// object uniform data
-		BufferLoadDesc ubObjectDesc = {};
-		ubObjectDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		ubObjectDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
-		ubObjectDesc.mDesc.mSize = sizeof(UniformObjectData);
-		ubObjectDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
-		ubObjectDesc.pData = NULL;
-		for (int i = 0; i < gNumSpheres; ++i)
+	const double time = (now - gTelemetryStartTime) / 1000000.0;
+	if (json)
+	{
+		// One object per line
+		fsPrintToStream(&stream, "{\"time_s\":%.3f,\"frames\":%u,\"scopes\":[", time, gTelemetryFrames);
+		for (uint32_t i = 0; i < gTelemetryRecordCount; ++i)
 		{
-			ubObjectDesc.ppBuffer = &pBufferUniformSphere[i];
-			addResource(&ubObjectDesc, NULL);
+			const TelemetryRecord& record = gTelemetryRecords[i];
+			fsPrintToStream(&stream, "%s{\"type\":\"%s\",\"name\":\"%s\",\"parent\":\"%s\",\"depth\":%u,\"samples\":%u,\"avg_ms\":%.4f,\"max_ms\":%.4f}",
+				i ? "," : "", record.mGpu ? "gpu" : "cpu", record.pName, record.pParent, record.mDepth, record.mSamples,
+				record.mTotalMs / record.mSamples, record.mMaxMs);
 		}
 
-		ubObjectDesc.ppBuffer = &pBufferUniformPlane;
-		addResource(&ubObjectDesc, NULL);
-
-		ubObjectDesc.ppBuffer = &pBufferUniformLightObject;
-		addResource(&ubObjectDesc, NULL);
-
-		// Uniform buffer for camera data
-		BufferLoadDesc ubCamDesc = {};
-		ubCamDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		ubCamDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
-		ubCamDesc.mDesc.mSize = sizeof(UniformCamData);
-		ubCamDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
-		ubCamDesc.pData = NULL;
-
-		for (uint32_t i = 0; i < gImageCount; ++i)
+		fsPrintToStream(&stream, "],\"pipeline_statistics\":[");
+		for (uint32_t i = 0; i < gTelemetryStatRecordCount; ++i)
 		{
-			ubCamDesc.ppBuffer = &pBufferUniformCamera[i];
-			addResource(&ubCamDesc, NULL);
+			const TelemetryStatRecord& record = gTelemetryStatRecords[i];
+			const double scale = 1.0 / record.mSamples;
+			fsPrintToStream(&stream, "%s{\"name\":\"%s\",\"samples\":%u,\"ia_vertices\":%.0f,\"ia_primitives\":%.0f,"
+				"\"vs_invocations\":%.0f,\"c_invocations\":%.0f,\"c_primitives\":%.0f,\"ps_invocations\":%.0f}",
+				i ? "," : "", record.pName, record.mSamples, record.mTotal.mIAVertices * scale, record.mTotal.mIAPrimitives * scale,
+				record.mTotal.mVSInvocations * scale, record.mTotal.mCInvocations * scale, record.mTotal.mCPrimitives * scale,
+				record.mTotal.mPSInvocations * scale);
 		}
+		fsPrintToStream(&stream, "]}\n");
+	}
+	else
+	{
+		// Timing and statistics rows share the columns, the ones that do not apply stay empty
+		if (!fileStarted)
+			fsPrintToStream(&stream, "time_s,frames,type,name,parent,depth,samples,avg_ms,max_ms,"
+				"ia_vertices,ia_primitives,vs_invocations,c_invocations,c_primitives,ps_invocations\n");
 
-		// Uniform buffer for light data
-		BufferLoadDesc ubLightDesc = {};
-		ubLightDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		ubLightDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
-		ubLightDesc.mDesc.mSize = sizeof(UniformLightData);
-		ubLightDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
-		ubLightDesc.pData = NULL;
+		for (uint32_t i = 0; i < gTelemetryRecordCount; ++i)
+		{
+			const TelemetryRecord& record = gTelemetryRecords[i];
+			fsPrintToStream(&stream, "%.3f,%u,%s,%s,%s,%u,%u,%.4f,%.4f,,,,,,\n",
+				time, gTelemetryFrames, record.mGpu ? "gpu" : "cpu", record.pName, record.pParent, record.mDepth, record.mSamples,
+				record.mTotalMs / record.mSamples, record.mMaxMs);
+		}
 
-		for (uint32_t i = 0; i < gImageCount; ++i)
+		for (uint32_t i = 0; i < gTelemetryStatRecordCount; ++i)
 		{
-			ubLightDesc.ppBuffer = &pBufferUniformLight[i];
-			addResource(&ubLightDesc, NULL);
+			const TelemetryStatRecord& record = gTelemetryStatRecords[i];
+			const double scale = 1.0 / record.mSamples;
+			fsPrintToStream(&stream, "%.3f,%u,stats,%s,,0,%u,,,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f\n",
+				time, gTelemetryFrames, record.pName, record.mSamples, record.mTotal.mIAVertices * scale, record.mTotal.mIAPrimitives * scale,
+				record.mTotal.mVSInvocations * scale, record.mTotal.mCInvocations * scale, record.mTotal.mCPrimitives * scale,
+				record.mTotal.mPSInvocations * scale);
 		}
+	}
 
+	fsCloseStream(&stream);
+	fileStarted = true;
+}
 
-		// Init input system
-		if (!initInputSystem(pWindow))
-			return false;
+// Writes the averages of the last interval once gTelemetryIntervalSec passed
+void telemetryUpdateExport()
+{
+	const int64_t now = getUSec();
+	if (!gTelemetryEnabled)
+	{
+		gTelemetryIntervalStart = 0;
+		return;
+	}
 
-		// Initialize microprofiler and it's UI.
-		initProfiler();
+	// First frame since telemetry was enabled, drop what was collected before
+	if (!gTelemetryIntervalStart)
+	{
+		if (!gTelemetryStartTime)
+			gTelemetryStartTime = now;
+		telemetryResetRecords(now);
+		return;
+	}
 
-		// Gpu profiler can only be added after initProfile.
-		gGpuProfileToken = addGpuProfiler(pRenderer, pGraphicsQueue, "Graphics");
+	if (now - gTelemetryIntervalStart < (int64_t)(gTelemetryIntervalSec * 1000000.0f) || !gTelemetryFrames)
+		return;
 
+	telemetryWrite(now);
+	telemetryResetRecords(now);
+}
 
-		// Create UI
-		if (!gAppUI.Init(pRenderer))
-			return false;
+// BENCHMARK
+// Technique varies fastest, then blur count, then resolution
+BenchmarkConfig getBenchmarkConfig(uint32_t index)
+{
+	const uint32_t blurCount = (sizeof(gBenchmarkBlurCounts) / sizeof(gBenchmarkBlurCounts[0]));
+	BenchmarkConfig config = {};
+	config.mTechnique = (int32_t)(index % SHADOW_TECHNIQUE_COUNT);
+	config.mBlurCount = gBenchmarkBlurCounts[(index / SHADOW_TECHNIQUE_COUNT) % blurCount];
+	config.mShadowMapSize = gBenchmarkShadowMapSizes[index / (SHADOW_TECHNIQUE_COUNT * blurCount)];
+	return config;
+}
+
+void benchmarkSamplePath(float time, vec3* pCameraPosition, vec3* pCameraTarget, vec3* pLightSphereCoords)
+{
+	const uint32_t lastKey = (sizeof(gBenchmarkPath) / sizeof(gBenchmarkPath[0])) - 1;
+	time = fmodf(time, gBenchmarkPath[lastKey].mTime);
 
-		gAppUI.LoadFont("TitilliumText/TitilliumText-Bold.otf");
+	uint32_t key = 0;
+	while (key + 1 < lastKey && gBenchmarkPath[key + 1].mTime <= time)
+		++key;
 
-		/************************************************************************/
-		// Camera
-		/************************************************************************/
-		CameraMotionParameters camParameters{ 100.0f, 150.0f, 300.0f };
-		vec3                   camPos{ 0.0f, 5.0f, -10.0f };
-		vec3                   lookAt{ 0.0f, 0.0f, 0.0f };
+	const BenchmarkKeyframe& a = gBenchmarkPath[key];
+	const BenchmarkKeyframe& b = gBenchmarkPath[key + 1];
+	float t = clamp((time - a.mTime) / (b.mTime - a.mTime), 0.0f, 1.0f);
+	// Ease in and out so the camera does not jerk at keyframes
+	t = t * t * (3.0f - 2.0f * t);
 
-		pCameraController = createFpsCameraController(camPos, lookAt);
+	*pCameraPosition = lerp(t, a.mCameraPosition, b.mCameraPosition);
+	*pCameraTarget = lerp(t, a.mCameraTarget, b.mCameraTarget);
+	*pLightSphereCoords = lerp(t, a.mLightSphereCoords, b.mLightSphereCoords);
+}
 
-		pCameraController->setMotionParameters(camParameters);
+void benchmarkRequest()
+{
+	gBenchmarkRequested = true;
+}
 
-		/************************************************************************/
-		// GUI
-		/************************************************************************/
-		GuiDesc guiDesc = {};
-		guiDesc.mStartPosition = vec2(mSettings.mWidth * 0.01f, mSettings.mHeight * 0.25f);
-		pGui = gAppUI.AddGuiComponent(GetName(), &guiDesc);
-#if !defined(TARGET_IOS)
-		pGui->AddWidget(CheckboxWidget("Toggle VSync\t\t\t\t\t", &gToggleVSync));
-#endif
+int benchmarkCompareFrameTimes(const void* pA, const void* pB)
+{
+	uint32_t a = *(const uint32_t*)pA;
+	uint32_t b = *(const uint32_t*)pB;
+	return (a > b) - (a < b);
+}
 
-		SliderFloat3Widget lightVal("Light Intensity", (float3*)&gDataLight.mLightValue,
-			float3(0.0f), float3(100.0f), float3(0.5f));
-		SliderFloat3Widget lightAmb("Light Ambient", (float3*)&gDataLight.mLightAmbient,
-			float3(0.0f), float3(1.0f));
-		//SliderFloat3Widget lightPos("Light Position", (float3*)&gDataLight.mLightPosition,
-		//	float3(-200.0f, -200.0f, -200.0f), float3(200.0f, 200.0f, 200.0f));
-		//SliderFloatWidget lightOrbitDist("Light Orbit Distance", (float*)&gLightOrbitDistance,
-		//	1.0f, 50.0f);
-		SliderFloatWidget lightRad("Light Radius", (float*)(&gLightSphereCoords), 50.1f, 200.0f);
-		SliderFloatWidget lightAng("Light Angle", ((float*)&gLightSphereCoords) + 1, 20.0f, 160.0f);
-		SliderFloatWidget lightAz("Light Azimuth", ((float*)&gLightSphereCoords) + 2, -179.9f, 179.9f);
+// Nearest rank on sorted frame times, in milliseconds
+float benchmarkPercentile(const uint32_t* pSortedTimes, uint32_t count, float percentile)
+{
+	uint32_t rank = (uint32_t)ceilf(percentile * count);
+	return pSortedTimes[min(max(rank, 1u), count) - 1] / 1000.0f;
+}
 
+// MOMENT FORMATS
+// Shader variant a storage format is rendered and sampled with
+uint32_t getMomentEncodingVSM(uint32_t format)
+{
+	return (format == VSM_FORMAT_RG16_UNORM) ? 1 : 0;
+}
 
-		//SliderFloatWidget lightOrbitSpeed("Light Orbit Speed", (float*)&gLightOrbitSpeed,
-		//	0.0f, 10.0f);
+uint32_t getMomentEncodingMSM(uint32_t format)
+{
+	return (format == MSM_FORMAT_RGBA32F) ? 1 : 0;
+}
 
-		SliderFloatWidget bounceSpeed("Bounce Speed", &gBounceSpeed, 0.0f, 20.0f);
-		//CheckboxWidget debugDepth("Debug Depth", (bool*)&gDataCamera.mDebugFlags[0]);
-		//CheckboxWidget debugSF("Debug Shadow Frustum", (bool*)&gDataCamera.mDebugFlags[1]);
-		SliderUintWidget blurPasses("Gaussian Filter Shadow Passes", &gBlurCount, 0, gMaxBlurs);
+// Format of the directional shadow map
+TinyImageFormat getShadowMapFormat()
+{
+	if (gShadowTechnique == SHADOW_TECHNIQUE_ESM)
+		return gShadowMapFormatsESM[gFormatESM];
+	return (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? gShadowMapFormatsMSM[gFormatMSM] : gShadowMapFormatsVSM[gFormatVSM];
+}
 
+// Format of the atlas, point shadow and virtual page targets, ESM leaves them on VSM
+TinyImageFormat getLocalShadowMapFormat()
+{
+	return (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? gShadowMapFormatsMSM[gFormatMSM] : gShadowMapFormatsVSM[gFormatVSM];
+}
 
-		pGui->AddWidget(lightAmb);
-		pGui->AddWidget(lightVal);
-		//pGui->AddWidget(lightOrbitDist);
-		//pGui->AddWidget(lightOrbitSpeed);
-		pGui->AddWidget(lightRad);
-		pGui->AddWidget(lightAng);
-		pGui->AddWidget(lightAz);
-		pGui->AddWidget(bounceSpeed);
-		pGui->AddWidget(blurPasses);
-		//pGui->AddWidget(debugDepth);
-		//pGui->AddWidget(debugSF);
+uint32_t getShadingPrecision()
+{
+	return (gHalfPrecision) ? SHADER_PRECISION_HALF : SHADER_PRECISION_FULL;
+}
 
-		const char* labels[] = {
-			"Variance Shadow Mapping",
-			"Moment Shadow Mapping"
-		};
+// Summing in half only loses what RG16F moments never stored, the other
+// formats keep more bits than a half accumulator
+uint32_t getBlurPrecision()
+{
+	return (gHalfPrecision && gShadowTechnique == SHADOW_TECHNIQUE_VSM && gFormatVSM == VSM_FORMAT_RG16F) ? SHADER_PRECISION_HALF : SHADER_PRECISION_FULL;
+}
 
-		for (int i = 0; i < 2; ++i)
-		{
-			pGui->AddWidget(RadioButtonWidget(labels[i], (int32_t*)&gToggleMSM, i));
-		}
+ClearValue getShadowFarMoments()
+{
+	// The centered VSM encoding stores 4 * (1 - 0.5)^2, the same 1
+	return (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? gShadowAtlasFarMomentsMSM[gFormatMSM] : gShadowAtlasFarMomentsVSM;
+}
+
+// DIRECTIONAL SHADOW
+// The toroidal map renders its bands depth-only, the compute passes
+// scroll their writes into the cache
+bool isShadowDepthOnly()
+{
+	return gDepthOnlyShadows || gShadowMsaa != SHADOW_MSAA_OFF || gToroidalShadowMap;
+}
 
+// Virtual pages hold moments, with ESM the mask only samples the shadow map
+bool isVirtualShadowMapActive()
+{
+	return gVirtualShadowMap && gShadowTechnique != SHADOW_TECHNIQUE_ESM;
+}
 
+// The blocker estimate needs linear moments, ESM keeps its fixed kernel.
+// Penumbra widths are taken in texels of the uniform map, not of a warped one.
+bool isContactHardeningActive()
+{
+	return gContactHardening && gShadowTechnique != SHADOW_TECHNIQUE_ESM && !gShadowWarp;
+}
 
-		// App Actions
-		InputActionDesc actionDesc = { InputBindings::BUTTON_FULLSCREEN, [](InputActionContext* ctx) { toggleFullscreen(((IApp*)ctx->pUserData)->pWindow); return true; }, this };
-		addInputAction(&actionDesc);
-		actionDesc = { InputBindings::BUTTON_EXIT, [](InputActionContext* ctx) { requestShutdown(); return true; } };
+// Size of the directional shadow targets, multisampling halves it
+uvec2 getShadowMapResolution()
+{
+	uvec2 size = gShadowMapData.mSize;
+	if (gShadowMsaa != SHADOW_MSAA_OFF)
+	{
+		size[0] = max(size[0] / 2, 1u);
+		size[1] = max(size[1] / 2, 1u);
+	}
+	return size;
+}
+
+// MOMENT PRECISION
+// Renders nothing: depth samples of synthetic filter footprints go through
+// the encoding, storage and filtering of every format on the CPU and are
+// compared with the same technique evaluated on float64 moments.
+void momentPrecisionRequest()
+{
+	gMomentPrecisionRequested = true;
+}
+
+// Own generator, the scene keeps its rand() sequence
+float momentPrecisionRandom(uint32_t* pState, float minValue, float maxValue)
+{
+	*pState = *pState * 1664525u + 1013904223u;
+	return minValue + (float)(*pState >> 8) / 16777216.0f * (maxValue - minValue);
+}
+
+float momentQuantizeUnorm16(float value)
+{
+	return roundf(clamp(value, 0.0f, 1.0f) * 65535.0f) / 65535.0f;
+}
+
+// Round to the nearest half float, subnormals included
+float momentQuantizeHalf(float value)
+{
+	if (value == 0.0f)
+		return 0.0f;
+
+	int exponent = 0;
+	frexpf(value, &exponent);
+	// 11 significant bits, fixed steps of 2^-24 below 2^-14
+	const float step = ldexpf(1.0f, max(exponent, -13) - 11);
+	return clamp(roundf(value / step) * step, -65504.0f, 65504.0f);
+}
+
+// What a render target of the format keeps of the written moments
+void momentStore(TinyImageFormat format, float* pMoments, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (format == TinyImageFormat_R16G16_SFLOAT)
+			pMoments[i] = momentQuantizeHalf(pMoments[i]);
+		else if (format == TinyImageFormat_R16G16_UNORM || format == TinyImageFormat_R16G16B16A16_UNORM)
+			pMoments[i] = momentQuantizeUnorm16(pMoments[i]);
+	}
+}
+
+// EncodeVSMMoments and EncodeMSMMoments in shadowCommon.h, without the derivative bias
+void momentEncode(bool msm, uint32_t format, float depth, float* pMoments)
+{
+	if (!msm)
+	{
+		pMoments[0] = depth;
+		pMoments[1] = depth * depth;
+		if (getMomentEncodingVSM(format))
+			pMoments[1] = 4.0f * (pMoments[1] - depth) + 1.0f;
+		return;
+	}
+
+	const float power[4] = { depth, depth * depth, depth * depth * depth, depth * depth * depth * depth };
+	if (getMomentEncodingMSM(format))
+	{
+		memcpy(pMoments, power, sizeof(power));
+		return;
+	}
+
+	const float optimize[4][4] = {
+		{ -2.07224649f,   13.7948857237f,  0.105877704f,   9.7924062118f },
+		{ 32.23703778f,  -59.4683975703f, -1.9077466311f, -33.7652110555f },
+		{ -68.571074599f, 82.0359750338f,  9.3496555107f,  47.9456096605f },
+		{ 39.3703274134f, -35.364903257f, -6.6543490743f, -23.9728048165f },
+	};
+	for (uint32_t j = 0; j < 4; ++j)
+		pMoments[j] = power[0] * optimize[0][j] + power[1] * optimize[1][j] + power[2] * optimize[2][j] + power[3] * optimize[3][j];
+	pMoments[0] += 0.035955884801f;
+}
+
+// DecodeVSMMoments and DecodeMSMMoments in shadowCommon.h, in float like the GPU
+void momentDecode(bool msm, uint32_t format, const float* pStored, double* pMoments)
+{
+	if (!msm)
+	{
+		pMoments[0] = pStored[0];
+		pMoments[1] = (getMomentEncodingVSM(format)) ? 0.25f * pStored[1] + pStored[0] - 0.25f : pStored[1];
+		return;
+	}
+
+	if (getMomentEncodingMSM(format))
+	{
+		for (uint32_t i = 0; i < 4; ++i)
+			pMoments[i] = pStored[i];
+		return;
+	}
+
+	const float decode[4][4] = {
+		{ 0.2227744146f, 0.1549679261f, 0.1451988946f, 0.163127443f },
+		{ 0.0771972861f, 0.1394629426f, 0.2120202157f, 0.2591432266f },
+		{ 0.7926986636f, 0.7963415838f, 0.7258694464f, 0.6539092497f },
+		{ 0.0319417555f,-0.1722823173f,-0.2758014811f,-0.3376131734f },
+	};
+	const float optimized0 = pStored[0] - 0.035955884801f;
+	for (uint32_t j = 0; j < 4; ++j)
+		pMoments[j] = optimized0 * decode[0][j] + pStored[1] * decode[1][j] + pStored[2] * decode[2][j] + pStored[3] * decode[3][j];
+}
+
+// ChebyshevUpperBoundMoments in shadowCommon.h
+double momentVisibilityVSM(const double* pMoments, double depth)
+{
+	if (depth <= pMoments[0])
+		return 1.0;
+
+	const double variance = fmax(pMoments[1] - pMoments[0] * pMoments[0], gMomentMinVariance);
+	const double difference = depth - pMoments[0];
+	return variance / (difference * difference + variance);
+}
+
+// ComputeMSMShadowIntensity in shadowCommon.h without a depth bias. NaNs
+// saturate to 0 like on the GPU.
+double momentVisibilityMSM(const double* pMoments, double depth)
+{
+	double b[4];
+	for (uint32_t i = 0; i < 4; ++i)
+		b[i] = pMoments[i] + (0.5 - pMoments[i]) * gMomentBias;
+
+	double z[3];
+	z[0] = depth;
+	const double L32D22 = -b[0] * b[1] + b[2];
+	const double D22 = -b[0] * b[0] + b[1];
+	const double squaredDepthVariance = -b[1] * b[1] + b[3];
+	const double D33D22 = squaredDepthVariance * D22 - L32D22 * L32D22;
+	const double invD22 = 1.0 / D22;
+	const double L32 = L32D22 * invD22;
+	double c[3] = { 1.0, z[0], z[0] * z[0] };
+	c[1] -= b[0];
+	c[2] -= b[1] + L32 * c[1];
+	c[1] *= invD22;
+	c[2] *= D22 / D33D22;
+	c[1] -= L32 * c[2];
+	c[0] -= c[1] * b[0] + c[2] * b[1];
+	const double p = c[1] / c[2];
+	const double q = c[0] / c[2];
+	const double r = sqrt(p * p * 0.25 - q);
+	z[1] = -p * 0.5 - r;
+	z[2] = -p * 0.5 + r;
+
+	double sw[4] = { 0.0, 0.0, 0.0, 0.0 };
+	if (z[2] < z[0])
+	{
+		sw[0] = z[1]; sw[1] = z[0]; sw[2] = 1.0; sw[3] = 1.0;
+	}
+	else if (z[1] < z[0])
+	{
+		sw[0] = z[0]; sw[1] = z[1]; sw[2] = 0.0; sw[3] = 1.0;
+	}
+
+	const double quotient = (sw[0] * z[2] - b[0] * (sw[0] + z[2]) + b[1]) / ((z[2] - sw[1]) * (z[0] - z[1]));
+	return 1.0 - fmin(fmax(sw[2] + sw[3] * quotient, 0.0), 1.0);
+}
+
+// Every format sees the same cases. The stored moments of each sample are
+// averaged in float and stored again, like a blur pass writing its target.
+void momentPrecisionEvaluate(const MomentPrecisionScene& scene, bool msm, uint32_t format, MomentPrecisionResult* pResult)
+{
+	const TinyImageFormat storage = (msm) ? gShadowMapFormatsMSM[format] : gShadowMapFormatsVSM[format];
+	const uint32_t momentCount = (msm) ? 4 : 2;
+	uint32_t state = gMomentPrecisionSeed;
+	*pResult = {};
+
+	for (uint32_t c = 0; c < gMomentPrecisionCases; ++c)
+	{
+		float layers[gMomentPrecisionMaxSamples];
+		for (uint32_t i = 0; i < scene.mLayerCount; ++i)
+			layers[i] = momentPrecisionRandom(&state, scene.mMinDepth, scene.mMaxDepth);
+
+		double reference[4] = {};
+		float filtered[4] = {};
+		float nearest = 1.0f;
+		float farthest = 0.0f;
+		for (uint32_t s = 0; s < scene.mSampleCount; ++s)
+		{
+			float depth = 0.0f;
+			if (scene.mLayerCount)
+			{
+				const uint32_t layer = min((uint32_t)momentPrecisionRandom(&state, 0.0f, (float)scene.mLayerCount), scene.mLayerCount - 1);
+				depth = layers[layer] + momentPrecisionRandom(&state, -0.5f, 0.5f) * gMomentPrecisionLayerJitter;
+			}
+			else
+			{
+				depth = momentPrecisionRandom(&state, scene.mMinDepth, scene.mMaxDepth);
+			}
+			nearest = min(nearest, depth);
+			farthest = max(farthest, depth);
+
+			double power = 1.0;
+			for (uint32_t i = 0; i < 4; ++i)
+			{
+				power *= depth;
+				reference[i] += power / scene.mSampleCount;
+			}
+
+			float stored[4];
+			momentEncode(msm, format, depth, stored);
+			momentStore(storage, stored, momentCount);
+			for (uint32_t i = 0; i < momentCount; ++i)
+				filtered[i] += stored[i] / scene.mSampleCount;
+		}
+		momentStore(storage, filtered, momentCount);
+
+		double moments[4];
+		momentDecode(msm, format, filtered, moments);
+
+		// One receiver behind every sample, one anywhere in the footprint's range
+		const float occluded = min(farthest + scene.mReceiverOffset, 1.0f);
+		const float receivers[2] = { occluded, momentPrecisionRandom(&state, max(nearest - scene.mReceiverOffset, 0.0f), occluded) };
+		for (uint32_t r = 0; r < 2; ++r)
+		{
+			const double visibility = (msm) ? momentVisibilityMSM(moments, receivers[r]) : momentVisibilityVSM(moments, receivers[r]);
+			const double expected = (msm) ? momentVisibilityMSM(reference, receivers[r]) : momentVisibilityVSM(reference, receivers[r]);
+			const double error = fabs(visibility - expected);
+			pResult->mErrorSum += error;
+			pResult->mErrorMax = fmax(pResult->mErrorMax, error);
+			++pResult->mCount;
+
+			if (r == 0)
+			{
+				pResult->mLeakSum += visibility;
+				pResult->mLeakMax = fmax(pResult->mLeakMax, visibility);
+				pResult->mReferenceLeakSum += expected;
+			}
+		}
+	}
+}
+
+void momentPrecisionRun()
+{
+	const uint32_t sceneCount = sizeof(gMomentPrecisionScenes) / sizeof(gMomentPrecisionScenes[0]);
+	for (uint32_t i = 0; i < sceneCount; ++i)
+	{
+		const MomentPrecisionScene& scene = gMomentPrecisionScenes[i];
+		for (uint32_t f = 0; f < VSM_FORMAT_COUNT + MSM_FORMAT_COUNT; ++f)
+		{
+			const bool msm = f >= VSM_FORMAT_COUNT;
+			const uint32_t format = (msm) ? f - VSM_FORMAT_COUNT : f;
+
+			MomentPrecisionResult result;
+			momentPrecisionEvaluate(scene, msm, format, &result);
+
+			const uint32_t occluded = result.mCount / 2;
+			LOGF(LogLevel::eINFO, "Moment precision: %s, %s: mean error %.6f, max error %.6f, mean leak %.6f (float64 %.6f), max leak %.6f",
+				scene.pName, (msm) ? gFormatNamesMSM[format] : gFormatNamesVSM[format],
+				result.mErrorSum / result.mCount, result.mErrorMax,
+				result.mLeakSum / occluded, result.mReferenceLeakSum / occluded, result.mLeakMax);
+		}
+	}
+}
+
+// HALF PRECISION
+// Runs the min16float math of the HALF_PRECISION shader variants on the CPU,
+// rounding every intermediate to a half, next to the float variants on the
+// same random inputs. GPUs round differently in places, the error is only
+// an estimate.
+typedef float (*HalfPrecisionRoundFn)(float value);
+
+void halfPrecisionRequest()
+{
+	gHalfPrecisionRequested = true;
+}
+
+float halfPrecisionKeep(float value)
+{
+	return value;
+}
+
+void halfPrecisionRandomDirection(uint32_t* pState, float* v)
+{
+	const float z = momentPrecisionRandom(pState, -1.0f, 1.0f);
+	const float phi = momentPrecisionRandom(pState, 0.0f, 2.0f * PI);
+	const float r = sqrtf(max(1.0f - z * z, 0.0f));
+	v[0] = r * cosf(phi);
+	v[1] = r * sinf(phi);
+	v[2] = z;
+}
+
+// Directional light of VSM.frag and MSM.frag, shadow and local lights left
+// out. Directions, NH and pow(NH, a) stay in float in both variants.
+void halfPrecisionShade(HalfPrecisionRoundFn round, float minLH, const float* N, const float* L, const float* V,
+	const float* pKd, const float* pKs, float shininess, float* pColor)
+{
+	float H[3] = { L[0] + V[0], L[1] + V[1], L[2] + V[2] };
+	const float length = sqrtf(H[0] * H[0] + H[1] * H[1] + H[2] * H[2]);
+	for (uint32_t i = 0; i < 3; ++i)
+		H[i] /= length;
+
+	const float a = round(shininess);
+	const float LH = max(minLH, round(L[0] * H[0] + L[1] * H[1] + L[2] * H[2]));
+	const float NH = max(0.0f, N[0] * H[0] + N[1] * H[1] + N[2] * H[2]);
+	const float NL = max(0.0f, round(N[0] * L[0] + N[1] * L[1] + N[2] * L[2]));
+	const float G = round(1.0f / round(LH * LH));
+	const float D = round(round(round(a + 2.0f) * round(powf(NH, shininess))) / round(2.0f * PI));
+	const float fresnel = round(powf(round(1.0f - LH), 5.0f));
+
+	for (uint32_t i = 0; i < 3; ++i)
+	{
+		const float Kd = round(pKd[i]);
+		const float Ks = round(pKs[i]);
+		const float Ia = round(gDataLight.mLightAmbient[i]);
+		const float Ii = round(gDataLight.mLightValue[i]);
+
+		const float F = round(Ks + round(round(1.0f - Ks) * fresnel));
+		const float BRDF = round(round(Kd / PI) + round(round(round(F * G) * D) / 4.0f));
+		const float diffspec = round(round(Ii * NL) * BRDF);
+		pColor[i] = clamp(round(Ia * Kd) + diffspec, 0.0f, 1.0f);
+	}
+}
+
+// Angular receiver bias of the MSM shadow mask, 1 - cosTheta^2 in float
+float halfPrecisionBias(HalfPrecisionRoundFn round, float cosTheta)
+{
+	const float sinTheta = round(sqrtf(round(clamp(1.0f - cosTheta * cosTheta, 0.0f, 1.0f))));
+	const float bias = round(round(0.005f * sinTheta) / round(cosTheta));
+	return clamp(bias, 0.0f, 0.1f);
+}
+
+// One horizontal or vertical pass of shadowBlur.comp over RG16F moments
+float halfPrecisionBlur(HalfPrecisionRoundFn round, const float* pTaps)
+{
+	float sum = 0.0f;
+	for (uint32_t i = 0; i < 5; ++i)
+		sum = round(sum + round(pTaps[i] * round(gHalfBlurWeights[i])));
+	return momentQuantizeHalf(sum);
+}
+
+void halfPrecisionRun()
+{
+	uint32_t state = gHalfPrecisionSeed;
+
+	// Material ranges of GenerateScene, the plane's included
+	double shadingErrorSum = 0.0;
+	float shadingErrorMax = 0.0f;
+	uint32_t shadingFailures = 0;
+	for (uint32_t c = 0; c < gHalfPrecisionCases; ++c)
+	{
+		float N[3], L[3], V[3], Kd[3], Ks[3];
+		halfPrecisionRandomDirection(&state, N);
+		halfPrecisionRandomDirection(&state, L);
+		halfPrecisionRandomDirection(&state, V);
+		for (uint32_t i = 0; i < 3; ++i)
+		{
+			Kd[i] = momentPrecisionRandom(&state, 0.0f, 1.0f);
+			Ks[i] = momentPrecisionRandom(&state, 0.0f, 0.03f);
+		}
+		const float shininess = momentPrecisionRandom(&state, 0.0f, 24.0f);
+
+		float full[3], half[3];
+		halfPrecisionShade(halfPrecisionKeep, 0.0f, N, L, V, Kd, Ks, shininess, full);
+		halfPrecisionShade(momentQuantizeHalf, gHalfShadingMinLH, N, L, V, Kd, Ks, shininess, half);
+
+		float error = 0.0f;
+		for (uint32_t i = 0; i < 3; ++i)
+			error = max(error, fabsf(half[i] - full[i]));
+		shadingErrorSum += error;
+		shadingErrorMax = max(shadingErrorMax, error);
+		shadingFailures += (error > gHalfShadingTolerance) ? 1 : 0;
+	}
+
+	// Relative to tan(acos()) in double, the float variant shows the error of the rewrite
+	double biasErrorMax[SHADER_PRECISION_COUNT] = {};
+	for (uint32_t c = 0; c < gHalfPrecisionCases; ++c)
+	{
+		const float cosTheta = momentPrecisionRandom(&state, 0.001f, 1.0f);
+		const double expected = fmin(0.005 * tan(acos((double)cosTheta)), 0.1);
+		const float bias[SHADER_PRECISION_COUNT] = {
+			halfPrecisionBias(halfPrecisionKeep, cosTheta),
+			halfPrecisionBias(momentQuantizeHalf, cosTheta),
+		};
+		for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+			biasErrorMax[p] = fmax(biasErrorMax[p], fabs(bias[p] - expected) / fmax(expected, 1e-6));
+	}
+
+	// Both variants write RG16F, count the stored results that differ
+	uint32_t blurDifferences = 0;
+	float blurStepsMax = 0.0f;
+	for (uint32_t c = 0; c < gHalfPrecisionCases; ++c)
+	{
+		const float depth = momentPrecisionRandom(&state, 0.0f, 1.0f);
+		float taps[2][5];
+		for (uint32_t i = 0; i < 5; ++i)
+		{
+			const float tap = clamp(depth + momentPrecisionRandom(&state, -0.05f, 0.05f), 0.0f, 1.0f);
+			taps[0][i] = momentQuantizeHalf(tap);
+			taps[1][i] = momentQuantizeHalf(tap * tap);
+		}
+
+		for (uint32_t m = 0; m < 2; ++m)
+		{
+			const float full = halfPrecisionBlur(halfPrecisionKeep, taps[m]);
+			const float half = halfPrecisionBlur(momentQuantizeHalf, taps[m]);
+			if (full == half)
+				continue;
+
+			int exponent = 0;
+			frexpf(full, &exponent);
+			++blurDifferences;
+			blurStepsMax = max(blurStepsMax, fabsf(half - full) / ldexpf(1.0f, max(exponent, -13) - 11));
+		}
+	}
+
+	LOGF(LogLevel::eINFO, "Half precision: shading: mean error %.6f, max error %.6f, %u of %u cases above %.6f",
+		shadingErrorSum / gHalfPrecisionCases, shadingErrorMax, shadingFailures, gHalfPrecisionCases, gHalfShadingTolerance);
+	LOGF(LogLevel::eINFO, "Half precision: MSM bias: max relative error float %.6f, half %.6f",
+		biasErrorMax[SHADER_PRECISION_FULL], biasErrorMax[SHADER_PRECISION_HALF]);
+	LOGF(LogLevel::eINFO, "Half precision: RG16F blur: %u of %u stored moments differ, by at most %.1f half steps",
+		blurDifferences, 2 * gHalfPrecisionCases, blurStepsMax);
+
+	if (shadingFailures || biasErrorMax[SHADER_PRECISION_HALF] > gHalfBiasTolerance || blurStepsMax > gHalfBlurTolerance)
+		LOGF(LogLevel::eWARNING, "Half precision: errors above tolerance, keep the float variants");
+}
+
+// JOBS
+// JOB_INVALID when the frame's pool cannot hold count more jobs
+JobHandle jobAllocate(uint32_t count)
+{
+	int32_t first = tfrg_atomic32_add_relaxed(&gJobCount, (int32_t)count);
+	if (first + count > gMaxJobs)
+	{
+		tfrg_atomic32_add_relaxed(&gJobCount, -(int32_t)count);
+		return JOB_INVALID;
+	}
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		Job& job = gJobs[first + i];
+		job = {};
+		job.mParent = JOB_INVALID;
+		job.mFirstChild = JOB_INVALID;
+		job.mUnfinished = 1;
+		job.mBlockers = 1;
+	}
+	return (JobHandle)first;
+}
+
+bool jobIsComplete(JobHandle handle)
+{
+	if (handle == JOB_INVALID)
+		return true;
+	return tfrg_atomic32_load_acquire(&gJobs[handle].mUnfinished) == 0;
+}
+
+void jobPush(uint32_t worker, JobHandle first, uint32_t count)
+{
+	JobDeque& deque = gJobDeques[worker];
+	deque.mMutex.Acquire();
+	for (uint32_t i = 0; i < count; ++i)
+		deque.mJobs[deque.mBottom++ % gMaxJobs] = first + i;
+	deque.mMutex.Release();
+
+	tfrg_atomic32_add_relaxed(&gJobQueued, (int32_t)count);
+	gJobSleepMutex.Acquire();
+	gJobWake.WakeAll();
+	gJobSleepMutex.Release();
+}
+
+bool jobPop(uint32_t worker, JobHandle* pJob)
+{
+	JobDeque& deque = gJobDeques[worker];
+	deque.mMutex.Acquire();
+	bool found = deque.mBottom != deque.mTop;
+	if (found)
+		*pJob = deque.mJobs[--deque.mBottom % gMaxJobs];
+	deque.mMutex.Release();
+
+	if (found)
+		tfrg_atomic32_add_relaxed(&gJobQueued, -1);
+	return found;
+}
+
+bool jobSteal(uint32_t worker, JobHandle* pJob)
+{
+	for (uint32_t i = 1; i <= gJobWorkerCount; ++i)
+	{
+		JobDeque& deque = gJobDeques[(worker + i) % (gJobWorkerCount + 1)];
+		if (!deque.mMutex.TryAcquire())
+			continue;
+		bool found = deque.mBottom != deque.mTop;
+		if (found)
+			*pJob = deque.mJobs[deque.mTop++ % gMaxJobs];
+		deque.mMutex.Release();
+
+		if (found)
+		{
+			tfrg_atomic32_add_relaxed(&gJobQueued, -1);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Queues the job once its last blocker is gone. The fences order the writes
+// of every blocker before the job runs.
+void jobUnblock(uint32_t worker, JobHandle handle)
+{
+	tfrg_memorybarrier_release();
+	if (tfrg_atomic32_add_relaxed(&gJobs[handle].mBlockers, -1) != 1)
+		return;
+
+	tfrg_memorybarrier_acquire();
+	jobPush(worker, handle, 1);
+}
+
+// Publishes the writes of the job, jobIsComplete acquires them. The last
+// range to finish acquires those of the others before finishing the parent.
+void jobFinish(uint32_t worker, JobHandle handle)
+{
+	Job& job = gJobs[handle];
+	tfrg_memorybarrier_release();
+	if (tfrg_atomic32_add_relaxed(&job.mUnfinished, -1) != 1)
+		return;
+
+	tfrg_memorybarrier_acquire();
+
+	gJobDependencyMutex.Acquire();
+	job.mComplete = true;
+	uint32_t continuationCount = job.mContinuationCount;
+	gJobDependencyMutex.Release();
+
+	for (uint32_t i = 0; i < continuationCount; ++i)
+		jobUnblock(worker, job.mContinuations[i]);
+	if (job.mParent != JOB_INVALID)
+		jobFinish(worker, job.mParent);
+}
+
+void jobExecute(uint32_t worker, JobHandle handle)
+{
+	Job& job = gJobs[handle];
+	if (job.pFunc)
+		job.pFunc(job.pData, job.mBegin, job.mEnd);
+	if (job.mChildCount)
+		jobPush(worker, job.mFirstChild, job.mChildCount);
+	jobFinish(worker, handle);
+}
+
+// job runs after dependency. Called before job is submitted, the dependency
+// may already be running or even complete.
+void jobAddDependency(JobHandle handle, JobHandle dependency)
+{
+	if (handle == JOB_INVALID || dependency == JOB_INVALID)
+		return;
+
+	MutexLock lock(gJobDependencyMutex);
+	Job& before = gJobs[dependency];
+	if (before.mComplete)
+		return;
+
+	ASSERT(before.mContinuationCount < gMaxJobContinuations);
+	ASSERT(tfrg_atomic32_load_relaxed(&gJobs[handle].mBlockers) > 0);
+	before.mContinuations[before.mContinuationCount++] = handle;
+	tfrg_atomic32_add_relaxed(&gJobs[handle].mBlockers, 1);
+}
+
+void jobSubmit(JobHandle handle)
+{
+	if (handle != JOB_INVALID)
+		jobUnblock(0, handle);
+}
+
+// The main thread runs queued jobs until the job completed
+void jobWait(JobHandle handle)
+{
+	while (!jobIsComplete(handle))
+	{
+		JobHandle next;
+		if (jobPop(0, &next) || jobSteal(0, &next))
+			jobExecute(0, next);
+		else
+			Thread::Sleep(0);
+	}
+}
+
+// Splits [0, count) into ranges that start at multiples of grainSize. The
+// returned job completes once every range ran. A nearly full pool gets fewer,
+// larger ranges. A full one runs the work inline once every job of the frame
+// is done, which stands in for its dependencies, and returns JOB_INVALID.
+JobHandle jobCreateParallelFor(JobFunc pFunc, void* pData, uint32_t count, uint32_t grainSize)
+{
+	uint32_t freeJobs = gMaxJobs - min((uint32_t)tfrg_atomic32_load_relaxed(&gJobCount), gMaxJobs);
+	uint32_t maxRanges = min(gMaxJobRanges, max(freeJobs, 1u) - 1);
+	uint32_t rangeSize = maxRanges ? (count + maxRanges - 1) / maxRanges : count;
+	rangeSize = max((rangeSize + grainSize - 1) / grainSize, 1u) * grainSize;
+	uint32_t rangeCount = (count + rangeSize - 1) / rangeSize;
+
+	JobHandle handle = (maxRanges || !count) ? jobAllocate(1 + rangeCount) : JOB_INVALID;
+	if (handle == JOB_INVALID)
+	{
+		LOGF(LogLevel::eWARNING, "Jobs: all %u jobs of the frame in use, running %u items inline", gMaxJobs, count);
+		for (uint32_t i = 0; i < min((uint32_t)tfrg_atomic32_load_relaxed(&gJobCount), gMaxJobs); ++i)
+			jobWait(i);
+		pFunc(pData, 0, count);
+		return JOB_INVALID;
+	}
+
+	Job& job = gJobs[handle];
+	job.mFirstChild = handle + 1;
+	job.mChildCount = rangeCount;
+	job.mUnfinished = 1 + rangeCount;
+
+	for (uint32_t i = 0; i < rangeCount; ++i)
+	{
+		Job& range = gJobs[handle + 1 + i];
+		range.pFunc = pFunc;
+		range.pData = pData;
+		range.mBegin = i * rangeSize;
+		range.mEnd = min(range.mBegin + rangeSize, count);
+		range.mParent = handle;
+	}
+	return handle;
+}
+
+void jobWorkerMain(void* pData)
+{
+	const uint32_t worker = (uint32_t)(uintptr_t)pData;
+	for (;;)
+	{
+		JobHandle job;
+		if (worker <= gJobActiveWorkers && (jobPop(worker, &job) || jobSteal(worker, &job)))
+		{
+			jobExecute(worker, job);
+			continue;
+		}
+
+		gJobSleepMutex.Acquire();
+		while (!gJobQuit && (worker > gJobActiveWorkers || !tfrg_atomic32_load_relaxed(&gJobQueued)))
+			gJobWake.Wait(gJobSleepMutex);
+		bool quit = gJobQuit;
+		gJobSleepMutex.Release();
+
+		if (quit)
+			return;
+	}
+}
+
+void jobInit()
+{
+	uint32_t cores = Thread::GetNumCPUCores();
+	gJobWorkerCount = min(max(cores, 1u) - 1, gMaxJobWorkers - 1);
+	gJobActiveWorkers = gJobWorkerCount;
+	gJobQuit = false;
+
+	gJobSleepMutex.Init();
+	gJobWake.Init();
+	gJobDependencyMutex.Init();
+	for (uint32_t i = 0; i <= gJobWorkerCount; ++i)
+		gJobDeques[i].mMutex.Init();
+
+	// create_thread keeps the desc pointer, so the descs are global
+	for (uint32_t i = 1; i <= gJobWorkerCount; ++i)
+	{
+		gJobWorkerDescs[i].pFunc = jobWorkerMain;
+		gJobWorkerDescs[i].pData = (void*)(uintptr_t)i;
+		gJobWorkerThreads[i] = create_thread(&gJobWorkerDescs[i]);
+	}
+}
+
+void jobExit()
+{
+	gJobSleepMutex.Acquire();
+	gJobQuit = true;
+	gJobWake.WakeAll();
+	gJobSleepMutex.Release();
+
+	for (uint32_t i = 1; i <= gJobWorkerCount; ++i)
+	{
+		join_thread(gJobWorkerThreads[i]);
+		destroy_thread(gJobWorkerThreads[i]);
+	}
+
+	for (uint32_t i = 0; i <= gJobWorkerCount; ++i)
+		gJobDeques[i].mMutex.Destroy();
+	gJobDependencyMutex.Destroy();
+	gJobWake.Destroy();
+	gJobSleepMutex.Destroy();
+}
+
+// Every job of the previous frame was waited on, their slots are reused
+void jobBeginFrame()
+{
+	ASSERT(tfrg_atomic32_load_relaxed(&gJobQueued) == 0);
+	tfrg_atomic32_store_relaxed(&gJobCount, 0);
+}
+
+// SCENE
+vec3 sceneSpherePosition(uint32_t i)
+{
+	return vec3(gSceneSphereX[i], gSceneSphereY[i], gSceneSphereZ[i]);
+}
+
+// Bounces spheres [begin, end) to gSceneAnimationTime, four at a time with
+// SSE2. Phases and time are never negative, so |sin| is folded into [0, pi)
+// and evaluated as cos around pi/2.
+void sceneAnimateSpheres(void* pData, uint32_t begin, uint32_t end)
+{
+	uint32_t i = begin;
+#if defined(SCENE_SSE2)
+	const __m128 pi = _mm_set1_ps(PI);
+	const __m128 invPi = _mm_set1_ps(1.0f / PI);
+	const __m128 halfPi = _mm_set1_ps(PI * 0.5f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 base = _mm_set1_ps(gPlanePosition.getY() + 1.0f);
+	const __m128 height = _mm_set1_ps(4.0f);
+	const __m128 time = _mm_set1_ps(gSceneAnimationTime);
+
+	for (; i + 4 <= end; i += 4)
+	{
+		__m128 arg = _mm_add_ps(_mm_load_ps(gSceneSpherePhase + i), _mm_mul_ps(time, _mm_load_ps(gSceneSphereFrequency + i)));
+		__m128 n = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(arg, invPi)));
+		__m128 u = _mm_sub_ps(_mm_sub_ps(arg, _mm_mul_ps(n, pi)), halfPi);
+		__m128 u2 = _mm_mul_ps(u, u);
+
+		// 1 - u^2/2! + u^4/4! - u^6/6! + u^8/8!
+		__m128 bounce = _mm_set1_ps(1.0f / 40320.0f);
+		bounce = _mm_add_ps(_mm_mul_ps(bounce, u2), _mm_set1_ps(-1.0f / 720.0f));
+		bounce = _mm_add_ps(_mm_mul_ps(bounce, u2), _mm_set1_ps(1.0f / 24.0f));
+		bounce = _mm_add_ps(_mm_mul_ps(bounce, u2), _mm_set1_ps(-0.5f));
+		bounce = _mm_add_ps(_mm_mul_ps(bounce, u2), one);
+
+		_mm_store_ps(gSceneSphereY + i, _mm_add_ps(base, _mm_mul_ps(height, bounce)));
+	}
+#endif
+
+	for (; i < end; ++i)
+	{
+		float bounce = fabsf(sinf(gSceneSpherePhase[i] + gSceneAnimationTime * gSceneSphereFrequency[i]));
+		gSceneSphereY[i] = gPlanePosition.getY() + 1.0f + bounce * 4.0f;
+	}
+}
+
+// Writes (position, scale) of spheres [begin, end) to the float4 array pData
+void sceneWriteSphereTransforms(void* pData, uint32_t begin, uint32_t end)
+{
+	float* pOut = (float*)pData;
+
+	uint32_t i = begin;
+#if defined(SCENE_SSE2)
+	for (; i + 4 <= end; i += 4)
+	{
+		__m128 x = _mm_load_ps(gSceneSphereX + i);
+		__m128 y = _mm_load_ps(gSceneSphereY + i);
+		__m128 z = _mm_load_ps(gSceneSphereZ + i);
+		__m128 scale = _mm_load_ps(gSceneSphereScale + i);
+		_MM_TRANSPOSE4_PS(x, y, z, scale);
+		_mm_storeu_ps(pOut + i * 4 + 0, x);
+		_mm_storeu_ps(pOut + i * 4 + 4, y);
+		_mm_storeu_ps(pOut + i * 4 + 8, z);
+		_mm_storeu_ps(pOut + i * 4 + 12, scale);
+	}
+#endif
+
+	for (; i < end; ++i)
+	{
+		pOut[i * 4 + 0] = gSceneSphereX[i];
+		pOut[i * 4 + 1] = gSceneSphereY[i];
+		pOut[i * 4 + 2] = gSceneSphereZ[i];
+		pOut[i * 4 + 3] = gSceneSphereScale[i];
+	}
+}
+
+// FRAME GRAPH
+uint64_t fgGetTargetSize(const RenderTargetDesc& desc)
+{
+	uint64_t texels = 0;
+	uint32_t width = desc.mWidth;
+	uint32_t height = desc.mHeight;
+	for (uint32_t mip = 0; mip < max(desc.mMipLevels, 1u); ++mip)
+	{
+		texels += (uint64_t)width * height;
+		width = max(width >> 1, 1u);
+		height = max(height >> 1, 1u);
+	}
+
+	texels *= max(desc.mDepth, 1u) * max(desc.mArraySize, 1u) * (uint32_t)desc.mSampleCount;
+	return texels * TinyImageFormat_BitSizeOfBlock(desc.mFormat) / 8;
+}
+
+uint64_t fgGetMemoryUsage(const FrameGraph* pGraph)
+{
+	uint64_t size = 0;
+	for (uint32_t i = 0; i < pGraph->mPhysicalCount; ++i)
+		size += pGraph->mPhysical[i].mSize;
+	return size;
+}
+
+// Releases physical targets no pass used for idleFrames frames. Must stay above
+// the number of frames in flight so the GPU is done with them.
+void fgReleaseIdleTargets(FrameGraph* pGraph, uint32_t idleFrames)
+{
+	idleFrames = max(idleFrames, gImageCount);
+
+	for (uint32_t i = 0; i < pGraph->mPhysicalCount;)
+	{
+		FrameGraphPhysicalTarget& physical = pGraph->mPhysical[i];
+		if (pGraph->mFrame - physical.mAssignedFrame <= idleFrames)
+		{
+			++i;
+			continue;
+		}
+
+		LOGF(LogLevel::eINFO, "Frame graph: released %s (%.1f MB) after %u idle frames",
+			physical.mDesc.pName, physical.mSize / (1024.0f * 1024.0f), pGraph->mFrame - physical.mAssignedFrame);
+		removeRenderTarget(pRenderer, physical.pRenderTarget);
+		physical = pGraph->mPhysical[--pGraph->mPhysicalCount];
+	}
+}
+
+void fgBeginFrame(FrameGraph* pGraph)
+{
+	pGraph->mPassCount = 0;
+	pGraph->mResourceCount = 0;
+	pGraph->mFinalBarrierCount = 0;
+	++pGraph->mFrame;
+
+	// Over budget, drop everything the GPU is guaranteed to be done with
+	bool overBudget = pGraph->mBudget && fgGetMemoryUsage(pGraph) > pGraph->mBudget;
+	fgReleaseIdleTargets(pGraph, overBudget ? gImageCount : pGraph->mIdleFrames);
+}
+
+FrameGraphResource fgAddResource(FrameGraph* pGraph, const char* pName)
+{
+	ASSERT(pGraph->mResourceCount < gMaxFrameGraphResources);
+	FrameGraphResource resource = pGraph->mResourceCount++;
+
+	FrameGraphResourceNode& node = pGraph->mResources[resource];
+	node = {};
+	node.pName = pName;
+	node.mFirstPass = FRAME_GRAPH_INVALID;
+	node.mLastPass = FRAME_GRAPH_INVALID;
+	node.mPhysical = FRAME_GRAPH_INVALID;
+	return resource;
+}
+
+// External target, left in finalState after the graph executed.
+// Imported targets with a final state are graph outputs and keep their producers alive.
+FrameGraphResource fgImport(FrameGraph* pGraph, const char* pName, RenderTarget* pRenderTarget,
+	ResourceState currentState, ResourceState finalState)
+{
+	FrameGraphResource resource = fgAddResource(pGraph, pName);
+	FrameGraphResourceNode& node = pGraph->mResources[resource];
+	node.pRenderTarget = pRenderTarget;
+	node.mState = currentState;
+	node.mFinalState = finalState;
+	node.mImported = true;
+	return resource;
+}
+
+// Transient target, only valid between its first and last use in this frame
+FrameGraphResource fgCreate(FrameGraph* pGraph, const char* pName, const RenderTargetDesc& desc)
+{
+	FrameGraphResource resource = fgAddResource(pGraph, pName);
+	pGraph->mResources[resource].mDesc = desc;
+	return resource;
+}
+
+// Target that keeps its contents across frames, identified by desc.pName.
+// Never aliased, and kept alive like a graph output.
+FrameGraphResource fgCreatePersistent(FrameGraph* pGraph, const RenderTargetDesc& desc)
+{
+	FrameGraphResource resource = fgAddResource(pGraph, desc.pName);
+	pGraph->mResources[resource].mDesc = desc;
+	pGraph->mResources[resource].mPersistent = true;
+	return resource;
+}
+
+uint32_t fgAddPass(FrameGraph* pGraph, const char* pName, FrameGraphExecuteFn pExecute, void* pUserData)
+{
+	ASSERT(pGraph->mPassCount < gMaxFrameGraphPasses);
+	uint32_t pass = pGraph->mPassCount++;
+
+	FrameGraphPass& node = pGraph->mPasses[pass];
+	node = {};
+	node.pName = pName;
+	node.pExecute = pExecute;
+	node.pUserData = pUserData;
+	return pass;
+}
+
+void fgRead(FrameGraph* pGraph, uint32_t pass, FrameGraphResource resource, ResourceState state)
+{
+	FrameGraphPass& node = pGraph->mPasses[pass];
+	ASSERT(node.mReadCount < gMaxFrameGraphPassAccesses);
+	node.mReads[node.mReadCount++] = { resource, state };
+}
+
+void fgWrite(FrameGraph* pGraph, uint32_t pass, FrameGraphResource resource, ResourceState state)
+{
+	FrameGraphPass& node = pGraph->mPasses[pass];
+	ASSERT(node.mWriteCount < gMaxFrameGraphPassAccesses);
+	node.mWrites[node.mWriteCount++] = { resource, state };
+}
+
+RenderTarget* fgGetRenderTarget(FrameGraph* pGraph, FrameGraphResource resource)
+{
+	return pGraph->mResources[resource].pRenderTarget;
+}
+
+bool fgIsCompatible(const RenderTargetDesc& a, const RenderTargetDesc& b)
+{
+	return a.mWidth == b.mWidth && a.mHeight == b.mHeight && a.mDepth == b.mDepth &&
+		a.mArraySize == b.mArraySize && a.mMipLevels == b.mMipLevels &&
+		a.mFormat == b.mFormat && a.mSampleCount == b.mSampleCount &&
+		a.mDescriptors == b.mDescriptors && a.mFlags == b.mFlags;
+}
+
+// False until a persistent target was allocated, or once it was released
+// while idle. Its previous contents are undefined in that case.
+bool fgHasPersistent(const FrameGraph* pGraph, const RenderTargetDesc& desc)
+{
+	for (uint32_t i = 0; i < pGraph->mPhysicalCount; ++i)
+	{
+		const FrameGraphPhysicalTarget& physical = pGraph->mPhysical[i];
+		if (physical.mPersistent && !strcmp(physical.mDesc.pName, desc.pName) && fgIsCompatible(physical.mDesc, desc))
+			return true;
+	}
+	return false;
+}
+
+uint32_t fgAcquirePhysical(FrameGraph* pGraph, const RenderTargetDesc& desc, bool persistent, uint32_t firstPass, uint32_t lastPass)
+{
+	// Persistent targets are matched by name. Transient ones alias onto a compatible
+	// target that is unused this frame or whose last user already ran.
+	for (uint32_t i = 0; i < pGraph->mPhysicalCount; ++i)
+	{
+		FrameGraphPhysicalTarget& physical = pGraph->mPhysical[i];
+		if (physical.mPersistent != persistent)
+			continue;
+
+		bool available = persistent ? !strcmp(physical.mDesc.pName, desc.pName) :
+			physical.mAssignedFrame != pGraph->mFrame || physical.mBusyUntilPass < firstPass;
+		if (available && fgIsCompatible(physical.mDesc, desc))
+		{
+			physical.mAssignedFrame = pGraph->mFrame;
+			physical.mBusyUntilPass = lastPass;
+			return i;
+		}
+	}
+
+	// A switch of technique or format allocates a new set of targets while the
+	// old one waits out its idle frames. Once the pool is full the longest idle
+	// target gives up its slot in place, the resources assigned this frame keep
+	// their indices.
+	uint32_t index = pGraph->mPhysicalCount;
+	if (index == gMaxFrameGraphPhysicalTargets)
+	{
+		for (uint32_t i = 0; i < pGraph->mPhysicalCount; ++i)
+		{
+			uint32_t assignedFrame = pGraph->mPhysical[i].mAssignedFrame;
+			if (assignedFrame != pGraph->mFrame && (index == gMaxFrameGraphPhysicalTargets || assignedFrame < pGraph->mPhysical[index].mAssignedFrame))
+				index = i;
+		}
+		ASSERT(index < gMaxFrameGraphPhysicalTargets);
+
+		FrameGraphPhysicalTarget& evicted = pGraph->mPhysical[index];
+		if (pGraph->mFrame - evicted.mAssignedFrame <= gImageCount)
+		{
+			LOGF(LogLevel::eWARNING, "Frame graph: pool full, waiting for the GPU to evict %s", evicted.mDesc.pName);
+			waitQueueIdle(pGraphicsQueue);
+		}
+		LOGF(LogLevel::eINFO, "Frame graph: evicted %s (%.1f MB) after %u idle frames",
+			evicted.mDesc.pName, evicted.mSize / (1024.0f * 1024.0f), pGraph->mFrame - evicted.mAssignedFrame);
+		removeRenderTarget(pRenderer, evicted.pRenderTarget);
+	}
+	else
+	{
+		++pGraph->mPhysicalCount;
+	}
+	FrameGraphPhysicalTarget& physical = pGraph->mPhysical[index];
+	physical = {};
+	physical.mDesc = desc;
+	physical.mState = RESOURCE_STATE_UNDEFINED;
+	physical.mAssignedFrame = pGraph->mFrame;
+	physical.mBusyUntilPass = lastPass;
+	physical.mSize = fgGetTargetSize(desc);
+	physical.mPersistent = persistent;
+	addRenderTarget(pRenderer, &desc, &physical.pRenderTarget);
+
+	LOGF(LogLevel::eINFO, "Frame graph: allocated %s (%s %ux%u, %.1f MB), %.1f MB resident",
+		desc.pName, TinyImageFormat_Name(desc.mFormat), desc.mWidth, desc.mHeight,
+		physical.mSize / (1024.0f * 1024.0f), fgGetMemoryUsage(pGraph) / (1024.0f * 1024.0f));
+	return index;
+}
+
+void fgTransition(FrameGraph* pGraph, FrameGraphResource resource, ResourceState state,
+	RenderTargetBarrier* pBarriers, uint32_t* pBarrierCount)
+{
+	FrameGraphResourceNode& node = pGraph->mResources[resource];
+	ResourceState* pCurrent = node.mImported ? &node.mState : &pGraph->mPhysical[node.mPhysical].mState;
+
+	// UAV to UAV still needs a barrier between dependent dispatches
+	if (*pCurrent == state && state != RESOURCE_STATE_UNORDERED_ACCESS)
+		return;
+
+	// A pass sees a resource in one state. Reads in several read states
+	// share the barrier, a write has to be the only access.
+	for (uint32_t i = 0; i < *pBarrierCount; ++i)
+	{
+		RenderTargetBarrier& barrier = pBarriers[i];
+		if (barrier.pRenderTarget != node.pRenderTarget)
+			continue;
+
+		const uint32_t readStates = RESOURCE_STATE_GENERIC_READ | RESOURCE_STATE_DEPTH_READ;
+		if (!(barrier.mNewState & ~readStates) && !(state & ~readStates))
+			barrier.mNewState = (ResourceState)(barrier.mNewState | state);
+		else
+			ASSERT(barrier.mNewState == state);
+		*pCurrent = barrier.mNewState;
+		return;
+	}
+
+	pBarriers[(*pBarrierCount)++] = { node.pRenderTarget, state };
+	*pCurrent = state;
+}
+
+void fgCompile(FrameGraph* pGraph)
+{
+	// Reference counts
+	for (uint32_t p = 0; p < pGraph->mPassCount; ++p)
+	{
+		FrameGraphPass& pass = pGraph->mPasses[p];
+		pass.mRefCount = pass.mWriteCount;
+		for (uint32_t i = 0; i < pass.mReadCount; ++i)
+			++pGraph->mResources[pass.mReads[i].mResource].mRefCount;
+	}
+
+	// Cull passes whose writes are never read and never leave the graph
+	FrameGraphResource unreferenced[gMaxFrameGraphResources];
+	uint32_t unreferencedCount = 0;
+	for (uint32_t r = 0; r < pGraph->mResourceCount; ++r)
+	{
+		const FrameGraphResourceNode& node = pGraph->mResources[r];
+		if (node.mRefCount == 0 && node.mFinalState == RESOURCE_STATE_UNDEFINED && !node.mPersistent)
+			unreferenced[unreferencedCount++] = r;
+	}
+
+	while (unreferencedCount)
+	{
+		FrameGraphResource resource = unreferenced[--unreferencedCount];
+		for (uint32_t p = 0; p < pGraph->mPassCount; ++p)
+		{
+			FrameGraphPass& pass = pGraph->mPasses[p];
+			for (uint32_t i = 0; i < pass.mWriteCount; ++i)
+			{
+				if (pass.mWrites[i].mResource != resource || pass.mRefCount == 0)
+					continue;
+
+				if (--pass.mRefCount == 0)
+				{
+					for (uint32_t j = 0; j < pass.mReadCount; ++j)
+					{
+						FrameGraphResourceNode& read = pGraph->mResources[pass.mReads[j].mResource];
+						if (--read.mRefCount == 0 && read.mFinalState == RESOURCE_STATE_UNDEFINED && !read.mPersistent)
+							unreferenced[unreferencedCount++] = pass.mReads[j].mResource;
+					}
+				}
+			}
+		}
+	}
+
+	// Lifetimes of the resources used by the remaining passes
+	for (uint32_t p = 0; p < pGraph->mPassCount; ++p)
+	{
+		FrameGraphPass& pass = pGraph->mPasses[p];
+		if (pass.mRefCount == 0)
+			continue;
+
+		FrameGraphAccess* accesses[2] = { pass.mReads, pass.mWrites };
+		uint32_t counts[2] = { pass.mReadCount, pass.mWriteCount };
+		for (uint32_t a = 0; a < 2; ++a)
+		{
+			for (uint32_t i = 0; i < counts[a]; ++i)
+			{
+				FrameGraphResourceNode& node = pGraph->mResources[accesses[a][i].mResource];
+				if (node.mFirstPass == FRAME_GRAPH_INVALID)
+					node.mFirstPass = p;
+				node.mLastPass = p;
+			}
+		}
+	}
+
+	// Resources are declared in pass order, so assigning them in declaration
+	// order lets later resources alias targets released by earlier ones
+	for (uint32_t r = 0; r < pGraph->mResourceCount; ++r)
+	{
+		FrameGraphResourceNode& node = pGraph->mResources[r];
+		if (node.mImported || node.mFirstPass == FRAME_GRAPH_INVALID)
+			continue;
+
+		node.mPhysical = fgAcquirePhysical(pGraph, node.mDesc, node.mPersistent, node.mFirstPass, node.mLastPass);
+		node.pRenderTarget = pGraph->mPhysical[node.mPhysical].pRenderTarget;
+	}
+
+	// Barriers, batched per pass
+	for (uint32_t p = 0; p < pGraph->mPassCount; ++p)
+	{
+		FrameGraphPass& pass = pGraph->mPasses[p];
+		if (pass.mRefCount == 0)
+			continue;
+
+		for (uint32_t i = 0; i < pass.mReadCount; ++i)
+			fgTransition(pGraph, pass.mReads[i].mResource, pass.mReads[i].mState, pass.mBarriers, &pass.mBarrierCount);
+		for (uint32_t i = 0; i < pass.mWriteCount; ++i)
+			fgTransition(pGraph, pass.mWrites[i].mResource, pass.mWrites[i].mState, pass.mBarriers, &pass.mBarrierCount);
+	}
+
+	for (uint32_t r = 0; r < pGraph->mResourceCount; ++r)
+	{
+		const FrameGraphResourceNode& node = pGraph->mResources[r];
+		if (node.mImported && node.mFinalState != RESOURCE_STATE_UNDEFINED)
+			fgTransition(pGraph, r, node.mFinalState, pGraph->mFinalBarriers, &pGraph->mFinalBarrierCount);
+	}
+
+	bool overBudget = pGraph->mBudget && fgGetMemoryUsage(pGraph) > pGraph->mBudget;
+	if (overBudget && !pGraph->mOverBudget)
+	{
+		LOGF(LogLevel::eWARNING, "Frame graph: %.1f MB resident exceeds the %.1f MB budget",
+			fgGetMemoryUsage(pGraph) / (1024.0f * 1024.0f), pGraph->mBudget / (1024.0f * 1024.0f));
+	}
+	pGraph->mOverBudget = overBudget;
+}
+
+void fgExecute(FrameGraph* pGraph, Cmd* pCmd)
+{
+	for (uint32_t p = 0; p < pGraph->mPassCount; ++p)
+	{
+		FrameGraphPass& pass = pGraph->mPasses[p];
+		if (pass.mRefCount == 0)
+			continue;
+
+		telemetryBeginGpuScope(pCmd, pass.pName);
+		if (pass.mBarrierCount)
+			cmdResourceBarrier(pCmd, 0, NULL, 0, NULL, pass.mBarrierCount, pass.mBarriers);
+
+		pass.pExecute(pCmd, pGraph, pass.pUserData);
+		telemetryEndGpuScope(pCmd);
+	}
+
+	if (pGraph->mFinalBarrierCount)
+		cmdResourceBarrier(pCmd, 0, NULL, 0, NULL, pGraph->mFinalBarrierCount, pGraph->mFinalBarriers);
+}
+
+void fgRemovePhysicalTargets(FrameGraph* pGraph)
+{
+	for (uint32_t i = 0; i < pGraph->mPhysicalCount; ++i)
+		removeRenderTarget(pRenderer, pGraph->mPhysical[i].pRenderTarget);
+
+	pGraph->mPhysicalCount = 0;
+}
+
+// Keeps persistent targets and their contents, the GPU must be idle
+void fgRemoveTransientTargets(FrameGraph* pGraph)
+{
+	for (uint32_t i = 0; i < pGraph->mPhysicalCount;)
+	{
+		FrameGraphPhysicalTarget& physical = pGraph->mPhysical[i];
+		if (physical.mPersistent)
+		{
+			++i;
+			continue;
+		}
+
+		removeRenderTarget(pRenderer, physical.pRenderTarget);
+		physical = pGraph->mPhysical[--pGraph->mPhysicalCount];
+	}
+}
+
+// SHADOW ATLAS
+void shadowAtlasReset(ShadowAtlasAllocator* pAllocator, uint32_t size)
+{
+	pAllocator->mSize = (int32_t)size;
+	pAllocator->mNodes[0] = { 0, 0, (int32_t)size };
+	pAllocator->mNodeCount = 1;
+}
+
+// Height the rectangle would be placed at when its left edge sits on segment index, -1 if it does not fit
+int32_t shadowAtlasFit(const ShadowAtlasAllocator* pAllocator, uint32_t index, int32_t size)
+{
+	int32_t x = pAllocator->mNodes[index].mX;
+	int32_t y = pAllocator->mNodes[index].mY;
+	if (x + size > pAllocator->mSize)
+		return -1;
+
+	for (int32_t spaceLeft = size; spaceLeft > 0; ++index)
+	{
+		if (index == pAllocator->mNodeCount)
+			return -1;
+
+		y = max(y, pAllocator->mNodes[index].mY);
+		if (y + size > pAllocator->mSize)
+			return -1;
+
+		spaceLeft -= pAllocator->mNodes[index].mWidth;
+	}
+	return y;
+}
+
+void shadowAtlasRemoveNode(ShadowAtlasAllocator* pAllocator, uint32_t index)
+{
+	for (uint32_t i = index; i + 1 < pAllocator->mNodeCount; ++i)
+		pAllocator->mNodes[i] = pAllocator->mNodes[i + 1];
+	--pAllocator->mNodeCount;
+}
+
+// Bottom-left placement of a square tile, keeps the skyline as low as possible
+bool shadowAtlasAllocate(ShadowAtlasAllocator* pAllocator, uint32_t tileSize, uint32_t* pX, uint32_t* pY)
+{
+	int32_t size = (int32_t)tileSize;
+	int32_t bestTop = pAllocator->mSize + 1;
+	int32_t bestWidth = pAllocator->mSize + 1;
+	uint32_t bestIndex = FRAME_GRAPH_INVALID;
+	int32_t bestY = 0;
+
+	for (uint32_t i = 0; i < pAllocator->mNodeCount; ++i)
+	{
+		int32_t y = shadowAtlasFit(pAllocator, i, size);
+		if (y < 0)
+			continue;
+
+		if (y + size < bestTop || (y + size == bestTop && pAllocator->mNodes[i].mWidth < bestWidth))
+		{
+			bestIndex = i;
+			bestTop = y + size;
+			bestWidth = pAllocator->mNodes[i].mWidth;
+			bestY = y;
+		}
+	}
+
+	if (bestIndex == FRAME_GRAPH_INVALID)
+		return false;
+
+	ASSERT(pAllocator->mNodeCount < gMaxAtlasLights + 1);
+	int32_t bestX = pAllocator->mNodes[bestIndex].mX;
+	for (uint32_t i = pAllocator->mNodeCount; i > bestIndex; --i)
+		pAllocator->mNodes[i] = pAllocator->mNodes[i - 1];
+	pAllocator->mNodes[bestIndex] = { bestX, bestY + size, size };
+	++pAllocator->mNodeCount;
+
+	// Shrink or drop the segments now covered by the new one
+	for (uint32_t i = bestIndex + 1; i < pAllocator->mNodeCount;)
+	{
+		const ShadowAtlasSkylineNode& previous = pAllocator->mNodes[i - 1];
+		ShadowAtlasSkylineNode& node = pAllocator->mNodes[i];
+		int32_t overlap = previous.mX + previous.mWidth - node.mX;
+		if (overlap <= 0)
+			break;
+
+		node.mX += overlap;
+		node.mWidth -= overlap;
+		if (node.mWidth > 0)
+			break;
+
+		shadowAtlasRemoveNode(pAllocator, i);
+	}
+
+	// Merge neighbouring segments of equal height
+	for (uint32_t i = 0; i + 1 < pAllocator->mNodeCount;)
+	{
+		if (pAllocator->mNodes[i].mY == pAllocator->mNodes[i + 1].mY)
+		{
+			pAllocator->mNodes[i].mWidth += pAllocator->mNodes[i + 1].mWidth;
+			shadowAtlasRemoveNode(pAllocator, i + 1);
+		}
+		else
+		{
+			++i;
+		}
+	}
+
+	*pX = (uint32_t)bestX;
+	*pY = (uint32_t)bestY;
+	return true;
+}
+
+// Cone against bounding sphere, conservative
+bool shadowAtlasConeOverlapsSphere(const ShadowAtlasLight& light, const vec3& center, float radius)
+{
+	vec3 toCenter = center - light.mPosition;
+	float alongAxis = dot(toCenter, light.mDirection);
+	if (alongAxis < -radius || alongAxis > light.mRange + radius)
+		return false;
+
+	float sinOuter = sqrtf(max(1.0f - light.mCosOuter * light.mCosOuter, 0.0f));
+	float distanceToAxis = sqrtf(max(dot(toCenter, toCenter) - alongAxis * alongAxis, 0.0f));
+	return light.mCosOuter * distanceToAxis - alongAxis * sinOuter <= radius;
+}
+
+// VIRTUAL SHADOW MAP
+// Frees every slot, no page is resident afterwards
+void virtualShadowReset()
+{
+	for (uint32_t i = 0; i < gVirtualShadowPageCount; ++i)
+		gVirtualShadowPageTable[i] = VIRTUAL_PAGE_NONE;
+
+	// Popped from the back, the first slots go first
+	for (uint32_t i = 0; i < gVirtualShadowSlotCount; ++i)
+	{
+		gVirtualShadowSlots[i] = { VIRTUAL_PAGE_NONE, 0, 0 };
+		gVirtualShadowFreeSlots[i] = gVirtualShadowSlotCount - 1 - i;
+	}
+	gVirtualShadowFreeSlotCount = gVirtualShadowSlotCount;
+	gVirtualShadowResidentCount = 0;
+}
+
+// A free slot, or the slot of the page requested longest ago. Pages requested
+// in frame are never evicted, VIRTUAL_PAGE_NONE if every slot holds one.
+uint32_t virtualShadowAllocateSlot(uint32_t frame)
+{
+	if (gVirtualShadowFreeSlotCount)
+		return gVirtualShadowFreeSlots[--gVirtualShadowFreeSlotCount];
+
+	uint32_t oldest = VIRTUAL_PAGE_NONE;
+	for (uint32_t i = 0; i < gVirtualShadowSlotCount; ++i)
+	{
+		const VirtualShadowSlot& slot = gVirtualShadowSlots[i];
+		if (slot.mLastRequest == frame)
+			continue;
+		if (oldest == VIRTUAL_PAGE_NONE || slot.mLastRequest < gVirtualShadowSlots[oldest].mLastRequest)
+			oldest = i;
+	}
+
+	if (oldest != VIRTUAL_PAGE_NONE)
+	{
+		gVirtualShadowPageTable[gVirtualShadowSlots[oldest].mPage] = VIRTUAL_PAGE_NONE;
+		--gVirtualShadowResidentCount;
+	}
+	return oldest;
+}
+
+ShadowAtlasTile virtualShadowSlotTile(uint32_t slot)
+{
+	ShadowAtlasTile tile = {};
+	tile.mX = (slot % gVirtualShadowPoolSlots) * gVirtualShadowSlotSize;
+	tile.mY = (slot / gVirtualShadowPoolSlots) * gVirtualShadowSlotSize;
+	tile.mSize = gVirtualShadowSlotSize;
+	return tile;
+}
+
+// Clip space scale and x, y offset that fit a page and its border to the
+// viewport of a slot, see pageTransform in shadowPass.vert
+vec4 virtualShadowPageTransform(uint32_t page)
+{
+	const float interior = (float)(gVirtualShadowSlotSize - 2 * gVirtualShadowSlotBorder);
+	// Half the clip space width of the slot
+	const float extent = (float)gVirtualShadowSlotSize / (interior * gVirtualShadowPages);
+	float centerX = 2.0f * ((page % gVirtualShadowPages) + 0.5f) / gVirtualShadowPages - 1.0f;
+	float centerY = 1.0f - 2.0f * ((page / gVirtualShadowPages) + 0.5f) / gVirtualShadowPages;
+	return vec4(1.0f / extent, -centerX / extent, -centerY / extent, 0.0f);
+}
+
+// SHADOW CASTERS
+// Bounds of a sphere for the caster tests. The CPU never sees spheres bounced
+// on the GPU, those are bounded over their whole bounce.
+void shadowGetCasterBounds(uint32_t i, vec3* pCenter, float* pRadius)
+{
+	*pRadius = gSphereDiameter * gSceneSphereScale[i];
+	if (gSceneGpuAnimationActive)
+	{
+		*pCenter = vec3(gSceneSphereX[i], gPlanePosition.getY() + 3.0f, gSceneSphereZ[i]);
+		*pRadius += 2.0f;
+	}
+	else
+	{
+		*pCenter = sceneSpherePosition(i);
+	}
+}
+
+// Flags the lights with a sphere of [begin, end) in their volume, bouncing
+// spheres change those shadows every frame. Lights flagged by another range
+// are skipped. The directional map only cares about the texels it keeps.
+void shadowTestCasters(void* pData, uint32_t begin, uint32_t end)
+{
+	vec3 center;
+	float radius;
+	for (uint32_t i = 0; i < gShadowAtlasLightCount; ++i)
+	{
+		const ShadowAtlasLight& light = gShadowAtlasLights[i];
+		tfrg_atomic32_t* pMoved = &gShadowCastersMoved[i];
+		for (uint32_t j = begin; j < end && !tfrg_atomic32_load_relaxed(pMoved); ++j)
+		{
+			shadowGetCasterBounds(j, &center, &radius);
+			if (shadowAtlasConeOverlapsSphere(light, center, radius))
+				tfrg_atomic32_store_relaxed(pMoved, 1);
+		}
+	}
+
+	for (uint32_t i = 0; i < gPointLightCount; ++i)
+	{
+		const vec3 position = gPointLights[i].mPosition;
+		const float range = 1.0f / gDataPointLights.mLights[i].mPositionInvRange.getW();
+		tfrg_atomic32_t* pMoved = &gShadowCastersMoved[gMaxAtlasLights + i];
+		for (uint32_t j = begin; j < end && !tfrg_atomic32_load_relaxed(pMoved); ++j)
+		{
+			shadowGetCasterBounds(j, &center, &radius);
+			if (length(center - position) < range + radius)
+				tfrg_atomic32_store_relaxed(pMoved, 1);
+		}
+	}
+
+	tfrg_atomic32_t* pMoved = &gShadowCastersMoved[gDirectionalCastersMoved];
+	for (uint32_t j = begin; j < end && !tfrg_atomic32_load_relaxed(pMoved); ++j)
+	{
+		shadowGetCasterBounds(j, &center, &radius);
+		const vec4 centerInLight = gDirectionalKeptView * vec4(center, 1.0f);
+		if (centerInLight.getX() + radius > gDirectionalKeptRegion.getX() && centerInLight.getX() - radius < gDirectionalKeptRegion.getZ() &&
+			centerInLight.getY() + radius > gDirectionalKeptRegion.getY() && centerInLight.getY() - radius < gDirectionalKeptRegion.getW())
+			tfrg_atomic32_store_relaxed(pMoved, 1);
+	}
+}
+
+// CULLING
+// World space planes of a D3D style view projection (depth in [0, 1]),
+// left, right, bottom, top, near, far, pointing inwards and normalized
+void cullExtractPlanes(const mat4& viewProj, vec4 planes[6])
+{
+	const vec4 row0 = viewProj.getRow(0);
+	const vec4 row1 = viewProj.getRow(1);
+	const vec4 row2 = viewProj.getRow(2);
+	const vec4 row3 = viewProj.getRow(3);
+
+	planes[0] = row3 + row0;
+	planes[1] = row3 - row0;
+	planes[2] = row3 + row1;
+	planes[3] = row3 - row1;
+	planes[4] = row2;
+	planes[5] = row3 - row2;
+
+	for (uint32_t i = 0; i < 6; ++i)
+		planes[i] /= length(planes[i].getXYZ());
+}
+
+// SHADOW VIEWS
+// The per frame sets of the camera views hold gImageCount sets per view
+uint32_t getViewSetIndex(uint32_t view)
+{
+	return view * gImageCount + gFrameIndex;
+}
+
+// Top-down orthographic camera over the ground around center. It stays over
+// the plane, so that the ground fills the whole view.
+void shadowViewUpdateMinimap(ShadowView* pView, const vec3& center)
+{
+	const float limit = max(gPlaneSize.getX() * 0.5f - gMinimapExtent, 0.0f);
+	const float height = 50.0f;
+	const float x = clamp(center.getX(), -limit, limit);
+	const float z = clamp(center.getZ(), -limit, limit);
+
+	LightView camera;
+	camera.moveTo(vec3(x, gPlanePosition.getY() + height, z));
+	camera.lookAt(vec3(x, gPlanePosition.getY(), z));
+
+	mat4 projMat = mat4::orthographic(-gMinimapExtent, gMinimapExtent, -gMinimapExtent, gMinimapExtent, 1.0f, height * 2.0f);
+	pView->mCamera.mProjectView = projMat * camera.getViewMatrix();
+	pView->mCamera.mCamPos = vec4(camera.viewPosition, 0.0f);
+}
+
+// ------------------------------------
+
+class MomentShadows : public IApp
+{
+public:
+	MomentShadows()
+	{
+		gToggleVSync = mSettings.mDefaultVSyncEnabled;
+	}
+
+	bool Init()
+	{
+		// FILE PATHS
+		fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_SHADER_SOURCES, "Shaders");
+		fsSetPathForResourceDir(pSystemFileIO, RM_DEBUG, RD_SHADER_BINARIES, "CompiledShaders");
+		fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_GPU_CONFIG, "GPUCfg");
+		fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_TEXTURES, "Textures");
+		fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_FONTS, "Fonts");
+
+		jobInit();
+
+		// window and renderer setup
+		RendererDesc settings = { 0 };
+		initRenderer(GetName(), &settings, &pRenderer);
+		//check for init success
+		if (!pRenderer)
+			return false;
+
+		// Set up the graphics queue
+		QueueDesc queueDesc = {};
+		queueDesc.mType = QUEUE_TYPE_GRAPHICS;
+		queueDesc.mFlag = QUEUE_FLAG_INIT_MICROPROFILE;
+		addQueue(pRenderer, &queueDesc, &pGraphicsQueue);
+
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			CmdPoolDesc cmdPoolDesc = {};
+			cmdPoolDesc.pQueue = pGraphicsQueue;
+			addCmdPool(pRenderer, &cmdPoolDesc, &pCmdPools[i]);
+			CmdDesc cmdDesc = {};
+			cmdDesc.pPool = pCmdPools[i];
+			addCmd(pRenderer, &cmdDesc, &pCmds[i]);
+
+			addFence(pRenderer, &pFencesRenderComplete[i]);
+			addSemaphore(pRenderer, &pSemaphoresRenderComplete[i]);
+		}
+		addSemaphore(pRenderer, &pSemaphoreImageAcquired);
+
+		initResourceLoaderInterface(pRenderer);
+
+		// Initialize virtual joystick
+		if (!gVirtualJoystick.Init(pRenderer, "circlepad"))
+		{
+			LOGF(LogLevel::eERROR, "Could not initialize Virtual Joystick.");
+			return false;
+		}
+
+		// Every moment shader comes in the default encoding and the one of
+		// 16-bit UNORM VSM or 128-bit MSM, only the variant macro differs
+		ShaderMacro momentMacroVSM = { "MOMENT_CENTERED", "1" };
+		ShaderMacro momentMacroMSM = { "MOMENT_RAW", "1" };
+		// The half precision variants prepend HALF_PRECISION to the list
+		ShaderMacro halfMacrosVSM[] = { { "HALF_PRECISION", "1" }, momentMacroVSM };
+		ShaderMacro halfMacrosMSM[] = { { "HALF_PRECISION", "1" }, momentMacroMSM };
+		// The directional projection may be perspective, see getWarpedLightViewProj
+		ShaderMacro screenDepthMacrosVSM[] = { { "SCREEN_DEPTH", "1" }, momentMacroVSM };
+		ShaderMacro screenDepthMacrosMSM[] = { { "SCREEN_DEPTH", "1" }, momentMacroMSM };
+		// ESM has a single encoding, its compute shaders only differ by ESM
+		ShaderMacro esmMacro = { "ESM", "1" };
+		ShaderMacro halfMacrosESM[] = { { "HALF_PRECISION", "1" }, esmMacro };
+
+		for (uint32_t i = 0; i < gMomentEncodingCount; ++i)
+		{
+			for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+			{
+				ShaderLoadDesc shaderVSM = {};
+				shaderVSM.mStages[0] = { "basic.vert", NULL, 0 };
+				shaderVSM.mStages[1] = { "VSM.frag", &halfMacrosVSM[1 - p], p + i };
+				addShader(pRenderer, &shaderVSM, &pShaderVSM[p][i]);
+
+				ShaderLoadDesc shaderMSM = {};
+				shaderMSM.mStages[0] = { "basic.vert", NULL, 0 };
+				shaderMSM.mStages[1] = { "MSM.frag", &halfMacrosMSM[1 - p], p + i };
+				addShader(pRenderer, &shaderMSM, &pShaderMSM[p][i]);
+			}
+
+
+			ShaderLoadDesc shaderMapVSM = {};
+			shaderMapVSM.mStages[0] = { "shadowPass.vert", NULL, 0 };
+			shaderMapVSM.mStages[1] = { "mapVSM.frag", screenDepthMacrosVSM, 1 + i };
+			addShader(pRenderer, &shaderMapVSM, &pShaderMapVSM[i]);
+
+			ShaderLoadDesc shaderMapMSM = {};
+			shaderMapMSM.mStages[0] = { "shadowPass.vert", NULL, 0 };
+			shaderMapMSM.mStages[1] = { "mapMSM.frag", screenDepthMacrosMSM, 1 + i };
+			addShader(pRenderer, &shaderMapMSM, &pShaderMapMSM[i]);
+		}
+
+		ShaderLoadDesc shaderMapESM = {};
+		shaderMapESM.mStages[0] = { "shadowPass.vert", NULL, 0 };
+		shaderMapESM.mStages[1] = { "mapESM.frag", screenDepthMacrosVSM, 1 };
+		addShader(pRenderer, &shaderMapESM, &pShaderMapESM);
+
+
+		for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+		{
+			ShaderLoadDesc shaderShadowBlur = {};
+			shaderShadowBlur.mStages[0] = { "shadowBlur.comp", halfMacrosVSM, p };
+			addShader(pRenderer, &shaderShadowBlur, &pShaderShadowBlur[p]);
+		}
+
+		// Filters in log space, exp(c * d) leaves the range of a half
+		ShaderLoadDesc shaderShadowBlurESM = {};
+		shaderShadowBlurESM.mStages[0] = { "shadowBlur.comp", &esmMacro, 1 };
+		addShader(pRenderer, &shaderShadowBlurESM, &pShaderShadowBlurESM);
+
+		// Depth-only directional shadow map, the moments are built in compute
+		ShaderLoadDesc shaderShadowDepth = {};
+		shaderShadowDepth.mStages[0] = { "shadowPass.vert", NULL, 0 };
+		addShader(pRenderer, &shaderShadowDepth, &pShaderShadowDepth);
+
+		// Per sample count, then encoding. Single sampled variants leave out SAMPLE_COUNT.
+		const char* pShadowMsaaSamples[SHADOW_MSAA_COUNT] = { "1", "4", "8" };
+
+		for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
+		{
+			for (uint32_t i = 0; i < gMomentEncodingCount; ++i)
+			{
+				ShaderMacro shadowMomentsMacros[3] = {};
+				uint32_t macroCount = 0;
+				if (msaa)
+					shadowMomentsMacros[macroCount++] = { "SAMPLE_COUNT", pShadowMsaaSamples[msaa] };
+				if (i)
+					shadowMomentsMacros[macroCount++] = momentMacroVSM;
+
+				ShaderLoadDesc shaderShadowMomentsVSM = {};
+				shaderShadowMomentsVSM.mStages[0] = { "shadowMoments.comp", shadowMomentsMacros, macroCount };
+				addShader(pRenderer, &shaderShadowMomentsVSM, &pShaderShadowMomentsVSM[msaa][i]);
+
+				macroCount = (msaa) ? 1 : 0;
+				shadowMomentsMacros[macroCount++] = { "MSM", "1" };
+				if (i)
+					shadowMomentsMacros[macroCount++] = momentMacroMSM;
+
+				ShaderLoadDesc shaderShadowMomentsMSM = {};
+				shaderShadowMomentsMSM.mStages[0] = { "shadowMoments.comp", shadowMomentsMacros, macroCount };
+				addShader(pRenderer, &shaderShadowMomentsMSM, &pShaderShadowMomentsMSM[msaa][i]);
+			}
+
+			ShaderMacro shadowMomentsMacros[2] = {};
+			uint32_t macroCount = 0;
+			if (msaa)
+				shadowMomentsMacros[macroCount++] = { "SAMPLE_COUNT", pShadowMsaaSamples[msaa] };
+			shadowMomentsMacros[macroCount++] = esmMacro;
+
+			ShaderLoadDesc shaderShadowMomentsESM = {};
+			shaderShadowMomentsESM.mStages[0] = { "shadowMoments.comp", shadowMomentsMacros, macroCount };
+			addShader(pRenderer, &shaderShadowMomentsESM, &pShaderShadowMomentsESM[msaa]);
+		}
+
+
+		// Spot lights render into tiles of the shadow atlas
+		ShaderMacro shadowAtlasMacro = { "SHADOW_ATLAS", "1" };
+
+		for (uint32_t i = 0; i < gMomentEncodingCount; ++i)
+		{
+			ShaderLoadDesc shaderShadowAtlasVSM = {};
+			shaderShadowAtlasVSM.mStages[0] = { "shadowPass.vert", &shadowAtlasMacro, 1 };
+			shaderShadowAtlasVSM.mStages[1] = { "mapVSM.frag", &momentMacroVSM, i };
+			addShader(pRenderer, &shaderShadowAtlasVSM, &pShaderShadowAtlasVSM[i]);
+
+			ShaderLoadDesc shaderShadowAtlasMSM = {};
+			shaderShadowAtlasMSM.mStages[0] = { "shadowPass.vert", &shadowAtlasMacro, 1 };
+			shaderShadowAtlasMSM.mStages[1] = { "mapMSM.frag", &momentMacroMSM, i };
+			addShader(pRenderer, &shaderShadowAtlasMSM, &pShaderShadowAtlasMSM[i]);
+		}
+
+		ShaderLoadDesc shaderShadowAtlasBlur = {};
+		shaderShadowAtlasBlur.mStages[0] = { "shadowAtlasBlur.comp", NULL, 0 };
+		addShader(pRenderer, &shaderShadowAtlasBlur, &pShaderShadowAtlasBlur);
+
+
+		// Point lights render all cube faces in one layered pass
+		ShaderMacro shadowCubeMacro = { "SHADOW_CUBE", "1" };
+
+		for (uint32_t i = 0; i < gMomentEncodingCount; ++i)
+		{
+			ShaderLoadDesc shaderPointShadowVSM = {};
+			shaderPointShadowVSM.mStages[0] = { "shadowPass.vert", &shadowCubeMacro, 1 };
+			shaderPointShadowVSM.mStages[1] = { "mapVSM.frag", &momentMacroVSM, i };
+			addShader(pRenderer, &shaderPointShadowVSM, &pShaderPointShadowVSM[i]);
+
+			ShaderLoadDesc shaderPointShadowMSM = {};
+			shaderPointShadowMSM.mStages[0] = { "shadowPass.vert", &shadowCubeMacro, 1 };
+			shaderPointShadowMSM.mStages[1] = { "mapMSM.frag", &momentMacroMSM, i };
+			addShader(pRenderer, &shaderPointShadowMSM, &pShaderPointShadowMSM[i]);
+		}
+
+		ShaderLoadDesc shaderPointShadowBlur = {};
+		shaderPointShadowBlur.mStages[0] = { "shadowCubeBlur.comp", NULL, 0 };
+		addShader(pRenderer, &shaderPointShadowBlur, &pShaderPointShadowBlur);
+
+
+		// Pages of the virtual shadow map render into slots of the page pool
+		ShaderMacro virtualPageMacro = { "VIRTUAL_PAGE", "1" };
+
+		for (uint32_t i = 0; i < gMomentEncodingCount; ++i)
+		{
+			ShaderLoadDesc shaderVirtualPageVSM = {};
+			shaderVirtualPageVSM.mStages[0] = { "shadowPass.vert", &virtualPageMacro, 1 };
+			shaderVirtualPageVSM.mStages[1] = { "mapVSM.frag", screenDepthMacrosVSM, 1 + i };
+			addShader(pRenderer, &shaderVirtualPageVSM, &pShaderVirtualPageVSM[i]);
+
+			ShaderLoadDesc shaderVirtualPageMSM = {};
+			shaderVirtualPageMSM.mStages[0] = { "shadowPass.vert", &virtualPageMacro, 1 };
+			shaderVirtualPageMSM.mStages[1] = { "mapMSM.frag", screenDepthMacrosMSM, 1 + i };
+			addShader(pRenderer, &shaderVirtualPageMSM, &pShaderVirtualPageMSM[i]);
+		}
+
+
+		// Camera depth for the shadow mask, no pixel shader
+		ShaderLoadDesc shaderDepthPrepass = {};
+		shaderDepthPrepass.mStages[0] = { "basic.vert", NULL, 0 };
+		addShader(pRenderer, &shaderDepthPrepass, &pShaderDepthPrepass);
+
+		// Directional shadow evaluated at reduced resolution
+		ShaderMacro shadowMaskMacros[] = { { "HALF_PRECISION", "1" }, { "MSM", "1" }, momentMacroMSM };
+
+		for (uint32_t i = 0; i < gMomentEncodingCount; ++i)
+		{
+			for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+			{
+				ShaderLoadDesc shaderShadowMaskVSM = {};
+				shaderShadowMaskVSM.mStages[0] = { "shadowMask.comp", &halfMacrosVSM[1 - p], p + i };
+				addShader(pRenderer, &shaderShadowMaskVSM, &pShaderShadowMaskVSM[p][i]);
+
+				ShaderLoadDesc shaderShadowMaskMSM = {};
+				shaderShadowMaskMSM.mStages[0] = { "shadowMask.comp", &shadowMaskMacros[1 - p], p + 1 + i };
+				addShader(pRenderer, &shaderShadowMaskMSM, &pShaderShadowMaskMSM[p][i]);
+			}
+		}
+
+		for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+		{
+			ShaderLoadDesc shaderShadowMaskESM = {};
+			shaderShadowMaskESM.mStages[0] = { "shadowMask.comp", &halfMacrosESM[1 - p], p + 1 };
+			addShader(pRenderer, &shaderShadowMaskESM, &pShaderShadowMaskESM[p]);
+		}
+
+		ShaderLoadDesc shaderShadowMaskTemporal = {};
+		shaderShadowMaskTemporal.mStages[0] = { "shadowMaskTemporal.comp", NULL, 0 };
+		addShader(pRenderer, &shaderShadowMaskTemporal, &pShaderShadowMaskTemporal);
+
+		for (uint32_t i = 0; i < gMomentEncodingCount; ++i)
+		{
+			ShaderLoadDesc shaderShadowMinMaxVSM = {};
+			shaderShadowMinMaxVSM.mStages[0] = { "shadowMinMax.comp", &momentMacroVSM, i };
+			addShader(pRenderer, &shaderShadowMinMaxVSM, &pShaderShadowMinMaxVSM[i]);
+
+			ShaderLoadDesc shaderShadowMinMaxMSM = {};
+			shaderShadowMinMaxMSM.mStages[0] = { "shadowMinMax.comp", &shadowMaskMacros[1], 1 + i };
+			addShader(pRenderer, &shaderShadowMinMaxMSM, &pShaderShadowMinMaxMSM[i]);
+		}
+
+		ShaderLoadDesc shaderShadowMinMaxESM = {};
+		shaderShadowMinMaxESM.mStages[0] = { "shadowMinMax.comp", &esmMacro, 1 };
+		addShader(pRenderer, &shaderShadowMinMaxESM, &pShaderShadowMinMaxESM);
+
+		ShaderLoadDesc shaderShadowMomentMips = {};
+		shaderShadowMomentMips.mStages[0] = { "shadowMomentMips.comp", NULL, 0 };
+		addShader(pRenderer, &shaderShadowMomentMips, &pShaderShadowMomentMips);
+
+		// Sphere bounce on the GPU
+		ShaderLoadDesc shaderSceneAnimation = {};
+		shaderSceneAnimation.mStages[0] = { "sceneAnimation.comp", NULL, 0 };
+		addShader(pRenderer, &shaderSceneAnimation, &pShaderSceneAnimation);
+
+		// GPU culling, the occlusion variant tests against the Hi-Z of the depth prepass
+		ShaderLoadDesc shaderHiZ = {};
+		shaderHiZ.mStages[0] = { "hiZ.comp", NULL, 0 };
+		addShader(pRenderer, &shaderHiZ, &pShaderHiZ);
+
+		ShaderMacro cullOcclusionMacro = { "OCCLUSION", "1" };
+
+		ShaderLoadDesc shaderCullFrustum = {};
+		shaderCullFrustum.mStages[0] = { "cullObjects.comp", NULL, 0 };
+		addShader(pRenderer, &shaderCullFrustum, &pShaderCullFrustum);
+
+		ShaderLoadDesc shaderCullOcclusion = {};
+		shaderCullOcclusion.mStages[0] = { "cullObjects.comp", &cullOcclusionMacro, 1 };
+		addShader(pRenderer, &shaderCullOcclusion, &pShaderCullOcclusion);
+
+
+		SamplerDesc clampMiplessSamplerDesc = {};
+		clampMiplessSamplerDesc.mAddressU = ADDRESS_MODE_CLAMP_TO_EDGE;
+		clampMiplessSamplerDesc.mAddressV = ADDRESS_MODE_CLAMP_TO_EDGE;
+		clampMiplessSamplerDesc.mAddressW = ADDRESS_MODE_CLAMP_TO_EDGE;
+		clampMiplessSamplerDesc.mMinFilter = FILTER_LINEAR;
+		clampMiplessSamplerDesc.mMagFilter = FILTER_LINEAR;
+		clampMiplessSamplerDesc.mMipMapMode = MIPMAP_MODE_LINEAR;
+		clampMiplessSamplerDesc.mMipLodBias = 0.0f;
+		clampMiplessSamplerDesc.mMaxAnisotropy = 0.0f;
+		addSampler(pRenderer, &clampMiplessSamplerDesc, &pSamplerMipless);
+
+		SamplerDesc wrapMiplessSamplerDesc = clampMiplessSamplerDesc;
+		wrapMiplessSamplerDesc.mAddressU = ADDRESS_MODE_REPEAT;
+		wrapMiplessSamplerDesc.mAddressV = ADDRESS_MODE_REPEAT;
+		wrapMiplessSamplerDesc.mAddressW = ADDRESS_MODE_REPEAT;
+		addSampler(pRenderer, &wrapMiplessSamplerDesc, &pSamplerWrapMipless);
+
+		SamplerDesc samplerDesc = { FILTER_LINEAR,       FILTER_LINEAR,       MIPMAP_MODE_LINEAR,
+									ADDRESS_MODE_REPEAT, ADDRESS_MODE_REPEAT, ADDRESS_MODE_REPEAT };
+		addSampler(pRenderer, &samplerDesc, &pSamplerBilinear);
+
+
+		/************************************************************************/
+		// Root sigs
+		/************************************************************************/
+		const char*       pStaticSamplerNames[] = { "miplessSampler" };
+		Sampler* pStaticSamplers[] = { pSamplerMipless };
+
+		// Main render passes
+		RootSignatureDesc rootDesc = { pShaderVSM[0], SHADER_PRECISION_COUNT * gMomentEncodingCount };
+		rootDesc.mStaticSamplerCount = 1;
+		rootDesc.ppStaticSamplerNames = pStaticSamplerNames;
+		rootDesc.ppStaticSamplers = pStaticSamplers;
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureVSM);
+
+		rootDesc.ppShaders = pShaderMSM[0];
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureMSM);
+
+
+		// Shadow blur
+		Shader* pShadowBlurShaders[] = { pShaderShadowBlur[0], pShaderShadowBlur[1], pShaderShadowBlurESM };
+		rootDesc = { pShadowBlurShaders, 3 };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureShadowBlur);
+
+		// Multisampled depth is a different texture type, one layout per sample count
+		for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
+		{
+			Shader* pShadowMomentsShaders[] = {
+				pShaderShadowMomentsVSM[msaa][0], pShaderShadowMomentsVSM[msaa][1],
+				pShaderShadowMomentsMSM[msaa][0], pShaderShadowMomentsMSM[msaa][1],
+				pShaderShadowMomentsESM[msaa],
+			};
+			rootDesc = { pShadowMomentsShaders, 5 };
+			addRootSignature(pRenderer, &rootDesc, &pRootSignatureShadowMoments[msaa]);
+		}
+
+		// Shadow mapping, ESM draws with the VSM layout
+		Shader* pMapVSMShaders[] = { pShaderMapVSM[0], pShaderMapVSM[1], pShaderMapESM };
+		rootDesc = { pMapVSMShaders, 3 };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureMapVSM);
+
+		rootDesc = { pShaderMapMSM, gMomentEncodingCount };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureMapMSM);
+
+		// Shadow atlas, both techniques share one layout
+		Shader* pShadowAtlasShaders[] = { pShaderShadowAtlasVSM[0], pShaderShadowAtlasVSM[1], pShaderShadowAtlasMSM[0], pShaderShadowAtlasMSM[1] };
+		rootDesc = { pShadowAtlasShaders, 4 };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureShadowAtlas);
+
+		rootDesc = { &pShaderShadowAtlasBlur, 1 };
+		rootDesc.mStaticSamplerCount = 1;
+		rootDesc.ppStaticSamplerNames = pStaticSamplerNames;
+		rootDesc.ppStaticSamplers = pStaticSamplers;
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureShadowAtlasBlur);
+
+		// Point light shadows
+		Shader* pPointShadowShaders[] = { pShaderPointShadowVSM[0], pShaderPointShadowVSM[1], pShaderPointShadowMSM[0], pShaderPointShadowMSM[1] };
+		rootDesc = { pPointShadowShaders, 4 };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignaturePointShadow);
+
+		rootDesc = { &pShaderPointShadowBlur, 1 };
+		rootDesc.mStaticSamplerCount = 1;
+		rootDesc.ppStaticSamplerNames = pStaticSamplerNames;
+		rootDesc.ppStaticSamplers = pStaticSamplers;
+		addRootSignature(pRenderer, &rootDesc, &pRootSignaturePointShadowBlur);
+
+		// Virtual shadow pages, blurred with the atlas blur
+		Shader* pVirtualPageShaders[] = { pShaderVirtualPageVSM[0], pShaderVirtualPageVSM[1], pShaderVirtualPageMSM[0], pShaderVirtualPageMSM[1] };
+		rootDesc = { pVirtualPageShaders, 4 };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureVirtualPage);
+
+		// Depth prepass and shadow mask
+		rootDesc = { &pShaderDepthPrepass, 1 };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureDepthPrepass);
+
+		Shader* pShadowMaskShaders[] = {
+			pShaderShadowMaskVSM[0][0], pShaderShadowMaskVSM[0][1], pShaderShadowMaskMSM[0][0], pShaderShadowMaskMSM[0][1],
+			pShaderShadowMaskVSM[1][0], pShaderShadowMaskVSM[1][1], pShaderShadowMaskMSM[1][0], pShaderShadowMaskMSM[1][1],
+			pShaderShadowMaskESM[0], pShaderShadowMaskESM[1],
+		};
+		const char* pShadowMaskSamplerNames[] = { "miplessSampler", "wrapSampler" };
+		Sampler* pShadowMaskSamplers[] = { pSamplerMipless, pSamplerWrapMipless };
+		rootDesc = { pShadowMaskShaders, 10 };
+		rootDesc.mStaticSamplerCount = 2;
+		rootDesc.ppStaticSamplerNames = pShadowMaskSamplerNames;
+		rootDesc.ppStaticSamplers = pShadowMaskSamplers;
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureShadowMask);
+
+		rootDesc.ppShaders = &pShaderShadowMaskTemporal;
+		rootDesc.mShaderCount = 1;
+		rootDesc.mStaticSamplerCount = 1;
+		rootDesc.ppStaticSamplerNames = pStaticSamplerNames;
+		rootDesc.ppStaticSamplers = pStaticSamplers;
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureShadowMaskTemporal);
+
+		Shader* pShadowMinMaxShaders[] = { pShaderShadowMinMaxVSM[0], pShaderShadowMinMaxVSM[1], pShaderShadowMinMaxMSM[0], pShaderShadowMinMaxMSM[1], pShaderShadowMinMaxESM };
+		rootDesc = { pShadowMinMaxShaders, 5 };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureShadowMinMax);
+
+		rootDesc = { &pShaderShadowMomentMips, 1 };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureShadowMomentMips);
+
+		rootDesc = { &pShaderSceneAnimation, 1 };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureSceneAnimation);
+
+		// GPU culling
+		rootDesc = { &pShaderHiZ, 1 };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureHiZ);
+
+		Shader* pCullShaders[] = { pShaderCullFrustum, pShaderCullOcclusion };
+		rootDesc = { pCullShaders, 2 };
+		addRootSignature(pRenderer, &rootDesc, &pRootSignatureCull);
+
+		// Sphere draws of the cull views, only the arguments come from the GPU
+		IndirectArgumentDescriptor cullArgumentDesc = {};
+		cullArgumentDesc.mType = INDIRECT_DRAW;
+
+		CommandSignatureDesc cullSignatureDesc = {};
+		cullSignatureDesc.pRootSignature = NULL;
+		cullSignatureDesc.pArgDescs = &cullArgumentDesc;
+		cullSignatureDesc.mIndirectArgCount = 1;
+		cullSignatureDesc.mPacked = true;
+		addIndirectCommandSignature(pRenderer, &cullSignatureDesc, &pCommandSignatureCull);
+
+		addOffscreenPipelines();
+
+
+		/************************************************************************/
+		// Descriptor Sets
+		/************************************************************************/
+
+		// Rendering sets, the per frame ones and those of the depth prepass and
+		// shadow mask once per view, see getViewSetIndex
+		DescriptorSetDesc desc = { pRootSignatureVSM, DESCRIPTOR_UPDATE_FREQ_NONE, 1 };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetVSM[0]);
+		desc = { pRootSignatureVSM, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount * SHADOW_VIEW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetVSM[1]);
+		desc = { pRootSignatureVSM, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, SCENE_DRAW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetVSM[2]);
+
+		// Rendering sets
+		desc = { pRootSignatureMSM, DESCRIPTOR_UPDATE_FREQ_NONE, 1 };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMSM[0]);
+		desc = { pRootSignatureMSM, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount * SHADOW_VIEW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMSM[1]);
+		desc = { pRootSignatureMSM, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, SCENE_DRAW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMSM[2]);
+
+
+		// Shadow pass set
+		desc = { pRootSignatureMapVSM, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMapVSM[0]);
+		desc = { pRootSignatureMapVSM, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, SCENE_DRAW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMapVSM[1]);
+
+		desc = { pRootSignatureMapMSM, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMapMSM[0]);
+		desc = { pRootSignatureMapMSM, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, SCENE_DRAW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetMapMSM[1]);
+
+
+
+		// Shadow blur set
+		desc = { pRootSignatureShadowBlur, DESCRIPTOR_UPDATE_FREQ_NONE, gMaxBlurs * 2 * gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowBlur[0]);
+		desc = { pRootSignatureShadowBlur, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, gMaxBlurs * 2 * gImageCount};
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowBlur[1]);
+
+		for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
+		{
+			desc = { pRootSignatureShadowMoments[msaa], DESCRIPTOR_UPDATE_FREQ_NONE, gImageCount };
+			addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowMoments[msaa]);
+		}
+
+		// Shadow atlas sets
+		desc = { pRootSignatureShadowAtlas, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowAtlas[0]);
+		desc = { pRootSignatureShadowAtlas, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, SCENE_DRAW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowAtlas[1]);
+
+		desc = { pRootSignatureShadowAtlasBlur, DESCRIPTOR_UPDATE_FREQ_NONE, 2 * gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowAtlasBlur);
+
+		// Point shadow sets
+		desc = { pRootSignaturePointShadow, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetPointShadow[0]);
+		desc = { pRootSignaturePointShadow, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, SCENE_DRAW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetPointShadow[1]);
+
+		desc = { pRootSignaturePointShadowBlur, DESCRIPTOR_UPDATE_FREQ_NONE, 2 * gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetPointShadowBlur);
+
+		// Virtual shadow map sets
+		desc = { pRootSignatureVirtualPage, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetVirtualPage[0]);
+		desc = { pRootSignatureVirtualPage, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, SCENE_DRAW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetVirtualPage[1]);
+
+		desc = { pRootSignatureShadowAtlasBlur, DESCRIPTOR_UPDATE_FREQ_NONE, 2 * gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetVirtualShadowBlur);
+
+		// Depth prepass and shadow mask sets
+		desc = { pRootSignatureDepthPrepass, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount * SHADOW_VIEW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetDepthPrepass[0]);
+		desc = { pRootSignatureDepthPrepass, DESCRIPTOR_UPDATE_FREQ_PER_DRAW, SCENE_DRAW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetDepthPrepass[1]);
+
+		desc = { pRootSignatureShadowMask, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount * SHADOW_VIEW_COUNT };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowMask);
+		desc = { pRootSignatureShadowMaskTemporal, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowMaskTemporal);
+		// One per pyramid level
+		desc = { pRootSignatureShadowMinMax, DESCRIPTOR_UPDATE_FREQ_NONE, gMaxShadowMinMaxLevels * gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowMinMax);
+		desc = { pRootSignatureShadowMomentMips, DESCRIPTOR_UPDATE_FREQ_NONE, gMaxShadowMomentLevels * gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetShadowMomentMips);
+
+		desc = { pRootSignatureSceneAnimation, DESCRIPTOR_UPDATE_FREQ_NONE, 1 };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetSceneAnimation);
+
+		// GPU culling sets, the Hi-Z target is handed out by the frame graph every frame
+		desc = { pRootSignatureHiZ, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetHiZ);
+		desc = { pRootSignatureCull, DESCRIPTOR_UPDATE_FREQ_PER_FRAME, gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetCull[0]);
+		desc = { pRootSignatureCull, DESCRIPTOR_UPDATE_FREQ_NONE, gImageCount };
+		addDescriptorSet(pRenderer, &desc, &pDescriptorSetCull[1]);
+
+
+		// Generate sphere vertex buffer
+		float* pSpherePoints;
+		generateSpherePoints(&pSpherePoints, &gNumberOfSpherePoints, gSphereResolution, gSphereDiameter);
+
+		// Generate plane vertex buffer
+		float* pPlanePoints;
+		generateCuboidPoints(&pPlanePoints, &gNumberOfPlanePoints,
+			gPlaneSize.getX(),
+			gPlaneSize.getY(),
+			gPlaneSize.getZ(),
+			vec3(0.0f));
+
+		float* pLightObjPoints;
+		generateCuboidPoints(&pLightObjPoints, &gNumberOfLightObjectPoints, 3.0f, 3.0f, 3.0f, vec3(0.0f));
+
+		// vertex data
+		// Common among all
+		BufferLoadDesc vbDesc = {};
+		vbDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_VERTEX_BUFFER;
+		vbDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_ONLY;
+
+		// Sphere
+		uint64_t       sphereDataSize = gNumberOfSpherePoints * sizeof(float);
+		vbDesc.mDesc.mSize = sphereDataSize;
+		vbDesc.pData = pSpherePoints;
+		vbDesc.ppBuffer = &pBufferVertexSphere;
+		addResource(&vbDesc, NULL);
+
+		// Plane 
+		uint64_t       planeDataSize = gNumberOfPlanePoints * sizeof(float);
+		vbDesc.mDesc.mSize = planeDataSize;
+		vbDesc.pData = pPlanePoints;
+		vbDesc.ppBuffer = &pBufferVertexPlane;
+		addResource(&vbDesc, NULL);
+
+		// Light object
+		uint64_t       lightObjectDataSize = gNumberOfLightObjectPoints * sizeof(float);
+		vbDesc.mDesc.mSize = lightObjectDataSize;
+		vbDesc.pData = pLightObjPoints;
+		vbDesc.ppBuffer = &pBufferVertexLightObject;;
+		addResource(&vbDesc, NULL);
+
+
+		// Object range of every draw
+		BufferLoadDesc ubObjectDesc = {};
+		ubObjectDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		ubObjectDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+		ubObjectDesc.mDesc.mSize = sizeof(UniformObjectDrawData);
+		ubObjectDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+		ubObjectDesc.pData = NULL;
+		for (uint32_t i = 0; i < SCENE_DRAW_COUNT; ++i)
+		{
+			ubObjectDesc.ppBuffer = &pBufferUniformObjectDraw[i];
+			addResource(&ubObjectDesc, NULL);
+		}
+
+		// Object transforms are written every frame, materials when the scene is generated
+		BufferLoadDesc objectDesc = {};
+		objectDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_BUFFER;
+		objectDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+		objectDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+		objectDesc.mDesc.mFirstElement = 0;
+		objectDesc.mDesc.mElementCount = gMaxSceneObjects;
+		objectDesc.pData = NULL;
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			objectDesc.mDesc.mStructStride = sizeof(vec4);
+			objectDesc.mDesc.mSize = sizeof(vec4) * gMaxSceneObjects;
+			objectDesc.ppBuffer = &pBufferObjectTransforms[i];
+			addResource(&objectDesc, NULL);
+
+			objectDesc.mDesc.mStructStride = sizeof(ObjectMaterial);
+			objectDesc.mDesc.mSize = sizeof(ObjectMaterial) * gMaxSceneObjects;
+			objectDesc.ppBuffer = &pBufferObjectMaterials[i];
+			addResource(&objectDesc, NULL);
+		}
+
+		// What the passes read, written by a copy and the sphere animation
+		BufferLoadDesc sceneDesc = {};
+		sceneDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_BUFFER | DESCRIPTOR_TYPE_RW_BUFFER;
+		sceneDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_ONLY;
+		sceneDesc.mDesc.mStartState = RESOURCE_STATE_SHADER_RESOURCE;
+		sceneDesc.mDesc.mFirstElement = 0;
+		sceneDesc.mDesc.mElementCount = gMaxSceneObjects;
+		sceneDesc.mDesc.mStructStride = sizeof(vec4);
+		sceneDesc.mDesc.mSize = sizeof(vec4) * gMaxSceneObjects;
+		sceneDesc.ppBuffer = &pBufferSceneTransforms;
+		addResource(&sceneDesc, NULL);
+
+		sceneDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_RW_BUFFER;
+		sceneDesc.mDesc.mStartState = RESOURCE_STATE_UNORDERED_ACCESS;
+		sceneDesc.mDesc.mElementCount = gMaxSceneSpheres;
+		sceneDesc.mDesc.mStructStride = sizeof(SphereAnimation);
+		sceneDesc.mDesc.mSize = sizeof(SphereAnimation) * gMaxSceneSpheres;
+		sceneDesc.ppBuffer = &pBufferSphereAnimation;
+		addResource(&sceneDesc, NULL);
+
+		// Visible lists and indirect sphere draws of the cull views
+		BufferLoadDesc cullDesc = {};
+		cullDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_BUFFER | DESCRIPTOR_TYPE_RW_BUFFER;
+		cullDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_ONLY;
+		cullDesc.mDesc.mStartState = RESOURCE_STATE_SHADER_RESOURCE;
+		cullDesc.mDesc.mFirstElement = 0;
+		cullDesc.mDesc.mElementCount = CULL_VIEW_COUNT * gMaxSceneSpheres;
+		cullDesc.mDesc.mStructStride = sizeof(uint32_t);
+		cullDesc.mDesc.mSize = sizeof(uint32_t) * CULL_VIEW_COUNT * gMaxSceneSpheres;
+		cullDesc.ppBuffer = &pBufferVisibleObjects;
+		addResource(&cullDesc, NULL);
+
+		cullDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_INDIRECT_BUFFER | DESCRIPTOR_TYPE_RW_BUFFER;
+		cullDesc.mDesc.mStartState = RESOURCE_STATE_INDIRECT_ARGUMENT;
+		cullDesc.mDesc.mElementCount = CULL_VIEW_COUNT * sizeof(IndirectDrawArguments) / sizeof(uint32_t);
+		cullDesc.mDesc.mSize = sizeof(IndirectDrawArguments) * CULL_VIEW_COUNT;
+		cullDesc.ppBuffer = &pBufferCullArguments;
+		addResource(&cullDesc, NULL);
+
+		// Every view starts the frame drawing no spheres
+		IndirectDrawArguments cullArgumentsReset[CULL_VIEW_COUNT] = {};
+		for (uint32_t i = 0; i < CULL_VIEW_COUNT; ++i)
+			cullArgumentsReset[i].mVertexCount = gNumberOfSpherePoints / 6;
+
+		cullDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_UNDEFINED;
+		cullDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+		cullDesc.mDesc.mStartState = RESOURCE_STATE_UNDEFINED;
+		cullDesc.mDesc.mElementCount = 0;
+		cullDesc.mDesc.mStructStride = 0;
+		cullDesc.pData = cullArgumentsReset;
+		cullDesc.ppBuffer = &pBufferCullArgumentsReset;
+		addResource(&cullDesc, NULL);
+
+		// Uniform buffer for camera data
+		BufferLoadDesc ubCamDesc = {};
+		ubCamDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		ubCamDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+		ubCamDesc.mDesc.mSize = sizeof(UniformCamData);
+		ubCamDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+		ubCamDesc.pData = NULL;
+
+		// One per view and frame
+		for (uint32_t view = 0; view < SHADOW_VIEW_COUNT; ++view)
+		{
+			for (uint32_t i = 0; i < gImageCount; ++i)
+			{
+				ubCamDesc.ppBuffer = &pBufferUniformCamera[view][i];
+				addResource(&ubCamDesc, NULL);
+			}
+		}
+
+		// Uniform buffer for light data
+		BufferLoadDesc ubLightDesc = {};
+		ubLightDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		ubLightDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+		ubLightDesc.mDesc.mSize = sizeof(UniformLightData);
+		ubLightDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+		ubLightDesc.pData = NULL;
+
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			ubLightDesc.ppBuffer = &pBufferUniformLight[i];
+			addResource(&ubLightDesc, NULL);
+		}
+
+		// Uniform buffer for the atlas lights
+		ubLightDesc.mDesc.mSize = sizeof(UniformAtlasLightData);
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			ubLightDesc.ppBuffer = &pBufferUniformShadowAtlas[i];
+			addResource(&ubLightDesc, NULL);
+		}
+
+		// Uniform buffer for the point lights
+		ubLightDesc.mDesc.mSize = sizeof(UniformPointLightData);
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			ubLightDesc.ppBuffer = &pBufferUniformPointLights[i];
+			addResource(&ubLightDesc, NULL);
+		}
+
+		// Uniform buffer for the shadow mask pass
+		ubLightDesc.mDesc.mSize = sizeof(UniformShadowMaskData);
+		for (uint32_t view = 0; view < SHADOW_VIEW_COUNT; ++view)
+		{
+			for (uint32_t i = 0; i < gImageCount; ++i)
+			{
+				ubLightDesc.ppBuffer = &pBufferUniformShadowMask[view][i];
+				addResource(&ubLightDesc, NULL);
+			}
+		}
+
+		// Uniform buffer for the culling passes
+		ubLightDesc.mDesc.mSize = sizeof(UniformCullData);
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			ubLightDesc.ppBuffer = &pBufferUniformCull[i];
+			addResource(&ubLightDesc, NULL);
+		}
+
+		// Tiles re-rendered in a frame, read by the atlas blur
+		BufferLoadDesc atlasTileDesc = {};
+		atlasTileDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_BUFFER;
+		atlasTileDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+		atlasTileDesc.mDesc.mSize = sizeof(gShadowAtlasDirtyTiles);
+		atlasTileDesc.mDesc.mFirstElement = 0;
+		atlasTileDesc.mDesc.mElementCount = gMaxAtlasLights;
+		atlasTileDesc.mDesc.mStructStride = sizeof(ShadowAtlasTile);
+		atlasTileDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+		atlasTileDesc.pData = NULL;
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			atlasTileDesc.ppBuffer = &pBufferShadowAtlasTiles[i];
+			addResource(&atlasTileDesc, NULL);
+		}
+
+		// Virtual shadow map: page table and rendered slots per frame, the
+		// requests of the shadow mask and their readback copies
+		BufferLoadDesc virtualPageDesc = atlasTileDesc;
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			virtualPageDesc.ppBuffer = &pBufferVirtualPageTiles[i];
+			addResource(&virtualPageDesc, NULL);
+		}
+
+		virtualPageDesc.mDesc.mSize = sizeof(uint32_t) * gVirtualShadowPageCount;
+		virtualPageDesc.mDesc.mElementCount = gVirtualShadowPageCount;
+		virtualPageDesc.mDesc.mStructStride = sizeof(uint32_t);
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			virtualPageDesc.ppBuffer = &pBufferVirtualPageTable[i];
+			addResource(&virtualPageDesc, NULL);
+		}
+
+		// Zeroed, no frame stamps its requests with 0
+		virtualPageDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_RW_BUFFER;
+		virtualPageDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_ONLY;
+		virtualPageDesc.mDesc.mStartState = RESOURCE_STATE_UNORDERED_ACCESS;
+		virtualPageDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_NONE;
+		virtualPageDesc.mForceReset = true;
+		virtualPageDesc.ppBuffer = &pBufferVirtualPageRequests;
+		addResource(&virtualPageDesc, NULL);
+
+		// Telemetry queries, resolved into readback buffers and read once the frame's fence signalled
+		QueryPoolDesc timestampPoolDesc = {};
+		timestampPoolDesc.mType = QUERY_TYPE_TIMESTAMP;
+		timestampPoolDesc.mQueryCount = gMaxTelemetryScopes * 2;
+		QueryPoolDesc statPoolDesc = {};
+		statPoolDesc.mType = QUERY_TYPE_PIPELINE_STATISTICS;
+		statPoolDesc.mQueryCount = gMaxTelemetryStatQueries;
+
+		BufferLoadDesc readbackDesc = {};
+		readbackDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_UNDEFINED;
+		readbackDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_TO_CPU;
+		readbackDesc.mDesc.mStartState = RESOURCE_STATE_COPY_DEST;
+		readbackDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+		readbackDesc.pData = NULL;
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			addQueryPool(pRenderer, &timestampPoolDesc, &pTelemetryTimestampPool[i]);
+			addQueryPool(pRenderer, &statPoolDesc, &pTelemetryStatPool[i]);
+
+			readbackDesc.mDesc.mSize = sizeof(uint64_t) * gMaxTelemetryScopes * 2;
+			readbackDesc.ppBuffer = &pTelemetryTimestampReadback[i];
+			addResource(&readbackDesc, NULL);
+			readbackDesc.mDesc.mSize = sizeof(PipelineStatistics) * gMaxTelemetryStatQueries;
+			readbackDesc.ppBuffer = &pTelemetryStatReadback[i];
+			addResource(&readbackDesc, NULL);
+			readbackDesc.mDesc.mSize = sizeof(uint32_t) * gVirtualShadowPageCount;
+			readbackDesc.ppBuffer = &pBufferVirtualPageReadback[i];
+			addResource(&readbackDesc, NULL);
+		}
+		getTimestampFrequency(pGraphicsQueue, &gTelemetryTimestampFrequency);
+
+
+		// Init input system
+		if (!initInputSystem(pWindow))
+			return false;
+
+		// Initialize microprofiler and it's UI.
+		initProfiler();
+
+		// Gpu profiler can only be added after initProfile.
+		gGpuProfileToken = addGpuProfiler(pRenderer, pGraphicsQueue, "Graphics");
+
+
+		// Create UI
+		if (!gAppUI.Init(pRenderer))
+			return false;
+
+		gAppUI.LoadFont("TitilliumText/TitilliumText-Bold.otf");
+
+		/************************************************************************/
+		// Camera
+		/************************************************************************/
+		CameraMotionParameters camParameters{ 100.0f, 150.0f, 300.0f };
+		vec3                   camPos{ 0.0f, 5.0f, -10.0f };
+		vec3                   lookAt{ 0.0f, 0.0f, 0.0f };
+
+		pCameraController = createFpsCameraController(camPos, lookAt);
+
+		pCameraController->setMotionParameters(camParameters);
+
+		/************************************************************************/
+		// GUI
+		/************************************************************************/
+		GuiDesc guiDesc = {};
+		guiDesc.mStartPosition = vec2(mSettings.mWidth * 0.01f, mSettings.mHeight * 0.25f);
+		pGui = gAppUI.AddGuiComponent(GetName(), &guiDesc);
+#if !defined(TARGET_IOS)
+		pGui->AddWidget(CheckboxWidget("Toggle VSync\t\t\t\t\t", &gToggleVSync));
+#endif
+
+		SliderFloat3Widget lightVal("Light Intensity", (float3*)&gDataLight.mLightValue,
+			float3(0.0f), float3(100.0f), float3(0.5f));
+		SliderFloat3Widget lightAmb("Light Ambient", (float3*)&gDataLight.mLightAmbient,
+			float3(0.0f), float3(1.0f));
+		//SliderFloat3Widget lightPos("Light Position", (float3*)&gDataLight.mLightPosition,
+		//	float3(-200.0f, -200.0f, -200.0f), float3(200.0f, 200.0f, 200.0f));
+		//SliderFloatWidget lightOrbitDist("Light Orbit Distance", (float*)&gLightOrbitDistance,
+		//	1.0f, 50.0f);
+		SliderFloatWidget lightRad("Light Radius", (float*)(&gLightSphereCoords), 50.1f, 200.0f);
+		SliderFloatWidget lightAng("Light Angle", ((float*)&gLightSphereCoords) + 1, 20.0f, 160.0f);
+		SliderFloatWidget lightAz("Light Azimuth", ((float*)&gLightSphereCoords) + 2, -179.9f, 179.9f);
+
+
+		//SliderFloatWidget lightOrbitSpeed("Light Orbit Speed", (float*)&gLightOrbitSpeed,
+		//	0.0f, 10.0f);
+
+		SliderFloatWidget bounceSpeed("Bounce Speed", &gBounceSpeed, 0.0f, 20.0f);
+		SliderUintWidget sceneSpheres("Scene Spheres", &gSceneSphereCount, 0, gMaxSceneSpheres);
+		SliderUintWidget jobWorkers("Job Worker Threads", &gJobActiveWorkers, 0, gJobWorkerCount);
+		CheckboxWidget gpuAnimation("GPU Sphere Animation", &gSceneGpuAnimation);
+		CheckboxWidget gpuCulling("GPU Culling", &gGpuCulling);
+		CheckboxWidget depthOnlyShadows("Depth-Only Shadow Pass", &gDepthOnlyShadows);
+		const char* shadowMsaaLabels[SHADOW_MSAA_COUNT] = { "Shadow MSAA Off", "Shadow MSAA 4x (Half Resolution)", "Shadow MSAA 8x (Half Resolution)" };
+		//CheckboxWidget debugDepth("Debug Depth", (bool*)&gShadowViews[SHADOW_VIEW_MAIN].mCamera.mDebugFlags[0]);
+		//CheckboxWidget debugSF("Debug Shadow Frustum", (bool*)&gShadowViews[SHADOW_VIEW_MAIN].mCamera.mDebugFlags[1]);
+		SliderUintWidget blurPasses("Gaussian Filter Shadow Passes", &gBlurCount, 0, gMaxBlurs);
+		SliderUintWidget shadowMaskScale("Shadow Mask Downsample", &gShadowMaskScale, 1, 4);
+		CheckboxWidget shadowMaskTemporal("Temporal Shadow Filter", &gShadowMaskTemporal);
+		SliderUintWidget shadowMaskTaps("Shadow Kernel Taps Per Frame", &gShadowMaskTaps, 1, 4);
+		SliderFloatWidget shadowMaskBlend("Temporal Shadow Blend", &gShadowMaskTemporalBlend, 0.02f, 1.0f);
+		CheckboxWidget shadowMinMax("Shadow Min/Max Early-Out", &gShadowMinMax);
+		CheckboxWidget shadowWarp("Light Space Perspective Shadow Map", &gShadowWarp);
+		CheckboxWidget toroidalShadowMap("Toroidal Shadow Map (Follow Camera)", &gToroidalShadowMap);
+		CheckboxWidget contactHardening("Contact Hardening Shadows", &gContactHardening);
+		SliderFloatWidget lightAngularSize("Light Angular Size (deg)", &gLightAngularSizeDeg, 0.1f, 10.0f, 0.1f);
+		SliderUintWidget maxPenumbra("Max Penumbra (texels)", &gMaxPenumbraTexels, 4, 1u << (gMaxShadowMomentLevels - 1), 4);
+		CheckboxWidget minimap("Minimap", &gMinimap);
+		SliderUintWidget minimapSize("Minimap Size", &gMinimapSize, 64, 512, 32);
+		CheckboxWidget memoryReport("Show Memory Report", &gShowMemoryReport);
+		SliderFloatWidget memoryBudget("Shadow Memory Budget (MB)", &gMemoryBudgetMB, 16.0f, 512.0f, 16.0f);
+		SliderUintWidget idleFrames("Release Idle Shadow Targets After (frames)", &gTransientIdleFrames, gImageCount, 1000);
+		SliderUintWidget atlasLights("Shadowed Spot Lights", &gShadowAtlasLightCount, 0, gMaxAtlasLights);
+		SliderFloatWidget atlasOrbitSpeed("Spot Light Orbit Speed", &gShadowAtlasOrbitSpeed, 0.0f, 2.0f);
+		SliderUintWidget pointLights("Shadowed Point Lights", &gPointLightCount, 0, gMaxPointLights);
+		SliderFloatWidget pointOrbitSpeed("Point Light Orbit Speed", &gPointLightOrbitSpeed, 0.0f, 2.0f);
+		SliderFloatWidget updateBudget("Shadow Update Budget (Mtexels)", &gShadowUpdateBudgetMTexels, 0.5f, 16.0f, 0.5f);
+		SliderUintWidget directionalInterval("Directional Shadow Update Interval", &gDirectionalUpdateInterval, 1, 16);
+		CheckboxWidget virtualShadowMap("Virtual Shadow Map", &gVirtualShadowMap);
+		SliderUintWidget virtualShadowBudget("Virtual Shadow Pages Per Frame", &gVirtualShadowPageBudget, 1, gMaxVirtualShadowPageUpdates);
+		SliderUintWidget nearInterval("Near Light Update Interval", &gNearLightUpdateInterval, 1, 16);
+		SliderUintWidget farInterval("Far Light Update Interval", &gFarLightUpdateInterval, 1, 16);
+		CheckboxWidget telemetry("Export Telemetry", &gTelemetryEnabled);
+		SliderFloatWidget telemetryInterval("Telemetry Interval (s)", &gTelemetryIntervalSec, 1.0f, 60.0f, 1.0f);
+		SliderUintWidget benchmarkFrames("Benchmark Frames Per Configuration", &gBenchmarkFrames, 60, gMaxBenchmarkFrames);
+		ButtonWidget runBenchmark("Run Benchmark");
+		runBenchmark.pOnEdited = benchmarkRequest;
+
+		ButtonWidget runMomentPrecision("Run Moment Precision Test");
+		runMomentPrecision.pOnEdited = momentPrecisionRequest;
+		ButtonWidget runHalfPrecision("Run Half Precision Test");
+		runHalfPrecision.pOnEdited = halfPrecisionRequest;
+
+
+		pGui->AddWidget(lightAmb);
+		pGui->AddWidget(lightVal);
+		//pGui->AddWidget(lightOrbitDist);
+		//pGui->AddWidget(lightOrbitSpeed);
+		pGui->AddWidget(lightRad);
+		pGui->AddWidget(lightAng);
+		pGui->AddWidget(lightAz);
+		pGui->AddWidget(bounceSpeed);
+		pGui->AddWidget(sceneSpheres);
+		pGui->AddWidget(jobWorkers);
+		pGui->AddWidget(gpuAnimation);
+		pGui->AddWidget(gpuCulling);
+		pGui->AddWidget(depthOnlyShadows);
+		for (int i = 0; i < SHADOW_MSAA_COUNT; ++i)
+		{
+			pGui->AddWidget(RadioButtonWidget(shadowMsaaLabels[i], &gShadowMsaa, i));
+		}
+		pGui->AddWidget(blurPasses);
+		pGui->AddWidget(shadowMaskScale);
+		pGui->AddWidget(shadowMaskTemporal);
+		pGui->AddWidget(shadowMaskTaps);
+		pGui->AddWidget(shadowMaskBlend);
+		pGui->AddWidget(shadowMinMax);
+		pGui->AddWidget(shadowWarp);
+		pGui->AddWidget(toroidalShadowMap);
+		pGui->AddWidget(contactHardening);
+		pGui->AddWidget(lightAngularSize);
+		pGui->AddWidget(maxPenumbra);
+		pGui->AddWidget(minimap);
+		pGui->AddWidget(minimapSize);
+		pGui->AddWidget(memoryReport);
+		pGui->AddWidget(memoryBudget);
+		pGui->AddWidget(idleFrames);
+		pGui->AddWidget(atlasLights);
+		pGui->AddWidget(atlasOrbitSpeed);
+		pGui->AddWidget(pointLights);
+		pGui->AddWidget(pointOrbitSpeed);
+		pGui->AddWidget(updateBudget);
+		pGui->AddWidget(directionalInterval);
+		pGui->AddWidget(virtualShadowMap);
+		pGui->AddWidget(virtualShadowBudget);
+		pGui->AddWidget(nearInterval);
+		pGui->AddWidget(farInterval);
+		pGui->AddWidget(telemetry);
+		pGui->AddWidget(telemetryInterval);
+		pGui->AddWidget(benchmarkFrames);
+		pGui->AddWidget(runBenchmark);
+		pGui->AddWidget(runMomentPrecision);
+		pGui->AddWidget(runHalfPrecision);
+		//pGui->AddWidget(debugDepth);
+		//pGui->AddWidget(debugSF);
+
+		const char* labels[SHADOW_TECHNIQUE_COUNT] = {
+			"Variance Shadow Mapping",
+			"Moment Shadow Mapping",
+			"Exponential Shadow Mapping"
+		};
+
+		for (int i = 0; i < SHADOW_TECHNIQUE_COUNT; ++i)
+		{
+			pGui->AddWidget(RadioButtonWidget(labels[i], &gShadowTechnique, i));
+		}
+
+		// Moment storage, the persistent shadow targets follow the format
+		for (int i = 0; i < VSM_FORMAT_COUNT; ++i)
+		{
+			pGui->AddWidget(RadioButtonWidget(gFormatNamesVSM[i], &gFormatVSM, i));
+		}
+
+		for (int i = 0; i < MSM_FORMAT_COUNT; ++i)
+		{
+			pGui->AddWidget(RadioButtonWidget(gFormatNamesMSM[i], &gFormatMSM, i));
+		}
+
+		for (int i = 0; i < ESM_FORMAT_COUNT; ++i)
+		{
+			pGui->AddWidget(RadioButtonWidget(gFormatNamesESM[i], &gFormatESM, i));
+		}
+		pGui->AddWidget(CheckboxWidget("Half Precision Shading", &gHalfPrecision));
+
+		const char* telemetryLabels[] = {
+			"Telemetry CSV",
+			"Telemetry JSON"
+		};
+
+		for (int i = 0; i < 2; ++i)
+		{
+			pGui->AddWidget(RadioButtonWidget(telemetryLabels[i], &gTelemetryFormat, i));
+		}
+
+
+
+		// App Actions
+		InputActionDesc actionDesc = { InputBindings::BUTTON_FULLSCREEN, [](InputActionContext* ctx) { toggleFullscreen(((IApp*)ctx->pUserData)->pWindow); return true; }, this };
+		addInputAction(&actionDesc);
+		actionDesc = { InputBindings::BUTTON_EXIT, [](InputActionContext* ctx) { requestShutdown(); return true; } };
 		addInputAction(&actionDesc);
 		actionDesc =
 		{
-			InputBindings::BUTTON_ANY, [](InputActionContext* ctx)
+			InputBindings::BUTTON_ANY, [](InputActionContext* ctx)
+			{
+				bool capture = gAppUI.OnButton(ctx->mBinding, ctx->mBool, ctx->pPosition);
+				setEnableCaptureInput(capture && INPUT_ACTION_PHASE_CANCELED != ctx->mPhase);
+				return true;
+			}, this
+		};
+		addInputAction(&actionDesc);
+		typedef bool(*CameraInputHandler)(InputActionContext* ctx, uint32_t index);
+		static CameraInputHandler onCameraInput = [](InputActionContext* ctx, uint32_t index)
+		{
+			if (!gAppUI.IsFocused() && *ctx->pCaptured)
+			{
+				gVirtualJoystick.OnMove(index, ctx->mPhase != INPUT_ACTION_PHASE_CANCELED, ctx->pPosition);
+				index ? pCameraController->onRotate(ctx->mFloat2) : pCameraController->onMove(ctx->mFloat2);
+			}
+			return true;
+		};
+		actionDesc = { InputBindings::FLOAT_RIGHTSTICK, [](InputActionContext* ctx) { return onCameraInput(ctx, 1); }, NULL, 20.0f, 200.0f, 1.0f };
+		addInputAction(&actionDesc);
+		actionDesc = { InputBindings::FLOAT_LEFTSTICK, [](InputActionContext* ctx) { return onCameraInput(ctx, 0); }, NULL, 20.0f, 200.0f, 1.0f };
+		addInputAction(&actionDesc);
+		actionDesc = { InputBindings::BUTTON_NORTH, [](InputActionContext* ctx) { pCameraController->resetView(); return true; } };
+		addInputAction(&actionDesc);
+
+		tf_free(pSpherePoints);
+		tf_free(pLightObjPoints);
+		tf_free(pPlanePoints);
+
+		waitForAllResourceLoads();
+		GenerateScene();
+
+		for (int i = 1; i < IApp::argc; ++i)
+		{
+			if (!strcmp(IApp::argv[i], "-benchmark"))
+			{
+				gBenchmarkRequested = true;
+				gBenchmarkExitWhenDone = true;
+			}
+			else if (!strcmp(IApp::argv[i], "-momentprecision"))
+			{
+				gMomentPrecisionRequested = true;
+			}
+			else if (!strcmp(IApp::argv[i], "-halfprecision"))
+			{
+				gHalfPrecisionRequested = true;
+			}
+		}
+
+
+		return true;
+	}
+
+	void Exit()
+	{
+		waitQueueIdle(pGraphicsQueue);
+
+		jobExit();
+
+		exitInputSystem();
+
+		destroyCameraController(pCameraController);
+
+		gVirtualJoystick.Exit();
+
+		gAppUI.Exit();
+
+		// Exit profile
+		exitProfiler();
+
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			removeResource(pBufferUniformLight[i]);
+			for (uint32_t view = 0; view < SHADOW_VIEW_COUNT; ++view)
+			{
+				removeResource(pBufferUniformCamera[view][i]);
+				removeResource(pBufferUniformShadowMask[view][i]);
+			}
+			removeResource(pBufferUniformShadowAtlas[i]);
+			removeResource(pBufferShadowAtlasTiles[i]);
+			removeResource(pBufferUniformPointLights[i]);
+			removeResource(pBufferUniformCull[i]);
+			removeResource(pTelemetryTimestampReadback[i]);
+			removeResource(pTelemetryStatReadback[i]);
+			removeResource(pBufferVirtualPageTable[i]);
+			removeResource(pBufferVirtualPageTiles[i]);
+			removeResource(pBufferVirtualPageReadback[i]);
+			removeQueryPool(pRenderer, pTelemetryTimestampPool[i]);
+			removeQueryPool(pRenderer, pTelemetryStatPool[i]);
+		}
+
+		removeOffscreenPipelines();
+		fgRemovePhysicalTargets(&gFrameGraph);
+
+		for (int i = 0; i < 3; ++i)
+		{
+			removeDescriptorSet(pRenderer, pDescriptorSetVSM[i]);
+			removeDescriptorSet(pRenderer, pDescriptorSetMSM[i]);
+
+			if (i < 2)
+			{
+				removeDescriptorSet(pRenderer, pDescriptorSetMapVSM[i]);
+				removeDescriptorSet(pRenderer, pDescriptorSetMapMSM[i]);
+				removeDescriptorSet(pRenderer, pDescriptorSetShadowBlur[i]);
+				removeDescriptorSet(pRenderer, pDescriptorSetShadowAtlas[i]);
+				removeDescriptorSet(pRenderer, pDescriptorSetPointShadow[i]);
+				removeDescriptorSet(pRenderer, pDescriptorSetVirtualPage[i]);
+				removeDescriptorSet(pRenderer, pDescriptorSetDepthPrepass[i]);
+			}
+		}
+		for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
+			removeDescriptorSet(pRenderer, pDescriptorSetShadowMoments[msaa]);
+		removeDescriptorSet(pRenderer, pDescriptorSetShadowAtlasBlur);
+		removeDescriptorSet(pRenderer, pDescriptorSetPointShadowBlur);
+		removeDescriptorSet(pRenderer, pDescriptorSetVirtualShadowBlur);
+		removeDescriptorSet(pRenderer, pDescriptorSetShadowMask);
+		removeDescriptorSet(pRenderer, pDescriptorSetShadowMaskTemporal);
+		removeDescriptorSet(pRenderer, pDescriptorSetShadowMinMax);
+		removeDescriptorSet(pRenderer, pDescriptorSetShadowMomentMips);
+		removeDescriptorSet(pRenderer, pDescriptorSetSceneAnimation);
+		removeDescriptorSet(pRenderer, pDescriptorSetHiZ);
+		removeDescriptorSet(pRenderer, pDescriptorSetCull[0]);
+		removeDescriptorSet(pRenderer, pDescriptorSetCull[1]);
+
+		removeResource(pBufferVertexPlane);
+		removeResource(pBufferVertexSphere);
+		removeResource(pBufferVertexLightObject);
+		for (uint32_t i = 0; i < SCENE_DRAW_COUNT; ++i)
+		{
+			removeResource(pBufferUniformObjectDraw[i]);
+		}
+
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			removeResource(pBufferObjectTransforms[i]);
+			removeResource(pBufferObjectMaterials[i]);
+		}
+		removeResource(pBufferSceneTransforms);
+		removeResource(pBufferSphereAnimation);
+		removeResource(pBufferVisibleObjects);
+		removeResource(pBufferCullArguments);
+		removeResource(pBufferCullArgumentsReset);
+		removeResource(pBufferVirtualPageRequests);
+		removeIndirectCommandSignature(pRenderer, pCommandSignatureCull);
+
+
+		removeSampler(pRenderer, pSamplerBilinear);
+		removeSampler(pRenderer, pSamplerMipless);
+		removeSampler(pRenderer, pSamplerWrapMipless);
+		for (uint32_t i = 0; i < gMomentEncodingCount; ++i)
+		{
+			for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+			{
+				removeShader(pRenderer, pShaderVSM[p][i]);
+				removeShader(pRenderer, pShaderMSM[p][i]);
+				removeShader(pRenderer, pShaderShadowMaskVSM[p][i]);
+				removeShader(pRenderer, pShaderShadowMaskMSM[p][i]);
+			}
+			removeShader(pRenderer, pShaderMapVSM[i]);
+			removeShader(pRenderer, pShaderMapMSM[i]);
+			removeShader(pRenderer, pShaderShadowAtlasVSM[i]);
+			removeShader(pRenderer, pShaderShadowAtlasMSM[i]);
+			removeShader(pRenderer, pShaderPointShadowVSM[i]);
+			removeShader(pRenderer, pShaderPointShadowMSM[i]);
+			removeShader(pRenderer, pShaderVirtualPageVSM[i]);
+			removeShader(pRenderer, pShaderVirtualPageMSM[i]);
+			for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
+			{
+				removeShader(pRenderer, pShaderShadowMomentsVSM[msaa][i]);
+				removeShader(pRenderer, pShaderShadowMomentsMSM[msaa][i]);
+			}
+		}
+		for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+		{
+			removeShader(pRenderer, pShaderShadowBlur[p]);
+			removeShader(pRenderer, pShaderShadowMaskESM[p]);
+		}
+		for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
+			removeShader(pRenderer, pShaderShadowMomentsESM[msaa]);
+		removeShader(pRenderer, pShaderMapESM);
+		removeShader(pRenderer, pShaderShadowBlurESM);
+		removeShader(pRenderer, pShaderShadowMinMaxESM);
+		removeShader(pRenderer, pShaderShadowMomentMips);
+		removeShader(pRenderer, pShaderShadowDepth);
+		removeShader(pRenderer, pShaderShadowAtlasBlur);
+		removeShader(pRenderer, pShaderPointShadowBlur);
+		removeShader(pRenderer, pShaderDepthPrepass);
+		removeShader(pRenderer, pShaderShadowMaskTemporal);
+		for (uint32_t i = 0; i < gMomentEncodingCount; ++i)
+		{
+			removeShader(pRenderer, pShaderShadowMinMaxVSM[i]);
+			removeShader(pRenderer, pShaderShadowMinMaxMSM[i]);
+		}
+		removeShader(pRenderer, pShaderSceneAnimation);
+		removeShader(pRenderer, pShaderHiZ);
+		removeShader(pRenderer, pShaderCullFrustum);
+		removeShader(pRenderer, pShaderCullOcclusion);
+		removeRootSignature(pRenderer, pRootSignatureVSM);
+		removeRootSignature(pRenderer, pRootSignatureMSM);
+		removeRootSignature(pRenderer, pRootSignatureMapVSM);
+		removeRootSignature(pRenderer, pRootSignatureMapMSM);
+		removeRootSignature(pRenderer, pRootSignatureShadowBlur);
+		for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
+			removeRootSignature(pRenderer, pRootSignatureShadowMoments[msaa]);
+		removeRootSignature(pRenderer, pRootSignatureShadowAtlas);
+		removeRootSignature(pRenderer, pRootSignatureShadowAtlasBlur);
+		removeRootSignature(pRenderer, pRootSignaturePointShadow);
+		removeRootSignature(pRenderer, pRootSignaturePointShadowBlur);
+		removeRootSignature(pRenderer, pRootSignatureVirtualPage);
+		removeRootSignature(pRenderer, pRootSignatureDepthPrepass);
+		removeRootSignature(pRenderer, pRootSignatureShadowMask);
+		removeRootSignature(pRenderer, pRootSignatureShadowMaskTemporal);
+		removeRootSignature(pRenderer, pRootSignatureShadowMinMax);
+		removeRootSignature(pRenderer, pRootSignatureShadowMomentMips);
+		removeRootSignature(pRenderer, pRootSignatureSceneAnimation);
+		removeRootSignature(pRenderer, pRootSignatureHiZ);
+		removeRootSignature(pRenderer, pRootSignatureCull);
+
+		for (uint32_t i = 0; i < gImageCount; ++i)
+		{
+			removeFence(pRenderer, pFencesRenderComplete[i]);
+			removeSemaphore(pRenderer, pSemaphoresRenderComplete[i]);
+
+			removeCmd(pRenderer, pCmds[i]);
+			removeCmdPool(pRenderer, pCmdPools[i]);
+		}
+		removeSemaphore(pRenderer, pSemaphoreImageAcquired);
+
+		exitResourceLoaderInterface(pRenderer);
+		removeQueue(pRenderer, pGraphicsQueue);
+		removeRenderer(pRenderer);
+
+	}
+
+	bool Load()
+	{
+		if (!addSwapChain())
+			return false;
+
+		if (!addRenderTargets())
+			return false;
+
+		if (!gAppUI.Load(pSwapChain->ppRenderTargets, 1))
+			return false;
+
+		if (!gVirtualJoystick.Load(pSwapChain->ppRenderTargets[0]))
+			return false;
+
+		loadProfilerUI(&gAppUI, mSettings.mWidth, mSettings.mHeight);
+
+		//layout and pipeline for sphere draw
+		VertexLayout vertexLayout = {};
+		vertexLayout.mAttribCount = 2;
+		vertexLayout.mAttribs[0].mSemantic = SEMANTIC_POSITION;
+		vertexLayout.mAttribs[0].mFormat = TinyImageFormat_R32G32B32_SFLOAT;
+		vertexLayout.mAttribs[0].mBinding = 0;
+		vertexLayout.mAttribs[0].mLocation = 0;
+		vertexLayout.mAttribs[0].mOffset = 0;
+		vertexLayout.mAttribs[1].mSemantic = SEMANTIC_NORMAL;
+		vertexLayout.mAttribs[1].mFormat = TinyImageFormat_R32G32B32_SFLOAT;
+		vertexLayout.mAttribs[1].mBinding = 0;
+		vertexLayout.mAttribs[1].mLocation = 1;
+		vertexLayout.mAttribs[1].mOffset = 3 * sizeof(float);
+
+		RasterizerStateDesc basicRasterizerStateDesc = {};
+		basicRasterizerStateDesc.mCullMode = CULL_MODE_NONE;
+
+		DepthStateDesc depthStateDesc = {};
+		depthStateDesc.mDepthTest = true;
+		depthStateDesc.mDepthWrite = true;
+		depthStateDesc.mDepthFunc = CMP_LEQUAL;
+
+		PipelineDesc desc = {};
+		desc.mType = PIPELINE_TYPE_GRAPHICS;
+
+		// MAIN RENDER
+		desc.mGraphicsDesc = {};
+		GraphicsPipelineDesc& pipelineVSM = desc.mGraphicsDesc;
+		pipelineVSM.mPrimitiveTopo = PRIMITIVE_TOPO_TRI_LIST;
+		pipelineVSM.mRenderTargetCount = 1;
+		pipelineVSM.pDepthState = &depthStateDesc;
+		pipelineVSM.pColorFormats = &pSwapChain->ppRenderTargets[0]->mFormat;
+		pipelineVSM.mSampleCount = pSwapChain->ppRenderTargets[0]->mSampleCount;
+		pipelineVSM.mSampleQuality = pSwapChain->ppRenderTargets[0]->mSampleQuality;
+		pipelineVSM.mDepthStencilFormat = pRenderTargetDepthBuffer->mFormat;
+		pipelineVSM.pRootSignature = pRootSignatureVSM;
+		pipelineVSM.pVertexLayout = &vertexLayout;
+		pipelineVSM.pRasterizerState = &basicRasterizerStateDesc;
+		for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+		{
+			for (uint32_t i = 0; i < VSM_FORMAT_COUNT; ++i)
+			{
+				pipelineVSM.pShaderProgram = pShaderVSM[p][getMomentEncodingVSM(i)];
+				addPipeline(pRenderer, &desc, &pPipelineVSM[p][i]);
+			}
+		}
+
+		GraphicsPipelineDesc& pipelineMSM = desc.mGraphicsDesc;
+		pipelineMSM.pRootSignature = pRootSignatureMSM;
+		for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+		{
+			for (uint32_t i = 0; i < MSM_FORMAT_COUNT; ++i)
+			{
+				pipelineMSM.pShaderProgram = pShaderMSM[p][getMomentEncodingMSM(i)];
+				addPipeline(pRenderer, &desc, &pPipelineMSM[p][i]);
+			}
+		}
+
+		// DEPTH PREPASS
+		desc.mGraphicsDesc = {};
+		GraphicsPipelineDesc& depthPrepassPipelineSettings = desc.mGraphicsDesc;
+		depthPrepassPipelineSettings.mPrimitiveTopo = PRIMITIVE_TOPO_TRI_LIST;
+		depthPrepassPipelineSettings.mRenderTargetCount = 0;
+		depthPrepassPipelineSettings.pDepthState = &depthStateDesc;
+		depthPrepassPipelineSettings.mSampleCount = pRenderTargetDepthBuffer->mSampleCount;
+		depthPrepassPipelineSettings.mSampleQuality = 0;
+		depthPrepassPipelineSettings.mDepthStencilFormat = pRenderTargetDepthBuffer->mFormat;
+		depthPrepassPipelineSettings.pRootSignature = pRootSignatureDepthPrepass;
+		depthPrepassPipelineSettings.pShaderProgram = pShaderDepthPrepass;
+		depthPrepassPipelineSettings.pVertexLayout = &vertexLayout;
+		depthPrepassPipelineSettings.pRasterizerState = &basicRasterizerStateDesc;
+		addPipeline(pRenderer, &desc, &pPipelineDepthPrepass);
+
+		
+
+		PrepareDescriptorSets();
+
+		return true;
+	}
+
+	void Unload()
+	{
+		waitQueueIdle(pGraphicsQueue);
+
+		unloadProfilerUI();
+		gAppUI.Unload();
+
+		gVirtualJoystick.Unload();
+
+		for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+		{
+			for (uint32_t i = 0; i < VSM_FORMAT_COUNT; ++i)
+				removePipeline(pRenderer, pPipelineVSM[p][i]);
+			for (uint32_t i = 0; i < MSM_FORMAT_COUNT; ++i)
+				removePipeline(pRenderer, pPipelineMSM[p][i]);
+		}
+		removePipeline(pRenderer, pPipelineDepthPrepass);
+
+		removeSwapChain(pRenderer, pSwapChain);
+
+		// Cached shadow maps do not depend on the window size and stay
+		// resident, window sized history is reallocated by name on mismatch
+		removeRenderTarget(pRenderer, pRenderTargetDepthBuffer);
+		fgRemoveTransientTargets(&gFrameGraph);
+	}
+
+	void Update(float deltaTime)
+	{
+		telemetryBeginCpuFrame();
+		telemetryBeginCpuScope("Update");
+		jobBeginFrame();
+
+		if (gBenchmarkRequested)
+		{
+			gBenchmarkRequested = false;
+			StartBenchmark();
+		}
+
+		if (gMomentPrecisionRequested)
+		{
+			gMomentPrecisionRequested = false;
+			momentPrecisionRun();
+		}
+
+		if (gHalfPrecisionRequested)
+		{
+			gHalfPrecisionRequested = false;
+			halfPrecisionRun();
+		}
+
+		// Frame time independent animation, every run renders the same frames
+		if (gBenchmarkActive)
+			deltaTime = gBenchmarkTimestep;
+
+#if !defined(TARGET_IOS)
+		if (pSwapChain->mEnableVsync != gToggleVSync)
+		{
+			waitQueueIdle(pGraphicsQueue);
+			gFrameIndex = 0;
+			::toggleVSync(pRenderer, &pSwapChain);
+		}
+#endif
+
+		updateInputSystem(mSettings.mWidth, mSettings.mHeight);
+		pCameraController->update(deltaTime);
+
+		// Settings edited in the UI change the shadow cache descs, apply them
+		// before the scheduler checks which caches are still resident
+		gAppUI.Update(deltaTime);
+
+		if (gBenchmarkActive)
+		{
+			vec3 cameraPosition, cameraTarget;
+			benchmarkSamplePath(gBenchmarkTime, &cameraPosition, &cameraTarget, &gLightSphereCoords);
+			pCameraController->moveTo(cameraPosition);
+			pCameraController->lookAt(cameraTarget);
+			gBenchmarkTime += deltaTime;
+		}
+
+		mat4 viewMat = pCameraController->getViewMatrix();
+
+		const float aspectInverse = (float)mSettings.mHeight / (float)mSettings.mWidth;
+		const float horizontal_fov = PI / 2.0f;
+		mat4        projMat = mat4::perspective(horizontal_fov, aspectInverse, 1.0f, 1000.0f);
+		ShadowView& mainView = gShadowViews[SHADOW_VIEW_MAIN];
+		mainView.mCamera.mProjectView = projMat * viewMat;
+		mainView.mCamera.mCamPos = vec4(pCameraController->getViewPosition(), 0.0f);
+		UpdateShadowViews();
+
+		// bounce the spheres yes, on the GPU or on the workers while the lights update
+		if (gSceneSphereCount != gSceneGeneratedSphereCount)
+			GenerateScene();
+		if (gSceneGpuAnimation && !gSceneGpuAnimationActive)
+			UploadSphereAnimation();
+		gSceneGpuAnimationActive = gSceneGpuAnimation;
+
+		gSceneAnimationTime += deltaTime * gBounceSpeed * 0.4f;
+		gSceneAnimationConstants = { deltaTime, gBounceSpeed, gSceneFirstSphere, gSceneGeneratedSphereCount };
+		gSceneAnimationJob = JOB_INVALID;
+		if (!gSceneGpuAnimationActive)
+		{
+			gSceneAnimationJob = jobCreateParallelFor(sceneAnimateSpheres, NULL, gSceneGeneratedSphereCount, gSceneJobGrain);
+			jobSubmit(gSceneAnimationJob);
+		}
+
+
+		// Light updates
+		vec3 diff = gDataLight.mLightValue.getXYZ();
+		diff = normalize(diff);
+		gDataLightObject.mDiffuse = vec4(diff, 0.0f); // 0.0f means not calculated by lighting
+
+		SetShadowLight(&gShadowRenderer, SphericalToCartesian(gLightSphereCoords), mainView);
+
+		telemetryBeginCpuScope("Shadow Views");
+		SubmitShadowCasters(&gShadowRenderer, mainView, projMat.getCol1().getY(), deltaTime);
+		telemetryEndCpuScope();
+
+		// The light view is the transform the shadow map renders with this frame.
+		// Only the main view is culled on the GPU.
+		cullExtractPlanes(mainView.mCamera.mProjectView, gDataCull.mCameraPlanes);
+		cullExtractPlanes(gDataLight.mLightViewProj, gDataCull.mLightPlanes);
+		gDataCull.mCameraProjView = mainView.mCamera.mProjectView;
+		gDataCull.mSphereRange[0] = gSceneFirstSphere;
+		gDataCull.mSphereRange[1] = gSceneGeneratedSphereCount;
+		gDataCull.mSphereRange[2] = gMaxSceneSpheres;
+		RenderTargetDesc hiZDesc = getHiZDesc();
+		gDataCull.mDepthSize[0] = pRenderTargetDepthBuffer->mWidth;
+		gDataCull.mDepthSize[1] = pRenderTargetDepthBuffer->mHeight;
+		gDataCull.mDepthSize[2] = hiZDesc.mWidth;
+		gDataCull.mDepthSize[3] = hiZDesc.mHeight;
+		gDataCull.mProjParams = vec4(gSphereDiameter, projMat.getCol0().getX(), projMat.getCol1().getY(), 0.0f);
+		const float depthScale = projMat.getCol2().getZ();
+		const float depthBias = projMat.getCol3().getZ();
+		gDataCull.mDepthParams = vec4(depthScale, depthBias, -depthBias / depthScale, 0.0f);
+
+		telemetryEndCpuScope();
+	}
+
+	void Draw()
+	{
+		telemetryBeginCpuScope("Draw");
+
+		uint32_t swapchainImageIndex;
+		acquireNextImage(pRenderer, pSwapChain, pSemaphoreImageAcquired, NULL, &swapchainImageIndex);
+
+		RenderTarget* pRenderTarget = pSwapChain->ppRenderTargets[swapchainImageIndex];
+		Semaphore*    pSemaphoreRenderComplete = pSemaphoresRenderComplete[gFrameIndex];
+		Fence*        pFenceRenderComplete = pFencesRenderComplete[gFrameIndex];
+
+		// Stall if CPU is running "Swap Chain Buffer Count" frames ahead of GPU
+		FenceStatus fenceStatus;
+		getFenceStatus(pRenderer, pFenceRenderComplete, &fenceStatus);
+		if (fenceStatus == FENCE_STATUS_INCOMPLETE)
+		{
+			telemetryBeginCpuScope("Wait For GPU");
+			waitForFences(pRenderer, 1, &pFenceRenderComplete);
+			telemetryEndCpuScope();
+		}
+		telemetryCollectGpuFrame();
+
+		// Reset cmd pool for this frame
+		resetCmdPool(pRenderer, pCmdPools[gFrameIndex]);
+
+		/************************************************************************/
+		// Update Uniform Buffers
+		/************************************************************************/
+		telemetryBeginCpuScope("Update Uniforms");
+
+		// The workers write the sphere transforms while the constants are uploaded,
+		// unless the spheres are animated on the GPU
+		BufferUpdateDesc transformUpdate = { pBufferObjectTransforms[gFrameIndex] };
+		beginUpdateResource(&transformUpdate);
+		vec4* pTransforms = (vec4*)transformUpdate.pMappedData;
+		pTransforms[SCENE_DRAW_PLANE] = vec4(gPlanePosition, 1.0f);
+		pTransforms[SCENE_DRAW_LIGHT_OBJECT] = vec4(gDataLight.mLightPosition.getXYZ(), 1.0f);
+		const uint32_t cpuSphereCount = gSceneGpuAnimationActive ? 0 : gSceneGeneratedSphereCount;
+		JobHandle transformJob = jobCreateParallelFor(sceneWriteSphereTransforms, pTransforms + gSceneFirstSphere, cpuSphereCount, gSceneJobGrain);
+		jobAddDependency(transformJob, gSceneAnimationJob);
+		jobSubmit(transformJob);
+
+		BufferUpdateDesc lightCbv = { pBufferUniformLight[gFrameIndex] };
+		beginUpdateResource(&lightCbv);
+		*(UniformLightData*)lightCbv.pMappedData = gDataLight;
+		endUpdateResource(&lightCbv, NULL);
+
+		BufferUpdateDesc atlasLightCbv = { pBufferUniformShadowAtlas[gFrameIndex] };
+		beginUpdateResource(&atlasLightCbv);
+		*(UniformAtlasLightData*)atlasLightCbv.pMappedData = gDataShadowAtlasLights;
+		endUpdateResource(&atlasLightCbv, NULL);
+
+		BufferUpdateDesc pointLightCbv = { pBufferUniformPointLights[gFrameIndex] };
+		beginUpdateResource(&pointLightCbv);
+		*(UniformPointLightData*)pointLightCbv.pMappedData = gDataPointLights;
+		endUpdateResource(&pointLightCbv, NULL);
+
+		UpdateShadowMaskHistory();
+		UpdateVirtualShadowPages();
+
+		// Camera and shadow mask constants of every view bound this frame
+		for (uint32_t view = 0; view < SHADOW_VIEW_COUNT; ++view)
+		{
+			ShadowView& shadowView = gShadowViews[view];
+			if (!shadowView.mActive)
+				continue;
+
+			UpdateShadowMaskUniforms(&shadowView);
+
+			BufferUpdateDesc camCbv = { pBufferUniformCamera[view][gFrameIndex] };
+			beginUpdateResource(&camCbv);
+			*(UniformCamData*)camCbv.pMappedData = shadowView.mCamera;
+			endUpdateResource(&camCbv, NULL);
+
+			BufferUpdateDesc shadowMaskCbv = { pBufferUniformShadowMask[view][gFrameIndex] };
+			beginUpdateResource(&shadowMaskCbv);
+			*(UniformShadowMaskData*)shadowMaskCbv.pMappedData = shadowView.mShadowMask;
+			endUpdateResource(&shadowMaskCbv, NULL);
+		}
+
+		BufferUpdateDesc cullCbv = { pBufferUniformCull[gFrameIndex] };
+		beginUpdateResource(&cullCbv);
+		*(UniformCullData*)cullCbv.pMappedData = gDataCull;
+		endUpdateResource(&cullCbv, NULL);
+
+		gPrevProjectView = gShadowViews[SHADOW_VIEW_MAIN].mCamera.mProjectView;
+		gPrevCamPos = gShadowViews[SHADOW_VIEW_MAIN].mCamera.mCamPos;
+
+		// Follows the light color, every other material is written by GenerateScene
+		BufferUpdateDesc lightObjectUpdate = { pBufferObjectMaterials[gFrameIndex], sizeof(ObjectMaterial) * SCENE_DRAW_LIGHT_OBJECT, sizeof(ObjectMaterial) };
+		beginUpdateResource(&lightObjectUpdate);
+		*(ObjectMaterial*)lightObjectUpdate.pMappedData = gDataLightObject;
+		endUpdateResource(&lightObjectUpdate, NULL);
+
+		jobWait(transformJob);
+		endUpdateResource(&transformUpdate, NULL);
+		telemetryEndCpuScope();
+
+		/************************************************************************/
+		// Begin Render 
+		/************************************************************************/
+		Cmd* cmd = pCmds[gFrameIndex];
+		beginCmd(cmd);
+
+		/************************************************************************/
+		// Draw Objects
+		/************************************************************************/
+		cmdBeginGpuFrameProfile(cmd, gGpuProfileToken);
+		telemetryBeginGpuFrame(cmd);
+
+		telemetryBeginCpuScope("Frame Graph Build");
+		gFrameGraph.mIdleFrames = gTransientIdleFrames;
+		gFrameGraph.mBudget = (uint64_t)(gMemoryBudgetMB * 1024.0f * 1024.0f);
+		fgBeginFrame(&gFrameGraph);
+
+		FrameGraphResource swapchain = fgImport(&gFrameGraph, "Swapchain", pRenderTarget,
+			RESOURCE_STATE_PRESENT, RESOURCE_STATE_PRESENT);
+		FrameGraphResource depthBuffer = fgImport(&gFrameGraph, "Depth RT", pRenderTargetDepthBuffer,
+			RESOURCE_STATE_UNDEFINED, RESOURCE_STATE_UNDEFINED);
+
+		// The main view's depth comes first, the culling of its main pass reads it
+		addDepthPrepass(&gFrameGraph, &gShadowViews[SHADOW_VIEW_MAIN], depthBuffer);
+		FrameGraphResource hiZ = gGpuCulling ? addHiZPass(&gFrameGraph, depthBuffer) : FRAME_GRAPH_INVALID;
+
+		BuildShadows(&gShadowRenderer, &gFrameGraph);
+
+		// Every other view reuses the depth buffer once the view before it is drawn
+		for (uint32_t view = 0; view < SHADOW_VIEW_COUNT; ++view)
+		{
+			ShadowView* pView = &gShadowViews[view];
+			if (!pView->mActive)
+				continue;
+
+			if (view != SHADOW_VIEW_MAIN)
+				addDepthPrepass(&gFrameGraph, pView, depthBuffer);
+			FrameGraphResource shadowMask = BindShadowsForView(&gShadowRenderer, &gFrameGraph, pView, depthBuffer);
+			addMainPass(&gFrameGraph, &gShadowRenderer, pView, shadowMask, (view == SHADOW_VIEW_MAIN) ? hiZ : FRAME_GRAPH_INVALID,
+				swapchain, depthBuffer);
+		}
+		addUIPass(&gFrameGraph, swapchain);
+		telemetryEndCpuScope();
+
+		telemetryBeginCpuScope("Frame Graph Compile");
+		fgCompile(&gFrameGraph);
+		telemetryEndCpuScope();
+
+		telemetryBeginCpuScope("Command Recording");
+		recordSceneAnimation(cmd);
+		recordFrustumCulling(cmd);
+		fgExecute(&gFrameGraph, cmd);
+		telemetryEndCpuScope();
+
+		telemetryEndGpuFrame(cmd);
+		cmdEndGpuFrameProfile(cmd, gGpuProfileToken);
+		endCmd(cmd);
+
+		telemetryBeginCpuScope("Submit And Present");
+
+		QueueSubmitDesc submitDesc = {};
+		submitDesc.mCmdCount = 1;
+		submitDesc.mSignalSemaphoreCount = 1;
+		submitDesc.mWaitSemaphoreCount = 1;
+		submitDesc.ppCmds = &cmd;
+		submitDesc.ppSignalSemaphores = &pSemaphoreRenderComplete;
+		submitDesc.ppWaitSemaphores = &pSemaphoreImageAcquired;
+		submitDesc.pSignalFence = pFenceRenderComplete;
+		queueSubmit(pGraphicsQueue, &submitDesc);
+		QueuePresentDesc presentDesc = {};
+		presentDesc.mIndex = swapchainImageIndex;
+		presentDesc.mWaitSemaphoreCount = 1;
+		presentDesc.pSwapChain = pSwapChain;
+		presentDesc.ppWaitSemaphores = &pSemaphoreRenderComplete;
+		presentDesc.mSubmitDone = true;
+		queuePresent(pGraphicsQueue, &presentDesc);
+		telemetryEndCpuScope();
+		flipProfiler();
+
+		gFrameIndex = (gFrameIndex + 1) % gImageCount;
+
+		if (gBenchmarkActive)
+			UpdateBenchmark();
+
+		telemetryEndCpuScope();
+		telemetryEndCpuFrame();
+		telemetryUpdateExport();
+	}
+
+	const char* GetName() { return "09b_MomentShadows"; }
+
+private:
+
+	vec3 SphericalToCartesian(const vec3& coord)
+	{
+		float radius = coord[0];
+		float theta = Vectormath::degToRad(coord[1]);
+		float phi = Vectormath::degToRad(coord[2]);
+
+		float a = radius * cosf(theta);
+
+		vec3 result;
+		result[0] = a * cosf(phi);
+		result[1] = radius * sinf(theta);
+		result[2] = a * sinf(phi);
+
+		return result;
+	}
+
+	float RandomZeroOne()
+	{
+		return ((float)rand() / RAND_MAX);
+	}
+
+
+	void StartBenchmark()
+	{
+		if (gBenchmarkActive)
+			return;
+
+		gBenchmarkSavedSettings.mTechnique = gShadowTechnique;
+		gBenchmarkSavedSettings.mBlurCount = gBlurCount;
+		gBenchmarkSavedSettings.mShadowMapSize = gShadowMapData.mSize;
+		gBenchmarkSavedSettings.mLightSphereCoords = gLightSphereCoords;
+		gBenchmarkSavedSettings.mVSync = gToggleVSync;
+
+		LOGF(LogLevel::eINFO, "Benchmark: %u configurations, %u frames each after %u warmup frames",
+			gBenchmarkConfigCount, gBenchmarkFrames, gBenchmarkWarmupFrames);
+
+		gBenchmarkActive = true;
+		gToggleVSync = false;
+		gBenchmarkConfig = 0;
+		BeginBenchmarkConfig();
+	}
+
+	// Every configuration replays the same scene from the start of the path
+	void BeginBenchmarkConfig()
+	{
+		BenchmarkConfig config = getBenchmarkConfig(gBenchmarkConfig);
+		gShadowTechnique = config.mTechnique;
+		gBlurCount = config.mBlurCount;
+		gShadowMapData.mSize[0] = config.mShadowMapSize;
+		gShadowMapData.mSize[1] = config.mShadowMapSize;
+
+		GenerateScene();
+		gSceneAnimationTime = 0.0f;
+		gShadowAtlasOrbit = 0.0f;
+		gPointLightOrbit = 0.0f;
+
+		gBenchmarkTime = 0.0f;
+		gBenchmarkFrame = 0;
+		gBenchmarkSampleCount = 0;
+	}
+
+	// Called at the end of every frame while the benchmark runs
+	void UpdateBenchmark()
+	{
+		int64_t now = getUSec();
+		if (gBenchmarkFrame >= gBenchmarkWarmupFrames && gBenchmarkSampleCount < gMaxBenchmarkFrames)
+			gBenchmarkFrameTimes[gBenchmarkSampleCount++] = (uint32_t)(now - gBenchmarkLastFrameTime);
+		gBenchmarkLastFrameTime = now;
+
+		if (++gBenchmarkFrame < gBenchmarkWarmupFrames + gBenchmarkFrames)
+			return;
+
+		ReportBenchmarkConfig();
+		if (++gBenchmarkConfig < gBenchmarkConfigCount)
+		{
+			BeginBenchmarkConfig();
+			return;
+		}
+
+		gShadowTechnique = gBenchmarkSavedSettings.mTechnique;
+		gBlurCount = gBenchmarkSavedSettings.mBlurCount;
+		gShadowMapData.mSize = gBenchmarkSavedSettings.mShadowMapSize;
+		gLightSphereCoords = gBenchmarkSavedSettings.mLightSphereCoords;
+		gToggleVSync = gBenchmarkSavedSettings.mVSync;
+		gBenchmarkActive = false;
+		LOGF(LogLevel::eINFO, "Benchmark: finished");
+
+		if (gBenchmarkExitWhenDone)
+			requestShutdown();
+	}
+
+	// Logs the percentiles and appends them to a CSV file in the log directory
+	void ReportBenchmarkConfig()
+	{
+		BenchmarkConfig config = getBenchmarkConfig(gBenchmarkConfig);
+		const uint32_t count = gBenchmarkSampleCount;
+		if (!count)
+			return;
+
+		qsort(gBenchmarkFrameTimes, count, sizeof(uint32_t), benchmarkCompareFrameTimes);
+		uint64_t total = 0;
+		for (uint32_t i = 0; i < count; ++i)
+			total += gBenchmarkFrameTimes[i];
+
+		const char* pTechnique = gShadowTechniqueNames[config.mTechnique];
+		float average = total / (1000.0f * count);
+		float p50 = benchmarkPercentile(gBenchmarkFrameTimes, count, 0.50f);
+		float p90 = benchmarkPercentile(gBenchmarkFrameTimes, count, 0.90f);
+		float p95 = benchmarkPercentile(gBenchmarkFrameTimes, count, 0.95f);
+		float p99 = benchmarkPercentile(gBenchmarkFrameTimes, count, 0.99f);
+		float maximum = gBenchmarkFrameTimes[count - 1] / 1000.0f;
+
+		LOGF(LogLevel::eINFO, "Benchmark: %s, %u blurs, %ux%u: avg %.3f ms, p50 %.3f ms, p90 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms",
+			pTechnique, config.mBlurCount, config.mShadowMapSize, config.mShadowMapSize, average, p50, p90, p95, p99, maximum);
+
+		// The first configuration of a run starts a new file
+		FileStream stream = {};
+		if (!fsOpenStreamFromPath(RD_LOG, "VarianceMomentShadows_benchmark.csv", gBenchmarkConfig ? FM_APPEND : FM_WRITE, &stream))
+			return;
+
+		if (!gBenchmarkConfig)
+			fsPrintToStream(&stream, "technique,blur_count,shadow_map_size,frames,avg_ms,p50_ms,p90_ms,p95_ms,p99_ms,max_ms\n");
+		fsPrintToStream(&stream, "%s,%u,%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+			pTechnique, config.mBlurCount, config.mShadowMapSize, count, average, p50, p90, p95, p99, maximum);
+		fsCloseStream(&stream);
+	}
+
+	// Lays out the camera views of this frame. The main view fills the
+	// screen, the minimap sits in the top right corner over it.
+	void UpdateShadowViews()
+	{
+		const uint32_t width = pRenderTargetDepthBuffer->mWidth;
+		const uint32_t height = pRenderTargetDepthBuffer->mHeight;
+
+		ShadowView& mainView = gShadowViews[SHADOW_VIEW_MAIN];
+		mainView.mActive = true;
+		mainView.mViewport[0] = 0;
+		mainView.mViewport[1] = 0;
+		mainView.mViewport[2] = width;
+		mainView.mViewport[3] = height;
+		mainView.mPrepassCull = CULL_VIEW_CAMERA;
+		mainView.mMainCull = CULL_VIEW_OCCLUSION;
+		mainView.mTemporal = gShadowMaskTemporal;
+
+		// Not GPU culled, the cull views only cover the main camera and the light
+		const uint32_t margin = 16;
+		const uint32_t size = min(gMinimapSize, min(width, height) / 2);
+		ShadowView& minimap = gShadowViews[SHADOW_VIEW_MINIMAP];
+		minimap.mActive = gMinimap;
+		minimap.mViewport[0] = width - size - margin;
+		minimap.mViewport[1] = margin;
+		minimap.mViewport[2] = size;
+		minimap.mViewport[3] = size;
+		minimap.mPrepassCull = CULL_VIEW_NONE;
+		minimap.mMainCull = CULL_VIEW_NONE;
+		minimap.mTemporal = false;
+		shadowViewUpdateMinimap(&minimap, mainView.mCamera.mCamPos.getXYZ());
+
+		for (uint32_t view = 0; view < SHADOW_VIEW_COUNT; ++view)
+		{
+			ShadowView& shadowView = gShadowViews[view];
+			shadowView.mCamera.mViewportSize = vec4((float)shadowView.mViewport[2], (float)shadowView.mViewport[3], 0.0f, 0.0f);
+			shadowView.mMaskPassData.mView = view;
+			shadowView.mMainPassData.mView = view;
+		}
+	}
+
+	// Light space perspective shadow map (LiSPSM). Seen from the light, a
+	// perspective along the view direction gives receivers close to the camera
+	// more texels than distant ones. Light rays stay parallel to the depth axis,
+	// the warp only changes the texel sizes. The frustum bounds the part of the
+	// view inside of the uniform map, the uniform map's depth range keeps every
+	// caster. Fails when the view looks along the light, no warp helps then.
+	static bool getWarpedLightViewProj(const mat4& lightView, const ShadowView& view, float depthNear, float depthFar, mat4* pLightViewProj)
+	{
+		const mat4 invProjectView = inverse(view.mCamera.mProjectView);
+		const vec3 camPos = view.mCamera.mCamPos.getXYZ();
+		const vec4 center = invProjectView * vec4(0.0f, 0.0f, 0.5f, 1.0f);
+		const vec3 viewDir = normalize(center.getXYZ() / center.getW() - camPos);
+
+		// Turn the light view about the light direction so the view direction points up
+		const vec4 viewDirLight = lightView * vec4(viewDir, 0.0f);
+		const float sinGamma = sqrtf(viewDirLight.getX() * viewDirLight.getX() + viewDirLight.getY() * viewDirLight.getY());
+		if (sinGamma < 0.05f)
+			return false;
+		const float upX = viewDirLight.getX() / sinGamma;
+		const float upY = viewDirLight.getY() / sinGamma;
+		const mat4 warpView = mat4(vec4(upY, upX, 0.0f, 0.0f), vec4(-upX, upY, 0.0f, 0.0f), vec4(0.0f, 0.0f, 1.0f, 0.0f), vec4(0.0f, 0.0f, 0.0f, 1.0f)) * lightView;
+		const mat4 invLightView = inverse(lightView);
+
+		// Region of the uniform map, the view is cut to its farthest point
+		const float extent = gDirectionalShadowExtent;
+		vec2 sceneMin = vec2(1e30f);
+		vec2 sceneMax = vec2(-1e30f);
+		float farDistance = 0.0f;
+		for (uint32_t i = 0; i < 8; ++i)
+		{
+			vec4 corner = vec4((i & 1) ? extent : -extent, (i & 2) ? extent : -extent, (i & 4) ? depthFar : depthNear, 1.0f);
+			vec4 warped = warpView * invLightView * corner;
+			sceneMin = vec2(min(sceneMin.getX(), warped.getX()), min(sceneMin.getY(), warped.getY()));
+			sceneMax = vec2(max(sceneMax.getX(), warped.getX()), max(sceneMax.getY(), warped.getY()));
+			farDistance = max(farDistance, dot((invLightView * corner).getXYZ() - camPos, viewDir));
+		}
+
+		// Corners of the view between its near plane and the cut
+		vec2 bodyMin = vec2(1e30f);
+		vec2 bodyMax = vec2(-1e30f);
+		float nearDistance = 0.0f;
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			const float x = (i & 1) ? 1.0f : -1.0f;
+			const float y = (i & 2) ? 1.0f : -1.0f;
+			vec4 nearCorner = invProjectView * vec4(x, y, 0.0f, 1.0f);
+			vec4 farCorner = invProjectView * vec4(x, y, 1.0f, 1.0f);
+			vec3 nearPoint = nearCorner.getXYZ() / nearCorner.getW();
+			vec3 ray = farCorner.getXYZ() / farCorner.getW() - camPos;
+			nearDistance = dot(nearPoint - camPos, viewDir);
+			const float rayDistance = dot(ray, viewDir);
+			vec3 farPoint = camPos + ray * (clamp(farDistance, 2.0f * nearDistance, rayDistance) / rayDistance);
+
+			vec3 points[2] = { nearPoint, farPoint };
+			for (uint32_t j = 0; j < 2; ++j)
+			{
+				vec4 warped = warpView * vec4(points[j], 1.0f);
+				bodyMin = vec2(min(bodyMin.getX(), warped.getX()), min(bodyMin.getY(), warped.getY()));
+				bodyMax = vec2(max(bodyMax.getX(), warped.getX()), max(bodyMax.getY(), warped.getY()));
+			}
+		}
+		const float minX = max(bodyMin.getX(), sceneMin.getX());
+		const float maxX = min(bodyMax.getX(), sceneMax.getX());
+		const float minY = max(bodyMin.getY(), sceneMin.getY());
+		const float maxY = min(bodyMax.getY(), sceneMax.getY());
+		if (minX >= maxX || minY >= maxY)
+			return false;
+
+		// Eye of the warp below the bounds, at the distance that spreads the
+		// aliasing error evenly over the view depth
+		farDistance = max(farDistance, 2.0f * nearDistance);
+		const float n = (nearDistance + sqrtf(nearDistance * farDistance)) / sinGamma;
+		const float f = n + (maxY - minY);
+		const float eyeY = minY - n;
+
+		// x / y and z / y of the warp, y runs from n to f over the bounds
+		float minU = 1e30f, maxU = -1e30f, minDepth = 1e30f, maxDepth = -1e30f;
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			const float y = (i & 2) ? f : n;
+			const float u = ((i & 1) ? maxX : minX) / y;
+			const float depth = ((i & 1) ? depthFar : depthNear) / y;
+			minU = min(minU, u);
+			maxU = max(maxU, u);
+			minDepth = min(minDepth, depth);
+			maxDepth = max(maxDepth, depth);
+		}
+
+		// Clip x = ax * u + bx, clip y = A + B / y and depth = az * z / y + bz, w = y
+		const float ax = 2.0f / (maxU - minU);
+		const float bx = -(maxU + minU) / (maxU - minU);
+		const float A = (n + f) / (f - n);
+		const float B = 2.0f * n * f / (n - f);
+		const float az = 1.0f / (maxDepth - minDepth);
+		const float bz = -minDepth / (maxDepth - minDepth);
+		const mat4 warpProj = mat4(
+			vec4(ax, 0.0f, 0.0f, 0.0f),
+			vec4(bx, A, bz, 1.0f),
+			vec4(0.0f, 0.0f, az, 0.0f),
+			vec4(-bx * eyeY, B - A * eyeY, -bz * eyeY, -eyeY));
+
+		*pLightViewProj = warpProj * warpView;
+		return true;
+	}
+
+	// Points the directional light at the origin and flags its map when it moved.
+	// The toroidal map centers the frustum on the view instead, in whole texels.
+	// The warped map follows the view and is re-rendered whenever it changes.
+	void SetShadowLight(ShadowRenderer* pShadows, const vec3& lightPosition, const ShadowView& view)
+	{
+		gViewLight.moveTo({ 0.0f, 0.0f, 0.0f });
+		gViewLight.lookAt(normalize(vec3(0.0f) - lightPosition));
+		const vec3 viewPosition = view.mCamera.mCamPos.getXYZ();
+
+		// The frustum only moves by whole texels, so a scrolled one shares
+		// the texels of the cached one but for the exposed bands
+		const uvec2 shadowMapResolution = getShadowMapResolution();
+		const float extent = gDirectionalShadowExtent;
+		const float texelWidth = 2.0f * extent / shadowMapResolution[0];
+		const float texelHeight = 2.0f * extent / shadowMapResolution[1];
+		int32_t origin[2] = { 0, 0 };
+		if (gToroidalShadowMap && !gShadowWarp)
+		{
+			vec4 viewInLight = gViewLight.getViewMatrix() * vec4(viewPosition, 1.0f);
+			origin[0] = (int32_t)floorf(viewInLight.getX() / texelWidth + 0.5f);
+			// Rows run down the map
+			origin[1] = -(int32_t)floorf(viewInLight.getY() / texelHeight + 0.5f);
+		}
+		const float centerX = origin[0] * texelWidth;
+		const float centerY = -origin[1] * texelHeight;
+
+		// directional lighting model
+		const float depthNear = -gPlaneSize.getZ() * 0.25f;
+		const float depthFar = gPlaneSize.getZ() * 0.75f;
+		mat4 lightViewProj = mat4::orthographic(centerX - extent, centerX + extent, centerY - extent, centerY + extent,
+			depthNear, depthFar) * gViewLight.getViewMatrix();
+		const bool warped = gShadowWarp && getWarpedLightViewProj(gViewLight.getViewMatrix(), view, depthNear, depthFar, &lightViewProj);
+
+		bool lightMoved = length(lightPosition - gDataLight.mLightPosition.getXYZ()) > 0.0001f;
+		gDirectionalFullUpdate |= lightMoved;
+		if (warped || gDirectionalWarped)
+			gDirectionalFullUpdate |= memcmp(&lightViewProj, &gDirectionalViewProj, sizeof(mat4)) != 0;
+		gDirectionalWarped = warped;
+		const int32_t scrollX = origin[0] - gShadowMapOrigin[0];
+		const int32_t scrollY = origin[1] - gShadowMapOrigin[1];
+		gDirectionalSchedule.mPending |= gDirectionalFullUpdate || scrollX || scrollY;
+		gDirectionalSchedule.mInterval = gDirectionalUpdateInterval;
+		// A scroll only costs its render bands, margin included
+		const uint32_t mapTexels = shadowMapResolution[0] * shadowMapResolution[1];
+		ShadowRect bands[2];
+		const uint32_t bandCount = getShadowScrollBands(scrollX, scrollY, 2 * getShadowScrollReach(), shadowMapResolution, bands);
+		uint32_t bandTexels = 0;
+		for (uint32_t i = 0; i < bandCount; ++i)
+			bandTexels += bands[i].mWidth * bands[i].mHeight;
+		gDirectionalSchedule.mCost = gDirectionalFullUpdate ? mapTexels : min(bandTexels, mapTexels);
+
+		// Bouncing spheres only invalidate the texels shared with the cached
+		// frustum, see UpdateShadowCasters. The warp keeps none of them.
+		gDirectionalKeptView = gViewLight.getViewMatrix();
+		gDirectionalKeptRegion = vec4(
+			max(centerX, gShadowMapOrigin[0] * texelWidth) - extent,
+			max(centerY, -gShadowMapOrigin[1] * texelHeight) - extent,
+			min(centerX, gShadowMapOrigin[0] * texelWidth) + extent,
+			min(centerY, -gShadowMapOrigin[1] * texelHeight) + extent);
+		if (warped)
+			gDirectionalKeptRegion = vec4(-1e30f, -1e30f, 1e30f, 1e30f);
+		gDirectionalViewProj = lightViewProj;
+		gDirectionalOrigin[0] = origin[0];
+		gDirectionalOrigin[1] = origin[1];
+
+		gDataLight.mLightPosition = vec4(lightPosition, 1.0f);
+		pShadows->mLightPosition = lightPosition;
+		pShadows->mLightViewProj = lightViewProj;
+	}
+
+	// Texels within reach of the exposed ones filter them. The VSM slope
+	// reaches one texel, a blur iteration two per direction and another one
+	// as it samples between texels.
+	static uint32_t getShadowScrollReach()
+	{
+		return 1 + 4 * gBlurCount;
+	}
+
+	// Bands of the frustum exposed by a scroll, widened by margin towards the
+	// kept texels. The row band leaves out the columns of the column band.
+	static uint32_t getShadowScrollBands(int32_t scrollX, int32_t scrollY, uint32_t margin, const uvec2& size, ShadowRect* pRects)
+	{
+		uint32_t count = 0;
+		uint32_t firstColumn = 0;
+		uint32_t lastColumn = size[0];
+		if (scrollX)
+		{
+			uint32_t columns = min((uint32_t)abs(scrollX) + margin, size[0]);
+			uint32_t x = (scrollX > 0) ? size[0] - columns : 0;
+			pRects[count++] = { x, 0, columns, size[1] };
+			if (scrollX > 0)
+				lastColumn = x;
+			else
+				firstColumn = columns;
+		}
+		if (scrollY && lastColumn > firstColumn)
+		{
+			uint32_t rows = min((uint32_t)abs(scrollY) + margin, size[1]);
+			pRects[count++] = { firstColumn, (scrollY > 0) ? size[1] - rows : 0, lastColumn - firstColumn, rows };
+		}
+		return count;
+	}
+
+	// Picks the texels the scheduled directional update renders and writes.
+	// Scrolls by less than the map keep the shared texels, everything else
+	// and every change of the casters or the light re-renders the frustum.
+	void UpdateDirectionalShadowRects()
+	{
+		const uvec2 size = getShadowMapResolution();
+		const int32_t scrollX = gDirectionalOrigin[0] - gShadowMapOrigin[0];
+		const int32_t scrollY = gDirectionalOrigin[1] - gShadowMapOrigin[1];
+		DirectionalShadowUpdate& update = gDirectionalUpdate;
+
+		if (gDirectionalFullUpdate || (uint32_t)abs(scrollX) >= size[0] || (uint32_t)abs(scrollY) >= size[1])
+		{
+			update.mRenderRects[0] = { 0, 0, size[0], size[1] };
+			update.mWriteRects[0] = update.mRenderRects[0];
+			update.mRenderRectCount = 1;
+			update.mWriteRectCount = 1;
+		}
+		else
+		{
+			const uint32_t reach = getShadowScrollReach();
+			update.mWriteRectCount = getShadowScrollBands(scrollX, scrollY, reach, size, update.mWriteRects);
+			update.mRenderRectCount = getShadowScrollBands(scrollX, scrollY, 2 * reach, size, update.mRenderRects);
+		}
+
+		gShadowMapOrigin[0] = gDirectionalOrigin[0];
+		gShadowMapOrigin[1] = gDirectionalOrigin[1];
+		gDirectionalFullUpdate = false;
+
+		// Modulo the size, the origin may be negative
+		update.mWrapOffset[0] = (uint32_t)(((gShadowMapOrigin[0] % (int32_t)size[0]) + (int32_t)size[0]) % (int32_t)size[0]);
+		update.mWrapOffset[1] = (uint32_t)(((gShadowMapOrigin[1] % (int32_t)size[1]) + (int32_t)size[1]) % (int32_t)size[1]);
+	}
+
+	// Moves the local lights and decides which shadow views render this frame.
+	// The atlas tiles are sized by their coverage of the primary view.
+	void SubmitShadowCasters(ShadowRenderer* pShadows, const ShadowView& primaryView, float projScale, float deltaTime)
+	{
+		UpdateShadowAtlasLights(deltaTime, primaryView.mCamera.mProjectView, projScale);
+		UpdatePointLights(deltaTime);
+		UpdateShadowCasters();
+		ScheduleShadowUpdates();
+		UpdateShadowUniforms();
+	}
+
+	void UpdateShadowMaskUniforms(ShadowView* pView)
+	{
+		RenderTargetDesc shadowMaskDesc = getShadowMaskDesc(*pView);
+		UniformShadowMaskData& data = pView->mShadowMask;
+		data.mInvProjectView = inverse(pView->mCamera.mProjectView);
+		data.mPrevProjectView = pView->mTemporal ? gPrevProjectView : pView->mCamera.mProjectView;
+		data.mLightViewProj = gDataLight.mLightViewProj;
+		data.mCamPos = pView->mCamera.mCamPos;
+		data.mPrevCamPos = pView->mTemporal ? gPrevCamPos : pView->mCamera.mCamPos;
+		data.mLightPosition = gDataLight.mLightPosition;
+		data.mShadowMaskSize[0] = shadowMaskDesc.mWidth;
+		data.mShadowMaskSize[1] = shadowMaskDesc.mHeight;
+		data.mShadowMaskSize[2] = max(gShadowMaskScale, 1u);
+		// Without the temporal filter every frame takes the full kernel
+		data.mShadowMaskSize[3] = pView->mTemporal ? clamp(gShadowMaskTaps, 1u, 16u) : 16;
+		data.mTemporalParams[0] = gShadowMaskFrame;
+		data.mTemporalParams[1] = (pView->mTemporal && gShadowMaskHistoryValid) ? 1 : 0;
+		data.mTemporalBlend = vec4(gShadowMaskTemporalBlend, 0.0f, 0.0f, 0.0f);
+		data.mSourceSize[0] = pView->mViewport[2];
+		data.mSourceSize[1] = pView->mViewport[3];
+		data.mSourceSize[2] = getShadowMapResolution()[0];
+		data.mSourceSize[3] = getShadowMapResolution()[1];
+		data.mVirtualPages[0] = isVirtualShadowMapActive() ? gVirtualShadowPages : 0;
+		data.mVirtualPages[1] = gVirtualShadowSlotSize;
+		data.mVirtualPages[2] = gVirtualShadowSlotBorder;
+		data.mVirtualPages[3] = gVirtualShadowRequestStamps[gFrameIndex];
+		data.mVirtualPool[0] = gVirtualShadowPoolSize;
+		data.mVirtualPool[1] = gVirtualShadowPoolSize;
+		data.mVirtualPool[2] = gVirtualShadowPoolSlots;
+		data.mMinMaxParams[0] = gShadowMinMax ? getShadowMinMaxDesc().mMipLevels : 0;
+		data.mViewportOffset[0] = pView->mViewport[0];
+		data.mViewportOffset[1] = pView->mViewport[1];
+
+		// The penumbra is the blocker distance times the light's angular size,
+		// in texels of the orthographic light frustum. The search region stays
+		// within the mips of the cache.
+		const float texelsPerUnit = getShadowMapResolution()[0] / (2.0f * gDirectionalShadowExtent);
+		const float penumbraScale = gPlaneSize.getZ() * tanf(Vectormath::degToRad(gLightAngularSizeDeg)) * texelsPerUnit;
+		const uint32_t searchTexels = min(gMaxPenumbraTexels, 1u << (getShadowMapCacheDesc().mMipLevels - 1));
+		data.mContactHardening = vec4(isContactHardeningActive() ? penumbraScale : 0.0f, (float)searchTexels, 0.0f, 0.0f);
+
+		// Origin of the cached frustum, not the current one
+		const uvec2 shadowMapResolution = getShadowMapResolution();
+		data.mShadowMapOrigin = vec4(
+			(float)gDirectionalUpdate.mWrapOffset[0] / shadowMapResolution[0],
+			(float)gDirectionalUpdate.mWrapOffset[1] / shadowMapResolution[1],
+			(gDirectionalUpdate.mWrapOffset[0] || gDirectionalUpdate.mWrapOffset[1]) ? 1.0f : 0.0f, 0.0f);
+	}
+
+	// Moves the spot lights, sizes their atlas tiles by screen coverage
+	// and flags the tiles whose contents changed since the last frame
+	void UpdateShadowAtlasLights(float deltaTime, const mat4& projView, float projScale)
+	{
+		const vec3 colors[] = { vec3(1.0f, 0.6f, 0.3f), vec3(0.3f, 0.6f, 1.0f), vec3(0.5f, 1.0f, 0.4f), vec3(1.0f, 0.4f, 0.7f) };
+		const float cosOuter = cosf(Vectormath::degToRad(35.0f));
+		const float cosInner = cosf(Vectormath::degToRad(25.0f));
+
+		gShadowAtlasOrbit += deltaTime * gShadowAtlasOrbitSpeed;
+		bool repack = gShadowAtlasLightCount != gShadowAtlasPackedCount;
+
+		for (uint32_t i = 0; i < gShadowAtlasLightCount; ++i)
+		{
+			ShadowAtlasLight& light = gShadowAtlasLights[i];
+
+			// Golden angle spacing keeps the lights spread for any count
+			float angle = gShadowAtlasOrbit + i * 2.39996f;
+			float radius = 6.0f + 3.0f * (float)(i % 4);
+			vec3 position = vec3(cosf(angle) * radius, 4.0f + (float)(i % 3), sinf(angle) * radius);
+			vec3 target = vec3(cosf(angle) * radius * 0.3f, gPlanePosition.getY(), sinf(angle) * radius * 0.3f);
+			vec3 direction = normalize(target - position);
+
+			bool moved = length(position - light.mPosition) > 0.0001f || length(direction - light.mDirection) > 0.0001f;
+
+			LightView view;
+			view.moveTo(position);
+			view.lookAt(target);
+
+			light.mPosition = position;
+			light.mDirection = direction;
+			light.mColor = colors[i % 4] * 2.0f;
+			light.mRange = 25.0f;
+			light.mCosOuter = cosOuter;
+			light.mCosInner = cosInner;
+			light.mViewProj = mat4::perspective(2.0f * acosf(cosOuter), 1.0f, 0.1f, light.mRange) * view.getViewMatrix();
+
+			// Screen coverage of the cone's bounding sphere
+			vec3 center = position + direction * (light.mRange * 0.5f);
+			float boundsRadius = light.mRange * 0.5f;
+			float viewDepth = (projView * vec4(center, 1.0f)).getW();
+			float coverage = 0.0f;
+			if (viewDepth > -boundsRadius)
+				coverage = min(boundsRadius * projScale / max(viewDepth, boundsRadius), 1.0f);
+
+			// Grow right away, but only shrink once well below the next size down
+			// so tiles don't flip between two sizes and force repacks
+			float desired = coverage * gShadowAtlasMaxTileSize;
+			uint32_t size = max(light.mRequestedSize, gShadowAtlasMinTileSize);
+			while (size < gShadowAtlasMaxTileSize && desired > size)
+				size <<= 1;
+			while (size > gShadowAtlasMinTileSize && desired < size * 0.375f)
+				size >>= 1;
+
+			repack |= size != light.mRequestedSize;
+			light.mRequestedSize = size;
+
+			light.mSchedule.mPending |= moved;
+			light.mSchedule.mInterval = GetLightUpdateInterval(position);
+		}
+
+		if (repack)
+			PackShadowAtlas();
+
+		for (uint32_t i = 0; i < gShadowAtlasLightCount; ++i)
+			gShadowAtlasLights[i].mSchedule.mCost = gShadowAtlasLights[i].mTile.mSize * gShadowAtlasLights[i].mTile.mSize;
+	}
+
+	// Point lights circle between the rows of spheres
+	void UpdatePointLights(float deltaTime)
+	{
+		const vec3 colors[] = { vec3(1.0f, 0.8f, 0.5f), vec3(0.5f, 0.7f, 1.0f) };
+		const float range = 12.0f;
+
+		gPointLightOrbit += deltaTime * gPointLightOrbitSpeed;
+
+		gDataPointLights.mLightCount[0] = gPointLightCount;
+		gDataPointLights.mLightCount[1] = gPointShadowSize;
+		for (uint32_t i = 0; i < gPointLightCount; ++i)
+		{
+			ShadowPointLight& light = gPointLights[i];
+			float angle = gPointLightOrbit + i * (2.0f * PI / gMaxPointLights);
+			vec3 position = vec3(cosf(angle) * 2.5f, 0.5f, sinf(angle) * 2.5f);
+
+			bool moved = length(position - light.mPosition) > 0.0001f;
+
+			light.mPosition = position;
+			light.mSchedule.mPending |= moved;
+			light.mSchedule.mInterval = GetLightUpdateInterval(position);
+			light.mSchedule.mCost = 6 * gPointShadowSize * gPointShadowSize;
+
+			gDataPointLights.mLights[i].mPositionInvRange = vec4(position, 1.0f / range);
+			gDataPointLights.mLights[i].mColorNear = vec4(colors[i % 2] * 3.0f, 0.05f);
+		}
+	}
+
+	// Spheres are tested against every spot and point light in parallel ranges
+	// once this frame's bounce is known
+	void UpdateShadowCasters()
+	{
+		if (gBounceSpeed <= 0.0f)
+			return;
+
+		for (uint32_t i = 0; i <= gDirectionalCastersMoved; ++i)
+			tfrg_atomic32_store_relaxed(&gShadowCastersMoved[i], 0);
+
+		JobHandle casters = jobCreateParallelFor(shadowTestCasters, NULL, gSceneGeneratedSphereCount, gSceneJobGrain);
+		jobAddDependency(casters, gSceneAnimationJob);
+		jobSubmit(casters);
+		jobWait(casters);
+
+		for (uint32_t i = 0; i < gShadowAtlasLightCount; ++i)
+			gShadowAtlasLights[i].mSchedule.mPending |= tfrg_atomic32_load_relaxed(&gShadowCastersMoved[i]) != 0;
+		for (uint32_t i = 0; i < gPointLightCount; ++i)
+			gPointLights[i].mSchedule.mPending |= tfrg_atomic32_load_relaxed(&gShadowCastersMoved[gMaxAtlasLights + i]) != 0;
+		if (tfrg_atomic32_load_relaxed(&gShadowCastersMoved[gDirectionalCastersMoved]))
+		{
+			const uvec2 size = getShadowMapResolution();
+			gDirectionalFullUpdate = true;
+			gDirectionalSchedule.mPending = true;
+			gDirectionalSchedule.mCost = size[0] * size[1];
+		}
+	}
+
+	uint32_t GetLightUpdateInterval(const vec3& position)
+	{
+		float distance = length(position - pCameraController->getViewPosition());
+		return (distance < gShadowNearLightDistance) ? gNearLightUpdateInterval : gFarLightUpdateInterval;
+	}
+
+	// Picks the shadow views updated this frame. Views without usable contents
+	// always update; changed views that waited at least their interval follow,
+	// most overdue first, while the texel budget lasts. A skipped view only gets
+	// more overdue, so the views take turns.
+	void ScheduleShadowUpdates()
+	{
+		ShadowViewSchedule* views[1 + gMaxPointLights + gMaxAtlasLights];
+		uint32_t viewCount = 0;
+
+		gDirectionalSchedule.mInvalid |= !fgHasPersistent(&gFrameGraph, getShadowMapCacheDesc());
+		gDirectionalFullUpdate |= gDirectionalSchedule.mInvalid;
+		views[viewCount++] = &gDirectionalSchedule;
+
+		bool pointCacheResident = fgHasPersistent(&gFrameGraph, getPointShadowDesc());
+		for (uint32_t i = 0; i < gPointLightCount; ++i)
+		{
+			gPointLights[i].mSchedule.mInvalid |= !pointCacheResident;
+			views[viewCount++] = &gPointLights[i].mSchedule;
+		}
+
+		bool atlasResident = fgHasPersistent(&gFrameGraph, getShadowAtlasDesc());
+		for (uint32_t i = 0; i < gShadowAtlasLightCount; ++i)
+		{
+			gShadowAtlasLights[i].mSchedule.mInvalid |= !atlasResident;
+			views[viewCount++] = &gShadowAtlasLights[i].mSchedule;
+		}
+
+		uint32_t frame = ++gShadowScheduleFrame;
+		ShadowViewSchedule* candidates[1 + gMaxPointLights + gMaxAtlasLights];
+		float urgency[1 + gMaxPointLights + gMaxAtlasLights];
+		uint32_t candidateCount = 0;
+		for (uint32_t i = 0; i < viewCount; ++i)
+		{
+			ShadowViewSchedule* view = views[i];
+			view->mScheduled = false;
+
+			uint32_t age = frame - view->mLastUpdate;
+			if (!view->mInvalid && (!view->mPending || age < view->mInterval))
+				continue;
+
+			// Stable insertion, equally overdue views keep their order. Invalid views
+			// go first, no valid view can be more overdue than the frame count.
+			float viewUrgency = view->mInvalid ? (float)frame + 1.0f : (float)age / (float)max(view->mInterval, 1u);
+			uint32_t j = candidateCount++;
+			for (; j > 0 && urgency[j - 1] < viewUrgency; --j)
+			{
+				candidates[j] = candidates[j - 1];
+				urgency[j] = urgency[j - 1];
+			}
+			candidates[j] = view;
+			urgency[j] = viewUrgency;
+		}
+
+		uint64_t budget = (uint64_t)(gShadowUpdateBudgetMTexels * 1024.0f * 1024.0f);
+		gShadowUpdateCost = 0;
+		gShadowUpdatesDeferred = 0;
+		for (uint32_t i = 0; i < candidateCount; ++i)
+		{
+			ShadowViewSchedule* view = candidates[i];
+
+			// The most overdue view always makes progress, even over budget
+			if (!view->mInvalid && gShadowUpdateCost && gShadowUpdateCost + view->mCost > budget)
+			{
+				++gShadowUpdatesDeferred;
+				continue;
+			}
+
+			view->mScheduled = true;
+			view->mLastUpdate = frame;
+			view->mPending = false;
+			view->mInvalid = false;
+			gShadowUpdateCost += view->mCost;
+		}
+	}
+
+	// Updated views take the current transforms. The others keep the ones
+	// their cached contents were rendered with.
+	void UpdateShadowUniforms()
+	{
+		if (gDirectionalSchedule.mScheduled)
+		{
+			UpdateDirectionalShadowRects();
+			gDataLight.mLightViewProj = gDirectionalViewProj;
+		}
+
+		for (uint32_t i = 0; i < gPointLightCount; ++i)
+		{
+			ShadowPointLight& light = gPointLights[i];
+			if (light.mSchedule.mScheduled)
+				light.mShadowPosition = light.mPosition;
+			gDataPointLights.mLights[i].mShadowPosition = vec4(light.mShadowPosition, 1.0f);
+		}
+
+		gDataShadowAtlasLights.mLightCount[0] = gShadowAtlasLightCount;
+		for (uint32_t i = 0; i < gShadowAtlasLightCount; ++i)
+		{
+			ShadowAtlasLight& light = gShadowAtlasLights[i];
+			if (light.mSchedule.mScheduled)
+				light.mShadowViewProj = light.mViewProj;
+
+			UniformAtlasLight& data = gDataShadowAtlasLights.mLights[i];
+			data.mViewProj = light.mShadowViewProj;
+			data.mPositionInvRange = vec4(light.mPosition, 1.0f / light.mRange);
+			data.mDirectionCosOuter = vec4(light.mDirection, light.mCosOuter);
+			data.mColorCosInner = vec4(light.mColor, light.mCosInner);
+
+			// Inset by half a texel so filtering never reaches the neighbouring tile
+			data.mTileRect = vec4(
+				(light.mTile.mX + 0.5f) / gShadowAtlasSize,
+				(light.mTile.mY + 0.5f) / gShadowAtlasSize,
+				(light.mTile.mSize - 1.0f) / gShadowAtlasSize,
+				(light.mTile.mSize - 1.0f) / gShadowAtlasSize);
+		}
+	}
+
+	// The temporal filter ping-pongs between two persistent mask targets. The one
+	// written last frame is only usable if it was written by the previous frame
+	// at the current mask resolution.
+	void UpdateShadowMaskHistory()
+	{
+		if (!gShadowMaskTemporal)
+		{
+			gShadowMaskHistoryValid = false;
+			return;
+		}
+
+		++gShadowMaskFrame;
+		gShadowMaskHistoryValid = gShadowMaskHistoryFrame == gFrameGraph.mFrame &&
+			fgHasPersistent(&gFrameGraph, getShadowMaskHistoryDesc((gShadowMaskFrame + 1) & 1));
+		// The graph frame counter advances when this frame's graph is built
+		gShadowMaskHistoryFrame = gFrameGraph.mFrame + 1;
+	}
+
+	// Reads the pages the shadow mask requested when this frame index was last
+	// rendered. Missing pages get a slot and are rendered first; in frames the
+	// directional map updates, the rest of the budget re-renders requested
+	// pages, least recently rendered first. Every page is dropped when the
+	// light transform changed or the pool lost its contents.
+	void UpdateVirtualShadowPages()
+	{
+		VirtualShadowPassData& data = gVirtualShadowPassData;
+		data.mPageCount = 0;
+		if (!isVirtualShadowMapActive())
+		{
+			gVirtualShadowRequestStamps[gFrameIndex] = 0;
+			return;
+		}
+
+		if (!fgHasPersistent(&gFrameGraph, getVirtualShadowPoolDesc()) ||
+			memcmp(&gVirtualShadowViewProj, &gDataLight.mLightViewProj, sizeof(mat4)) != 0)
+		{
+			virtualShadowReset();
+			gVirtualShadowViewProj = gDataLight.mLightViewProj;
+		}
+
+		uint32_t frame = ++gVirtualShadowFrame;
+		uint32_t stamp = gVirtualShadowRequestStamps[gFrameIndex];
+		gVirtualShadowRequestStamps[gFrameIndex] = frame;
+		const uint32_t budget = min(gVirtualShadowPageBudget, gMaxVirtualShadowPageUpdates);
+
+		if (stamp)
+		{
+			// Resident requests first, so that no requested page is evicted for a missing one
+			const uint32_t* pRequests = (const uint32_t*)pBufferVirtualPageReadback[gFrameIndex]->pCpuMappedAddress;
+			for (uint32_t page = 0; page < gVirtualShadowPageCount; ++page)
+			{
+				if (pRequests[page] == stamp && gVirtualShadowPageTable[page] != VIRTUAL_PAGE_NONE)
+					gVirtualShadowSlots[gVirtualShadowPageTable[page]].mLastRequest = frame;
+			}
+
+			// Pages over budget are requested again by the following frames
+			for (uint32_t page = 0; page < gVirtualShadowPageCount && data.mPageCount < budget; ++page)
+			{
+				if (pRequests[page] != stamp || gVirtualShadowPageTable[page] != VIRTUAL_PAGE_NONE)
+					continue;
+
+				uint32_t slot = virtualShadowAllocateSlot(frame);
+				if (slot == VIRTUAL_PAGE_NONE)
+					break;
+
+				gVirtualShadowSlots[slot] = { page, frame, frame };
+				gVirtualShadowPageTable[page] = slot;
+				++gVirtualShadowResidentCount;
+				data.mPages[data.mPageCount++] = page;
+			}
+		}
+
+		// The casters moved, refresh the requested pages rendered longest ago.
+		// Stable insertion keeps the oldest ones that fit the budget.
+		if (gDirectionalSchedule.mScheduled && data.mPageCount < budget)
+		{
+			uint32_t refresh[gMaxVirtualShadowPageUpdates];
+			uint32_t refreshCount = 0;
+			const uint32_t maxRefresh = budget - data.mPageCount;
+			for (uint32_t i = 0; i < gVirtualShadowSlotCount; ++i)
+			{
+				const VirtualShadowSlot& slot = gVirtualShadowSlots[i];
+				if (slot.mPage == VIRTUAL_PAGE_NONE || slot.mLastRequest != frame || slot.mLastUpdate == frame)
+					continue;
+				if (refreshCount == maxRefresh && slot.mLastUpdate >= gVirtualShadowSlots[refresh[refreshCount - 1]].mLastUpdate)
+					continue;
+
+				uint32_t j = min(refreshCount, maxRefresh - 1);
+				refreshCount = min(refreshCount + 1, maxRefresh);
+				for (; j > 0 && gVirtualShadowSlots[refresh[j - 1]].mLastUpdate > slot.mLastUpdate; --j)
+					refresh[j] = refresh[j - 1];
+				refresh[j] = i;
+			}
+
+			for (uint32_t i = 0; i < refreshCount; ++i)
+			{
+				gVirtualShadowSlots[refresh[i]].mLastUpdate = frame;
+				data.mPages[data.mPageCount++] = gVirtualShadowSlots[refresh[i]].mPage;
+			}
+		}
+
+		BufferUpdateDesc tableUpdate = { pBufferVirtualPageTable[gFrameIndex] };
+		beginUpdateResource(&tableUpdate);
+		memcpy(tableUpdate.pMappedData, gVirtualShadowPageTable, sizeof(gVirtualShadowPageTable));
+		endUpdateResource(&tableUpdate, NULL);
+	}
+
+	// Packs the tiles largest first. When the requested sizes don't fit,
+	// every tile is halved until they do.
+	void PackShadowAtlas()
+	{
+		uint32_t order[gMaxAtlasLights];
+		for (uint32_t i = 0; i < gShadowAtlasLightCount; ++i)
+		{
+			uint32_t j = i;
+			for (; j > 0 && gShadowAtlasLights[order[j - 1]].mRequestedSize < gShadowAtlasLights[i].mRequestedSize; --j)
+				order[j] = order[j - 1];
+			order[j] = i;
+		}
+
+		uint32_t shift = 0;
+		for (;; ++shift)
+		{
+			ShadowAtlasAllocator allocator;
+			shadowAtlasReset(&allocator, gShadowAtlasSize);
+
+			bool packed = true;
+			for (uint32_t i = 0; i < gShadowAtlasLightCount && packed; ++i)
+			{
+				ShadowAtlasLight& light = gShadowAtlasLights[order[i]];
+				uint32_t size = max(light.mRequestedSize >> shift, gShadowAtlasMinTileSize);
+				uint32_t x = 0, y = 0;
+				packed = shadowAtlasAllocate(&allocator, size, &x, &y);
+				light.mTile = { x, y, size, 0 };
+			}
+
+			// gMaxAtlasLights minimum sized tiles always fit
+			if (packed || (gShadowAtlasMaxTileSize >> shift) <= gShadowAtlasMinTileSize)
+				break;
+		}
+
+		if (shift)
+			LOGF(LogLevel::eINFO, "Shadow atlas: tiles halved %u times to fit %u lights", shift, gShadowAtlasLightCount);
+
+		// Tiles moved, their old contents are of no use
+		for (uint32_t i = 0; i < gShadowAtlasLightCount; ++i)
+			gShadowAtlasLights[i].mSchedule.mInvalid = true;
+
+		gShadowAtlasPackedCount = gShadowAtlasLightCount;
+	}
+
+	// Places the hand made rows of spheres and spreads the rest over the plane on a
+	// jittered grid. Seeded, every generated scene of a given size is the same.
+	void GenerateScene()
+	{
+		// The materials and draw ranges are shared by the frames in flight
+		waitQueueIdle(pGraphicsQueue);
+
+		const uint32_t sphereCount = min(gSceneSphereCount, gMaxSceneSpheres);
+		srand(gSceneSeed);
+
+		BufferUpdateDesc materialUpdate = { pBufferObjectMaterials[0] };
+		beginUpdateResource(&materialUpdate);
+		ObjectMaterial* pMaterials = (ObjectMaterial*)materialUpdate.pMappedData;
+
+		gDataPlane.mDiffuse = { 0.65f, 0.65f, 0.65f, 1.0f };
+		gDataPlane.mSpecular = vec4(gMiniSpec, 2.0f);
+		pMaterials[SCENE_DRAW_PLANE] = gDataPlane;
+		pMaterials[SCENE_DRAW_LIGHT_OBJECT] = gDataLightObject;
+
+		// Generated spheres spread over most of the plane on a jittered grid and shrink to fit its cells
+		const uint32_t gridCount = sphereCount - min(sphereCount, gSceneClassicSpheres);
+		const uint32_t gridSide = (uint32_t)ceilf(sqrtf((float)gridCount));
+		const float extent = gPlaneSize.getX() * 0.9f;
+		const float cellSize = gridSide ? extent / gridSide : extent;
+		const float gridScale = min(1.0f, 0.8f * cellSize / gSphereDiameter);
+
+		for (uint32_t i = 0; i < sphereCount; ++i)
+		{
+			// Start at a random timer
+			float timer = RandomZeroOne() * 100.0f;
+			gSceneSphereFrequency[i] = RandomZeroOne() + 0.5f;
+			gSceneSpherePhase[i] = timer * gSceneSphereFrequency[i];
+			float scale = RandomZeroOne();
+
+			ObjectMaterial& material = pMaterials[gSceneFirstSphere + i];
+			material.mDiffuse = { RandomZeroOne(), RandomZeroOne(), RandomZeroOne(), 1.0f };
+			material.mSpecular = vec4(vec3(RandomZeroOne() * 0.03f), RandomZeroOne() * 24.0f);
+
+			if (i < gSceneClassicSpheres)
+			{
+				// Horizontal line, then the vertical ones on the left and right without their centers
+				uint32_t row = i / 9;
+				uint32_t column = i % 9;
+				gSceneSphereX[i] = row == 0 ? column - 4.0f : (row == 1 ? -4.0f : 4.0f);
+				gSceneSphereZ[i] = row == 0 ? 0.0f : 5.0f - (column < 5 ? column : column + 1);
+				gSceneSphereScale[i] = 1.0f;
+			}
+			else
+			{
+				uint32_t g = i - gSceneClassicSpheres;
+				gSceneSphereX[i] = -0.5f * extent + ((g % gridSide) + 0.5f + (RandomZeroOne() - 0.5f) * 0.2f) * cellSize;
+				gSceneSphereZ[i] = -0.5f * extent + ((g / gridSide) + 0.5f + (RandomZeroOne() - 0.5f) * 0.2f) * cellSize;
+				gSceneSphereScale[i] = gridScale * (scale * 0.3f + 0.7f);
+			}
+		}
+
+		for (uint32_t i = 1; i < gImageCount; ++i)
+		{
+			BufferUpdateDesc copyUpdate = { pBufferObjectMaterials[i] };
+			beginUpdateResource(&copyUpdate);
+			memcpy(copyUpdate.pMappedData, pMaterials, sizeof(ObjectMaterial) * (gSceneFirstSphere + sphereCount));
+			endUpdateResource(&copyUpdate, NULL);
+		}
+		endUpdateResource(&materialUpdate, NULL);
+
+		const UniformObjectDrawData draws[SCENE_DRAW_COUNT] = {
+			{ SCENE_DRAW_PLANE, 1, ~0u },
+			{ SCENE_DRAW_LIGHT_OBJECT, 1, ~0u },
+			{ gSceneFirstSphere, sphereCount, ~0u },
+			{ gSceneFirstSphere, sphereCount, CULL_VIEW_CAMERA * gMaxSceneSpheres },
+			{ gSceneFirstSphere, sphereCount, CULL_VIEW_LIGHT * gMaxSceneSpheres },
+			{ gSceneFirstSphere, sphereCount, CULL_VIEW_OCCLUSION * gMaxSceneSpheres },
+		};
+		for (uint32_t i = 0; i < SCENE_DRAW_COUNT; ++i)
+		{
+			BufferUpdateDesc drawUpdate = { pBufferUniformObjectDraw[i] };
+			beginUpdateResource(&drawUpdate);
+			*(UniformObjectDrawData*)drawUpdate.pMappedData = draws[i];
+			endUpdateResource(&drawUpdate, NULL);
+		}
+
+		gSceneSphereCount = sphereCount;
+		gSceneGeneratedSphereCount = sphereCount;
+		gSceneGpuAnimationActive = false;
+	}
+
+	// Starts the GPU bounce where the CPU one is, every frame after advances it
+	// by the same step as gSceneAnimationTime
+	void UploadSphereAnimation()
+	{
+		if (!gSceneGeneratedSphereCount)
+			return;
+
+		waitQueueIdle(pGraphicsQueue);
+
+		BufferUpdateDesc update = { pBufferSphereAnimation, 0, sizeof(SphereAnimation) * gSceneGeneratedSphereCount };
+		beginUpdateResource(&update);
+		SphereAnimation* pSpheres = (SphereAnimation*)update.pMappedData;
+		for (uint32_t i = 0; i < gSceneGeneratedSphereCount; ++i)
+		{
+			pSpheres[i] = {};
+			pSpheres[i].mPositionScale = vec4(gSceneSphereX[i], gPlanePosition.getY() + 1.0f, gSceneSphereZ[i], gSceneSphereScale[i]);
+			pSpheres[i].mAngle = fmodf(gSceneSpherePhase[i] + gSceneAnimationTime * gSceneSphereFrequency[i], PI);
+			pSpheres[i].mFrequency = gSceneSphereFrequency[i];
+		}
+		endUpdateResource(&update, NULL);
+		waitForAllResourceLoads();
+	}
+
+	void PrepareDescriptorSets()
+	{
+		/************************************************************************/
+		// Scene animation descriptors
+		/************************************************************************/
+		{
+			DescriptorData params[2] = {};
+			params[0].pName = "sphereAnimation";
+			params[0].ppBuffers = &pBufferSphereAnimation;
+			params[1].pName = "objectTransformsOut";
+			params[1].ppBuffers = &pBufferSceneTransforms;
+			updateDescriptorSet(pRenderer, 0, pDescriptorSetSceneAnimation, 2, params);
+		}
+
+		/************************************************************************/
+		// GPU culling descriptors
+		/************************************************************************/
+		{
+			DescriptorData params[4] = {};
+			for (uint32_t i = 0; i < gImageCount; ++i)
+			{
+				params[0].pName = "cbCull";
+				params[0].ppBuffers = &pBufferUniformCull[i];
+				params[1].pName = "objectTransforms";
+				params[1].ppBuffers = &pBufferSceneTransforms;
+				params[2].pName = "visibleObjects";
+				params[2].ppBuffers = &pBufferVisibleObjects;
+				params[3].pName = "cullArguments";
+				params[3].ppBuffers = &pBufferCullArguments;
+				updateDescriptorSet(pRenderer, i, pDescriptorSetCull[0], 4, params);
+			}
+		}
+
+		/************************************************************************/
+		// Shadow pass descriptors
+		/************************************************************************/
+		{
+			DescriptorData params[3] = {};
+			for (uint32_t i = 0; i < gImageCount; ++i)
+			{
+				params[0].pName = "cbLight";
+				params[0].ppBuffers = &pBufferUniformLight[i];
+				params[1].pName = "objectTransforms";
+				params[1].ppBuffers = &pBufferSceneTransforms;
+				params[2].pName = "visibleObjects";
+				params[2].ppBuffers = &pBufferVisibleObjects;
+				updateDescriptorSet(pRenderer, i, pDescriptorSetMapVSM[0], 3, params);
+			}
+
+			params[0] = {};
+			params[0].pName = "cbObject";
+			for (uint32_t i = 0; i < SCENE_DRAW_COUNT; ++i)
+			{
+				params[0].ppBuffers = &pBufferUniformObjectDraw[i];
+				updateDescriptorSet(pRenderer, i, pDescriptorSetMapVSM[1], 1, params);
+			}
+		}
+
+		{
+			DescriptorData params[3] = {};
+			for (uint32_t i = 0; i < gImageCount; ++i)
+			{
+				params[0].pName = "cbLight";
+				params[0].ppBuffers = &pBufferUniformLight[i];
+				params[1].pName = "objectTransforms";
+				params[1].ppBuffers = &pBufferSceneTransforms;
+				params[2].pName = "visibleObjects";
+				params[2].ppBuffers = &pBufferVisibleObjects;
+				updateDescriptorSet(pRenderer, i, pDescriptorSetMapMSM[0], 3, params);
+			}
+
+			params[0] = {};
+			params[0].pName = "cbObject";
+			for (uint32_t i = 0; i < SCENE_DRAW_COUNT; ++i)
+			{
+				params[0].ppBuffers = &pBufferUniformObjectDraw[i];
+				updateDescriptorSet(pRenderer, i, pDescriptorSetMapMSM[1], 1, params);
+			}
+		}
+
+		/************************************************************************/
+		// Shadow atlas descriptors
+		/************************************************************************/
+		{
+			DescriptorData params[2] = {};
+			for (uint32_t i = 0; i < gImageCount; ++i)
+			{
+				params[0].pName = "cbAtlasLights";
+				params[0].ppBuffers = &pBufferUniformShadowAtlas[i];
+				params[1].pName = "objectTransforms";
+				params[1].ppBuffers = &pBufferSceneTransforms;
+				updateDescriptorSet(pRenderer, i, pDescriptorSetShadowAtlas[0], 2, params);
+			}
+
+			params[0] = {};
+			params[0].pName = "cbObject";
+			for (uint32_t i = 0; i < SCENE_DRAW_COUNT; ++i)
+			{
+				params[0].ppBuffers = &pBufferUniformObjectDraw[i];
+				updateDescriptorSet(pRenderer, i, pDescriptorSetShadowAtlas[1], 1, params);
+			}
+		}
+
+
+
+		/************************************************************************/
+		// Virtual shadow page descriptors
+		/************************************************************************/
+		{
+			DescriptorData params[3] = {};
+			for (uint32_t i = 0; i < gImageCount; ++i)
+			{
+				params[0].pName = "cbLight";
+				params[0].ppBuffers = &pBufferUniformLight[i];
+				params[1].pName = "objectTransforms";
+				params[1].ppBuffers = &pBufferSceneTransforms;
+				params[2].pName = "visibleObjects";
+				params[2].ppBuffers = &pBufferVisibleObjects;
+				updateDescriptorSet(pRenderer, i, pDescriptorSetVirtualPage[0], 3, params);
+			}
+
+			params[0] = {};
+			params[0].pName = "cbObject";
+			for (uint32_t i = 0; i < SCENE_DRAW_COUNT; ++i)
+			{
+				params[0].ppBuffers = &pBufferUniformObjectDraw[i];
+				updateDescriptorSet(pRenderer, i, pDescriptorSetVirtualPage[1], 1, params);
+			}
+		}
+
+		/************************************************************************/
+		// Point shadow descriptors
+		/************************************************************************/
+		{
+			DescriptorData params[2] = {};
+			for (uint32_t i = 0; i < gImageCount; ++i)
+			{
+				params[0].pName = "cbPointLights";
+				params[0].ppBuffers = &pBufferUniformPointLights[i];
+				params[1].pName = "objectTransforms";
+				params[1].ppBuffers = &pBufferSceneTransforms;
+				updateDescriptorSet(pRenderer, i, pDescriptorSetPointShadow[0], 2, params);
+			}
+
+			params[0] = {};
+			params[0].pName = "cbObject";
+			for (uint32_t i = 0; i < SCENE_DRAW_COUNT; ++i)
+			{
+				params[0].ppBuffers = &pBufferUniformObjectDraw[i];
+				updateDescriptorSet(pRenderer, i, pDescriptorSetPointShadow[1], 1, params);
+			}
+		}
+
+		/************************************************************************/
+		// Depth prepass and shadow mask descriptors
+		/************************************************************************/
+		{
+			DescriptorData params[5] = {};
+			for (uint32_t view = 0; view < SHADOW_VIEW_COUNT; ++view)
+			{
+				for (uint32_t i = 0; i < gImageCount; ++i)
+				{
+					uint32_t index = view * gImageCount + i;
+
+					params[0].pName = "cbCamera";
+					params[0].ppBuffers = &pBufferUniformCamera[view][i];
+					params[1].pName = "cbLight";
+					params[1].ppBuffers = &pBufferUniformLight[i];
+					params[2].pName = "objectTransforms";
+					params[2].ppBuffers = &pBufferSceneTransforms;
+					params[3].pName = "objectMaterials";
+					params[3].ppBuffers = &pBufferObjectMaterials[i];
+					params[4].pName = "visibleObjects";
+					params[4].ppBuffers = &pBufferVisibleObjects;
+					updateDescriptorSet(pRenderer, index, pDescriptorSetDepthPrepass[0], 5, params);
+
+					params[0].pName = "cbShadowMask";
+					params[0].ppBuffers = &pBufferUniformShadowMask[view][i];
+					// Only the main view has a temporal filter
+					if (view == SHADOW_VIEW_MAIN)
+						updateDescriptorSet(pRenderer, i, pDescriptorSetShadowMaskTemporal, 1, params);
+					params[1].pName = "pageTable";
+					params[1].ppBuffers = &pBufferVirtualPageTable[i];
+					params[2].pName = "pageRequests";
+					params[2].ppBuffers = &pBufferVirtualPageRequests;
+					updateDescriptorSet(pRenderer, index, pDescriptorSetShadowMask, 3, params);
+				}
+			}
+
+			params[0] = {};
+			params[0].pName = "cbObject";
+			for (uint32_t i = 0; i < SCENE_DRAW_COUNT; ++i)
 			{
-				bool capture = gAppUI.OnButton(ctx->mBinding, ctx->mBool, ctx->pPosition);
-				setEnableCaptureInput(capture && INPUT_ACTION_PHASE_CANCELED != ctx->mPhase);
-				return true;
-			}, this
-		};
-		addInputAction(&actionDesc);
-		typedef bool(*CameraInputHandler)(InputActionContext* ctx, uint32_t index);
-		static CameraInputHandler onCameraInput = [](InputActionContext* ctx, uint32_t index)
+				params[0].ppBuffers = &pBufferUniformObjectDraw[i];
+				updateDescriptorSet(pRenderer, i, pDescriptorSetDepthPrepass[1], 1, params);
+			}
+		}
+
+		/************************************************************************/
+		// VSM descriptors
+		/************************************************************************/
 		{
-			if (!gAppUI.IsFocused() && *ctx->pCaptured)
+			DescriptorData params[7] = {};
+			
+			for (uint32_t index = 0; index < gImageCount * SHADOW_VIEW_COUNT; ++index)
 			{
-				gVirtualJoystick.OnMove(index, ctx->mPhase != INPUT_ACTION_PHASE_CANCELED, ctx->pPosition);
-				index ? pCameraController->onRotate(ctx->mFloat2) : pCameraController->onMove(ctx->mFloat2);
+				uint32_t i = index % gImageCount;
+
+				params[0] = {};
+				params[0].pName = "cbCamera";
+				params[0].ppBuffers = &pBufferUniformCamera[index / gImageCount][i];
+
+				params[1] = {};
+				params[1].pName = "cbLight";
+				params[1].ppBuffers = &pBufferUniformLight[i];
+
+				params[2] = {};
+				params[2].pName = "cbAtlasLights";
+				params[2].ppBuffers = &pBufferUniformShadowAtlas[i];
+
+				params[3] = {};
+				params[3].pName = "cbPointLights";
+				params[3].ppBuffers = &pBufferUniformPointLights[i];
+
+				params[4] = {};
+				params[4].pName = "objectTransforms";
+				params[4].ppBuffers = &pBufferSceneTransforms;
+
+				params[5] = {};
+				params[5].pName = "objectMaterials";
+				params[5].ppBuffers = &pBufferObjectMaterials[i];
+
+				params[6] = {};
+				params[6].pName = "visibleObjects";
+				params[6].ppBuffers = &pBufferVisibleObjects;
+
+				updateDescriptorSet(pRenderer, index, pDescriptorSetVSM[1], 7, params);
 			}
-			return true;
-		};
-		actionDesc = { InputBindings::FLOAT_RIGHTSTICK, [](InputActionContext* ctx) { return onCameraInput(ctx, 1); }, NULL, 20.0f, 200.0f, 1.0f };
-		addInputAction(&actionDesc);
-		actionDesc = { InputBindings::FLOAT_LEFTSTICK, [](InputActionContext* ctx) { return onCameraInput(ctx, 0); }, NULL, 20.0f, 200.0f, 1.0f };
-		addInputAction(&actionDesc);
-		actionDesc = { InputBindings::BUTTON_NORTH, [](InputActionContext* ctx) { pCameraController->resetView(); return true; } };
-		addInputAction(&actionDesc);
 
-		tf_free(pSpherePoints);
-		tf_free(pLightObjPoints);
-		tf_free(pPlanePoints);
+			params[0] = {};
+			params[0].pName = "cbObject";
+			for (uint32_t i = 0; i < SCENE_DRAW_COUNT; ++i)
+			{
+				params[0].ppBuffers = &pBufferUniformObjectDraw[i];
+				updateDescriptorSet(pRenderer, i, pDescriptorSetVSM[2], 1, params);
+			}
 
-		waitForAllResourceLoads();
-		PrepareResources();
+		}
+
+		/************************************************************************/
+		// MSM descriptors
+		/************************************************************************/
+		{
+			DescriptorData params[7] = {};
+			
+			for (uint32_t index = 0; index < gImageCount * SHADOW_VIEW_COUNT; ++index)
+			{
+				uint32_t i = index % gImageCount;
+
+				params[0] = {};
+				params[0].pName = "cbCamera";
+				params[0].ppBuffers = &pBufferUniformCamera[index / gImageCount][i];
+
+				params[1] = {};
+				params[1].pName = "cbLight";
+				params[1].ppBuffers = &pBufferUniformLight[i];
 
+				params[2] = {};
+				params[2].pName = "cbAtlasLights";
+				params[2].ppBuffers = &pBufferUniformShadowAtlas[i];
+
+				params[3] = {};
+				params[3].pName = "cbPointLights";
+				params[3].ppBuffers = &pBufferUniformPointLights[i];
+
+				params[4] = {};
+				params[4].pName = "objectTransforms";
+				params[4].ppBuffers = &pBufferSceneTransforms;
+
+				params[5] = {};
+				params[5].pName = "objectMaterials";
+				params[5].ppBuffers = &pBufferObjectMaterials[i];
+
+				params[6] = {};
+				params[6].pName = "visibleObjects";
+				params[6].ppBuffers = &pBufferVisibleObjects;
+
+				updateDescriptorSet(pRenderer, index, pDescriptorSetMSM[1], 7, params);
+			}
+
+			params[0] = {};
+			params[0].pName = "cbObject";
+			for (uint32_t i = 0; i < SCENE_DRAW_COUNT; ++i)
+			{
+				params[0].ppBuffers = &pBufferUniformObjectDraw[i];
+				updateDescriptorSet(pRenderer, i, pDescriptorSetMSM[2], 1, params);
+			}
+
+		}
 
-		return true;
 	}
 
-	void Exit()
+	// Pipelines that never draw to the swapchain or its depth buffer. Their
+	// formats are fixed, so they live from Init to Exit and resizes keep them.
+	void addOffscreenPipelines()
 	{
-		waitQueueIdle(pGraphicsQueue);
+		// Layout for shadow map
+		VertexLayout vertexLayoutPositionOnly = {};
+		vertexLayoutPositionOnly.mAttribCount = 1;
+		vertexLayoutPositionOnly.mAttribs[0].mSemantic = SEMANTIC_POSITION;
+		vertexLayoutPositionOnly.mAttribs[0].mFormat = TinyImageFormat_R32G32B32_SFLOAT;
+		vertexLayoutPositionOnly.mAttribs[0].mBinding = 0;
+		vertexLayoutPositionOnly.mAttribs[0].mLocation = 0;
+		vertexLayoutPositionOnly.mAttribs[0].mOffset = 0;
 
-		exitInputSystem();
 
-		destroyCameraController(pCameraController);
+		RasterizerStateDesc shadowRasterizerStateDesc = {};
+		shadowRasterizerStateDesc.mCullMode = CULL_MODE_FRONT;
 
-		gVirtualJoystick.Exit();
+		DepthStateDesc depthStateDesc = {};
+		depthStateDesc.mDepthTest = true;
+		depthStateDesc.mDepthWrite = true;
+		depthStateDesc.mDepthFunc = CMP_LEQUAL;
 
-		gAppUI.Exit();
+		PipelineDesc desc = {};
+		desc.mType = PIPELINE_TYPE_GRAPHICS;
 
-		// Exit profile
-		exitProfiler();
+		// SHADOW PASS
+		desc.mGraphicsDesc = {};
+		GraphicsPipelineDesc& shadowPassPipelineSettings = desc.mGraphicsDesc;
+		shadowPassPipelineSettings.mPrimitiveTopo = PRIMITIVE_TOPO_TRI_LIST;
+		shadowPassPipelineSettings.mRenderTargetCount = 1;
+		shadowPassPipelineSettings.pDepthState = &depthStateDesc;
+		shadowPassPipelineSettings.mSampleCount = SAMPLE_COUNT_1;
+		shadowPassPipelineSettings.mSampleQuality = 0;
+		shadowPassPipelineSettings.mDepthStencilFormat = gShadowDepthFormat;
+		shadowPassPipelineSettings.pRasterizerState = &shadowRasterizerStateDesc;
+		shadowPassPipelineSettings.pVertexLayout = &vertexLayoutPositionOnly;
 
-		for (uint32_t i = 0; i < gImageCount; ++i)
+		// One set of shadow pipelines per moment storage format
+		for (uint32_t i = 0; i < VSM_FORMAT_COUNT; ++i)
 		{
-			removeResource(pBufferUniformLight[i]);
-			removeResource(pBufferUniformCamera[i]);
+			const uint32_t encoding = getMomentEncodingVSM(i);
+			TinyImageFormat shadowMapFormat = gShadowMapFormatsVSM[i];
+			shadowPassPipelineSettings.pColorFormats = &shadowMapFormat;
+			shadowPassPipelineSettings.pRootSignature = pRootSignatureMapVSM;
+			shadowPassPipelineSettings.pShaderProgram = pShaderMapVSM[encoding];
+			addPipeline(pRenderer, &desc, &pPipelineMapVSM[i]);
+
+			// SHADOW ATLAS
+			shadowPassPipelineSettings.pRootSignature = pRootSignatureShadowAtlas;
+			shadowPassPipelineSettings.pShaderProgram = pShaderShadowAtlasVSM[encoding];
+			addPipeline(pRenderer, &desc, &pPipelineShadowAtlasVSM[i]);
+
+			// POINT SHADOWS
+			shadowPassPipelineSettings.pRootSignature = pRootSignaturePointShadow;
+			shadowPassPipelineSettings.pShaderProgram = pShaderPointShadowVSM[encoding];
+			addPipeline(pRenderer, &desc, &pPipelinePointShadowVSM[i]);
+
+			// VIRTUAL SHADOW PAGES
+			shadowPassPipelineSettings.pRootSignature = pRootSignatureVirtualPage;
+			shadowPassPipelineSettings.pShaderProgram = pShaderVirtualPageVSM[encoding];
+			addPipeline(pRenderer, &desc, &pPipelineVirtualPageVSM[i]);
 		}
 
-		for (int i = 0; i < 3; ++i)
+		for (uint32_t i = 0; i < MSM_FORMAT_COUNT; ++i)
 		{
-			removeDescriptorSet(pRenderer, pDescriptorSetVSM[i]);
-			removeDescriptorSet(pRenderer, pDescriptorSetMSM[i]);
+			const uint32_t encoding = getMomentEncodingMSM(i);
+			TinyImageFormat shadowMapFormat = gShadowMapFormatsMSM[i];
+			shadowPassPipelineSettings.pColorFormats = &shadowMapFormat;
+			shadowPassPipelineSettings.pRootSignature = pRootSignatureMapMSM;
+			shadowPassPipelineSettings.pShaderProgram = pShaderMapMSM[encoding];
+			addPipeline(pRenderer, &desc, &pPipelineMapMSM[i]);
+
+			// SHADOW ATLAS
+			shadowPassPipelineSettings.pRootSignature = pRootSignatureShadowAtlas;
+			shadowPassPipelineSettings.pShaderProgram = pShaderShadowAtlasMSM[encoding];
+			addPipeline(pRenderer, &desc, &pPipelineShadowAtlasMSM[i]);
+
+			// POINT SHADOWS
+			shadowPassPipelineSettings.pRootSignature = pRootSignaturePointShadow;
+			shadowPassPipelineSettings.pShaderProgram = pShaderPointShadowMSM[encoding];
+			addPipeline(pRenderer, &desc, &pPipelinePointShadowMSM[i]);
+
+			// VIRTUAL SHADOW PAGES
+			shadowPassPipelineSettings.pRootSignature = pRootSignatureVirtualPage;
+			shadowPassPipelineSettings.pShaderProgram = pShaderVirtualPageMSM[encoding];
+			addPipeline(pRenderer, &desc, &pPipelineVirtualPageMSM[i]);
+		}
 
-			if (i < 2)
+		// ESM only renders the directional map
+		for (uint32_t i = 0; i < ESM_FORMAT_COUNT; ++i)
+		{
+			TinyImageFormat shadowMapFormat = gShadowMapFormatsESM[i];
+			shadowPassPipelineSettings.pColorFormats = &shadowMapFormat;
+			shadowPassPipelineSettings.pRootSignature = pRootSignatureMapVSM;
+			shadowPassPipelineSettings.pShaderProgram = pShaderMapESM;
+			addPipeline(pRenderer, &desc, &pPipelineMapESM[i]);
+		}
+
+		// DEPTH-ONLY SHADOW PASS, draws with the VSM shadow pass sets
+		shadowPassPipelineSettings.mRenderTargetCount = 0;
+		shadowPassPipelineSettings.pColorFormats = NULL;
+		shadowPassPipelineSettings.pRootSignature = pRootSignatureMapVSM;
+		shadowPassPipelineSettings.pShaderProgram = pShaderShadowDepth;
+		for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
+		{
+			shadowPassPipelineSettings.mSampleCount = gShadowMsaaSampleCounts[msaa];
+			addPipeline(pRenderer, &desc, &pPipelineShadowDepth[msaa]);
+		}
+
+
+		// BLUR
+		PipelineDesc computeDesc = {};
+		computeDesc.mType = PIPELINE_TYPE_COMPUTE;
+
+		ComputePipelineDesc& shadowBlurPipelineSettings = computeDesc.mComputeDesc;
+		shadowBlurPipelineSettings.pRootSignature = pRootSignatureShadowBlur;
+		for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+		{
+			shadowBlurPipelineSettings.pShaderProgram = pShaderShadowBlur[p];
+			for (uint32_t i = 0; i < gMaxBlurs; ++i)
 			{
-				removeDescriptorSet(pRenderer, pDescriptorSetMapVSM[i]);
-				removeDescriptorSet(pRenderer, pDescriptorSetMapMSM[i]);
-				removeDescriptorSet(pRenderer, pDescriptorSetShadowBlur[i]);
+				addPipeline(pRenderer, &computeDesc, &pPipelineShadowBlur[p][i][0]);
+				addPipeline(pRenderer, &computeDesc, &pPipelineShadowBlur[p][i][1]);
 			}
 		}
 
-		removeResource(pBufferVertexPlane);
-		removeResource(pBufferVertexSphere);
-		removeResource(pBufferVertexLightObject);
-		removeResource(pBufferUniformPlane);
-		removeResource(pBufferUniformLightObject);
-		removeResource(pTexBlurHorVSM);
-		removeResource(pTexBlurVertVSM);
-		removeResource(pTexBlurHorMSM);
-		removeResource(pTexBlurVertMSM);
+		shadowBlurPipelineSettings.pShaderProgram = pShaderShadowBlurESM;
+		for (uint32_t i = 0; i < gMaxBlurs; ++i)
+		{
+			addPipeline(pRenderer, &computeDesc, &pPipelineShadowBlurESM[i][0]);
+			addPipeline(pRenderer, &computeDesc, &pPipelineShadowBlurESM[i][1]);
+		}
 
-		for (int i = 0; i < gNumSpheres; ++i)
+		for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
 		{
-			removeResource(pBufferUniformSphere[i]);
+			shadowBlurPipelineSettings.pRootSignature = pRootSignatureShadowMoments[msaa];
+			for (uint32_t i = 0; i < VSM_FORMAT_COUNT; ++i)
+			{
+				shadowBlurPipelineSettings.pShaderProgram = pShaderShadowMomentsVSM[msaa][getMomentEncodingVSM(i)];
+				addPipeline(pRenderer, &computeDesc, &pPipelineShadowMomentsVSM[msaa][i]);
+			}
+
+			for (uint32_t i = 0; i < MSM_FORMAT_COUNT; ++i)
+			{
+				shadowBlurPipelineSettings.pShaderProgram = pShaderShadowMomentsMSM[msaa][getMomentEncodingMSM(i)];
+				addPipeline(pRenderer, &computeDesc, &pPipelineShadowMomentsMSM[msaa][i]);
+			}
+
+			shadowBlurPipelineSettings.pShaderProgram = pShaderShadowMomentsESM[msaa];
+			addPipeline(pRenderer, &computeDesc, &pPipelineShadowMomentsESM[msaa]);
 		}
 
+		shadowBlurPipelineSettings.pRootSignature = pRootSignatureShadowAtlasBlur;
+		shadowBlurPipelineSettings.pShaderProgram = pShaderShadowAtlasBlur;
+		addPipeline(pRenderer, &computeDesc, &pPipelineShadowAtlasBlur);
 
-		removeSampler(pRenderer, pSamplerBilinear);
-		removeSampler(pRenderer, pSamplerMipless);
-		removeShader(pRenderer, pShaderVSM);
-		removeShader(pRenderer, pShaderMSM);
-		removeShader(pRenderer, pShaderMapVSM);
-		removeShader(pRenderer, pShaderMapMSM);
-		removeShader(pRenderer, pShaderShadowBlur);
-		removeRootSignature(pRenderer, pRootSignatureVSM);
-		removeRootSignature(pRenderer, pRootSignatureMSM);
-		removeRootSignature(pRenderer, pRootSignatureMapVSM);
-		removeRootSignature(pRenderer, pRootSignatureMapMSM);
-		removeRootSignature(pRenderer, pRootSignatureShadowBlur);
+		shadowBlurPipelineSettings.pRootSignature = pRootSignaturePointShadowBlur;
+		shadowBlurPipelineSettings.pShaderProgram = pShaderPointShadowBlur;
+		addPipeline(pRenderer, &computeDesc, &pPipelinePointShadowBlur);
 
-		for (uint32_t i = 0; i < gImageCount; ++i)
+		// SHADOW MASK
+		shadowBlurPipelineSettings.pRootSignature = pRootSignatureShadowMask;
+		for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
 		{
-			removeFence(pRenderer, pFencesRenderComplete[i]);
-			removeSemaphore(pRenderer, pSemaphoresRenderComplete[i]);
+			for (uint32_t i = 0; i < VSM_FORMAT_COUNT; ++i)
+			{
+				shadowBlurPipelineSettings.pShaderProgram = pShaderShadowMaskVSM[p][getMomentEncodingVSM(i)];
+				addPipeline(pRenderer, &computeDesc, &pPipelineShadowMaskVSM[p][i]);
+			}
 
-			removeCmd(pRenderer, pCmds[i]);
-			removeCmdPool(pRenderer, pCmdPools[i]);
+			for (uint32_t i = 0; i < MSM_FORMAT_COUNT; ++i)
+			{
+				shadowBlurPipelineSettings.pShaderProgram = pShaderShadowMaskMSM[p][getMomentEncodingMSM(i)];
+				addPipeline(pRenderer, &computeDesc, &pPipelineShadowMaskMSM[p][i]);
+			}
+
+			shadowBlurPipelineSettings.pShaderProgram = pShaderShadowMaskESM[p];
+			addPipeline(pRenderer, &computeDesc, &pPipelineShadowMaskESM[p]);
+		}
+
+		shadowBlurPipelineSettings.pRootSignature = pRootSignatureShadowMaskTemporal;
+		shadowBlurPipelineSettings.pShaderProgram = pShaderShadowMaskTemporal;
+		addPipeline(pRenderer, &computeDesc, &pPipelineShadowMaskTemporal);
+
+		shadowBlurPipelineSettings.pRootSignature = pRootSignatureShadowMinMax;
+		for (uint32_t i = 0; i < VSM_FORMAT_COUNT; ++i)
+		{
+			shadowBlurPipelineSettings.pShaderProgram = pShaderShadowMinMaxVSM[getMomentEncodingVSM(i)];
+			addPipeline(pRenderer, &computeDesc, &pPipelineShadowMinMaxVSM[i]);
+		}
+
+		for (uint32_t i = 0; i < MSM_FORMAT_COUNT; ++i)
+		{
+			shadowBlurPipelineSettings.pShaderProgram = pShaderShadowMinMaxMSM[getMomentEncodingMSM(i)];
+			addPipeline(pRenderer, &computeDesc, &pPipelineShadowMinMaxMSM[i]);
+		}
+
+		shadowBlurPipelineSettings.pShaderProgram = pShaderShadowMinMaxESM;
+		addPipeline(pRenderer, &computeDesc, &pPipelineShadowMinMaxESM);
+
+		shadowBlurPipelineSettings.pRootSignature = pRootSignatureShadowMomentMips;
+		shadowBlurPipelineSettings.pShaderProgram = pShaderShadowMomentMips;
+		addPipeline(pRenderer, &computeDesc, &pPipelineShadowMomentMips);
+
+		// SCENE ANIMATION
+		shadowBlurPipelineSettings.pRootSignature = pRootSignatureSceneAnimation;
+		shadowBlurPipelineSettings.pShaderProgram = pShaderSceneAnimation;
+		addPipeline(pRenderer, &computeDesc, &pPipelineSceneAnimation);
+
+		// GPU CULLING
+		shadowBlurPipelineSettings.pRootSignature = pRootSignatureHiZ;
+		shadowBlurPipelineSettings.pShaderProgram = pShaderHiZ;
+		addPipeline(pRenderer, &computeDesc, &pPipelineHiZ);
+
+		shadowBlurPipelineSettings.pRootSignature = pRootSignatureCull;
+		shadowBlurPipelineSettings.pShaderProgram = pShaderCullFrustum;
+		addPipeline(pRenderer, &computeDesc, &pPipelineCullFrustum);
+
+		shadowBlurPipelineSettings.pShaderProgram = pShaderCullOcclusion;
+		addPipeline(pRenderer, &computeDesc, &pPipelineCullOcclusion);
+	}
+
+	void removeOffscreenPipelines()
+	{
+		for (uint32_t i = 0; i < VSM_FORMAT_COUNT; ++i)
+		{
+			for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+				removePipeline(pRenderer, pPipelineShadowMaskVSM[p][i]);
+			removePipeline(pRenderer, pPipelineMapVSM[i]);
+			removePipeline(pRenderer, pPipelineShadowAtlasVSM[i]);
+			removePipeline(pRenderer, pPipelinePointShadowVSM[i]);
+			removePipeline(pRenderer, pPipelineVirtualPageVSM[i]);
+			removePipeline(pRenderer, pPipelineShadowMinMaxVSM[i]);
+			for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
+				removePipeline(pRenderer, pPipelineShadowMomentsVSM[msaa][i]);
+		}
+		for (uint32_t i = 0; i < MSM_FORMAT_COUNT; ++i)
+		{
+			for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+				removePipeline(pRenderer, pPipelineShadowMaskMSM[p][i]);
+			removePipeline(pRenderer, pPipelineMapMSM[i]);
+			removePipeline(pRenderer, pPipelineShadowAtlasMSM[i]);
+			removePipeline(pRenderer, pPipelinePointShadowMSM[i]);
+			removePipeline(pRenderer, pPipelineVirtualPageMSM[i]);
+			removePipeline(pRenderer, pPipelineShadowMinMaxMSM[i]);
+			for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
+				removePipeline(pRenderer, pPipelineShadowMomentsMSM[msaa][i]);
+		}
+		for (uint32_t i = 0; i < ESM_FORMAT_COUNT; ++i)
+			removePipeline(pRenderer, pPipelineMapESM[i]);
+		for (uint32_t msaa = 0; msaa < SHADOW_MSAA_COUNT; ++msaa)
+		{
+			removePipeline(pRenderer, pPipelineShadowDepth[msaa]);
+			removePipeline(pRenderer, pPipelineShadowMomentsESM[msaa]);
+		}
+		for (uint32_t p = 0; p < SHADER_PRECISION_COUNT; ++p)
+		{
+			for (uint32_t i = 0; i < gMaxBlurs; ++i)
+			{
+				removePipeline(pRenderer, pPipelineShadowBlur[p][i][0]);
+				removePipeline(pRenderer, pPipelineShadowBlur[p][i][1]);
+			}
+			removePipeline(pRenderer, pPipelineShadowMaskESM[p]);
+		}
+		for (uint32_t i = 0; i < gMaxBlurs; ++i)
+		{
+			removePipeline(pRenderer, pPipelineShadowBlurESM[i][0]);
+			removePipeline(pRenderer, pPipelineShadowBlurESM[i][1]);
+		}
+		removePipeline(pRenderer, pPipelineShadowMinMaxESM);
+		removePipeline(pRenderer, pPipelineShadowMomentMips);
+		removePipeline(pRenderer, pPipelineShadowAtlasBlur);
+		removePipeline(pRenderer, pPipelinePointShadowBlur);
+		removePipeline(pRenderer, pPipelineShadowMaskTemporal);
+		removePipeline(pRenderer, pPipelineSceneAnimation);
+		removePipeline(pRenderer, pPipelineHiZ);
+		removePipeline(pRenderer, pPipelineCullFrustum);
+		removePipeline(pRenderer, pPipelineCullOcclusion);
+	}
+
+	bool addSwapChain()
+	{
+		SwapChainDesc swapChainDesc = {};
+		swapChainDesc.mWindowHandle = pWindow->handle;
+		swapChainDesc.mPresentQueueCount = 1;
+		swapChainDesc.ppPresentQueues = &pGraphicsQueue;
+		swapChainDesc.mWidth = mSettings.mWidth;
+		swapChainDesc.mHeight = mSettings.mHeight;
+		swapChainDesc.mImageCount = gImageCount;
+		swapChainDesc.mColorFormat = getRecommendedSwapchainFormat(true);
+		swapChainDesc.mEnableVsync = mSettings.mDefaultVSyncEnabled;
+		::addSwapChain(pRenderer, &swapChainDesc, &pSwapChain);
+
+		return pSwapChain != NULL;
+	}
+
+	bool addRenderTargets()
+	{
+		// Add depth buffer
+		RenderTargetDesc depthRT = {};
+		depthRT.mArraySize = 1;
+		depthRT.mClearValue.depth = 1.0f;
+		depthRT.mClearValue.stencil = 0;
+		depthRT.mDepth = 1;
+		depthRT.mFormat = TinyImageFormat_D32_SFLOAT;
+		depthRT.mHeight = mSettings.mHeight;
+		depthRT.mSampleCount = SAMPLE_COUNT_1;
+		depthRT.mDescriptors = DESCRIPTOR_TYPE_TEXTURE;
+		depthRT.mSampleQuality = 0;
+		depthRT.mWidth = mSettings.mWidth;
+		depthRT.mFlags = TEXTURE_CREATION_FLAG_ESRAM;
+		depthRT.pName = "Depth RT";
+		addRenderTarget(pRenderer, &depthRT, &pRenderTargetDepthBuffer);
+
+		// Shadow map, shadow depth and blur targets are transient and
+		// allocated on first use by the frame graph, see addShadowPasses
+		return pRenderTargetDepthBuffer != NULL;
+	}
+
+	/************************************************************************/
+	// Frame graph passes
+	/************************************************************************/
+	// Persistent targets holding the last update of every shadow view
+	static RenderTargetDesc getShadowMapCacheDesc()
+	{
+		RenderTargetDesc momentDesc = {};
+		momentDesc.mArraySize = 1;
+		momentDesc.mDepth = 1;
+		momentDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE | DESCRIPTOR_TYPE_RW_TEXTURE;
+		momentDesc.mFormat = getShadowMapFormat();
+		momentDesc.mWidth = getShadowMapResolution()[0];
+		momentDesc.mHeight = getShadowMapResolution()[1];
+		// Contact hardening samples the mean moments of wide regions from the mips
+		momentDesc.mMipLevels = 1;
+		while (isContactHardeningActive() && momentDesc.mMipLevels < gMaxShadowMomentLevels &&
+			(max(momentDesc.mWidth, momentDesc.mHeight) >> momentDesc.mMipLevels))
+			++momentDesc.mMipLevels;
+		momentDesc.mSampleCount = SAMPLE_COUNT_1;
+		momentDesc.mSampleQuality = 0;
+		momentDesc.pName = "Shadow Map Cache";
+		return momentDesc;
+	}
+
+	static RenderTargetDesc getShadowAtlasDesc()
+	{
+		RenderTargetDesc atlasDesc = {};
+		atlasDesc.mArraySize = 1;
+		atlasDesc.mDepth = 1;
+		atlasDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE | DESCRIPTOR_TYPE_RW_TEXTURE;
+		atlasDesc.mFormat = getLocalShadowMapFormat();
+		atlasDesc.mWidth = gShadowAtlasSize;
+		atlasDesc.mHeight = gShadowAtlasSize;
+		atlasDesc.mSampleCount = SAMPLE_COUNT_1;
+		atlasDesc.mSampleQuality = 0;
+		atlasDesc.mClearValue = getShadowFarMoments();
+		atlasDesc.pName = "Shadow Atlas";
+		return atlasDesc;
+	}
+
+	static RenderTargetDesc getVirtualShadowPoolDesc()
+	{
+		RenderTargetDesc poolDesc = {};
+		poolDesc.mArraySize = 1;
+		poolDesc.mDepth = 1;
+		poolDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE | DESCRIPTOR_TYPE_RW_TEXTURE;
+		poolDesc.mFormat = getLocalShadowMapFormat();
+		poolDesc.mWidth = gVirtualShadowPoolSize;
+		poolDesc.mHeight = gVirtualShadowPoolSize;
+		poolDesc.mSampleCount = SAMPLE_COUNT_1;
+		poolDesc.mSampleQuality = 0;
+		poolDesc.mClearValue = getShadowFarMoments();
+		poolDesc.pName = "Virtual Shadow Pages";
+		return poolDesc;
+	}
+
+	static RenderTargetDesc getPointShadowDesc()
+	{
+		RenderTargetDesc cubeDesc = {};
+		cubeDesc.mArraySize = 6 * gPointLightCount;
+		cubeDesc.mDepth = 1;
+		cubeDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE | DESCRIPTOR_TYPE_RW_TEXTURE;
+		cubeDesc.mFormat = getLocalShadowMapFormat();
+		cubeDesc.mWidth = gPointShadowSize;
+		cubeDesc.mHeight = gPointShadowSize;
+		cubeDesc.mSampleCount = SAMPLE_COUNT_1;
+		cubeDesc.mSampleQuality = 0;
+		cubeDesc.mClearValue = getShadowFarMoments();
+		cubeDesc.pName = "Point Shadow Cache";
+		return cubeDesc;
+	}
+
+	// Re-renders the scheduled atlas tiles into a transient target, then blurs
+	// them into the persistent atlas. The other tiles keep their moments.
+	static FrameGraphResource addShadowAtlasPasses(FrameGraph* pGraph)
+	{
+		if (!gShadowAtlasLightCount)
+			return FRAME_GRAPH_INVALID;
+
+		RenderTargetDesc atlasDesc = getShadowAtlasDesc();
+		FrameGraphResource atlas = fgCreatePersistent(pGraph, atlasDesc);
+
+		ShadowAtlasPassData& data = gShadowAtlasPassData;
+		data.mDirtyCount = 0;
+		data.mMaxDirtySize = 0;
+		for (uint32_t i = 0; i < gShadowAtlasLightCount; ++i)
+		{
+			const ShadowAtlasLight& light = gShadowAtlasLights[i];
+			if (!light.mSchedule.mScheduled)
+				continue;
+
+			gShadowAtlasDirtyTiles[data.mDirtyCount] = light.mTile;
+			data.mDirtyLights[data.mDirtyCount++] = i;
+			data.mMaxDirtySize = max(data.mMaxDirtySize, light.mTile.mSize);
+		}
+
+		if (!data.mDirtyCount)
+			return atlas;
+
+		BufferUpdateDesc tileUpdate = { pBufferShadowAtlasTiles[gFrameIndex] };
+		beginUpdateResource(&tileUpdate);
+		memcpy(tileUpdate.pMappedData, gShadowAtlasDirtyTiles, data.mDirtyCount * sizeof(ShadowAtlasTile));
+		endUpdateResource(&tileUpdate, NULL);
+
+		// Same layout as the shadow map targets, so the graph
+		// aliases them with the shadow passes that follow
+		RenderTargetDesc rawDesc = atlasDesc;
+		rawDesc.pName = "Shadow Atlas Raw";
+
+		RenderTargetDesc depthDesc = {};
+		depthDesc.mArraySize = 1;
+		depthDesc.mClearValue.depth = 1.0f;
+		depthDesc.mDepth = 1;
+		depthDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE;
+		depthDesc.mFormat = gShadowDepthFormat;
+		depthDesc.mWidth = gShadowAtlasSize;
+		depthDesc.mHeight = gShadowAtlasSize;
+		depthDesc.mSampleCount = SAMPLE_COUNT_1;
+		depthDesc.mSampleQuality = 0;
+		depthDesc.pName = "Shadow Atlas Depth";
+
+		data.mRaw = fgCreate(pGraph, rawDesc.pName, rawDesc);
+		data.mDepth = fgCreate(pGraph, depthDesc.pName, depthDesc);
+
+		uint32_t pass = fgAddPass(pGraph, "Shadow Atlas", executeShadowAtlasPass, &data);
+		fgWrite(pGraph, pass, data.mRaw, RESOURCE_STATE_RENDER_TARGET);
+		fgWrite(pGraph, pass, data.mDepth, RESOURCE_STATE_DEPTH_WRITE);
+
+		// One separable blur over all dirty tiles, the vertical half writes the atlas
+		BlurPassData& horizontal = gShadowAtlasBlurPassData[0];
+		horizontal.mHorizontal = true;
+		horizontal.mSrc = data.mRaw;
+		horizontal.mDst = fgCreate(pGraph, "Shadow Atlas Horizontal Blur", rawDesc);
+
+		pass = fgAddPass(pGraph, "Shadow Atlas Blur Horizontal", executeShadowAtlasBlurPass, &horizontal);
+		fgRead(pGraph, pass, horizontal.mSrc, RESOURCE_STATE_SHADER_RESOURCE);
+		fgWrite(pGraph, pass, horizontal.mDst, RESOURCE_STATE_UNORDERED_ACCESS);
+
+		BlurPassData& vertical = gShadowAtlasBlurPassData[1];
+		vertical.mHorizontal = false;
+		vertical.mSrc = horizontal.mDst;
+		vertical.mDst = atlas;
+
+		pass = fgAddPass(pGraph, "Shadow Atlas Blur Vertical", executeShadowAtlasBlurPass, &vertical);
+		fgRead(pGraph, pass, vertical.mSrc, RESOURCE_STATE_SHADER_RESOURCE);
+		fgWrite(pGraph, pass, vertical.mDst, RESOURCE_STATE_UNORDERED_ACCESS);
+
+		return atlas;
+	}
+
+	static FrameGraphResource addShadowPasses(FrameGraph* pGraph)
+	{
+		RenderTargetDesc cacheDesc = getShadowMapCacheDesc();
+		FrameGraphResource cache = fgCreatePersistent(pGraph, cacheDesc);
+		if (!gDirectionalSchedule.mScheduled)
+			return cache;
+
+		RenderTargetDesc momentDesc = cacheDesc;
+		momentDesc.mMipLevels = 1;
+		const char* pMapNames[SHADOW_TECHNIQUE_COUNT] = { "VSM RT", "MSM RT", "ESM RT" };
+		momentDesc.pName = pMapNames[gShadowTechnique];
+
+		RenderTargetDesc shadowDepthDesc = {};
+		shadowDepthDesc.mArraySize = 1;
+		shadowDepthDesc.mClearValue.depth = 1.0f;
+		shadowDepthDesc.mDepth = 1;
+		shadowDepthDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE;
+		shadowDepthDesc.mFormat = gShadowDepthFormat;
+		shadowDepthDesc.mWidth = cacheDesc.mWidth;
+		shadowDepthDesc.mHeight = cacheDesc.mHeight;
+		shadowDepthDesc.mSampleCount = gShadowMsaaSampleCounts[gShadowMsaa];
+		shadowDepthDesc.mSampleQuality = 0;
+		shadowDepthDesc.pName = "Shadow Map Depth RT";
+
+		gShadowPassData.mDepth = fgCreate(pGraph, shadowDepthDesc.pName, shadowDepthDesc);
+
+		uint32_t pass = fgAddPass(pGraph, "Shadow Map", executeShadowPass, &gShadowPassData);
+		fgWrite(pGraph, pass, gShadowPassData.mDepth, RESOURCE_STATE_DEPTH_WRITE);
+
+		FrameGraphResource src = 0;
+		uint32_t firstBlurDirection = 0;
+		if (!isShadowDepthOnly())
+		{
+			// Without blurs the shadow pass writes the cache directly
+			gShadowPassData.mMap = gBlurCount ? fgCreate(pGraph, momentDesc.pName, momentDesc) : cache;
+			fgWrite(pGraph, pass, gShadowPassData.mMap, RESOURCE_STATE_RENDER_TARGET);
+			src = gShadowPassData.mMap;
+		}
+		else
+		{
+			// The moments are built in compute together with the first
+			// horizontal blur, the unfiltered ones never reach memory
+			gShadowMomentsPassData.mDepth = gShadowPassData.mDepth;
+			gShadowMomentsPassData.mDst = gBlurCount ? fgCreate(pGraph, "Shadow Horizontal Blur", momentDesc) : cache;
+			gShadowMomentsPassData.mHorizontalBlur = gBlurCount > 0;
+			gShadowMomentsPassData.mWritesCache = gBlurCount == 0;
+			firstBlurDirection = 1;
+
+			pass = fgAddPass(pGraph, "Shadow Moments", executeShadowMomentsPass, &gShadowMomentsPassData);
+			fgRead(pGraph, pass, gShadowMomentsPassData.mDepth, RESOURCE_STATE_SHADER_RESOURCE);
+			fgWrite(pGraph, pass, gShadowMomentsPassData.mDst, RESOURCE_STATE_UNORDERED_ACCESS);
+			src = gShadowMomentsPassData.mDst;
+		}
+
+		// Every blur iteration writes new transient targets, the graph
+		// aliases them so at most two moment targets are alive at once.
+		// The last one writes the cache.
+		for (uint32_t blurIndex = 0; blurIndex < gBlurCount; ++blurIndex)
+		{
+			for (uint32_t direction = (blurIndex) ? 0 : firstBlurDirection; direction < 2; ++direction)
+			{
+				BlurPassData& data = gBlurPassData[blurIndex][direction];
+				data.mBlurIndex = blurIndex;
+				data.mHorizontal = (direction == 0);
+				data.mSrc = src;
+				data.mWritesCache = blurIndex + 1 == gBlurCount && !data.mHorizontal;
+				data.mDst = data.mWritesCache ? cache :
+					fgCreate(pGraph, data.mHorizontal ? "Shadow Horizontal Blur" : "Shadow Vertical Blur", momentDesc);
+
+				snprintf(data.mName, sizeof(data.mName), "Shadow Blur %u %s", blurIndex, data.mHorizontal ? "Horizontal" : "Vertical");
+				pass = fgAddPass(pGraph, data.mName, executeBlurPass, &data);
+				fgRead(pGraph, pass, data.mSrc, RESOURCE_STATE_SHADER_RESOURCE);
+				fgWrite(pGraph, pass, data.mDst, RESOURCE_STATE_UNORDERED_ACCESS);
+
+				src = data.mDst;
+			}
 		}
-		removeSemaphore(pRenderer, pSemaphoreImageAcquired);
-
-		exitResourceLoaderInterface(pRenderer);
-		removeQueue(pRenderer, pGraphicsQueue);
-		removeRenderer(pRenderer);
 
+		return cache;
 	}
 
-	bool Load()
+	// Renders the pages UpdateVirtualShadowPages picked into their slots of a
+	// transient target, then blurs the slots into the persistent pool. Like the
+	// atlas, only the rendered slots are touched.
+	static FrameGraphResource addVirtualShadowPasses(FrameGraph* pGraph)
 	{
-		if (!addSwapChain())
-			return false;
+		if (!isVirtualShadowMapActive())
+			return FRAME_GRAPH_INVALID;
+
+		RenderTargetDesc poolDesc = getVirtualShadowPoolDesc();
+		FrameGraphResource pool = fgCreatePersistent(pGraph, poolDesc);
+
+		VirtualShadowPassData& data = gVirtualShadowPassData;
+		if (!data.mPageCount)
+			return pool;
+
+		for (uint32_t i = 0; i < data.mPageCount; ++i)
+			gVirtualShadowDirtyTiles[i] = virtualShadowSlotTile(gVirtualShadowPageTable[data.mPages[i]]);
+
+		BufferUpdateDesc tileUpdate = { pBufferVirtualPageTiles[gFrameIndex] };
+		beginUpdateResource(&tileUpdate);
+		memcpy(tileUpdate.pMappedData, gVirtualShadowDirtyTiles, data.mPageCount * sizeof(ShadowAtlasTile));
+		endUpdateResource(&tileUpdate, NULL);
+
+		RenderTargetDesc rawDesc = poolDesc;
+		rawDesc.pName = "Virtual Shadow Pages Raw";
+
+		RenderTargetDesc depthDesc = {};
+		depthDesc.mArraySize = 1;
+		depthDesc.mClearValue.depth = 1.0f;
+		depthDesc.mDepth = 1;
+		depthDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE;
+		depthDesc.mFormat = gShadowDepthFormat;
+		depthDesc.mWidth = gVirtualShadowPoolSize;
+		depthDesc.mHeight = gVirtualShadowPoolSize;
+		depthDesc.mSampleCount = SAMPLE_COUNT_1;
+		depthDesc.mSampleQuality = 0;
+		depthDesc.pName = "Virtual Shadow Pages Depth";
+
+		data.mRaw = fgCreate(pGraph, rawDesc.pName, rawDesc);
+		data.mDepth = fgCreate(pGraph, depthDesc.pName, depthDesc);
+
+		uint32_t pass = fgAddPass(pGraph, "Virtual Shadow Pages", executeVirtualShadowPagePass, &data);
+		fgWrite(pGraph, pass, data.mRaw, RESOURCE_STATE_RENDER_TARGET);
+		fgWrite(pGraph, pass, data.mDepth, RESOURCE_STATE_DEPTH_WRITE);
+
+		BlurPassData& horizontal = gVirtualShadowBlurPassData[0];
+		horizontal.mHorizontal = true;
+		horizontal.mSrc = data.mRaw;
+		horizontal.mDst = fgCreate(pGraph, "Virtual Shadow Pages Horizontal Blur", rawDesc);
+
+		pass = fgAddPass(pGraph, "Virtual Shadow Pages Blur Horizontal", executeVirtualShadowBlurPass, &horizontal);
+		fgRead(pGraph, pass, horizontal.mSrc, RESOURCE_STATE_SHADER_RESOURCE);
+		fgWrite(pGraph, pass, horizontal.mDst, RESOURCE_STATE_UNORDERED_ACCESS);
+
+		BlurPassData& vertical = gVirtualShadowBlurPassData[1];
+		vertical.mHorizontal = false;
+		vertical.mSrc = horizontal.mDst;
+		vertical.mDst = pool;
+
+		pass = fgAddPass(pGraph, "Virtual Shadow Pages Blur Vertical", executeVirtualShadowBlurPass, &vertical);
+		fgRead(pGraph, pass, vertical.mSrc, RESOURCE_STATE_SHADER_RESOURCE);
+		fgWrite(pGraph, pass, vertical.mDst, RESOURCE_STATE_UNORDERED_ACCESS);
+
+		return pool;
+	}
 
-		if (!addRenderTargets())
-			return false;
+	// Scheduled point lights are drawn in one layered pass per run of consecutive
+	// lights, then blurred seam-aware into the persistent cube array
+	static FrameGraphResource addPointShadowPasses(FrameGraph* pGraph)
+	{
+		RenderTargetDesc cubeDesc = getPointShadowDesc();
 
-		if (!gAppUI.Load(pSwapChain->ppRenderTargets, 1))
-			return false;
+		// The resolve shaders always bind an array, give them a
+		// minimal one that is never sampled
+		if (!gPointLightCount)
+		{
+			cubeDesc.mArraySize = 6;
+			cubeDesc.mWidth = 1;
+			cubeDesc.mHeight = 1;
+			cubeDesc.pName = "Point Shadow Placeholder";
+			return fgCreate(pGraph, cubeDesc.pName, cubeDesc);
+		}
 
-		if (!gVirtualJoystick.Load(pSwapChain->ppRenderTargets[0]))
-			return false;
+		FrameGraphResource cache = fgCreatePersistent(pGraph, cubeDesc);
 
-		loadProfilerUI(&gAppUI, mSettings.mWidth, mSettings.mHeight);
+		PointShadowPassData& data = gPointShadowPassData;
+		data.mRunCount = 0;
+		for (uint32_t i = 0; i < gPointLightCount; ++i)
+		{
+			if (!gPointLights[i].mSchedule.mScheduled)
+				continue;
 
-		//layout and pipeline for sphere draw
-		VertexLayout vertexLayout = {};
-		vertexLayout.mAttribCount = 2;
-		vertexLayout.mAttribs[0].mSemantic = SEMANTIC_POSITION;
-		vertexLayout.mAttribs[0].mFormat = TinyImageFormat_R32G32B32_SFLOAT;
-		vertexLayout.mAttribs[0].mBinding = 0;
-		vertexLayout.mAttribs[0].mLocation = 0;
-		vertexLayout.mAttribs[0].mOffset = 0;
-		vertexLayout.mAttribs[1].mSemantic = SEMANTIC_NORMAL;
-		vertexLayout.mAttribs[1].mFormat = TinyImageFormat_R32G32B32_SFLOAT;
-		vertexLayout.mAttribs[1].mBinding = 0;
-		vertexLayout.mAttribs[1].mLocation = 1;
-		vertexLayout.mAttribs[1].mOffset = 3 * sizeof(float);
+			if (data.mRunCount && data.mRunFirst[data.mRunCount - 1] + data.mRunLength[data.mRunCount - 1] == i)
+			{
+				++data.mRunLength[data.mRunCount - 1];
+				continue;
+			}
 
-		// Layout for shadow map
-		VertexLayout vertexLayoutPositionOnly = {};
-		vertexLayoutPositionOnly.mAttribCount = 1;
-		vertexLayoutPositionOnly.mAttribs[0].mSemantic = SEMANTIC_POSITION;
-		vertexLayoutPositionOnly.mAttribs[0].mFormat = TinyImageFormat_R32G32B32_SFLOAT;
-		vertexLayoutPositionOnly.mAttribs[0].mBinding = 0;
-		vertexLayoutPositionOnly.mAttribs[0].mLocation = 0;
-		vertexLayoutPositionOnly.mAttribs[0].mOffset = 0;
+			data.mRunFirst[data.mRunCount] = i;
+			data.mRunLength[data.mRunCount++] = 1;
+		}
 
+		if (!data.mRunCount)
+			return cache;
+
+		RenderTargetDesc rawDesc = cubeDesc;
+		rawDesc.pName = "Point Shadow RT";
+
+		RenderTargetDesc depthDesc = {};
+		depthDesc.mArraySize = 6 * gPointLightCount;
+		depthDesc.mClearValue.depth = 1.0f;
+		depthDesc.mDepth = 1;
+		depthDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE;
+		depthDesc.mFormat = gShadowDepthFormat;
+		depthDesc.mWidth = gPointShadowSize;
+		depthDesc.mHeight = gPointShadowSize;
+		depthDesc.mSampleCount = SAMPLE_COUNT_1;
+		depthDesc.mSampleQuality = 0;
+		depthDesc.pName = "Point Shadow Depth RT";
+
+		data.mMap = fgCreate(pGraph, rawDesc.pName, rawDesc);
+		data.mDepth = fgCreate(pGraph, depthDesc.pName, depthDesc);
+
+		uint32_t pass = fgAddPass(pGraph, "Point Shadows", executePointShadowPass, &data);
+		fgWrite(pGraph, pass, data.mMap, RESOURCE_STATE_RENDER_TARGET);
+		fgWrite(pGraph, pass, data.mDepth, RESOURCE_STATE_DEPTH_WRITE);
+
+		FrameGraphResource src = data.mMap;
+		for (uint32_t direction = 0; direction < 2; ++direction)
+		{
+			BlurPassData& blur = gPointShadowBlurPassData[direction];
+			blur.mHorizontal = (direction == 0);
+			blur.mSrc = src;
+			blur.mDst = blur.mHorizontal ? fgCreate(pGraph, "Point Shadow Horizontal Blur", rawDesc) : cache;
 
-		RasterizerStateDesc shadowRasterizerStateDesc = {};
-		shadowRasterizerStateDesc.mCullMode = CULL_MODE_FRONT;
+			pass = fgAddPass(pGraph, blur.mHorizontal ? "Point Shadow Blur Horizontal" : "Point Shadow Blur Vertical",
+				executePointShadowBlurPass, &blur);
+			fgRead(pGraph, pass, blur.mSrc, RESOURCE_STATE_SHADER_RESOURCE);
+			fgWrite(pGraph, pass, blur.mDst, RESOURCE_STATE_UNORDERED_ACCESS);
 
-		RasterizerStateDesc basicRasterizerStateDesc = {};
-		basicRasterizerStateDesc.mCullMode = CULL_MODE_NONE;
+			src = blur.mDst;
+		}
 
-		DepthStateDesc depthStateDesc = {};
-		depthStateDesc.mDepthTest = true;
-		depthStateDesc.mDepthWrite = true;
-		depthStateDesc.mDepthFunc = CMP_LEQUAL;
+		return cache;
+	}
 
-		PipelineDesc desc = {};
-		desc.mType = PIPELINE_TYPE_GRAPHICS;
+	static RenderTargetDesc getShadowMaskDesc(const ShadowView& view)
+	{
+		static const char* pMaskNames[SHADOW_VIEW_COUNT] = { "Shadow Mask", "Minimap Shadow Mask" };
+		uint32_t scale = max(gShadowMaskScale, 1u);
+
+		RenderTargetDesc maskDesc = {};
+		maskDesc.mArraySize = 1;
+		maskDesc.mDepth = 1;
+		maskDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE | DESCRIPTOR_TYPE_RW_TEXTURE;
+		maskDesc.mFormat = gShadowMaskFormat;
+		maskDesc.mWidth = (view.mViewport[2] + scale - 1) / scale;
+		maskDesc.mHeight = (view.mViewport[3] + scale - 1) / scale;
+		maskDesc.mSampleCount = SAMPLE_COUNT_1;
+		maskDesc.mSampleQuality = 0;
+		maskDesc.pName = pMaskNames[view.mMaskPassData.mView];
+		return maskDesc;
+	}
 
-		// SHADOW PASS
-		desc.mGraphicsDesc = {};
-		GraphicsPipelineDesc& shadowPassPipelineSettings = desc.mGraphicsDesc;
-		shadowPassPipelineSettings.mPrimitiveTopo = PRIMITIVE_TOPO_TRI_LIST;
-		shadowPassPipelineSettings.mRenderTargetCount = 1;
-		shadowPassPipelineSettings.pColorFormats = &pRenderTargetMapVSM->mFormat;
-		shadowPassPipelineSettings.pDepthState = &depthStateDesc;
-		shadowPassPipelineSettings.mSampleCount = pRenderTargetShadowDepth->mSampleCount;
-		shadowPassPipelineSettings.mSampleQuality = pRenderTargetShadowDepth->mSampleQuality;
-		shadowPassPipelineSettings.mDepthStencilFormat = pRenderTargetShadowDepth->mFormat;
-		shadowPassPipelineSettings.pRootSignature = pRootSignatureMapVSM;
-		shadowPassPipelineSettings.pRasterizerState = &shadowRasterizerStateDesc;
-		shadowPassPipelineSettings.pVertexLayout = &vertexLayoutPositionOnly;
-		shadowPassPipelineSettings.pShaderProgram = pShaderMapVSM;
-		addPipeline(pRenderer, &desc, &pPipelineMapVSM);
+	// Only the main view keeps a history
+	static RenderTargetDesc getShadowMaskHistoryDesc(uint32_t index)
+	{
+		RenderTargetDesc historyDesc = getShadowMaskDesc(gShadowViews[SHADOW_VIEW_MAIN]);
+		historyDesc.pName = index ? "Shadow Mask History B" : "Shadow Mask History A";
+		return historyDesc;
+	}
 
-		shadowPassPipelineSettings.pColorFormats = &pRenderTargetMapMSM->mFormat;
-		shadowPassPipelineSettings.pShaderProgram = pShaderMapMSM;
-		addPipeline(pRenderer, &desc, &pPipelineMapMSM);
+	// Lays down the camera depth the shadow mask is evaluated from.
+	// The main pass then shades each pixel once with a LEQUAL depth test.
+	static void addDepthPrepass(FrameGraph* pGraph, ShadowView* pView, FrameGraphResource depth)
+	{
+		static const char* pPassNames[SHADOW_VIEW_COUNT] = { "Depth Prepass", "Minimap Depth Prepass" };
+		pView->mMaskPassData.mDepth = depth;
 
+		uint32_t pass = fgAddPass(pGraph, pPassNames[pView->mMaskPassData.mView], executeDepthPrepass, &pView->mMaskPassData);
+		fgWrite(pGraph, pass, depth, RESOURCE_STATE_DEPTH_WRITE);
+	}
 
-		// BLUR
-		PipelineDesc computeDesc = {};
-		computeDesc.mType = PIPELINE_TYPE_COMPUTE;
+	static RenderTargetDesc getHiZDesc()
+	{
+		RenderTargetDesc hiZDesc = {};
+		hiZDesc.mArraySize = 1;
+		hiZDesc.mDepth = 1;
+		hiZDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE | DESCRIPTOR_TYPE_RW_TEXTURE;
+		hiZDesc.mFormat = TinyImageFormat_R32_SFLOAT;
+		hiZDesc.mWidth = (pRenderTargetDepthBuffer->mWidth + gHiZTileSize - 1) / gHiZTileSize;
+		hiZDesc.mHeight = (pRenderTargetDepthBuffer->mHeight + gHiZTileSize - 1) / gHiZTileSize;
+		hiZDesc.mSampleCount = SAMPLE_COUNT_1;
+		hiZDesc.mSampleQuality = 0;
+		hiZDesc.pName = "Hi-Z";
+		return hiZDesc;
+	}
 
-		ComputePipelineDesc& shadowBlurPipelineSettings = computeDesc.mComputeDesc;
-		shadowBlurPipelineSettings.pRootSignature = pRootSignatureShadowBlur;
-		shadowBlurPipelineSettings.pShaderProgram = pShaderShadowBlur;
+	// Reduces the prepass depth to tiles and fills the occlusion list of the main
+	// pass from them. Only the main pass reads the tiles, which keeps the pass alive.
+	static FrameGraphResource addHiZPass(FrameGraph* pGraph, FrameGraphResource depth)
+	{
+		RenderTargetDesc hiZDesc = getHiZDesc();
 
-		for (int i = 0; i < gMaxBlurs; ++i)
-		{
-			addPipeline(pRenderer, &computeDesc, &pPipelineShadowBlur[i][0]);
-			addPipeline(pRenderer, &computeDesc, &pPipelineShadowBlur[i][1]);
-		}
+		gHiZPassData.mDepth = depth;
+		gHiZPassData.mHiZ = fgCreate(pGraph, hiZDesc.pName, hiZDesc);
 
+		uint32_t pass = fgAddPass(pGraph, "Hi-Z Occlusion Culling", executeHiZPass, &gHiZPassData);
+		fgRead(pGraph, pass, depth, RESOURCE_STATE_SHADER_RESOURCE);
+		fgWrite(pGraph, pass, gHiZPassData.mHiZ, RESOURCE_STATE_UNORDERED_ACCESS);
 
+		return gHiZPassData.mHiZ;
+	}
 
-		// MAIN RENDER
-		desc.mGraphicsDesc = {};
-		GraphicsPipelineDesc& pipelineVSM = desc.mGraphicsDesc;
-		pipelineVSM.mPrimitiveTopo = PRIMITIVE_TOPO_TRI_LIST;
-		pipelineVSM.mRenderTargetCount = 1;
-		pipelineVSM.pDepthState = &depthStateDesc;
-		pipelineVSM.pColorFormats = &pSwapChain->ppRenderTargets[0]->mFormat;
-		pipelineVSM.mSampleCount = pSwapChain->ppRenderTargets[0]->mSampleCount;
-		pipelineVSM.mSampleQuality = pSwapChain->ppRenderTargets[0]->mSampleQuality;
-		pipelineVSM.mDepthStencilFormat = pRenderTargetDepthBuffer->mFormat;
-		pipelineVSM.pRootSignature = pRootSignatureVSM;
-		pipelineVSM.pShaderProgram = pShaderVSM;
-		pipelineVSM.pVertexLayout = &vertexLayout;
-		pipelineVSM.pRasterizerState = &basicRasterizerStateDesc;
-		addPipeline(pRenderer, &desc, &pPipelineVSM);
+	static RenderTargetDesc getShadowMinMaxDesc()
+	{
+		uvec2 shadowMapSize = getShadowMapResolution();
+
+		RenderTargetDesc minMaxDesc = {};
+		minMaxDesc.mArraySize = 1;
+		minMaxDesc.mDepth = 1;
+		minMaxDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE | DESCRIPTOR_TYPE_RW_TEXTURE;
+		minMaxDesc.mFormat = TinyImageFormat_R32G32_SFLOAT;
+		minMaxDesc.mWidth = max(shadowMapSize[0] / 2, 1u);
+		minMaxDesc.mHeight = max(shadowMapSize[1] / 2, 1u);
+		// Down to one texel, or the coarsest level any kernel needs
+		minMaxDesc.mMipLevels = 1;
+		while (minMaxDesc.mMipLevels < gMaxShadowMinMaxLevels && (max(minMaxDesc.mWidth, minMaxDesc.mHeight) >> minMaxDesc.mMipLevels))
+			++minMaxDesc.mMipLevels;
+		minMaxDesc.mSampleCount = SAMPLE_COUNT_1;
+		minMaxDesc.mSampleQuality = 0;
+		minMaxDesc.pName = "Shadow Min Max";
+		return minMaxDesc;
+	}
 
-		GraphicsPipelineDesc& pipelineMSM = desc.mGraphicsDesc;
-		pipelineMSM.pShaderProgram = pShaderMSM;
-		pipelineMSM.pRootSignature = pRootSignatureMSM;
-		addPipeline(pRenderer, &desc, &pPipelineMSM);
+	// Persistent like the shadow map cache it is built from, and only rebuilt
+	// with it
+	static FrameGraphResource addShadowMinMaxPass(FrameGraph* pGraph, FrameGraphResource shadowMap)
+	{
+		RenderTargetDesc minMaxDesc = getShadowMinMaxDesc();
+		bool resident = fgHasPersistent(pGraph, minMaxDesc);
 
-		
+		gShadowMinMaxPassData.mShadowMap = shadowMap;
+		gShadowMinMaxPassData.mPyramid = fgCreatePersistent(pGraph, minMaxDesc);
+		gShadowMinMaxPassData.mLevelCount = minMaxDesc.mMipLevels;
+		if (resident && !gDirectionalSchedule.mScheduled)
+			return gShadowMinMaxPassData.mPyramid;
 
-		PrepareDescriptorSets();
+		uint32_t pass = fgAddPass(pGraph, "Shadow Min Max Pyramid", executeShadowMinMaxPass, &gShadowMinMaxPassData);
+		fgRead(pGraph, pass, shadowMap, RESOURCE_STATE_SHADER_RESOURCE);
+		fgWrite(pGraph, pass, gShadowMinMaxPassData.mPyramid, RESOURCE_STATE_UNORDERED_ACCESS);
 
-		return true;
+		return gShadowMinMaxPassData.mPyramid;
 	}
 
-	void Unload()
+	// Filters the mips of the shadow map cache after it was re-rendered
+	static void addShadowMomentMipsPass(FrameGraph* pGraph, FrameGraphResource shadowMap)
 	{
-		waitQueueIdle(pGraphicsQueue);
+		RenderTargetDesc cacheDesc = getShadowMapCacheDesc();
+		if (cacheDesc.mMipLevels < 2 || !gDirectionalSchedule.mScheduled)
+			return;
 
-		unloadProfilerUI();
-		gAppUI.Unload();
+		gShadowMomentMipsPassData.mShadowMap = shadowMap;
+		gShadowMomentMipsPassData.mLevelCount = cacheDesc.mMipLevels;
 
-		gVirtualJoystick.Unload();
+		uint32_t pass = fgAddPass(pGraph, "Shadow Moment Mips", executeShadowMomentMipsPass, &gShadowMomentMipsPassData);
+		fgWrite(pGraph, pass, shadowMap, RESOURCE_STATE_UNORDERED_ACCESS);
+	}
 
-		removePipeline(pRenderer, pPipelineVSM);
-		removePipeline(pRenderer, pPipelineMSM);
-		removePipeline(pRenderer, pPipelineMapVSM);
-		removePipeline(pRenderer, pPipelineMapMSM);
-		for (int i = 0; i < gMaxBlurs; ++i)
+	// Adds the shadow passes of this frame to the graph, once for all views
+	static void BuildShadows(ShadowRenderer* pShadows, FrameGraph* pGraph)
+	{
+		pShadows->mShadowAtlas = addShadowAtlasPasses(pGraph);
+		pShadows->mPointShadows = addPointShadowPasses(pGraph);
+		pShadows->mShadowMap = addShadowPasses(pGraph);
+		addShadowMomentMipsPass(pGraph, pShadows->mShadowMap);
+		pShadows->mVirtualPool = addVirtualShadowPasses(pGraph);
+		pShadows->mMinMax = gShadowMinMax ? addShadowMinMaxPass(pGraph, pShadows->mShadowMap) : FRAME_GRAPH_INVALID;
+	}
+
+	// Evaluates the built directional shadow for the depth of a view.
+	// Returns the mask its main pass reads.
+	static FrameGraphResource BindShadowsForView(const ShadowRenderer* pShadows, FrameGraph* pGraph, ShadowView* pView,
+		FrameGraphResource depth)
+	{
+		static const char* pPassNames[SHADOW_VIEW_COUNT] = { "Shadow Mask", "Minimap Shadow Mask" };
+		RenderTargetDesc maskDesc = getShadowMaskDesc(*pView);
+		ShadowMaskPassData& data = pView->mMaskPassData;
+
+		data.mDepth = depth;
+		data.mShadowMap = pShadows->mShadowMap;
+		data.mVirtualPool = pShadows->mVirtualPool;
+		data.mMinMax = pShadows->mMinMax;
+		data.mMask = fgCreate(pGraph, maskDesc.pName, maskDesc);
+
+		uint32_t pass = fgAddPass(pGraph, pPassNames[data.mView], executeShadowMaskPass, &data);
+		fgRead(pGraph, pass, depth, RESOURCE_STATE_SHADER_RESOURCE);
+		fgRead(pGraph, pass, data.mShadowMap, RESOURCE_STATE_SHADER_RESOURCE);
+		if (data.mVirtualPool != FRAME_GRAPH_INVALID)
+			fgRead(pGraph, pass, data.mVirtualPool, RESOURCE_STATE_SHADER_RESOURCE);
+		if (data.mMinMax != FRAME_GRAPH_INVALID)
+			fgRead(pGraph, pass, data.mMinMax, RESOURCE_STATE_SHADER_RESOURCE);
+		fgWrite(pGraph, pass, data.mMask, RESOURCE_STATE_UNORDERED_ACCESS);
+
+		if (!pView->mTemporal)
+			return data.mMask;
+
+		// Accumulate into this frame's history target, the main pass reads the result
+		RenderTargetDesc resolvedDesc = getShadowMaskHistoryDesc(gShadowMaskFrame & 1);
+		data.mResolved = fgCreatePersistent(pGraph, resolvedDesc);
+		data.mHistory = FRAME_GRAPH_INVALID;
+
+		pass = fgAddPass(pGraph, "Shadow Mask Temporal", executeShadowMaskTemporalPass, &data);
+		fgRead(pGraph, pass, depth, RESOURCE_STATE_SHADER_RESOURCE);
+		fgRead(pGraph, pass, data.mMask, RESOURCE_STATE_SHADER_RESOURCE);
+		if (gShadowMaskHistoryValid)
 		{
-			removePipeline(pRenderer, pPipelineShadowBlur[i][0]);
-			removePipeline(pRenderer, pPipelineShadowBlur[i][1]);
+			RenderTargetDesc historyDesc = getShadowMaskHistoryDesc((gShadowMaskFrame + 1) & 1);
+			data.mHistory = fgCreatePersistent(pGraph, historyDesc);
+			fgRead(pGraph, pass, data.mHistory, RESOURCE_STATE_SHADER_RESOURCE);
 		}
+		fgWrite(pGraph, pass, data.mResolved, RESOURCE_STATE_UNORDERED_ACCESS);
 
-		removeSwapChain(pRenderer, pSwapChain);
+		return data.mResolved;
+	}
 
-		removeRenderTarget(pRenderer, pRenderTargetDepthBuffer);
-		removeRenderTarget(pRenderer, pRenderTargetShadowDepth);
-		removeRenderTarget(pRenderer, pRenderTargetMapVSM);
-		removeRenderTarget(pRenderer, pRenderTargetMapMSM);
+	static void addMainPass(FrameGraph* pGraph, const ShadowRenderer* pShadows, ShadowView* pView, FrameGraphResource shadowMask,
+		FrameGraphResource hiZ, FrameGraphResource color, FrameGraphResource depth)
+	{
+		static const char* pPassNames[SHADOW_VIEW_COUNT] = { "Main", "Minimap" };
+		MainPassData& data = pView->mMainPassData;
+		data.mShadowMask = shadowMask;
+		data.mShadowAtlas = pShadows->mShadowAtlas;
+		data.mPointShadows = pShadows->mPointShadows;
+		data.mColor = color;
+		data.mDepth = depth;
+
+		uint32_t pass = fgAddPass(pGraph, pPassNames[data.mView], executeMainPass, &data);
+		fgRead(pGraph, pass, shadowMask, RESOURCE_STATE_SHADER_RESOURCE);
+		if (data.mShadowAtlas != FRAME_GRAPH_INVALID)
+			fgRead(pGraph, pass, data.mShadowAtlas, RESOURCE_STATE_SHADER_RESOURCE);
+		fgRead(pGraph, pass, data.mPointShadows, RESOURCE_STATE_SHADER_RESOURCE);
+		// Draws the occlusion list the Hi-Z pass wrote
+		if (hiZ != FRAME_GRAPH_INVALID)
+			fgRead(pGraph, pass, hiZ, RESOURCE_STATE_SHADER_RESOURCE);
+		fgWrite(pGraph, pass, color, RESOURCE_STATE_RENDER_TARGET);
+		fgWrite(pGraph, pass, depth, RESOURCE_STATE_DEPTH_WRITE);
 	}
 
-	void Update(float deltaTime)
+	static void addUIPass(FrameGraph* pGraph, FrameGraphResource color)
 	{
-#if !defined(TARGET_IOS)
-		if (pSwapChain->mEnableVsync != gToggleVSync)
-		{
-			waitQueueIdle(pGraphicsQueue);
-			gFrameIndex = 0;
-			::toggleVSync(pRenderer, &pSwapChain);
-		}
-#endif
+		gUIPassData.mColor = color;
 
-		updateInputSystem(mSettings.mWidth, mSettings.mHeight);
-		pCameraController->update(deltaTime);
+		uint32_t pass = fgAddPass(pGraph, "UI", executeUIPass, &gUIPassData);
+		fgWrite(pGraph, pass, color, RESOURCE_STATE_RENDER_TARGET);
+	}
 
-		mat4 viewMat = pCameraController->getViewMatrix();
+	static void executeDepthPrepass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const ShadowMaskPassData* pData = (const ShadowMaskPassData*)pUserData;
+		const ShadowView& view = gShadowViews[pData->mView];
+		RenderTarget* pDepthTarget = fgGetRenderTarget(pGraph, pData->mDepth);
 
-		const float aspectInverse = (float)mSettings.mHeight / (float)mSettings.mWidth;
-		const float horizontal_fov = PI / 2.0f;
-		mat4        projMat = mat4::perspective(horizontal_fov, aspectInverse, 1.0f, 1000.0f);
-		gDataCamera.mProjectView = projMat * viewMat;
-		gDataCamera.mCamPos = vec4(pCameraController->getViewPosition(), 0.0f);
+		// Clears the whole buffer, the views before this one are already drawn
+		LoadActionsDesc loadActions = {};
+		loadActions.mLoadActionDepth = LOAD_ACTION_CLEAR;
+		loadActions.mClearDepth.depth = 1.0f;
+		loadActions.mClearDepth.stencil = 0;
 
-		mat4 identity = mat4::identity();
-		// bounce the spheres yes
-		for (int i = 0; i < gNumSpheres; ++i)
-		{
-			vec3 translate = gDataSphere[i].mWorld.getCol3().getXYZ();
-			translate.setY(gPlanePosition.getY() + 1.0f + abs(sinf(gSphereTimers[i] * gSphereBounceModifiers[i]) * 4.0f));
-			gDataSphere[i].mWorld = identity.translation(translate);
+		// The light object is unlit and never reads the mask, it is left to the main pass
+		cmdBindPipeline(cmd, pPipelineDepthPrepass);
+		cmdBindRenderTargets(cmd, 0, NULL, pDepthTarget, &loadActions, NULL, NULL, -1, -1);
+		cmdSetViewport(cmd, (float)view.mViewport[0], (float)view.mViewport[1], (float)view.mViewport[2], (float)view.mViewport[3],
+			0.0f, 1.0f);
+		cmdSetScissor(cmd, view.mViewport[0], view.mViewport[1], view.mViewport[2], view.mViewport[3]);
+		if (pData->mView == SHADOW_VIEW_MAIN)
+			telemetryBeginPipelineStatistics(cmd, "Depth Prepass");
+		drawObjects(cmd, "Draw Objects (Depth Prepass)", pDescriptorSetDepthPrepass, true, 1, view.mPrepassCull, pData->mView);
+		if (pData->mView == SHADOW_VIEW_MAIN)
+			telemetryEndPipelineStatistics(cmd);
+		cmdBindRenderTargets(cmd, 0, NULL, NULL, NULL, NULL, NULL, -1, -1);
+	}
 
-			gSphereTimers[i] += deltaTime * gBounceSpeed * 0.4f;
-		}
+	static void executeHiZPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const HiZPassData* pData = (const HiZPassData*)pUserData;
+		Texture* pDepth = fgGetRenderTarget(pGraph, pData->mDepth)->pTexture;
+		RenderTarget* pHiZTarget = fgGetRenderTarget(pGraph, pData->mHiZ);
+
+		DescriptorData params[2] = {};
+		params[0].pName = "depthTexture";
+		params[0].ppTextures = &pDepth;
+		params[1].pName = "hiZ";
+		params[1].ppTextures = &pHiZTarget->pTexture;
+		updateDescriptorSet(pRenderer, gFrameIndex, pDescriptorSetHiZ, 2, params);
+		updateDescriptorSet(pRenderer, gFrameIndex, pDescriptorSetCull[1], 1, &params[1]);
+
+		cmdBindPipeline(cmd, pPipelineHiZ);
+		cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSetHiZ);
+
+		const uint32_t* pThreadGroupSize = pShaderHiZ->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+		cmdDispatch(cmd,
+			(pHiZTarget->mWidth + pThreadGroupSize[0] - 1) / pThreadGroupSize[0],
+			(pHiZTarget->mHeight + pThreadGroupSize[1] - 1) / pThreadGroupSize[1],
+			1);
+
+		// The occlusion test reads the tiles back and appends to the lists
+		BufferBarrier bufferBarriers[] = {
+			{ pBufferVisibleObjects, RESOURCE_STATE_UNORDERED_ACCESS },
+			{ pBufferCullArguments, RESOURCE_STATE_UNORDERED_ACCESS },
+		};
+		RenderTargetBarrier hiZBarrier = { pHiZTarget, RESOURCE_STATE_UNORDERED_ACCESS };
+		cmdResourceBarrier(cmd, 2, bufferBarriers, 0, NULL, 1, &hiZBarrier);
 
+		if (gSceneGeneratedSphereCount)
+		{
+			cmdBindPipeline(cmd, pPipelineCullOcclusion);
+			cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSetCull[0]);
+			cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSetCull[1]);
 
-		// Light updates
-		vec3 lightPosVec = SphericalToCartesian(gLightSphereCoords);
-		gViewLight.moveTo({ 0.0f, 0.0f, 0.0f });
-		gViewLight.lookAt(normalize(vec3(0.0f) - lightPosVec));
+			pThreadGroupSize = pShaderCullOcclusion->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+			cmdDispatch(cmd, (gSceneGeneratedSphereCount + pThreadGroupSize[0] - 1) / pThreadGroupSize[0], 1, 1);
+		}
 
+		bufferBarriers[0] = { pBufferVisibleObjects, RESOURCE_STATE_SHADER_RESOURCE };
+		bufferBarriers[1] = { pBufferCullArguments, RESOURCE_STATE_INDIRECT_ARGUMENT };
+		cmdResourceBarrier(cmd, 2, bufferBarriers, 0, NULL, 0, NULL);
+	}
 
-		vec3 diff = gDataLight.mLightValue.getXYZ();
-		diff = normalize(diff);
-		gDataLightObject.mDiffuse = vec4(diff, 0.0f); // 0.0f means not calculated by lighting
+	static void executeShadowMinMaxPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const ShadowMinMaxPassData* pData = (const ShadowMinMaxPassData*)pUserData;
+		RenderTarget* pShadowMapTarget = fgGetRenderTarget(pGraph, pData->mShadowMap);
+		Texture* pPyramid = fgGetRenderTarget(pGraph, pData->mPyramid)->pTexture;
 
-		// directional lighting model
-		mat4 lightViewProj = mat4::orthographic(-15, 15, -15, 15, -gPlaneSize.getZ() * 0.25f, gPlaneSize.getZ() * 0.75f) * gViewLight.getViewMatrix();
+		Pipeline* pPipeline = (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? pPipelineShadowMinMaxMSM[gFormatMSM] : pPipelineShadowMinMaxVSM[gFormatVSM];
+		if (gShadowTechnique == SHADOW_TECHNIQUE_ESM)
+			pPipeline = pPipelineShadowMinMaxESM;
+		cmdBindPipeline(cmd, pPipeline);
 
-		gDataLight.mLightViewProj = lightViewProj;
-		gDataLight.mLightPosition = vec4(lightPosVec, 1.0f);
-		gDataLightObject.mWorld = identity.translation(lightPosVec);
+		const uint32_t* pThreadGroupSize = pShaderShadowMinMaxVSM[0]->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+		uvec2 srcSize = { pShadowMapTarget->mWidth, pShadowMapTarget->mHeight };
+		for (uint32_t level = 0; level < pData->mLevelCount; ++level)
+		{
+			uint32_t index = gFrameIndex * gMaxShadowMinMaxLevels + level;
 
+			// Level 0 never reads srcLevel, any level is valid there
+			DescriptorData params[3] = {};
+			params[0].pName = "shadowMap";
+			params[0].ppTextures = &pShadowMapTarget->pTexture;
+			params[1].pName = "srcLevel";
+			params[1].ppTextures = &pPyramid;
+			params[1].mUAVMipSlice = (level > 0) ? level - 1 : 0;
+			params[2].pName = "dstLevel";
+			params[2].ppTextures = &pPyramid;
+			params[2].mUAVMipSlice = level;
+			updateDescriptorSet(pRenderer, index, pDescriptorSetShadowMinMax, 3, params);
+
+			ShadowMinMaxConstant minMaxConstantData = { srcSize, (level == 0) ? 1u : 0u };
+			cmdBindPushConstants(cmd, pRootSignatureShadowMinMax, "RootConstant", &minMaxConstantData);
+			cmdBindDescriptorSet(cmd, index, pDescriptorSetShadowMinMax);
+
+			uvec2 dstSize = { max(srcSize[0] / 2, 1u), max(srcSize[1] / 2, 1u) };
+			cmdDispatch(cmd,
+				(dstSize[0] + pThreadGroupSize[0] - 1) / pThreadGroupSize[0],
+				(dstSize[1] + pThreadGroupSize[1] - 1) / pThreadGroupSize[1],
+				1);
 
-		gAppUI.Update(deltaTime);
+			// The next level reads this one
+			RenderTargetBarrier levelBarrier = { fgGetRenderTarget(pGraph, pData->mPyramid), RESOURCE_STATE_UNORDERED_ACCESS };
+			cmdResourceBarrier(cmd, 0, NULL, 0, NULL, 1, &levelBarrier);
+			srcSize = dstSize;
+		}
 	}
 
-	void Draw()
+	static void executeShadowMomentMipsPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
 	{
-		uint32_t swapchainImageIndex;
-		acquireNextImage(pRenderer, pSwapChain, pSemaphoreImageAcquired, NULL, &swapchainImageIndex);
-
-		RenderTarget* pRenderTarget = pSwapChain->ppRenderTargets[swapchainImageIndex];
-		Semaphore*    pSemaphoreRenderComplete = pSemaphoresRenderComplete[gFrameIndex];
-		Fence*        pFenceRenderComplete = pFencesRenderComplete[gFrameIndex];
-
-		// Stall if CPU is running "Swap Chain Buffer Count" frames ahead of GPU
-		FenceStatus fenceStatus;
-		getFenceStatus(pRenderer, pFenceRenderComplete, &fenceStatus);
-		if (fenceStatus == FENCE_STATUS_INCOMPLETE)
-			waitForFences(pRenderer, 1, &pFenceRenderComplete);
+		const ShadowMomentMipsPassData* pData = (const ShadowMomentMipsPassData*)pUserData;
+		RenderTarget* pShadowMapTarget = fgGetRenderTarget(pGraph, pData->mShadowMap);
 
-		// Reset cmd pool for this frame
-		resetCmdPool(pRenderer, pCmdPools[gFrameIndex]);
+		cmdBindPipeline(cmd, pPipelineShadowMomentMips);
 
-		/************************************************************************/
-		// Update Uniform Buffers
-		/************************************************************************/
-		BufferUpdateDesc camCbv = { pBufferUniformCamera[gFrameIndex] };
-		gDataCamera.mViewportSize = vec4((float)pRenderTarget->mWidth, (float)pRenderTarget->mHeight, 0.0f, 0.0f);
-		beginUpdateResource(&camCbv);
-		*(UniformCamData*)camCbv.pMappedData = gDataCamera;
-		endUpdateResource(&camCbv, NULL);
+		const uint32_t* pThreadGroupSize = pShaderShadowMomentMips->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+		uvec2 srcSize = { pShadowMapTarget->mWidth, pShadowMapTarget->mHeight };
+		for (uint32_t level = 1; level < pData->mLevelCount; ++level)
+		{
+			uint32_t index = gFrameIndex * gMaxShadowMomentLevels + level;
 
-		BufferUpdateDesc lightCbv = { pBufferUniformLight[gFrameIndex] };
-		beginUpdateResource(&lightCbv);
-		*(UniformLightData*)lightCbv.pMappedData = gDataLight;
-		endUpdateResource(&lightCbv, NULL);
+			DescriptorData params[2] = {};
+			params[0].pName = "srcLevel";
+			params[0].ppTextures = &pShadowMapTarget->pTexture;
+			params[0].mUAVMipSlice = level - 1;
+			params[1].pName = "dstLevel";
+			params[1].ppTextures = &pShadowMapTarget->pTexture;
+			params[1].mUAVMipSlice = level;
+			updateDescriptorSet(pRenderer, index, pDescriptorSetShadowMomentMips, 2, params);
+
+			ShadowMomentMipsConstant mipsConstantData = { srcSize };
+			cmdBindPushConstants(cmd, pRootSignatureShadowMomentMips, "RootConstant", &mipsConstantData);
+			cmdBindDescriptorSet(cmd, index, pDescriptorSetShadowMomentMips);
+
+			uvec2 dstSize = { max(srcSize[0] / 2, 1u), max(srcSize[1] / 2, 1u) };
+			cmdDispatch(cmd,
+				(dstSize[0] + pThreadGroupSize[0] - 1) / pThreadGroupSize[0],
+				(dstSize[1] + pThreadGroupSize[1] - 1) / pThreadGroupSize[1],
+				1);
 
-		for (int i = 0; i < gNumSpheres; ++i)
-		{
-			BufferUpdateDesc sphereCbv = { pBufferUniformSphere[i] };
-			beginUpdateResource(&sphereCbv);
-			*(UniformObjectData*)sphereCbv.pMappedData = gDataSphere[i];
-			endUpdateResource(&sphereCbv, NULL);
+			// The next level reads this one
+			RenderTargetBarrier levelBarrier = { pShadowMapTarget, RESOURCE_STATE_UNORDERED_ACCESS };
+			cmdResourceBarrier(cmd, 0, NULL, 0, NULL, 1, &levelBarrier);
+			srcSize = dstSize;
 		}
+	}
 
-		BufferUpdateDesc lightObjectCbv = { pBufferUniformLightObject };
-		beginUpdateResource(&lightObjectCbv);
-		*(UniformObjectData*)lightObjectCbv.pMappedData = gDataLightObject;
-		endUpdateResource(&lightObjectCbv, NULL);
+	static void executeShadowMaskPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const ShadowMaskPassData* pData = (const ShadowMaskPassData*)pUserData;
+		Texture* pDepth = fgGetRenderTarget(pGraph, pData->mDepth)->pTexture;
+		Texture* pShadowMap = fgGetRenderTarget(pGraph, pData->mShadowMap)->pTexture;
+		RenderTarget* pMaskTarget = fgGetRenderTarget(pGraph, pData->mMask);
+		// Without the virtual map the shader never samples the pool, bind anything valid
+		const bool virtualShadows = pData->mVirtualPool != FRAME_GRAPH_INVALID;
+		Texture* pVirtualPool = virtualShadows ? fgGetRenderTarget(pGraph, pData->mVirtualPool)->pTexture : pShadowMap;
+		Texture* pMinMax = (pData->mMinMax != FRAME_GRAPH_INVALID) ? fgGetRenderTarget(pGraph, pData->mMinMax)->pTexture : pShadowMap;
+
+		DescriptorData params[5] = {};
+		params[0].pName = "depthTexture";
+		params[0].ppTextures = &pDepth;
+		params[1].pName = "shadowMap";
+		params[1].ppTextures = &pShadowMap;
+		params[2].pName = "shadowMask";
+		params[2].ppTextures = &pMaskTarget->pTexture;
+		params[3].pName = "virtualPool";
+		params[3].ppTextures = &pVirtualPool;
+		params[4].pName = "shadowMinMax";
+		params[4].ppTextures = &pMinMax;
+		const uint32_t setIndex = getViewSetIndex(pData->mView);
+		updateDescriptorSet(pRenderer, setIndex, pDescriptorSetShadowMask, 5, params);
+
+		const uint32_t precision = getShadingPrecision();
+		Pipeline* pPipeline = (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? pPipelineShadowMaskMSM[precision][gFormatMSM] : pPipelineShadowMaskVSM[precision][gFormatVSM];
+		if (gShadowTechnique == SHADOW_TECHNIQUE_ESM)
+			pPipeline = pPipelineShadowMaskESM[precision];
+		cmdBindPipeline(cmd, pPipeline);
+		cmdBindDescriptorSet(cmd, setIndex, pDescriptorSetShadowMask);
 
-		/************************************************************************/
-		// Begin Render 
-		/************************************************************************/
-		Cmd* cmd = pCmds[gFrameIndex];
-		beginCmd(cmd);
+		const uint32_t* pThreadGroupSize = pShaderShadowMaskVSM[0][0]->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+		cmdDispatch(cmd,
+			(pMaskTarget->mWidth + pThreadGroupSize[0] - 1) / pThreadGroupSize[0],
+			(pMaskTarget->mHeight + pThreadGroupSize[1] - 1) / pThreadGroupSize[1],
+			1);
 
-		/************************************************************************/
-		// Draw Objects
-		/************************************************************************/
-		cmdBeginGpuFrameProfile(cmd, gGpuProfileToken);
+		// The page requests are read once this frame's fence signalled.
+		// All views append to the same list, the last view's copy holds them all.
+		if (virtualShadows)
+		{
+			BufferBarrier requestBarrier = { pBufferVirtualPageRequests, RESOURCE_STATE_COPY_SOURCE };
+			cmdResourceBarrier(cmd, 1, &requestBarrier, 0, NULL, 0, NULL);
+			cmdUpdateBuffer(cmd, pBufferVirtualPageReadback[gFrameIndex], 0, pBufferVirtualPageRequests, 0, sizeof(uint32_t) * gVirtualShadowPageCount);
+			requestBarrier.mNewState = RESOURCE_STATE_UNORDERED_ACCESS;
+			cmdResourceBarrier(cmd, 1, &requestBarrier, 0, NULL, 0, NULL);
+		}
+	}
 
-		/************************************************************************/
-		// Shadow Map pass
-		/************************************************************************/
-		RenderTarget* mapTarget = (gToggleMSM) ? (pRenderTargetMapMSM) : pRenderTargetMapVSM;
-		Pipeline* pPipeline = (gToggleMSM) ? pPipelineMapMSM : pPipelineMapVSM;
+	static void executeShadowMaskTemporalPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const ShadowMaskPassData* pData = (const ShadowMaskPassData*)pUserData;
+		Texture* pDepth = fgGetRenderTarget(pGraph, pData->mDepth)->pTexture;
+		Texture* pCurrent = fgGetRenderTarget(pGraph, pData->mMask)->pTexture;
+		RenderTarget* pResolvedTarget = fgGetRenderTarget(pGraph, pData->mResolved);
+		// Without history the shader never samples it, bind anything valid
+		Texture* pHistory = (pData->mHistory != FRAME_GRAPH_INVALID) ?
+			fgGetRenderTarget(pGraph, pData->mHistory)->pTexture : pCurrent;
+
+		DescriptorData params[4] = {};
+		params[0].pName = "depthTexture";
+		params[0].ppTextures = &pDepth;
+		params[1].pName = "currentMask";
+		params[1].ppTextures = &pCurrent;
+		params[2].pName = "historyMask";
+		params[2].ppTextures = &pHistory;
+		params[3].pName = "resolvedMask";
+		params[3].ppTextures = &pResolvedTarget->pTexture;
+		updateDescriptorSet(pRenderer, gFrameIndex, pDescriptorSetShadowMaskTemporal, 4, params);
+
+		cmdBindPipeline(cmd, pPipelineShadowMaskTemporal);
+		cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSetShadowMaskTemporal);
+
+		const uint32_t* pThreadGroupSize = pShaderShadowMaskTemporal->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+		cmdDispatch(cmd,
+			(pResolvedTarget->mWidth + pThreadGroupSize[0] - 1) / pThreadGroupSize[0],
+			(pResolvedTarget->mHeight + pThreadGroupSize[1] - 1) / pThreadGroupSize[1],
+			1);
+	}
 
-		RenderTargetBarrier shadowBarriers[] = {
-			{ mapTarget, RESOURCE_STATE_RENDER_TARGET },
-			{ pRenderTargetShadowDepth, RESOURCE_STATE_DEPTH_WRITE }
-		};
-		cmdResourceBarrier(cmd, 0, NULL, 0, NULL, 2, shadowBarriers);
+	static void executeShadowPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const ShadowPassData* pData = (const ShadowPassData*)pUserData;
+		RenderTarget* depthTarget = fgGetRenderTarget(pGraph, pData->mDepth);
 
 		// Record screen clear
 		LoadActionsDesc loadActions = {};
 		loadActions.mLoadActionDepth = LOAD_ACTION_CLEAR;
 		loadActions.mClearDepth.depth = 1.0f;
 		loadActions.mClearDepth.stencil = 0;
-
-		ClearValue clearColor = { { 0.0f, 0.0f, 0.0f, 0.0f} };
-
-		loadActions.mClearColorValues[0] = clearColor;
+		loadActions.mClearColorValues[0] = { { 0.0f, 0.0f, 0.0f, 0.0f } };
 		loadActions.mLoadActionsColor[0] = LOAD_ACTION_CLEAR;
 
-		cmdBindPipeline(cmd, pPipeline);
-		cmdBindRenderTargets(cmd, 1, &mapTarget, pRenderTargetShadowDepth, &loadActions, NULL, NULL, -1, -1);
-		cmdSetViewport(cmd, 0.0f, 0.0f, (float)mapTarget->mWidth, (float)mapTarget->mHeight, 0.0f, 1.0f);
-		cmdSetScissor(cmd, 0, 0, mapTarget->mWidth, mapTarget->mHeight);
-		drawObjects(cmd, "Draw Objects (Shadow Map)", true);
-
-		/************************************************************************/
-		// Shadow Blur pass
-		/************************************************************************/
-
-		struct ShadowBlurConstant
+		if (isShadowDepthOnly())
 		{
-			uvec2 shadowMapSize;
-			bool horizontalPass;
-		} shadowConstantData = { gShadowMapData.mSize, true };
-
-		Texture* pTexBlurHor = (gToggleMSM) ? pTexBlurHorMSM : pTexBlurHorVSM;
-		Texture* pTexBlurVert = (gToggleMSM) ? pTexBlurVertMSM : pTexBlurVertVSM;
-
-		for (uint32_t blurIndex = 0; blurIndex < gBlurCount; ++blurIndex)
+			cmdBindPipeline(cmd, pPipelineShadowDepth[gShadowMsaa]);
+			cmdBindRenderTargets(cmd, 0, NULL, depthTarget, &loadActions, NULL, NULL, -1, -1);
+		}
+		else
 		{
-			//// FIRST PASS, HORIZONTAL
-			shadowConstantData.horizontalPass = true;
-
-			Texture* src;
-			if (blurIndex == 0)
-			{
-				RenderTargetBarrier blurBarriersHor[] = {
-					{ mapTarget, RESOURCE_STATE_SHADER_RESOURCE }
-				};
-				TextureBarrier texBlurBarrierHor[] = {
-					{ pTexBlurHor, RESOURCE_STATE_UNORDERED_ACCESS }
-				};
-				cmdResourceBarrier(cmd, 0, NULL, 1, texBlurBarrierHor, 1, blurBarriersHor);
-				src = mapTarget->pTexture;
-			}
-			else
-			{
-				TextureBarrier texBlurBarrierHor[] = {
-					{ pTexBlurVert, RESOURCE_STATE_SHADER_RESOURCE },
-					{ pTexBlurHor, RESOURCE_STATE_UNORDERED_ACCESS }
-				};
-				cmdResourceBarrier(cmd, 0, NULL, 2, texBlurBarrierHor, 0, NULL);
-				src = pTexBlurVert;
-			}
-
+			RenderTarget* mapTarget = fgGetRenderTarget(pGraph, pData->mMap);
+			Pipeline* pPipeline = (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? pPipelineMapMSM[gFormatMSM] : pPipelineMapVSM[gFormatVSM];
+			if (gShadowTechnique == SHADOW_TECHNIQUE_ESM)
+				pPipeline = pPipelineMapESM[gFormatESM];
+			cmdBindPipeline(cmd, pPipeline);
+			cmdBindRenderTargets(cmd, 1, &mapTarget, depthTarget, &loadActions, NULL, NULL, -1, -1);
+		}
+		cmdSetViewport(cmd, 0.0f, 0.0f, (float)depthTarget->mWidth, (float)depthTarget->mHeight, 0.0f, 1.0f);
+		telemetryBeginPipelineStatistics(cmd, "Shadow Map");
+		// The depth-only and ESM pipelines share the layout of the VSM one.
+		// A scrolled toroidal map only draws its bands, see DirectionalShadowUpdate.
+		for (uint32_t i = 0; i < gDirectionalUpdate.mRenderRectCount; ++i)
+		{
+			const ShadowRect& rect = gDirectionalUpdate.mRenderRects[i];
+			cmdSetScissor(cmd, rect.mX, rect.mY, rect.mWidth, rect.mHeight);
+			drawObjects(cmd, "Draw Objects (Shadow Map)", (gShadowTechnique == SHADOW_TECHNIQUE_MSM && !isShadowDepthOnly()) ? pDescriptorSetMapMSM : pDescriptorSetMapVSM, true, 1, CULL_VIEW_LIGHT);
+		}
+		telemetryEndPipelineStatistics(cmd);
+		cmdBindRenderTargets(cmd, 0, NULL, NULL, NULL, NULL, NULL, -1, -1);
+	}
 
-			cmdBindPipeline(cmd, pPipelineShadowBlur[blurIndex][0]);
-			cmdBindPushConstants(cmd, pRootSignatureShadowBlur, "RootConstant", &shadowConstantData);
-			const uint32_t* pThreadGroupSize = pShaderShadowBlur->pReflection->mStageReflections[0].mNumThreadsPerGroup;
-			{
-				uint32_t index = gFrameIndex * gMaxBlurs + blurIndex;
-				DescriptorData params[2] = {};
-				params[0].pName = "srcTexture";
-				params[0].ppTextures = &src;
-				updateDescriptorSet(pRenderer, index, pDescriptorSetShadowBlur[0], 1, params);
-
-				params[0].pName = "dstTexture";
-				params[0].ppTextures = &pTexBlurHor;
-				updateDescriptorSet(pRenderer, index, pDescriptorSetShadowBlur[1], 1, params);
-
-				cmdBindDescriptorSet(cmd, index, pDescriptorSetShadowBlur[0]);
-				cmdBindDescriptorSet(cmd, index, pDescriptorSetShadowBlur[1]);
-			}
+	static void executeShadowMomentsPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const ShadowMomentsPassData* pData = (const ShadowMomentsPassData*)pUserData;
+		Texture* depth = fgGetRenderTarget(pGraph, pData->mDepth)->pTexture;
+		Texture* dst = fgGetRenderTarget(pGraph, pData->mDst)->pTexture;
+
+		const uvec2 size = getShadowMapResolution();
+
+		DescriptorData params[2] = {};
+		params[0].pName = "depthTexture";
+		params[0].ppTextures = &depth;
+		params[1].pName = "dstTexture";
+		params[1].ppTextures = &dst;
+		updateDescriptorSet(pRenderer, gFrameIndex, pDescriptorSetShadowMoments[gShadowMsaa], 2, params);
+
+		Pipeline* pPipeline = (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? pPipelineShadowMomentsMSM[gShadowMsaa][gFormatMSM] : pPipelineShadowMomentsVSM[gShadowMsaa][gFormatVSM];
+		if (gShadowTechnique == SHADOW_TECHNIQUE_ESM)
+			pPipeline = pPipelineShadowMomentsESM[gShadowMsaa];
+		cmdBindPipeline(cmd, pPipeline);
+		cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSetShadowMoments[gShadowMsaa]);
+
+		// One dispatch per rect of the update, writes of the cache are scrolled
+		const DirectionalShadowUpdate& update = gDirectionalUpdate;
+		const ShadowRect* pRects = pData->mWritesCache ? update.mWriteRects : update.mRenderRects;
+		const uint32_t rectCount = pData->mWritesCache ? update.mWriteRectCount : update.mRenderRectCount;
+		uvec2 dstOffset = { 0, 0 };
+		if (pData->mWritesCache)
+			dstOffset = update.mWrapOffset;
+		const uint32_t* pThreadGroupSize = pShaderShadowMomentsVSM[0][0]->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+		for (uint32_t i = 0; i < rectCount; ++i)
+		{
+			const ShadowRect& rect = pRects[i];
+			ShadowMomentsConstant momentsConstantData = {
+				size, { rect.mX, rect.mY }, { rect.mWidth, rect.mHeight }, dstOffset, pData->mHorizontalBlur
+			};
+			cmdBindPushConstants(cmd, pRootSignatureShadowMoments[gShadowMsaa], "RootConstant", &momentsConstantData);
 			cmdDispatch(cmd,
-				gShadowMapData.mSize[0] / pThreadGroupSize[0] + 1,
-				gShadowMapData.mSize[1] / pThreadGroupSize[1] + 1,
+				(rect.mWidth + pThreadGroupSize[0] - 1) / pThreadGroupSize[0],
+				(rect.mHeight + pThreadGroupSize[1] - 1) / pThreadGroupSize[1],
 				1);
-			// ---------------------
+		}
+	}
+
+	static void executeShadowAtlasPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const ShadowAtlasPassData* pData = (const ShadowAtlasPassData*)pUserData;
+		RenderTarget* rawTarget = fgGetRenderTarget(pGraph, pData->mRaw);
+		RenderTarget* depthTarget = fgGetRenderTarget(pGraph, pData->mDepth);
+		Pipeline* pPipeline = (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? pPipelineShadowAtlasMSM[gFormatMSM] : pPipelineShadowAtlasVSM[gFormatVSM];
+
+		// Texels outside of the lights' geometry must read as far away
+		LoadActionsDesc loadActions = {};
+		loadActions.mLoadActionDepth = LOAD_ACTION_CLEAR;
+		loadActions.mClearDepth.depth = 1.0f;
+		loadActions.mClearDepth.stencil = 0;
+		loadActions.mClearColorValues[0] = getShadowFarMoments();
+		loadActions.mLoadActionsColor[0] = LOAD_ACTION_CLEAR;
 
+		cmdBindPipeline(cmd, pPipeline);
+		cmdBindRenderTargets(cmd, 1, &rawTarget, depthTarget, &loadActions, NULL, NULL, -1, -1);
+		telemetryBeginGpuScope(cmd, "Draw Objects (Shadow Atlas)");
+		telemetryBeginPipelineStatistics(cmd, "Shadow Atlas");
 
-			////  SECOND PASS, VERTICAL
-			shadowConstantData.horizontalPass = false;
+		for (uint32_t i = 0; i < pData->mDirtyCount; ++i)
+		{
+			const ShadowAtlasTile& tile = gShadowAtlasDirtyTiles[i];
+			cmdSetViewport(cmd, (float)tile.mX, (float)tile.mY, (float)tile.mSize, (float)tile.mSize, 0.0f, 1.0f);
+			cmdSetScissor(cmd, tile.mX, tile.mY, tile.mSize, tile.mSize);
+			cmdBindPushConstants(cmd, pRootSignatureShadowAtlas, "cbAtlasRootConstants", &pData->mDirtyLights[i]);
+			drawObjects(cmd, NULL, pDescriptorSetShadowAtlas, true);
+		}
 
-			TextureBarrier blurBarriersVert[] = {
-				{ pTexBlurHor, RESOURCE_STATE_SHADER_RESOURCE },
-				{ pTexBlurVert, RESOURCE_STATE_UNORDERED_ACCESS }
-			};
-			cmdResourceBarrier(cmd, 0, NULL, 2, blurBarriersVert, 0, NULL);
+		telemetryEndPipelineStatistics(cmd);
+		telemetryEndGpuScope(cmd);
+		cmdBindRenderTargets(cmd, 0, NULL, NULL, NULL, NULL, NULL, -1, -1);
+	}
 
-			cmdBindPushConstants(cmd, pRootSignatureShadowBlur, "RootConstant", &shadowConstantData);
-			//Update descriptors for new blur pass, vertical
-			{
-				uint32_t index = gFrameIndex * gMaxBlurs + gMaxBlurs * gImageCount + blurIndex;
+	static void executeVirtualShadowPagePass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const VirtualShadowPassData* pData = (const VirtualShadowPassData*)pUserData;
+		RenderTarget* rawTarget = fgGetRenderTarget(pGraph, pData->mRaw);
+		RenderTarget* depthTarget = fgGetRenderTarget(pGraph, pData->mDepth);
+		Pipeline* pPipeline = (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? pPipelineVirtualPageMSM[gFormatMSM] : pPipelineVirtualPageVSM[gFormatVSM];
 
-				DescriptorData params[2] = {};
-				params[0].pName = "srcTexture";
-				params[0].ppTextures = &pTexBlurHor;
-				updateDescriptorSet(pRenderer, index, pDescriptorSetShadowBlur[0], 1, params);
+		// Texels outside of the casters must read as far away
+		LoadActionsDesc loadActions = {};
+		loadActions.mLoadActionDepth = LOAD_ACTION_CLEAR;
+		loadActions.mClearDepth.depth = 1.0f;
+		loadActions.mClearDepth.stencil = 0;
+		loadActions.mClearColorValues[0] = getShadowFarMoments();
+		loadActions.mLoadActionsColor[0] = LOAD_ACTION_CLEAR;
 
-				params[0].pName = "dstTexture";
-				params[0].ppTextures = &pTexBlurVert;
-				updateDescriptorSet(pRenderer, index, pDescriptorSetShadowBlur[1], 1, params);
+		cmdBindPipeline(cmd, pPipeline);
+		cmdBindRenderTargets(cmd, 1, &rawTarget, depthTarget, &loadActions, NULL, NULL, -1, -1);
+		telemetryBeginGpuScope(cmd, "Draw Objects (Virtual Shadow Pages)");
 
-				cmdBindDescriptorSet(cmd, index, pDescriptorSetShadowBlur[0]);
-				cmdBindDescriptorSet(cmd, index, pDescriptorSetShadowBlur[1]);
-			}
-			cmdBindPipeline(cmd, pPipelineShadowBlur[blurIndex][1]);
+		// Every page draws the casters of the whole light frustum, the scissor drops the rest
+		for (uint32_t i = 0; i < pData->mPageCount; ++i)
+		{
+			const ShadowAtlasTile& tile = gVirtualShadowDirtyTiles[i];
+			vec4 pageTransform = virtualShadowPageTransform(pData->mPages[i]);
+			cmdSetViewport(cmd, (float)tile.mX, (float)tile.mY, (float)tile.mSize, (float)tile.mSize, 0.0f, 1.0f);
+			cmdSetScissor(cmd, tile.mX, tile.mY, tile.mSize, tile.mSize);
+			cmdBindPushConstants(cmd, pRootSignatureVirtualPage, "cbVirtualPageRootConstants", &pageTransform);
+			drawObjects(cmd, NULL, pDescriptorSetVirtualPage, true, 1, CULL_VIEW_LIGHT);
+		}
+
+		telemetryEndGpuScope(cmd);
+		cmdBindRenderTargets(cmd, 0, NULL, NULL, NULL, NULL, NULL, -1, -1);
+	}
+
+	static void executeBlurPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const BlurPassData* pData = (const BlurPassData*)pUserData;
+		Texture* src = fgGetRenderTarget(pGraph, pData->mSrc)->pTexture;
+		Texture* dst = fgGetRenderTarget(pGraph, pData->mDst)->pTexture;
+
+		const uvec2 size = getShadowMapResolution();
+
+		uint32_t index = gFrameIndex * gMaxBlurs + pData->mBlurIndex;
+		if (!pData->mHorizontal)
+			index += gMaxBlurs * gImageCount;
+
+		DescriptorData params[1] = {};
+		params[0].pName = "srcTexture";
+		params[0].ppTextures = &src;
+		updateDescriptorSet(pRenderer, index, pDescriptorSetShadowBlur[0], 1, params);
+
+		params[0].pName = "dstTexture";
+		params[0].ppTextures = &dst;
+		updateDescriptorSet(pRenderer, index, pDescriptorSetShadowBlur[1], 1, params);
+
+		const uint32_t direction = pData->mHorizontal ? 0 : 1;
+		cmdBindPipeline(cmd, (gShadowTechnique == SHADOW_TECHNIQUE_ESM) ?
+			pPipelineShadowBlurESM[pData->mBlurIndex][direction] : pPipelineShadowBlur[getBlurPrecision()][pData->mBlurIndex][direction]);
+		cmdBindDescriptorSet(cmd, index, pDescriptorSetShadowBlur[0]);
+		cmdBindDescriptorSet(cmd, index, pDescriptorSetShadowBlur[1]);
+
+		// Like the moments pass, one dispatch per rect of the update
+		const DirectionalShadowUpdate& update = gDirectionalUpdate;
+		const ShadowRect* pRects = pData->mWritesCache ? update.mWriteRects : update.mRenderRects;
+		const uint32_t rectCount = pData->mWritesCache ? update.mWriteRectCount : update.mRenderRectCount;
+		uvec2 dstOffset = { 0, 0 };
+		if (pData->mWritesCache)
+			dstOffset = update.mWrapOffset;
+		const uint32_t* pThreadGroupSize = pShaderShadowBlur[0]->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+		for (uint32_t i = 0; i < rectCount; ++i)
+		{
+			const ShadowRect& rect = pRects[i];
+			ShadowBlurConstant shadowConstantData = {
+				size, { rect.mX, rect.mY }, { rect.mWidth, rect.mHeight }, dstOffset, pData->mHorizontal
+			};
 			cmdBindPushConstants(cmd, pRootSignatureShadowBlur, "RootConstant", &shadowConstantData);
 			cmdDispatch(cmd,
-				gShadowMapData.mSize[0] / pThreadGroupSize[0] + 1,
-				gShadowMapData.mSize[1] / pThreadGroupSize[1] + 1,
+				(rect.mWidth + pThreadGroupSize[0] - 1) / pThreadGroupSize[0],
+				(rect.mHeight + pThreadGroupSize[1] - 1) / pThreadGroupSize[1],
 				1);
-			////// -------------------------
-
 		}
+	}
 
-		/************************************************************************/
-		// Main render pass
-		/************************************************************************/
-		// --------------------------------------
-		// Transfer shadow map to a Shader resource state
+	static void executePointShadowPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const PointShadowPassData* pData = (const PointShadowPassData*)pUserData;
+		RenderTarget* mapTarget = fgGetRenderTarget(pGraph, pData->mMap);
+		RenderTarget* depthTarget = fgGetRenderTarget(pGraph, pData->mDepth);
+		Pipeline* pPipeline = (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? pPipelinePointShadowMSM[gFormatMSM] : pPipelinePointShadowVSM[gFormatVSM];
+
+		LoadActionsDesc loadActions = {};
+		loadActions.mLoadActionDepth = LOAD_ACTION_CLEAR;
+		loadActions.mClearDepth.depth = 1.0f;
+		loadActions.mClearDepth.stencil = 0;
+		loadActions.mClearColorValues[0] = getShadowFarMoments();
+		loadActions.mLoadActionsColor[0] = LOAD_ACTION_CLEAR;
+
+		// All layers are bound, SV_RenderTargetArrayIndex picks the face per instance
+		cmdBindPipeline(cmd, pPipeline);
+		cmdBindRenderTargets(cmd, 1, &mapTarget, depthTarget, &loadActions, NULL, NULL, -1, -1);
+		cmdSetViewport(cmd, 0.0f, 0.0f, (float)mapTarget->mWidth, (float)mapTarget->mHeight, 0.0f, 1.0f);
+		cmdSetScissor(cmd, 0, 0, mapTarget->mWidth, mapTarget->mHeight);
 
-		if (gBlurCount != 0)
+		// One instanced draw per run of scheduled lights, the root constant
+		// offsets the instance into the light and layer range of the run
+		telemetryBeginGpuScope(cmd, "Draw Objects (Point Shadows)");
+		telemetryBeginPipelineStatistics(cmd, "Point Shadows");
+		for (uint32_t run = 0; run < pData->mRunCount; ++run)
 		{
-			RenderTargetBarrier rtBarriers[] = {
-				{ pRenderTarget, RESOURCE_STATE_RENDER_TARGET },
-				{ pRenderTargetDepthBuffer, RESOURCE_STATE_DEPTH_WRITE }
-			};
-			TextureBarrier texBarriers[] = {
-				{ pTexBlurVert, RESOURCE_STATE_SHADER_RESOURCE }
-			};
-			cmdResourceBarrier(cmd, 0, NULL, 1, texBarriers, 2, rtBarriers);
+			cmdBindPushConstants(cmd, pRootSignaturePointShadow, "cbPointShadowRootConstants", &pData->mRunFirst[run]);
+			drawObjects(cmd, NULL, pDescriptorSetPointShadow, true, 6 * pData->mRunLength[run]);
 		}
-		else
+		telemetryEndPipelineStatistics(cmd);
+		telemetryEndGpuScope(cmd);
+		cmdBindRenderTargets(cmd, 0, NULL, NULL, NULL, NULL, NULL, -1, -1);
+	}
+
+	static void executePointShadowBlurPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const BlurPassData* pData = (const BlurPassData*)pUserData;
+		Texture* src = fgGetRenderTarget(pGraph, pData->mSrc)->pTexture;
+		Texture* dst = fgGetRenderTarget(pGraph, pData->mDst)->pTexture;
+
+		const PointShadowPassData& runs = gPointShadowPassData;
+		uint32_t index = gFrameIndex * 2 + (pData->mHorizontal ? 0 : 1);
+
+		DescriptorData params[2] = {};
+		params[0].pName = "srcTexture";
+		params[0].ppTextures = &src;
+		params[1].pName = "dstTexture";
+		params[1].ppTextures = &dst;
+		updateDescriptorSet(pRenderer, index, pDescriptorSetPointShadowBlur, 2, params);
+
+		cmdBindPipeline(cmd, pPipelinePointShadowBlur);
+		cmdBindDescriptorSet(cmd, index, pDescriptorSetPointShadowBlur);
+
+		// Only the layers of scheduled lights are blurred, the others keep their moments
+		const uint32_t* pThreadGroupSize = pShaderPointShadowBlur->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+		for (uint32_t run = 0; run < runs.mRunCount; ++run)
 		{
-			RenderTargetBarrier rtBarriers[] = {
-				{ pRenderTarget, RESOURCE_STATE_RENDER_TARGET },
-				{ mapTarget, RESOURCE_STATE_SHADER_RESOURCE },
-				{ pRenderTargetDepthBuffer, RESOURCE_STATE_DEPTH_WRITE }
-			};
-			cmdResourceBarrier(cmd, 0, NULL, 0, NULL, 3, rtBarriers);
+			ShadowCubeBlurConstant blurConstantData = { gPointShadowSize, pData->mHorizontal ? 1u : 0u, 6 * runs.mRunFirst[run] };
+			cmdBindPushConstants(cmd, pRootSignaturePointShadowBlur, "RootConstant", &blurConstantData);
+			cmdDispatch(cmd,
+				(gPointShadowSize + pThreadGroupSize[0] - 1) / pThreadGroupSize[0],
+				(gPointShadowSize + pThreadGroupSize[1] - 1) / pThreadGroupSize[1],
+				6 * runs.mRunLength[run]);
 		}
+	}
+
+	// Blurs the listed tiles of a square target in one dispatch, samples stay
+	// inside their tile. Shared by the atlas and the virtual shadow pages.
+	static void recordTileBlur(Cmd* cmd, FrameGraph* pGraph, const BlurPassData* pData, DescriptorSet* pDescriptorSet,
+		Buffer* pTiles, uint32_t targetSize, uint32_t tileCount, uint32_t maxTileSize)
+	{
+		Texture* src = fgGetRenderTarget(pGraph, pData->mSrc)->pTexture;
+		Texture* dst = fgGetRenderTarget(pGraph, pData->mDst)->pTexture;
+
+		ShadowAtlasBlurConstant blurConstantData = { { targetSize, targetSize }, pData->mHorizontal ? 1u : 0u };
+		uint32_t index = gFrameIndex * 2 + (pData->mHorizontal ? 0 : 1);
+
+		DescriptorData params[3] = {};
+		params[0].pName = "srcTexture";
+		params[0].ppTextures = &src;
+		params[1].pName = "dstTexture";
+		params[1].ppTextures = &dst;
+		params[2].pName = "dirtyTiles";
+		params[2].ppBuffers = &pTiles;
+		updateDescriptorSet(pRenderer, index, pDescriptorSet, 3, params);
+
+		cmdBindPipeline(cmd, pPipelineShadowAtlasBlur);
+		cmdBindPushConstants(cmd, pRootSignatureShadowAtlasBlur, "RootConstant", &blurConstantData);
+		cmdBindDescriptorSet(cmd, index, pDescriptorSet);
+
+		// One slice of groups per tile, sized for the largest one
+		const uint32_t* pThreadGroupSize = pShaderShadowAtlasBlur->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+		cmdDispatch(cmd,
+			(maxTileSize + pThreadGroupSize[0] - 1) / pThreadGroupSize[0],
+			(maxTileSize + pThreadGroupSize[1] - 1) / pThreadGroupSize[1],
+			tileCount);
+	}
 
+	static void executeShadowAtlasBlurPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		recordTileBlur(cmd, pGraph, (const BlurPassData*)pUserData, pDescriptorSetShadowAtlasBlur, pBufferShadowAtlasTiles[gFrameIndex],
+			gShadowAtlasSize, gShadowAtlasPassData.mDirtyCount, gShadowAtlasPassData.mMaxDirtySize);
+	}
 
-		clearColor.r = 0.15f;
-		clearColor.g = 0.15f;
-		clearColor.b = 0.15f;
-		clearColor.a = 1.0f;
+	// The slot borders are blurred too, the clamp to the slot never reaches a neighbour
+	static void executeVirtualShadowBlurPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		recordTileBlur(cmd, pGraph, (const BlurPassData*)pUserData, pDescriptorSetVirtualShadowBlur, pBufferVirtualPageTiles[gFrameIndex],
+			gVirtualShadowPoolSize, gVirtualShadowPassData.mPageCount, gVirtualShadowSlotSize);
+	}
 
-		loadActions.mClearColorValues[0] = clearColor;
+	static void executeMainPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const MainPassData* pData = (const MainPassData*)pUserData;
+		const ShadowView& view = gShadowViews[pData->mView];
+		RenderTarget* pRenderTarget = fgGetRenderTarget(pGraph, pData->mColor);
+		RenderTarget* pDepthTarget = fgGetRenderTarget(pGraph, pData->mDepth);
+		RenderTarget* pMaskTarget = fgGetRenderTarget(pGraph, pData->mShadowMask);
+		Texture* pShadowMask = pMaskTarget->pTexture;
+		// Without spot lights the shader never samples the atlas, bind anything valid
+		Texture* pShadowAtlas = (pData->mShadowAtlas != FRAME_GRAPH_INVALID) ?
+			fgGetRenderTarget(pGraph, pData->mShadowAtlas)->pTexture : pShadowMask;
+		Texture* pPointShadows = fgGetRenderTarget(pGraph, pData->mPointShadows)->pTexture;
+
+		ShadowMaskConstant shadowConstantData = { { pMaskTarget->mWidth, pMaskTarget->mHeight },
+			{ view.mViewport[0], view.mViewport[1] }, max(gShadowMaskScale, 1u) };
+
+		// Depth comes from the prepass, the other views draw over the main one
+		LoadActionsDesc loadActions = {};
+		loadActions.mLoadActionDepth = LOAD_ACTION_LOAD;
+		loadActions.mClearColorValues[0] = { { 0.15f, 0.15f, 0.15f, 1.0f } };
+		loadActions.mLoadActionsColor[0] = (pData->mView == SHADOW_VIEW_MAIN) ? LOAD_ACTION_CLEAR : LOAD_ACTION_LOAD;
 
-		pPipeline = (gToggleMSM) ? pPipelineMSM : pPipelineVSM;
-		RootSignature* pRootSignature = (gToggleMSM) ? pRootSignatureMSM : pRootSignatureVSM;
+		const uint32_t precision = getShadingPrecision();
+		Pipeline* pPipeline = (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? pPipelineMSM[precision][gFormatMSM] : pPipelineVSM[precision][gFormatVSM];
+		RootSignature* pRootSignature = (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? pRootSignatureMSM : pRootSignatureVSM;
 
 		cmdBindPipeline(cmd, pPipeline);
 		cmdBindPushConstants(cmd, pRootSignature, "cbShadowRootConstants", &shadowConstantData);
 		{
-			DescriptorData params[1] = {};
-			params[0].pName = "shadowMap";
-			params[0].ppTextures = (gBlurCount) ? &pTexBlurVert : &mapTarget->pTexture;
-
-			DescriptorSet* pDescriptorSet = (gToggleMSM) ? pDescriptorSetMSM[1] : pDescriptorSetVSM[1];
-
-			updateDescriptorSet(pRenderer, gFrameIndex, pDescriptorSet, 1, params);
-			cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSet);
+			DescriptorData params[3] = {};
+			params[0].pName = "shadowMask";
+			params[0].ppTextures = &pShadowMask;
+			params[1].pName = "shadowAtlas";
+			params[1].ppTextures = &pShadowAtlas;
+			params[2].pName = "pointShadowMaps";
+			params[2].ppTextures = &pPointShadows;
+
+			DescriptorSet* pDescriptorSet = (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? pDescriptorSetMSM[1] : pDescriptorSetVSM[1];
+
+			// drawObjects binds the same set again
+			const uint32_t setIndex = getViewSetIndex(pData->mView);
+			updateDescriptorSet(pRenderer, setIndex, pDescriptorSet, 3, params);
+			cmdBindDescriptorSet(cmd, setIndex, pDescriptorSet);
 		}
 
-		cmdBindRenderTargets(cmd, 1, &pRenderTarget, pRenderTargetDepthBuffer, &loadActions, NULL, NULL, -1, -1);
-		cmdSetViewport(cmd, 0.0f, 0.0f, (float)pRenderTarget->mWidth, (float)pRenderTarget->mHeight, 0.0f, 1.0f);
-		cmdSetScissor(cmd, 0, 0, pRenderTarget->mWidth, pRenderTarget->mHeight);
-		drawObjects(cmd, "Draw Objects", false);
+		cmdBindRenderTargets(cmd, 1, &pRenderTarget, pDepthTarget, &loadActions, NULL, NULL, -1, -1);
+		cmdSetViewport(cmd, (float)view.mViewport[0], (float)view.mViewport[1], (float)view.mViewport[2], (float)view.mViewport[3],
+			0.0f, 1.0f);
+		cmdSetScissor(cmd, view.mViewport[0], view.mViewport[1], view.mViewport[2], view.mViewport[3]);
+		if (pData->mView == SHADOW_VIEW_MAIN)
+			telemetryBeginPipelineStatistics(cmd, "Main");
+		drawObjects(cmd, "Draw Objects", (gShadowTechnique == SHADOW_TECHNIQUE_MSM) ? pDescriptorSetMSM : pDescriptorSetVSM, false, 1, view.mMainCull, pData->mView);
+		if (pData->mView == SHADOW_VIEW_MAIN)
+			telemetryEndPipelineStatistics(cmd);
+		cmdBindRenderTargets(cmd, 0, NULL, NULL, NULL, NULL, NULL, -1, -1);
+	}
 
+	static void executeUIPass(Cmd* cmd, FrameGraph* pGraph, void* pUserData)
+	{
+		const MainPassData* pData = (const MainPassData*)pUserData;
+		RenderTarget* pRenderTarget = fgGetRenderTarget(pGraph, pData->mColor);
 
-		/************************************************************************/
-		// Draw UI
-		/************************************************************************/
-		loadActions = {};
+		LoadActionsDesc loadActions = {};
 		loadActions.mLoadActionsColor[0] = LOAD_ACTION_LOAD;
 		cmdBindRenderTargets(cmd, 1, &pRenderTarget, NULL, &loadActions, NULL, NULL, -1, -1);
-		cmdBeginGpuTimestampQuery(cmd, gGpuProfileToken, "Draw UI");
+		telemetryBeginGpuScope(cmd, "Draw UI");
 
 		gVirtualJoystick.Draw(cmd, { 1.0f, 1.0f, 1.0f, 1.0f });
 
 		const float txtIndent = 8.f;
 		float2 txtSizePx = cmdDrawCpuProfile(cmd, float2(txtIndent, 15.f), &gFrameTimeDraw);
-		cmdDrawGpuProfile(cmd, float2(txtIndent, txtSizePx.y + 30.f), gGpuProfileToken, &gFrameTimeDraw);
-
+		float2 gpuTxtSizePx = cmdDrawGpuProfile(cmd, float2(txtIndent, txtSizePx.y + 30.f), gGpuProfileToken, &gFrameTimeDraw);
 
+		if (gShowMemoryReport)
+			drawMemoryReport(cmd, pGraph, float2(txtIndent, txtSizePx.y + gpuTxtSizePx.y + 60.f));
 
 		cmdDrawProfilerUI();
 
 		gAppUI.Gui(pGui);
 		gAppUI.Draw(cmd);
 		cmdBindRenderTargets(cmd, 0, NULL, NULL, NULL, NULL, NULL, -1, -1);
-		cmdEndGpuTimestampQuery(cmd, gGpuProfileToken);
-
-		RenderTargetBarrier present = { pRenderTarget, RESOURCE_STATE_PRESENT };
-		cmdResourceBarrier(cmd, 0, NULL, 0, NULL, 1, &present);
-
-		cmdEndGpuFrameProfile(cmd, gGpuProfileToken);
-		endCmd(cmd);
-
-		QueueSubmitDesc submitDesc = {};
-		submitDesc.mCmdCount = 1;
-		submitDesc.mSignalSemaphoreCount = 1;
-		submitDesc.mWaitSemaphoreCount = 1;
-		submitDesc.ppCmds = &cmd;
-		submitDesc.ppSignalSemaphores = &pSemaphoreRenderComplete;
-		submitDesc.ppWaitSemaphores = &pSemaphoreImageAcquired;
-		submitDesc.pSignalFence = pFenceRenderComplete;
-		queueSubmit(pGraphicsQueue, &submitDesc);
-		QueuePresentDesc presentDesc = {};
-		presentDesc.mIndex = swapchainImageIndex;
-		presentDesc.mWaitSemaphoreCount = 1;
-		presentDesc.pSwapChain = pSwapChain;
-		presentDesc.ppWaitSemaphores = &pSemaphoreRenderComplete;
-		presentDesc.mSubmitDone = true;
-		queuePresent(pGraphicsQueue, &presentDesc);
-		flipProfiler();
-
-		gFrameIndex = (gFrameIndex + 1) % gImageCount;
-
-	}
-
-	const char* GetName() { return "09b_MomentShadows"; }
-
-private:
-
-	vec3 SphericalToCartesian(const vec3& coord)
-	{
-		float radius = coord[0];
-		float theta = Vectormath::degToRad(coord[1]);
-		float phi = Vectormath::degToRad(coord[2]);
-
-		float a = radius * cosf(theta);
-
-		vec3 result;
-		result[0] = a * cosf(phi);
-		result[1] = radius * sinf(theta);
-		result[2] = a * sinf(phi);
-
-		return result;
-	}
-
-	float RandomZeroOne()
-	{
-		return ((float)rand() / RAND_MAX);
+		telemetryEndGpuScope(cmd);
 	}
 
-	void PrepareSphere(vec3& translate, uint32_t i)
+	// Lists every resident shadow target with its size against the configured budget
+	static void drawMemoryReport(Cmd* cmd, const FrameGraph* pGraph, float2 position)
 	{
-		mat4 sphereMat = mat4::identity();
-		// Start at a random timer
-		gSphereTimers[i] = RandomZeroOne() * 100.0f;
+		const float lineHeight = 18.0f;
+		const float toMB = 1.0f / (1024.0f * 1024.0f);
+		char line[256];
 
-		gSphereBounceModifiers[i] = RandomZeroOne() + 0.5f;
+		uint64_t total = fgGetMemoryUsage(pGraph);
+		const TextDrawDesc* pTotalDraw = pGraph->mOverBudget ? &gMemoryReportOverBudgetDraw : &gMemoryReportDraw;
+		snprintf(line, sizeof(line), "Shadow targets: %.1f MB / %.1f MB budget", total * toMB, pGraph->mBudget * toMB);
+		gAppUI.DrawText(cmd, position, line, pTotalDraw);
+		position.y += lineHeight;
 
-		gDataSphere[i].mWorld = sphereMat.translation(translate) * sphereMat.scale(vec3(RandomZeroOne() * 0.3f + 0.2f));
-		gDataSphere[i].mDiffuse = { RandomZeroOne(), RandomZeroOne(), RandomZeroOne(), 1.0f };
-		gDataSphere[i].mSpecular = vec4(vec3(RandomZeroOne() * 0.03f), RandomZeroOne() * 24.0f);
-		BufferUpdateDesc sphereDataUpdateDesc = { pBufferUniformSphere[i] };
-		beginUpdateResource(&sphereDataUpdateDesc);
-		*(UniformObjectData*)sphereDataUpdateDesc.pMappedData = gDataSphere[i];
-		endUpdateResource(&sphereDataUpdateDesc, NULL);
-	}
-
-	void PrepareResources()
-	{
-		// Set spheres
-		// Horizontal line
-		for (int i = 0; i < 9; ++i)
-		{
-			//float negOneToOne = RandomZeroOne() * 2.0f - 1.0f;
-			vec3 translate = { i - 4.0f, 0.0f, 0.0f };
-			PrepareSphere(translate, i);
-		}
-
-		// Vert left (eliminate center one as it was created above)
-		for (int i = 9, j = 0; i < 19; ++i, ++j)
+		for (uint32_t i = 0; i < pGraph->mPhysicalCount; ++i)
 		{
-			vec3 translate = { -4.0, 0.0f, 5.0f - j };
-
-			// just knock it right out of here lol
-			if (i == 14)
-			{
-				translate[0] -= 999999.0f;
-			}
-			PrepareSphere(translate, i);
+			const FrameGraphPhysicalTarget& physical = pGraph->mPhysical[i];
+			uint32_t idleFrames = pGraph->mFrame - physical.mAssignedFrame;
+			snprintf(line, sizeof(line), "  %-24s %-24s %4ux%-4u %6.1f MB  %s%s",
+				physical.mDesc.pName, TinyImageFormat_Name(physical.mDesc.mFormat),
+				physical.mDesc.mWidth, physical.mDesc.mHeight, physical.mSize * toMB,
+				idleFrames ? "idle" : "in use", physical.mPersistent ? ", persistent" : "");
+			gAppUI.DrawText(cmd, position, line, &gMemoryReportDraw);
+			position.y += lineHeight;
 		}
 
-		// Vert right (eliminate center one as it was created above)
-		for (int i = 19, j = 0; i < 29; ++i, ++j)
+		RenderTargetDesc depthDesc = {};
+		depthDesc.mWidth = pRenderTargetDepthBuffer->mWidth;
+		depthDesc.mHeight = pRenderTargetDepthBuffer->mHeight;
+		depthDesc.mFormat = pRenderTargetDepthBuffer->mFormat;
+		depthDesc.mSampleCount = pRenderTargetDepthBuffer->mSampleCount;
+		snprintf(line, sizeof(line), "Depth RT: %.1f MB (not budgeted)", fgGetTargetSize(depthDesc) * toMB);
+		gAppUI.DrawText(cmd, position, line, &gMemoryReportDraw);
+		position.y += lineHeight;
+
+		snprintf(line, sizeof(line), "Shadow atlas: %u lights, %u tiles re-rendered",
+			gShadowAtlasLightCount, gShadowAtlasLightCount ? gShadowAtlasPassData.mDirtyCount : 0);
+		gAppUI.DrawText(cmd, position, line, &gMemoryReportDraw);
+		position.y += lineHeight;
+
+		if (isVirtualShadowMapActive())
 		{
-			vec3 translate = { 4.0, 0.0f, 5.0f - j };
-
-			if (i == 24) {
-				translate[0] -= 999999.f;
-			}
-			PrepareSphere(translate, i);
+			snprintf(line, sizeof(line), "Virtual shadow pages: %u / %u resident, %u rendered",
+				gVirtualShadowResidentCount, gVirtualShadowSlotCount, gVirtualShadowPassData.mPageCount);
+			gAppUI.DrawText(cmd, position, line, &gMemoryReportDraw);
+			position.y += lineHeight;
 		}
 
-		// Set plane
-		mat4 planeMat = mat4::identity();
-		gDataPlane.mWorld = planeMat.setTranslation(gPlanePosition);
-		gDataPlane.mDiffuse = { 0.65f, 0.65f, 0.65f, 1.0f };
-		gDataPlane.mSpecular = vec4(gMiniSpec, 2.0f);
-		BufferUpdateDesc planeDataUpdateDesc = { pBufferUniformPlane };
-		beginUpdateResource(&planeDataUpdateDesc);
-		*(UniformObjectData*)planeDataUpdateDesc.pMappedData = gDataPlane;
-		endUpdateResource(&planeDataUpdateDesc, NULL);
-
+		snprintf(line, sizeof(line), "Shadow updates: %.2f / %.2f Mtexels, %u views deferred",
+			gShadowUpdateCost * toMB, gShadowUpdateBudgetMTexels, gShadowUpdatesDeferred);
+		gAppUI.DrawText(cmd, position, line, &gMemoryReportDraw);
 	}
 
-	void PrepareDescriptorSets()
+	// Copies the CPU written transforms into the buffer the passes read, then
+	// bounces the spheres there when they are animated on the GPU
+	static void recordSceneAnimation(Cmd* cmd)
 	{
+		telemetryBeginGpuScope(cmd, "Scene Animation");
 
-		/************************************************************************/
-		// Shadow pass descriptors
-		/************************************************************************/
-		{
-			DescriptorData params[2] = {};
-			for (uint32_t i = 0; i < gImageCount; ++i)
-			{
-				params[0].pName = "cbLight";
-				params[0].ppBuffers = &pBufferUniformLight[i];
-				updateDescriptorSet(pRenderer, i, pDescriptorSetMapVSM[0], 1, params);
-			}
-
-			for (uint32_t i = 0; i < gNumSpheres; ++i)
-			{
-				params[0] = {};
-				params[0].pName = "cbObject";
-				params[0].ppBuffers = &pBufferUniformSphere[i];
-				updateDescriptorSet(pRenderer, i, pDescriptorSetMapVSM[1], 1, params);
-			}
-			params[0].ppBuffers = &pBufferUniformPlane;
-			updateDescriptorSet(pRenderer, gNumSpheres, pDescriptorSetMapVSM[1], 1, params);
-
-			params[0].ppBuffers = &pBufferUniformLightObject;
-			updateDescriptorSet(pRenderer, gNumSpheres + 1, pDescriptorSetMapVSM[1], 1, params);
-
-		}
+		const uint32_t cpuObjectCount = gSceneFirstSphere + (gSceneGpuAnimationActive ? 0 : gSceneGeneratedSphereCount);
+		BufferBarrier barrier = { pBufferSceneTransforms, RESOURCE_STATE_COPY_DEST };
+		cmdResourceBarrier(cmd, 1, &barrier, 0, NULL, 0, NULL);
+		cmdUpdateBuffer(cmd, pBufferSceneTransforms, 0, pBufferObjectTransforms[gFrameIndex], 0, sizeof(vec4) * cpuObjectCount);
 
+		if (gSceneGpuAnimationActive && gSceneGeneratedSphereCount)
 		{
-			DescriptorData params[2] = {};
-			for (uint32_t i = 0; i < gImageCount; ++i)
-			{
-				params[0].pName = "cbLight";
-				params[0].ppBuffers = &pBufferUniformLight[i];
-				updateDescriptorSet(pRenderer, i, pDescriptorSetMapMSM[0], 1, params);
-			}
-
-			for (uint32_t i = 0; i < gNumSpheres; ++i)
-			{
-				params[0] = {};
-				params[0].pName = "cbObject";
-				params[0].ppBuffers = &pBufferUniformSphere[i];
-				updateDescriptorSet(pRenderer, i, pDescriptorSetMapMSM[1], 1, params);
-			}
-			params[0].ppBuffers = &pBufferUniformPlane;
-			updateDescriptorSet(pRenderer, gNumSpheres, pDescriptorSetMapMSM[1], 1, params);
+			barrier = { pBufferSceneTransforms, RESOURCE_STATE_UNORDERED_ACCESS };
+			cmdResourceBarrier(cmd, 1, &barrier, 0, NULL, 0, NULL);
 
-			params[0].ppBuffers = &pBufferUniformLightObject;
-			updateDescriptorSet(pRenderer, gNumSpheres + 1, pDescriptorSetMapMSM[1], 1, params);
+			cmdBindPipeline(cmd, pPipelineSceneAnimation);
+			cmdBindDescriptorSet(cmd, 0, pDescriptorSetSceneAnimation);
+			cmdBindPushConstants(cmd, pRootSignatureSceneAnimation, "RootConstant", &gSceneAnimationConstants);
 
+			const uint32_t* pThreadGroupSize = pShaderSceneAnimation->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+			cmdDispatch(cmd, (gSceneGeneratedSphereCount + pThreadGroupSize[0] - 1) / pThreadGroupSize[0], 1, 1);
 		}
 
+		barrier = { pBufferSceneTransforms, RESOURCE_STATE_SHADER_RESOURCE };
+		cmdResourceBarrier(cmd, 1, &barrier, 0, NULL, 0, NULL);
 
+		telemetryEndGpuScope(cmd);
+	}
 
-		/************************************************************************/
-		// VSM descriptors
-		/************************************************************************/
-		{
-			DescriptorData params[3] = {};
-			
-			for (uint32_t i = 0; i < gImageCount; ++i)
-			{
-				params[0] = {};
-				params[0].pName = "cbCamera";
-				params[0].ppBuffers = &pBufferUniformCamera[i];
-
-				params[1] = {};
-				params[1].pName = "cbLight";
-				params[1].ppBuffers = &pBufferUniformLight[i];
-
-				updateDescriptorSet(pRenderer, i, pDescriptorSetVSM[1], 2, params);
-			}
+	// Resets the indirect draws of the cull views and fills the camera and light
+	// lists. The occlusion list is filled by the Hi-Z pass after the depth prepass.
+	static void recordFrustumCulling(Cmd* cmd)
+	{
+		if (!gGpuCulling)
+			return;
 
-			for (uint32_t i = 0; i < gNumSpheres; ++i)
-			{
-				params[0] = {};
-				params[0].pName = "cbObject";
-				params[0].ppBuffers = &pBufferUniformSphere[i];
-				updateDescriptorSet(pRenderer, i, pDescriptorSetVSM[2], 1, params);
-			}
-			params[0].ppBuffers = &pBufferUniformPlane;
-			updateDescriptorSet(pRenderer, gNumSpheres, pDescriptorSetVSM[2], 1, params);
+		telemetryBeginGpuScope(cmd, "Frustum Culling");
 
-			params[0].ppBuffers = &pBufferUniformLightObject;
-			updateDescriptorSet(pRenderer, gNumSpheres + 1, pDescriptorSetVSM[2], 1, params);
+		BufferBarrier barriers[] = {
+			{ pBufferCullArguments, RESOURCE_STATE_COPY_DEST },
+			{ pBufferVisibleObjects, RESOURCE_STATE_UNORDERED_ACCESS },
+		};
+		cmdResourceBarrier(cmd, 2, barriers, 0, NULL, 0, NULL);
+		cmdUpdateBuffer(cmd, pBufferCullArguments, 0, pBufferCullArgumentsReset, 0, sizeof(IndirectDrawArguments) * CULL_VIEW_COUNT);
 
-		}
+		barriers[0] = { pBufferCullArguments, RESOURCE_STATE_UNORDERED_ACCESS };
+		cmdResourceBarrier(cmd, 1, barriers, 0, NULL, 0, NULL);
 
-		/************************************************************************/
-		// MSM descriptors
-		/************************************************************************/
+		if (gSceneGeneratedSphereCount)
 		{
-			DescriptorData params[3] = {};
-			
-			for (uint32_t i = 0; i < gImageCount; ++i)
-			{
-				params[0] = {};
-				params[0].pName = "cbCamera";
-				params[0].ppBuffers = &pBufferUniformCamera[i];
-
-				params[1] = {};
-				params[1].pName = "cbLight";
-				params[1].ppBuffers = &pBufferUniformLight[i];
-
-				updateDescriptorSet(pRenderer, i, pDescriptorSetMSM[1], 2, params);
-			}
-			for (uint32_t i = 0; i < gNumSpheres; ++i)
-			{
-				params[0] = {};
-				params[0].pName = "cbObject";
-				params[0].ppBuffers = &pBufferUniformSphere[i];
-				updateDescriptorSet(pRenderer, i, pDescriptorSetMSM[2], 1, params);
-			}
-			params[0].ppBuffers = &pBufferUniformPlane;
-			updateDescriptorSet(pRenderer, gNumSpheres, pDescriptorSetMSM[2], 1, params);
-
-			params[0].ppBuffers = &pBufferUniformLightObject;
-			updateDescriptorSet(pRenderer, gNumSpheres + 1, pDescriptorSetMSM[2], 1, params);
+			cmdBindPipeline(cmd, pPipelineCullFrustum);
+			cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSetCull[0]);
 
+			const uint32_t* pThreadGroupSize = pShaderCullFrustum->pReflection->mStageReflections[0].mNumThreadsPerGroup;
+			cmdDispatch(cmd, (gSceneGeneratedSphereCount + pThreadGroupSize[0] - 1) / pThreadGroupSize[0], 1, 1);
 		}
 
-	}
-
-	bool addSwapChain()
-	{
-		SwapChainDesc swapChainDesc = {};
-		swapChainDesc.mWindowHandle = pWindow->handle;
-		swapChainDesc.mPresentQueueCount = 1;
-		swapChainDesc.ppPresentQueues = &pGraphicsQueue;
-		swapChainDesc.mWidth = mSettings.mWidth;
-		swapChainDesc.mHeight = mSettings.mHeight;
-		swapChainDesc.mImageCount = gImageCount;
-		swapChainDesc.mColorFormat = getRecommendedSwapchainFormat(true);
-		swapChainDesc.mEnableVsync = mSettings.mDefaultVSyncEnabled;
-		::addSwapChain(pRenderer, &swapChainDesc, &pSwapChain);
+		barriers[0] = { pBufferCullArguments, RESOURCE_STATE_INDIRECT_ARGUMENT };
+		barriers[1] = { pBufferVisibleObjects, RESOURCE_STATE_SHADER_RESOURCE };
+		cmdResourceBarrier(cmd, 2, barriers, 0, NULL, 0, NULL);
 
-		return pSwapChain != NULL;
+		telemetryEndGpuScope(cmd);
 	}
 
-	bool addRenderTargets()
+	// profilerName may be NULL when the caller already times a batch of draws.
+	// Every object kind is one instanced draw, the vertex shader reads the
+	// object from the draw range. Layered passes repeat the range per layer.
+	// With GPU culling the spheres of a cull view are drawn indirectly from
+	// its visible list. Sets with one copy per shadow view pass the view.
+	static void drawObjects(Cmd* cmd, const char* profilerName, DescriptorSet** set, bool shadowPass, uint32_t layerCount = 1,
+		CullView cullView = CULL_VIEW_NONE, uint32_t view = SHADOW_VIEW_MAIN)
 	{
-		// Add depth buffer
-		RenderTargetDesc depthRT = {};
-		depthRT.mArraySize = 1;
-		depthRT.mClearValue.depth = 1.0f;
-		depthRT.mClearValue.stencil = 0;
-		depthRT.mDepth = 1;
-		depthRT.mFormat = TinyImageFormat_D32_SFLOAT;
-		depthRT.mHeight = mSettings.mHeight;
-		depthRT.mSampleCount = SAMPLE_COUNT_1;
-		depthRT.mDescriptors = DESCRIPTOR_TYPE_TEXTURE;
-		depthRT.mSampleQuality = 0;
-		depthRT.mWidth = mSettings.mWidth;
-		depthRT.mFlags = TEXTURE_CREATION_FLAG_ESRAM;
-		depthRT.pName = "Depth RT";
-		addRenderTarget(pRenderer, &depthRT, &pRenderTargetDepthBuffer);
-
-		/************************************************************************/
-		// Shadow Map Render target
-		/************************************************************************/
-		RenderTargetDesc VSMRenderTargetDesc = {};
-		VSMRenderTargetDesc.mArraySize = 1;
-		VSMRenderTargetDesc.mDepth = 1;
-		VSMRenderTargetDesc.mDescriptors = DESCRIPTOR_TYPE_RW_TEXTURE;
-		VSMRenderTargetDesc.mFormat = TinyImageFormat_R32G32_SFLOAT;
-		VSMRenderTargetDesc.mWidth = gShadowMapData.mSize[0];
-		VSMRenderTargetDesc.mHeight = gShadowMapData.mSize[1];
-		VSMRenderTargetDesc.mSampleCount = (SampleCount)1;
-		VSMRenderTargetDesc.mSampleQuality = 0;
-		VSMRenderTargetDesc.pName = "VSM RT";
-		addRenderTarget(pRenderer, &VSMRenderTargetDesc, &pRenderTargetMapVSM);
-
-		RenderTargetDesc MSMRenderTargetDesc = VSMRenderTargetDesc;
-		MSMRenderTargetDesc.mFormat = TinyImageFormat_R16G16B16A16_UNORM;
-		MSMRenderTargetDesc.pName = "MSM RT";
-		addRenderTarget(pRenderer, &MSMRenderTargetDesc, &pRenderTargetMapMSM);
-
-
-		RenderTargetDesc shadowDepthRTDesc = {};
-		shadowDepthRTDesc.mArraySize = 1;
-		shadowDepthRTDesc.mClearValue.depth = 1.0f;
-		shadowDepthRTDesc.mDepth = 1;
-		shadowDepthRTDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE;
-		shadowDepthRTDesc.mFormat = TinyImageFormat_D32_SFLOAT;
-		shadowDepthRTDesc.mWidth = gShadowMapData.mSize[0];
-		shadowDepthRTDesc.mHeight = gShadowMapData.mSize[1];
-		shadowDepthRTDesc.mSampleCount = (SampleCount)1;
-		shadowDepthRTDesc.mSampleQuality = 0;
-		shadowDepthRTDesc.pName = "Shadow Map Depth RT";
-		addRenderTarget(pRenderer, &shadowDepthRTDesc, &pRenderTargetShadowDepth);
-
-
-		/************************************************************************/
-		// Shadow Blur Render Targets
-		/************************************************************************/
-		TextureLoadDesc blurLoadDesc = {};
-		TextureDesc     blurDesc = {};
-		blurDesc.mWidth = gShadowMapData.mSize[0];
-		blurDesc.mHeight = gShadowMapData.mSize[1];
-		blurDesc.mDepth = 1;
-		blurDesc.mArraySize = 1;
-		blurDesc.mMipLevels = 1;
-		blurDesc.mFormat = TinyImageFormat_R32G32_SFLOAT;
-		blurDesc.mDescriptors = DESCRIPTOR_TYPE_TEXTURE | DESCRIPTOR_TYPE_RW_TEXTURE;
-		blurDesc.mSampleCount = SAMPLE_COUNT_1;
-		blurDesc.mHostVisible = false;
-		blurLoadDesc.pDesc = &blurDesc;
-
-
-		blurDesc.pName = "VSM Horizontal Blur";
-		blurLoadDesc.ppTexture = &pTexBlurHorVSM;
-		addResource(&blurLoadDesc, NULL);
-
-		blurDesc.pName = "VSM Vertical Blur";
-		blurLoadDesc.ppTexture = &pTexBlurVertVSM;
-		addResource(&blurLoadDesc, NULL);
-
-		blurDesc.mFormat = TinyImageFormat_R16G16B16A16_UNORM;
-		blurDesc.pName = "MSM Horizontal Blur";
-		blurLoadDesc.ppTexture = &pTexBlurHorMSM;
-		addResource(&blurLoadDesc, NULL);
-		blurDesc.pName = "MSM Vertical Blur";
-		blurLoadDesc.ppTexture = &pTexBlurVertMSM;
-		addResource(&blurLoadDesc, NULL);
-
-
-
-		return (pRenderTargetDepthBuffer != NULL) &&
-			(pRenderTargetMapVSM != NULL) &&
-			(pRenderTargetMapMSM != NULL) &&
-			(pRenderTargetShadowDepth != NULL) &&
-			(pTexBlurHorVSM != NULL) &&
-			(pTexBlurVertVSM != NULL) &&
-			(pTexBlurHorMSM != NULL) &&
-			(pTexBlurVertMSM != NULL)
-
-			;
-	}
-
-	void drawObjects(Cmd* cmd, const char* profilerName, bool shadowPass)
-	{
-		cmdBeginGpuTimestampQuery(cmd, gGpuProfileToken, profilerName);
-
-		DescriptorSet** set;
-		if (shadowPass)
-			if (gToggleMSM)
-				set = &pDescriptorSetMapMSM[0];
-			else
-				set = &pDescriptorSetMapVSM[0];
-		else
-			if (gToggleMSM)
-				set = &pDescriptorSetMSM[0];
-			else
-				set = &pDescriptorSetVSM[0];
-
+		if (profilerName)
+			telemetryBeginGpuScope(cmd, profilerName);
 
 		uint32_t accessIndex = 0;
 
@@ -1551,40 +8077,49 @@ private:
 			cmdBindDescriptorSet(cmd, 0, set[accessIndex++]);
 		}
 
-		// Bind camera & lights
-		cmdBindDescriptorSet(cmd, gFrameIndex, set[accessIndex++]);
+		// Bind camera, lights and objects
+		cmdBindDescriptorSet(cmd, getViewSetIndex(view), set[accessIndex++]);
 
 
 		// OBJECTS
 		// -----------------
 
-		// Draw Sphere
-		const uint32_t vbSphereStride = sizeof(float) * 6;
-		cmdBindVertexBuffer(cmd, 1, &pBufferVertexSphere, &vbSphereStride, NULL);
-		for (int i = 0; i < gNumSpheres; ++i)
+		// Draw Spheres
+		if (gSceneGeneratedSphereCount)
 		{
-			cmdBindDescriptorSet(cmd, i, set[accessIndex]);
-			cmdDraw(cmd, gNumberOfSpherePoints / 6, 0);
+			const uint32_t vbSphereStride = sizeof(float) * 6;
+			cmdBindVertexBuffer(cmd, 1, &pBufferVertexSphere, &vbSphereStride, NULL);
+			if (gGpuCulling && cullView != CULL_VIEW_NONE)
+			{
+				cmdBindDescriptorSet(cmd, SCENE_DRAW_CULLED_SPHERES + cullView, set[accessIndex]);
+				cmdExecuteIndirect(cmd, pCommandSignatureCull, 1, pBufferCullArguments,
+					sizeof(IndirectDrawArguments) * cullView, NULL, 0);
+			}
+			else
+			{
+				cmdBindDescriptorSet(cmd, SCENE_DRAW_SPHERES, set[accessIndex]);
+				cmdDrawInstanced(cmd, gNumberOfSpherePoints / 6, 0, gSceneGeneratedSphereCount * layerCount, 0);
+			}
 		}
 
 		// Draw Plane
 		const uint32_t vbPlaneStride = sizeof(float) * 6;
 		cmdBindVertexBuffer(cmd, 1, &pBufferVertexPlane, &vbPlaneStride, NULL);
-		cmdBindDescriptorSet(cmd, gNumSpheres, set[accessIndex]);
-		cmdDraw(cmd, gNumberOfPlanePoints / 6, 0);
+		cmdBindDescriptorSet(cmd, SCENE_DRAW_PLANE, set[accessIndex]);
+		cmdDrawInstanced(cmd, gNumberOfPlanePoints / 6, 0, layerCount, 0);
 
 		// Draw Light Object
 		if (!shadowPass)
 		{
 			const uint32_t vbLightObjectStride = sizeof(float) * 6;
 			cmdBindVertexBuffer(cmd, 1, &pBufferVertexLightObject, &vbLightObjectStride, NULL);
-			cmdBindDescriptorSet(cmd, gNumSpheres + 1, set[accessIndex]);
+			cmdBindDescriptorSet(cmd, SCENE_DRAW_LIGHT_OBJECT, set[accessIndex]);
 			cmdDraw(cmd, gNumberOfLightObjectPoints / 6, 0);
 		}
 
 
-		cmdEndGpuTimestampQuery(cmd, gGpuProfileToken);
-		cmdBindRenderTargets(cmd, 0, NULL, NULL, NULL, NULL, NULL, -1, -1);
+		if (profilerName)
+			telemetryEndGpuScope(cmd);
 	}
 
 };